@@ -85,3 +85,18 @@ C_UnloadModule(void *module)
 	free(mod);
 	return CKR_OK;
 }
+
+/*
+ * Look up a symbol of a loaded module, for extensions that are
+ * not in the function list. Returns NULL if there is none.
+ */
+void *
+C_GetModuleSymbol(void *module, const char *name)
+{
+	sc_pkcs11_module_t *mod = (sc_pkcs11_module_t *) module;
+
+	if (!mod || mod->_magic != MAGIC || name == NULL)
+		return NULL;
+
+	return sc_dlsym(mod->handle, name);
+}
@@ -20,3 +20,4 @@
 
 void *C_LoadModule(const char *name, CK_FUNCTION_LIST_PTR_PTR);
 CK_RV C_UnloadModule(void *module);
+void *C_GetModuleSymbol(void *module, const char *name);
@@ -2,7 +2,7 @@ TOPDIR = ..\..
 
 TARGET                  = opensc.dll opensc_a.lib
 OBJECTS			= \
-	sc.obj ctx.obj log.obj errors.obj \
+	sc.obj ctx.obj log.obj errors.obj stats.obj atr-index.obj capture.obj \
 	asn1.obj base64.obj sec.obj card.obj iso7816.obj dir.obj ef-atr.obj padding.obj apdu.obj \
 	\
 	pkcs15.obj pkcs15-cert.obj pkcs15-data.obj pkcs15-pin.obj \
@@ -11,7 +11,7 @@ OBJECTS			= \
 	\
 	muscle.obj muscle-filesystem.obj \
 	\
-	ctbcs.obj reader-ctapi.obj reader-pcsc.obj reader-openct.obj \
+	ctbcs.obj reader-ctapi.obj reader-pcsc.obj reader-openct.obj reader-virtual.obj \
 	\
 	card-setcos.obj card-miocos.obj card-flex.obj card-gpk.obj \
 	card-cardos.obj card-tcos.obj card-default.obj \
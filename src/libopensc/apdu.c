@@ -24,6 +24,9 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "internal.h"
 
@@ -171,7 +174,12 @@ static int sc_apdu2bytes(sc_context_t *ctx, const sc_apdu_t *apdu,
 void sc_apdu_log(sc_context_t *ctx, int level, const u8 *data, size_t len, int is_out)
 {
 	size_t blen = len * 5 + 128;
-	char   *buf = malloc(blen);
+	char   *buf;
+
+	/* don't bother formatting what will not be logged */
+	if (ctx == NULL || ctx->debug < level)
+		return;
+	buf = malloc(blen);
 	if (buf == NULL)
 		return;
 
@@ -210,6 +218,84 @@ int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 	return SC_SUCCESS;
 }
 
+/* Smallest scratch buffer, enough for any short APDU and its response */
+#define SC_READER_APDU_BUF_MIN	(2 * SC_MAX_APDU_BUFFER_SIZE + 2)
+
+/** Encodes an APDU into the scratch buffer of the reader, followed by
+ *  room for the response, so that transmitting an APDU needs no memory
+ *  allocation. The buffer is grown to the largest APDU seen, kept out
+ *  of swap where possible, and must be wiped with
+ *  _sc_reader_clear_apdu_buf() after each exchange. The caller must
+ *  hold the card lock.
+ *  @param  reader  sc_reader_t object the APDU is sent through
+ *  @param  apdu    APDU to be encoded
+ *  @param  proto   protocol version to be used
+ *  @param  sbuf    returns the encoded APDU ...
+ *  @param  slen    ... and its length
+ *  @param  rbuf    returns the buffer for the response ...
+ *  @param  rlen    ... of this size
+ *  @return SC_SUCCESS on success and an error code otherwise
+ */
+int _sc_reader_get_apdu_buf(sc_reader_t *reader, const sc_apdu_t *apdu, unsigned int proto,
+	u8 **sbuf, size_t *slen, u8 **rbuf, size_t rlen)
+{
+	size_t	nlen, need;
+	u8	*nbuf;
+
+	if (reader == NULL || apdu == NULL || sbuf == NULL || slen == NULL || rbuf == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	nlen = sc_apdu_get_length(apdu, proto);
+	if (nlen == 0)
+		return SC_ERROR_INTERNAL;
+	need = nlen + rlen;
+	if (need > reader->apdu_buf_len) {
+		if (need < SC_READER_APDU_BUF_MIN)
+			need = SC_READER_APDU_BUF_MIN;
+		nbuf = calloc(1, need);
+		if (nbuf == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		_sc_reader_free_apdu_buf(reader);
+		reader->apdu_buf = nbuf;
+		reader->apdu_buf_len = need;
+#ifdef HAVE_SYS_MMAN_H
+		/* Not fatal, mlock() is subject to resource limits */
+		reader->apdu_buf_locked = mlock(nbuf, need) == 0;
+#endif
+	}
+	if (sc_apdu2bytes(reader->ctx, apdu, proto, reader->apdu_buf, nlen) != SC_SUCCESS)
+		return SC_ERROR_INTERNAL;
+	*sbuf = reader->apdu_buf;
+	*slen = nlen;
+	*rbuf = reader->apdu_buf + nlen;
+	return SC_SUCCESS;
+}
+
+/** Wipes what was used of the scratch buffer of the reader */
+void _sc_reader_clear_apdu_buf(sc_reader_t *reader, size_t slen, size_t rlen)
+{
+	if (reader == NULL || reader->apdu_buf == NULL)
+		return;
+	if (slen + rlen > reader->apdu_buf_len)
+		slen = reader->apdu_buf_len, rlen = 0;
+	sc_mem_clear(reader->apdu_buf, slen + rlen);
+}
+
+void _sc_reader_free_apdu_buf(sc_reader_t *reader)
+{
+	if (reader == NULL || reader->apdu_buf == NULL)
+		return;
+	sc_mem_clear(reader->apdu_buf, reader->apdu_buf_len);
+#ifdef HAVE_SYS_MMAN_H
+	if (reader->apdu_buf_locked)
+		munlock(reader->apdu_buf, reader->apdu_buf_len);
+#endif
+	free(reader->apdu_buf);
+	reader->apdu_buf = NULL;
+	reader->apdu_buf_len = 0;
+	reader->apdu_buf_locked = 0;
+}
+
 int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 	size_t len)
 {
@@ -365,6 +451,28 @@ static void sc_detect_apdu_cse(const sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
+/** Hands an APDU to the reader driver, records how long the reader
+ *  and card took to answer it and adds it to the APDU capture.
+ *  @param  card  sc_card_t object for the smartcard
+ *  @param  apdu  APDU to be sent
+ *  @return SC_SUCCESS on success and an error value otherwise
+ */
+static int sc_reader_transmit(sc_card_t *card, sc_apdu_t *apdu)
+{
+	unsigned long long start = _sc_stats_clock();
+	unsigned long long usec;
+	int r;
+
+	r = card->reader->ops->transmit(card->reader, apdu);
+	usec = _sc_stats_clock() - start;
+	_sc_stats_add_apdu(card, apdu->ins,
+		sc_apdu_get_length(apdu, card->reader->active_protocol),
+		apdu->resplen + 2, r, usec);
+	if (card->ctx->capture != NULL)
+		_sc_capture_apdu(card, apdu, r, start, (unsigned long)usec);
+	return r;
+}
+
 /** Sends a single APDU to the card reader and calls 
  *  GET RESPONSE to get the return data if necessary.
  *  @param  card  sc_card_t object for the smartcard
@@ -391,7 +499,7 @@ static int do_single_transmit(sc_card_t *card, sc_apdu_t *apdu)
 	/* send APDU to the reader driver */
 	if (card->reader->ops->transmit == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
-	r = card->reader->ops->transmit(card->reader, apdu);
+	r = sc_reader_transmit(card, apdu);
 	if (r != 0) {
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "unable to transmit APDU");
 		return r;
@@ -417,7 +525,8 @@ static int do_single_transmit(sc_card_t *card, sc_apdu_t *apdu)
 			if (card->type == SC_CARD_TYPE_BELPIC_EID)
 				msleep(40);
 			/* re-transmit the APDU with new Le length */
-			r = card->reader->ops->transmit(card->reader, apdu);
+			_sc_stats_inc(card, resend);
+			r = sc_reader_transmit(card, apdu);
 			if (r != SC_SUCCESS) {
 				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "unable to transmit APDU");
 				return r;
@@ -476,10 +585,15 @@ static int do_single_transmit(sc_card_t *card, sc_apdu_t *apdu)
 
 			do {
 				u8 tbuf[256];
+				/* read straight into the response buffer
+				 * if any answer will fit */
+				u8 *rbuf = buflen >= sizeof(tbuf) ? buf : tbuf;
+
 				/* call GET RESPONSE to get more date from
 				 * the card; note: GET RESPONSE returns the
 				 * amount of data left (== SW2) */
-				r = card->ops->get_response(card, &le, tbuf);
+				_sc_stats_inc(card, get_response);
+				r = card->ops->get_response(card, &le, rbuf);
 				if (r < 0)
 					SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, r);
 
@@ -487,7 +601,8 @@ static int do_single_transmit(sc_card_t *card, sc_apdu_t *apdu)
 				/* copy as much as will fit in requested buffer */
 					le = buflen;
 
-				memcpy(buf, tbuf, le);
+				if (rbuf == tbuf)
+					memcpy(buf, tbuf, le);
 				buf    += le;
 				buflen -= le;
 
@@ -515,28 +630,56 @@ static int do_single_transmit(sc_card_t *card, sc_apdu_t *apdu)
 	return SC_SUCCESS;
 }
 
-int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
+/* Forget the cached file selection if the APDU may select another file */
+static void sc_apdu_check_selection(sc_card_t *card, const sc_apdu_t *apdu)
 {
-	int r = SC_SUCCESS;
-
-	if (card == NULL || apdu == NULL)
-		return SC_ERROR_INVALID_ARGUMENTS;
+	int selects;
 
-	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+	if (!(card->caps & SC_CARD_CAP_SELECT_CACHE))
+		return;
+	switch (apdu->ins) {
+	case 0xA4:	/* SELECT FILE */
+	case 0xE0:	/* CREATE FILE */
+	case 0xE4:	/* DELETE FILE */
+		selects = 1;
+		break;
+	case 0xB0:	/* READ BINARY */
+	case 0xD0:	/* WRITE BINARY */
+	case 0xD6:	/* UPDATE BINARY */
+	case 0x0E:	/* ERASE BINARY */
+		/* short EF identifier in P1 */
+		selects = (apdu->p1 & 0x80) != 0;
+		break;
+	case 0xB1:
+	case 0xD7:
+		/* file identifier in P1-P2 */
+		selects = apdu->p1 != 0 || apdu->p2 != 0;
+		break;
+	case 0xB2:	/* READ RECORD */
+	case 0xDC:	/* UPDATE RECORD */
+	case 0xE2:	/* APPEND RECORD */
+		/* short EF identifier in P2 */
+		selects = (apdu->p2 >> 3) != 0;
+		break;
+	default:
+		selects = 0;
+		break;
+	}
+	if (selects)
+		sc_invalidate_selection(card);
+}
 
-	/* determine the APDU type if necessary, i.e. to use
-	 * short or extended APDUs  */
-	sc_detect_apdu_cse(card, apdu);
-	/* basic APDU consistency check */
-	r = sc_check_apdu(card, apdu);
-	if (r != SC_SUCCESS)
-		return SC_ERROR_INVALID_ARGUMENTS;
+/** Sends a single APDU, using command chaining if requested.
+ *  The caller must hold the card lock.
+ *  @param  card  sc_card_t object for the smartcard
+ *  @param  apdu  APDU to be sent
+ *  @return SC_SUCCESS on success and an error value otherwise
+ */
+static int sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
+{
+	int r = SC_SUCCESS;
 
-	r = sc_lock(card);	/* acquire card lock*/
-	if (r != SC_SUCCESS) {
-		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "unable to acquire lock");
-		return r;
-	} 
+	sc_apdu_check_selection(card, apdu);
 
 	if ((apdu->flags & SC_APDU_FLAGS_CHAINING) != 0) {
 		/* divide et impera: transmit APDU in chunks with Lc <= max_send_size
@@ -601,6 +744,35 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 	} else 
 		/* transmit single APDU */
 		r = do_single_transmit(card, apdu);
+
+	return r;
+}
+
+int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
+{
+	int r = SC_SUCCESS;
+
+	if (card == NULL || apdu == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+
+	/* determine the APDU type if necessary, i.e. to use
+	 * short or extended APDUs  */
+	sc_detect_apdu_cse(card, apdu);
+	/* basic APDU consistency check */
+	r = sc_check_apdu(card, apdu);
+	if (r != SC_SUCCESS)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	r = sc_lock(card);	/* acquire card lock*/
+	if (r != SC_SUCCESS) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "unable to acquire lock");
+		return r;
+	} 
+
+	r = sc_transmit(card, apdu);
+
 	/* all done => release lock */
 	if (sc_unlock(card) != SC_SUCCESS)
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "sc_unlock failed");
@@ -608,6 +780,57 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 	return r;
 }
 
+int sc_transmit_apdu_batch(sc_card_t *card, sc_apdu_t *apdus, size_t count,
+		int *results)
+{
+	size_t i;
+	int r = SC_SUCCESS;
+
+	if (card == NULL || (apdus == NULL && count != 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "transmitting %lu APDUs", (unsigned long) count);
+
+	/* check the whole batch before anything is sent to the card;
+	 * the APDUs are not dumped to the log one by one */
+	for (i = 0; i < count; i++) {
+		apdus[i].flags |= SC_APDU_FLAGS_NO_LOG;
+		sc_detect_apdu_cse(card, &apdus[i]);
+		if (sc_check_apdu(card, &apdus[i]) != SC_SUCCESS) {
+			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "inconsistent APDU #%lu in batch", (unsigned long) i);
+			return SC_ERROR_INVALID_ARGUMENTS;
+		}
+	}
+
+	/* one lock (i.e. one reader transaction) for the whole batch */
+	r = sc_lock(card);
+	if (r != SC_SUCCESS) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "unable to acquire lock");
+		return r;
+	}
+
+	for (i = 0; i < count; i++) {
+		r = sc_transmit(card, &apdus[i]);
+		if (results != NULL)
+			results[i] = r;
+		if (r != SC_SUCCESS) {
+			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "APDU #%lu of %lu failed: %s",
+				(unsigned long) i, (unsigned long) count, sc_strerror(r));
+			break;
+		}
+	}
+	/* don't send anything after a failed transmission */
+	if (results != NULL)
+		for (i++; i < count; i++)
+			results[i] = r;
+
+	if (sc_unlock(card) != SC_SUCCESS)
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "sc_unlock failed");
+
+	return r;
+}
+
 int sc_bytes2apdu(sc_context_t *ctx, const u8 *buf, size_t len, sc_apdu_t *apdu)
 {
     const u8 *p;
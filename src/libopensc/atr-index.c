@@ -0,0 +1,282 @@
+/*
+ * atr-index.c: ATR to card driver index
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * sc_connect_card() used to find the driver of a card by walking all
+ * drivers in order: first the card_atr entries from opensc.conf, each
+ * one converted from hex and compared, then the match_card() of every
+ * built-in driver until one accepts the card.
+ *
+ * The card_atr entries are converted once, when the context is created,
+ * and kept in a hash table keyed by the ATR; entries with a mask are
+ * kept on a list of their own. The ATR tables of the built-in drivers
+ * are private to their match_card(), which may also look at the card,
+ * so these are not indexed up front. Instead the driver that accepted
+ * an ATR is remembered and tried first the next time the ATR is seen,
+ * provided no driver talked to the card before accepting it: its answer
+ * would then have depended on more than the ATR.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "internal.h"
+
+#define ATR_INDEX_BUCKETS	64
+
+struct atr_index_entry {
+	u8 atr[SC_MAX_ATR_SIZE];
+	u8 mask[SC_MAX_ATR_SIZE];
+	size_t len;
+	/* position of the driver in ctx->card_drivers and of the
+	 * entry in its atr_map; learned entries have no atr_map entry */
+	int driver;
+	int table_idx;
+	struct atr_index_entry *next;
+};
+
+struct sc_atr_index {
+	struct atr_index_entry *conf[ATR_INDEX_BUCKETS];
+	struct atr_index_entry *conf_masked;
+	struct atr_index_entry *learned[ATR_INDEX_BUCKETS];
+#ifdef HAVE_PTHREAD
+	/* cards may be connected from several threads at once */
+	pthread_mutex_t lock;
+#endif
+};
+
+static unsigned int atr_index_bucket(const u8 *atr, size_t len)
+{
+	return (unsigned int)(_sc_fnv64_update(SC_FNV64_OFFSET_BASIS, atr, len) % ATR_INDEX_BUCKETS);
+}
+
+static void atr_index_free_list(struct atr_index_entry *e)
+{
+	struct atr_index_entry *next;
+
+	for (; e != NULL; e = next) {
+		next = e->next;
+		free(e);
+	}
+}
+
+static int atr_index_add_conf(struct sc_atr_index *index, int driver, int table_idx,
+		const struct sc_atr_table *t)
+{
+	struct atr_index_entry *e, **ep;
+	size_t i, mask_len;
+
+	e = calloc(1, sizeof(struct atr_index_entry));
+	if (e == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	e->driver = driver;
+	e->table_idx = table_idx;
+	e->len = sizeof(e->atr);
+	/* Entries match_atr_table() would never match are left out */
+	if (sc_hex_to_bin(t->atr, e->atr, &e->len) != SC_SUCCESS
+			|| e->len == 0 || strlen(t->atr) != e->len * 3 - 1)
+		goto skip;
+	if (t->atrmask != NULL) {
+		mask_len = sizeof(e->mask);
+		if (strlen(t->atrmask) != strlen(t->atr)
+				|| sc_hex_to_bin(t->atrmask, e->mask, &mask_len) != SC_SUCCESS
+				|| mask_len != e->len)
+			goto skip;
+		for (i = 0; i < e->len; i++)
+			e->atr[i] &= e->mask[i];
+		ep = &index->conf_masked;
+	} else {
+		ep = &index->conf[atr_index_bucket(e->atr, e->len)];
+	}
+	/* Append, to keep the lists in driver and table order */
+	while (*ep != NULL)
+		ep = &(*ep)->next;
+	*ep = e;
+	return SC_SUCCESS;
+
+skip:
+	free(e);
+	return SC_SUCCESS;
+}
+
+int _sc_atr_index_build(sc_context_t *ctx)
+{
+	struct sc_atr_index *index;
+	int i, j, r;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	_sc_atr_index_free(ctx);
+
+	index = calloc(1, sizeof(struct sc_atr_index));
+	if (index == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+#ifdef HAVE_PTHREAD
+	if (pthread_mutex_init(&index->lock, NULL) != 0) {
+		free(index);
+		return SC_ERROR_INTERNAL;
+	}
+#endif
+	ctx->atr_index = index;
+
+	for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		struct sc_card_driver *drv = ctx->card_drivers[i];
+
+		if (drv->atr_map == NULL || !strcmp(drv->short_name, "default"))
+			continue;
+		for (j = 0; drv->atr_map[j].atr != NULL; j++) {
+			r = atr_index_add_conf(index, i, j, &drv->atr_map[j]);
+			if (r != SC_SUCCESS) {
+				_sc_atr_index_free(ctx);
+				return r;
+			}
+		}
+	}
+	return SC_SUCCESS;
+}
+
+void _sc_atr_index_free(sc_context_t *ctx)
+{
+	struct sc_atr_index *index;
+	int i;
+
+	if (ctx == NULL || (index = ctx->atr_index) == NULL)
+		return;
+	for (i = 0; i < ATR_INDEX_BUCKETS; i++) {
+		atr_index_free_list(index->conf[i]);
+		atr_index_free_list(index->learned[i]);
+	}
+	atr_index_free_list(index->conf_masked);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&index->lock);
+#endif
+	free(index);
+	ctx->atr_index = NULL;
+}
+
+static int atr_index_before(const struct atr_index_entry *a, const struct atr_index_entry *b)
+{
+	return b == NULL || a->driver < b->driver
+		|| (a->driver == b->driver && a->table_idx < b->table_idx);
+}
+
+int _sc_atr_index_match_conf(sc_context_t *ctx, const struct sc_atr *atr,
+		struct sc_card_driver **driver)
+{
+	struct sc_atr_index *index;
+	const struct atr_index_entry *e, *best = NULL;
+	size_t i;
+
+	if (ctx == NULL || atr == NULL || driver == NULL || (index = ctx->atr_index) == NULL)
+		return -1;
+
+	/* The index is not changed after it is built, no lock needed */
+	for (e = index->conf[atr_index_bucket(atr->value, atr->len)]; e != NULL; e = e->next) {
+		if (e->len == atr->len && !memcmp(e->atr, atr->value, atr->len)
+				&& atr_index_before(e, best))
+			best = e;
+	}
+	for (e = index->conf_masked; e != NULL; e = e->next) {
+		if (e->len != atr->len || !atr_index_before(e, best))
+			continue;
+		for (i = 0; i < atr->len; i++)
+			if ((atr->value[i] & e->mask[i]) != e->atr[i])
+				break;
+		if (i == atr->len)
+			best = e;
+	}
+	if (best == NULL)
+		return -1;
+	*driver = ctx->card_drivers[best->driver];
+	return best->table_idx;
+}
+
+static void atr_index_lock(sc_context_t *ctx)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ctx->atr_index->lock);
+#else
+	sc_mutex_lock(ctx, ctx->mutex);
+#endif
+}
+
+static void atr_index_unlock(sc_context_t *ctx)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ctx->atr_index->lock);
+#else
+	sc_mutex_unlock(ctx, ctx->mutex);
+#endif
+}
+
+struct sc_card_driver *_sc_atr_index_lookup(sc_context_t *ctx, const struct sc_atr *atr)
+{
+	const struct atr_index_entry *e;
+	struct sc_card_driver *driver = NULL;
+
+	if (ctx == NULL || atr == NULL || ctx->atr_index == NULL)
+		return NULL;
+
+	atr_index_lock(ctx);
+	for (e = ctx->atr_index->learned[atr_index_bucket(atr->value, atr->len)]; e != NULL; e = e->next) {
+		if (e->len == atr->len && !memcmp(e->atr, atr->value, atr->len)) {
+			driver = ctx->card_drivers[e->driver];
+			break;
+		}
+	}
+	atr_index_unlock(ctx);
+	return driver;
+}
+
+void _sc_atr_index_learn(sc_context_t *ctx, const struct sc_atr *atr, struct sc_card_driver *driver)
+{
+	struct atr_index_entry *e, **head;
+	int i;
+
+	if (ctx == NULL || atr == NULL || driver == NULL || ctx->atr_index == NULL
+			|| atr->len == 0 || atr->len > SC_MAX_ATR_SIZE)
+		return;
+	for (i = 0; ctx->card_drivers[i] != NULL; i++)
+		if (ctx->card_drivers[i] == driver)
+			break;
+	if (ctx->card_drivers[i] == NULL)
+		return;
+
+	atr_index_lock(ctx);
+	head = &ctx->atr_index->learned[atr_index_bucket(atr->value, atr->len)];
+	for (e = *head; e != NULL; e = e->next)
+		if (e->len == atr->len && !memcmp(e->atr, atr->value, atr->len))
+			break;
+	if (e == NULL && (e = calloc(1, sizeof(struct atr_index_entry))) != NULL) {
+		memcpy(e->atr, atr->value, atr->len);
+		e->len = atr->len;
+		e->table_idx = -1;
+		e->next = *head;
+		*head = e;
+	}
+	if (e != NULL) {
+		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "remembering driver %s for this ATR", driver->short_name);
+		e->driver = i;
+	}
+	atr_index_unlock(ctx);
+}
@@ -0,0 +1,349 @@
+/*
+ * capture.c: APDU capture files
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * With apdu_capture set in opensc.conf every exchange with a reader
+ * driver is appended to a capture file, so that a session can be
+ * replayed and analyzed later with opensc-tool. The file is shared
+ * by all processes, each one appends its records with a single write;
+ * it is created readable by its owner only, as the responses are in
+ * clear.
+ *
+ * The file starts with the 8 byte magic "OSCAPDU" and a version byte,
+ * followed by records made of a 32 byte header and two data fields,
+ * all numbers big endian:
+ *
+ *   type     1  SC_CAPTURE_CARD, _APDU, _LOCK or _UNLOCK
+ *   flags    1  SC_CAPTURE_FLAG_*
+ *   card     2  number of the card, given out when it is connected
+ *   session  4  process ID of the writer
+ *   time     8  microseconds since some fixed point in the past
+ *   usec     4  time the reader driver took for an APDU
+ *   result   4  return code of the reader driver
+ *   len1     4  length of data1: the command APDU, or the reader name
+ *   len2     4  length of data2: the response and status word, or
+ *               the ATR
+ *
+ * The data field of the commands that carry PINs (VERIFY, CHANGE
+ * REFERENCE DATA, RESET RETRY COUNTER) is overwritten with zeros.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "internal.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define CAPTURE_MAGIC		"OSCAPDU"
+#define CAPTURE_VERSION		2
+#define CAPTURE_HEADER_SIZE	32
+
+struct sc_capture_writer {
+	int fd;
+	unsigned long session;
+};
+
+/* card numbers are unique within the process, over all contexts */
+static unsigned int capture_next_card = 1;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t capture_card_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+struct sc_capture {
+	FILE *f;
+	u8 *buf;
+	size_t buf_len;
+};
+
+static void capture_lock(sc_context_t *ctx)
+{
+#ifdef HAVE_PTHREAD
+	(void)ctx;
+	pthread_mutex_lock(&capture_card_lock);
+#else
+	sc_mutex_lock(ctx, ctx->mutex);
+#endif
+}
+
+static void capture_unlock(sc_context_t *ctx)
+{
+#ifdef HAVE_PTHREAD
+	(void)ctx;
+	pthread_mutex_unlock(&capture_card_lock);
+#else
+	sc_mutex_unlock(ctx, ctx->mutex);
+#endif
+}
+
+int _sc_capture_start(sc_context_t *ctx, const char *filename)
+{
+	struct sc_capture_writer *cap;
+	u8 magic[8];
+	int fd;
+
+	if (ctx == NULL || filename == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	_sc_capture_stop(ctx);
+
+	cap = calloc(1, sizeof(struct sc_capture_writer));
+	if (cap == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	/* only the process that creates the file writes the magic */
+	fd = open(filename, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_BINARY, 0600);
+	if (fd >= 0) {
+		memcpy(magic, CAPTURE_MAGIC, 7);
+		magic[7] = CAPTURE_VERSION;
+		if (write(fd, magic, sizeof(magic)) != (int)sizeof(magic)) {
+			close(fd);
+			unlink(filename);
+			fd = -1;
+		}
+	} else if (errno == EEXIST) {
+		fd = open(filename, O_WRONLY | O_APPEND | O_BINARY);
+	}
+	if (fd < 0) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "cannot open APDU capture file %s", filename);
+		free(cap);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	cap->fd = fd;
+	cap->session = (unsigned long)getpid();
+	ctx->capture = cap;
+	return SC_SUCCESS;
+}
+
+void _sc_capture_stop(sc_context_t *ctx)
+{
+	struct sc_capture_writer *cap;
+
+	if (ctx == NULL || (cap = ctx->capture) == NULL)
+		return;
+	close(cap->fd);
+	free(cap);
+	ctx->capture = NULL;
+}
+
+/* One write() for each record, so that the records of the processes
+ * appending to the file do not get mixed up */
+static int capture_write(struct sc_capture_writer *cap, unsigned int type, unsigned int flags,
+		unsigned int card, unsigned long long time, unsigned long usec, int result,
+		const u8 *data1, size_t len1, const u8 *data2, size_t len2)
+{
+	size_t len = CAPTURE_HEADER_SIZE + len1 + len2;
+	u8 *rec;
+	int r = SC_SUCCESS;
+
+	rec = malloc(len);
+	if (rec == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	rec[0] = (u8)type;
+	rec[1] = (u8)flags;
+	ushort2bebytes(rec + 2, (unsigned short)card);
+	ulong2bebytes(rec + 4, cap->session);
+	ulong2bebytes(rec + 8, (unsigned long)(time >> 32));
+	ulong2bebytes(rec + 12, (unsigned long)(time & 0xFFFFFFFFUL));
+	ulong2bebytes(rec + 16, usec);
+	ulong2bebytes(rec + 20, (unsigned long)result);
+	ulong2bebytes(rec + 24, len1);
+	ulong2bebytes(rec + 28, len2);
+	if (len1)
+		memcpy(rec + CAPTURE_HEADER_SIZE, data1, len1);
+	if (len2)
+		memcpy(rec + CAPTURE_HEADER_SIZE + len1, data2, len2);
+	if (write(cap->fd, rec, len) != (int)len)
+		r = SC_ERROR_INTERNAL;
+	sc_mem_clear(rec, len);
+	free(rec);
+	return r;
+}
+
+void _sc_capture_card(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	const char *name = card->reader->name != NULL ? card->reader->name : "";
+
+	if (ctx->capture == NULL)
+		return;
+	capture_lock(ctx);
+	card->capture_id = capture_next_card++;
+	capture_unlock(ctx);
+	capture_write(ctx->capture, SC_CAPTURE_CARD, 0, card->capture_id, _sc_stats_clock(), 0, 0,
+		(const u8 *)name, strlen(name), card->atr.value, card->atr.len);
+}
+
+void _sc_capture_lock(sc_card_t *card, int locked)
+{
+	sc_context_t *ctx = card->ctx;
+
+	if (ctx->capture == NULL)
+		return;
+	capture_write(ctx->capture, locked ? SC_CAPTURE_LOCK : SC_CAPTURE_UNLOCK, 0,
+		card->capture_id, _sc_stats_clock(), 0, 0, NULL, 0, NULL, 0);
+}
+
+void _sc_capture_apdu(sc_card_t *card, const sc_apdu_t *apdu, int result,
+		unsigned long long start, unsigned long usec)
+{
+	sc_context_t *ctx = card->ctx;
+	sc_apdu_t copy = *apdu;
+	u8 *cmd = NULL, *resp = NULL, *zero = NULL;
+	size_t cmd_len = 0, resp_len = 0;
+	unsigned int flags = 0;
+
+	if (ctx->capture == NULL)
+		return;
+
+	switch (apdu->ins) {
+	case 0x20:	/* VERIFY */
+	case 0x21:
+	case 0x24:	/* CHANGE REFERENCE DATA */
+	case 0x2C:	/* RESET RETRY COUNTER */
+		if (apdu->datalen > 0 && apdu->data != NULL) {
+			zero = calloc(1, apdu->datalen);
+			if (zero == NULL)
+				return;
+			copy.data = zero;
+			flags |= SC_CAPTURE_FLAG_REDACTED;
+		}
+		break;
+	}
+	if (sc_apdu_get_octets(ctx, &copy, &cmd, &cmd_len, card->reader->active_protocol) != SC_SUCCESS) {
+		cmd = NULL;
+		cmd_len = 0;
+	}
+	if (result == SC_SUCCESS) {
+		resp_len = apdu->resplen + 2;
+		resp = malloc(resp_len);
+		if (resp == NULL) {
+			resp_len = 0;
+		} else {
+			if (apdu->resplen)
+				memcpy(resp, apdu->resp, apdu->resplen);
+			resp[apdu->resplen] = (u8)apdu->sw1;
+			resp[apdu->resplen + 1] = (u8)apdu->sw2;
+		}
+	}
+
+	capture_write(ctx->capture, SC_CAPTURE_APDU, flags, card->capture_id, start, usec, result,
+		cmd, cmd_len, resp, resp_len);
+
+	if (resp != NULL) {
+		sc_mem_clear(resp, resp_len);
+		free(resp);
+	}
+	if (cmd != NULL) {
+		sc_mem_clear(cmd, cmd_len);
+		free(cmd);
+	}
+	free(zero);
+}
+
+int sc_capture_open(const char *filename, sc_capture_t **cap_out)
+{
+	sc_capture_t *cap;
+	u8 magic[8];
+
+	if (filename == NULL || cap_out == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	cap = calloc(1, sizeof(sc_capture_t));
+	if (cap == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	cap->f = fopen(filename, "rb");
+	if (cap->f == NULL) {
+		free(cap);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	if (fread(magic, 1, sizeof(magic), cap->f) != sizeof(magic)
+			|| memcmp(magic, CAPTURE_MAGIC, 7) != 0 || magic[7] != CAPTURE_VERSION) {
+		sc_capture_close(cap);
+		return SC_ERROR_INVALID_DATA;
+	}
+	*cap_out = cap;
+	return SC_SUCCESS;
+}
+
+int sc_capture_read(sc_capture_t *cap, sc_capture_record_t *rec)
+{
+	u8 hdr[CAPTURE_HEADER_SIZE];
+	size_t n, len1, len2;
+
+	if (cap == NULL || rec == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	n = fread(hdr, 1, sizeof(hdr), cap->f);
+	if (n == 0 && feof(cap->f))
+		return 0;
+	if (n != sizeof(hdr))
+		return SC_ERROR_INVALID_DATA;
+
+	len1 = bebytes2ulong(hdr + 24);
+	len2 = bebytes2ulong(hdr + 28);
+	if (len1 > SC_MAX_EXT_APDU_BUFFER_SIZE || len2 > SC_MAX_EXT_APDU_BUFFER_SIZE + 2)
+		return SC_ERROR_INVALID_DATA;
+	if (len1 + len2 > cap->buf_len) {
+		u8 *p = realloc(cap->buf, len1 + len2);
+
+		if (p == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		cap->buf = p;
+		cap->buf_len = len1 + len2;
+	}
+	if (fread(cap->buf, 1, len1 + len2, cap->f) != len1 + len2)
+		return SC_ERROR_INVALID_DATA;
+
+	rec->type = hdr[0];
+	rec->flags = hdr[1];
+	rec->card = bebytes2ushort(hdr + 2);
+	rec->session = bebytes2ulong(hdr + 4);
+	rec->time = ((unsigned long long)bebytes2ulong(hdr + 8) << 32) | bebytes2ulong(hdr + 12);
+	rec->usec = bebytes2ulong(hdr + 16);
+	rec->result = (int)bebytes2ulong(hdr + 20);
+	rec->data1 = cap->buf;
+	rec->len1 = len1;
+	rec->data2 = cap->buf + len1;
+	rec->len2 = len2;
+	return 1;
+}
+
+void sc_capture_close(sc_capture_t *cap)
+{
+	if (cap == NULL)
+		return;
+	if (cap->f != NULL)
+		fclose(cap->f);
+	free(cap->buf);
+	free(cap);
+}
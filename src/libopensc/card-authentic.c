@@ -434,6 +434,13 @@ authentic_init_oberthur_authentic_3_2(struct sc_card *card)
 	card->caps |= SC_CARD_CAP_APDU_EXT; 
 	card->caps |= SC_CARD_CAP_USE_FCI_AC;
 
+	/* READ/UPDATE BINARY are built of short APDUs: without a reader
+	 * waiting area keep sc_read_binary() chunks within short limits. */
+	if (!(card->reader->flags & SC_READER_HAS_WAITING_AREA))   {
+		card->max_recv_size = 256;
+		card->max_send_size = 255;
+	}
+
 	rv = authentic_select_aid(card, aid_AuthentIC_3_2, sizeof(aid_AuthentIC_3_2), NULL, NULL);
 	LOG_TEST_RET(ctx, rv, "AuthentIC application select error");
 
@@ -159,6 +159,7 @@ static int cardos_init(sc_card_t *card)
 
 	card->name = "CardOS M4";
 	card->cla = 0x00;
+	card->caps |= SC_CARD_CAP_SELECT_CACHE;
 
 	/* Set up algorithm info. */
 	flags = SC_ALGORITHM_NEED_USAGE
@@ -29,6 +29,14 @@
 #include <string.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <process.h>
+#endif
 #ifdef ENABLE_OPENSSL
 	/* openssl only needed for card administration */
 #include <openssl/evp.h>
@@ -146,6 +154,9 @@ typedef struct piv_private_data {
 	int keysWithOffCardCerts;
 	char * offCardCertURL;
 	int pin_preference; /* set from Discovery object */ 
+	int use_file_cache; /* keep objects in a file across processes */
+	int file_cache_dirty; /* objects read from the card since loading the file */
+	char * file_cache_name;
 } piv_private_data_t;
 
 #define PIV_DATA(card) ((piv_private_data_t*)card->drv_data)
@@ -928,6 +939,23 @@ err:
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
 }
 
+/*
+ * Objects kept in the persistent cache: the ones every process reads
+ * to find the certificates. Biometrics and the other PIN protected
+ * objects are never written to disk.
+ */
+static int piv_obj_persistent(int enumtag)
+{
+	switch (enumtag) {
+		case PIV_OBJ_CCC:
+		case PIV_OBJ_CHUI:
+		case PIV_OBJ_DISCOVERY:
+		case PIV_OBJ_HISTORY:
+			return 1;
+	}
+	return (piv_objects[enumtag].flags & PIV_OBJECT_TYPE_CERT) != 0;
+}
+
 static int piv_get_cached_data(sc_card_t * card, int enumtag,
 			u8 **buf, size_t *buf_len)
 {
@@ -987,6 +1015,8 @@ static int piv_get_cached_data(sc_card_t * card, int enumtag,
 		priv->obj_cache[enumtag].obj_data = rbuf;
 		*buf = rbuf;
 		*buf_len = r;
+		if (piv_obj_persistent(enumtag))
+			priv->file_cache_dirty = 1;
 
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"added #%d  %p:%d %p:%d",
 				enumtag,
@@ -999,6 +1029,8 @@ static int piv_get_cached_data(sc_card_t * card, int enumtag,
 		r = SC_ERROR_FILE_NOT_FOUND;
 		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID; 
 		priv->obj_cache[enumtag].obj_len = 0;
+		if (piv_obj_persistent(enumtag))
+			priv->file_cache_dirty = 1;
 	} else if ( r < 0) {
 		goto err;
 	}
@@ -1053,7 +1085,13 @@ static int piv_cache_internal_data(sc_card_t *card, int enumtag)
 #ifdef ENABLE_ZLIB
 			size_t len;
 			u8* newBuf = NULL;
-			if(SC_SUCCESS != sc_decompress_alloc(&newBuf, &len, tag, taglen, COMPRESSION_AUTO)) {
+			int r;
+
+			if (priv->use_file_cache)
+				r = sc_decompress_alloc_cached(card->ctx, &newBuf, &len, tag, taglen, COMPRESSION_AUTO);
+			else
+				r = sc_decompress_alloc(&newBuf, &len, tag, taglen, COMPRESSION_AUTO);
+			if(SC_SUCCESS != r) {
 				SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OBJECT_NOT_VALID);
 			}      
 			priv->obj_cache[enumtag].internal_obj_data = newBuf;
@@ -1277,6 +1315,8 @@ static int piv_write_certificate(sc_card_t *card,
  * When the last chuck of the data is sent, we will write it. 
  */
 
+static void piv_file_cache_drop(sc_card_t *card);
+
 static int piv_write_binary(sc_card_t *card, unsigned int idx,
 		const u8 *buf, size_t count, unsigned long flags)
 {
@@ -1296,6 +1336,9 @@ static int piv_write_binary(sc_card_t *card, unsigned int idx,
 
 	if (priv->rwb_state == -1) {
 
+		/* the card is being changed, next process must read it again */
+		piv_file_cache_drop(card);
+
 		/* if  cached, remove old entry */
 		if (priv->obj_cache[enumtag].flags & PIV_OBJ_CACHE_VALID) {
 			priv->obj_cache[enumtag].flags = 0;
@@ -2471,6 +2514,268 @@ err:
 }
 
 
+/*
+ * Persistent object cache. The objects listed in piv_obj_persistent()
+ * are kept in a file in the OpenSC cache directory, named after the
+ * card serial number (GUID or FASC-N from the CHUID). The file is only
+ * used if the CHUID and History object stored in it are identical to
+ * the ones on the card: the CHUID is signed and changes on reissue, the
+ * History object changes when keys are retired. The History object is
+ * read at init anyway, so validating costs one GET DATA of the CHUID,
+ * which is needed for the serial number later on too.
+ *
+ * File format: PIV_FILE_CACHE_MAGIC, then for each object the 3 byte
+ * BER-TLV tag, a 4 byte length (MSB first) and the object. A length of
+ * zero records an object that is not on the card.
+ */
+#define PIV_FILE_CACHE_MAGIC		"PIVC\x01"
+#define PIV_FILE_CACHE_MAGIC_LEN	5
+#define PIV_FILE_CACHE_MAX_SIZE		(1024 * 1024)
+
+static int piv_find_obj_by_tag(const u8 *tag)
+{
+	int i;
+
+	for (i = 0; piv_objects[i].enumtag < PIV_OBJ_LAST_ENUM; i++)
+		if (piv_objects[i].tag_len == 3
+				&& memcmp(piv_objects[i].tag_value, tag, 3) == 0)
+			return i;
+	return -1;
+}
+
+/* The object on the card is known and identical to the file's copy */
+static int piv_file_cache_match(piv_private_data_t * priv, int enumtag,
+	const u8 *data, size_t len)
+{
+	piv_obj_cache_t *oc = &priv->obj_cache[enumtag];
+
+	if (!(oc->flags & PIV_OBJ_CACHE_VALID) || oc->obj_len != len)
+		return 0;
+	return len == 0 || memcmp(oc->obj_data, data, len) == 0;
+}
+
+/* Find the record of an object in the file image */
+static const u8 * piv_file_cache_find(const u8 *buf, size_t buflen,
+	int enumtag, size_t *len)
+{
+	const u8 *p = buf + PIV_FILE_CACHE_MAGIC_LEN;
+	const u8 *end = buf + buflen;
+	size_t rlen;
+
+	while (end - p >= 7) {
+		rlen = (p[3] << 24) | (p[4] << 16) | (p[5] << 8) | p[6];
+		if (rlen > (size_t)(end - p - 7))
+			return NULL;
+		if (memcmp(p, piv_objects[enumtag].tag_value, 3) == 0) {
+			*len = rlen;
+			return p + 7;
+		}
+		p += 7 + rlen;
+	}
+	return NULL;
+}
+
+static int piv_file_cache_load(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	sc_serial_number_t serial;
+	char dir[PATH_MAX];
+	char name[PATH_MAX];
+	struct stat stbuf;
+	FILE *f = NULL;
+	u8 *buf = NULL;
+	const u8 *p, *end, *data;
+	size_t i, len, buflen;
+	int n, r, enumtag;
+
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+
+	r = piv_get_serial_nr_from_CHUI(card, &serial);
+	if (r < 0 || serial.len == 0)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r < 0 ? r : SC_ERROR_INTERNAL);
+
+	r = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
+	n = snprintf(name, sizeof(name), "%s/piv_", dir);
+	for (i = 0; n >= 0 && (size_t)n < sizeof(name) && i < serial.len; i++) {
+		len = n;
+		n = snprintf(name + len, sizeof(name) - len, "%02X", serial.value[i]);
+		if (n >= 0)
+			n += len;
+	}
+	if (n < 0 || (size_t)n >= sizeof(name))
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_BUFFER_TOO_SMALL);
+	priv->file_cache_name = strdup(name);
+	if (priv->file_cache_name == NULL)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY);
+
+	r = SC_ERROR_FILE_NOT_FOUND;
+	if (stat(name, &stbuf) != 0 || stbuf.st_size > PIV_FILE_CACHE_MAX_SIZE
+			|| stbuf.st_size < PIV_FILE_CACHE_MAGIC_LEN)
+		goto err;
+	buflen = stbuf.st_size;
+	buf = malloc(buflen);
+	if (buf == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	f = fopen(name, "rb");
+	if (f == NULL || fread(buf, 1, buflen, f) != buflen)
+		goto err;
+
+	r = SC_ERROR_OBJECT_NOT_VALID;
+	if (memcmp(buf, PIV_FILE_CACHE_MAGIC, PIV_FILE_CACHE_MAGIC_LEN) != 0)
+		goto err;
+
+	/* Validate against what was read from the card */
+	data = piv_file_cache_find(buf, buflen, PIV_OBJ_CHUI, &len);
+	if (data == NULL || len == 0 || !piv_file_cache_match(priv, PIV_OBJ_CHUI, data, len)) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "cached CHUID does not match the card");
+		goto err;
+	}
+	data = piv_file_cache_find(buf, buflen, PIV_OBJ_HISTORY, &len);
+	if (data == NULL)
+		len = 0;
+	if (!piv_file_cache_match(priv, PIV_OBJ_HISTORY, data, len)) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "cached History object does not match the card");
+		goto err;
+	}
+
+	p = buf + PIV_FILE_CACHE_MAGIC_LEN;
+	end = buf + buflen;
+	while (end - p >= 7) {
+		len = (p[3] << 24) | (p[4] << 16) | (p[5] << 8) | p[6];
+		if (len > (size_t)(end - p - 7))
+			break;
+		enumtag = piv_find_obj_by_tag(p);
+		data = p + 7;
+		p += 7 + len;
+
+		if (enumtag < 0 || !piv_obj_persistent(enumtag)
+				|| (priv->obj_cache[enumtag].flags & PIV_OBJ_CACHE_VALID))
+			continue;
+		if (len != 0) {
+			priv->obj_cache[enumtag].obj_data = malloc(len);
+			if (priv->obj_cache[enumtag].obj_data == NULL) {
+				r = SC_ERROR_OUT_OF_MEMORY;
+				goto err;
+			}
+			memcpy(priv->obj_cache[enumtag].obj_data, data, len);
+			priv->obj_cache[enumtag].flags &= ~PIV_OBJ_CACHE_NOT_PRESENT;
+		}
+		priv->obj_cache[enumtag].obj_len = len;
+		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "loaded #%d from file cache, len=%d",
+				enumtag, len);
+	}
+	/* Everything in memory is now what the file has, or identical to it */
+	priv->file_cache_dirty = 0;
+	r = SC_SUCCESS;
+
+err:
+	if (f)
+		fclose(f);
+	if (buf)
+		free(buf);
+	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
+}
+
+static int piv_file_cache_save(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	char tmp[PATH_MAX];
+	FILE *f;
+	u8 hdr[7];
+	size_t len;
+	int i, n, r = SC_SUCCESS;
+
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+
+	/* Without the CHUID the file could never be validated */
+	if (!(priv->obj_cache[PIV_OBJ_CHUI].flags & PIV_OBJ_CACHE_VALID)
+			|| priv->obj_cache[PIV_OBJ_CHUI].obj_len == 0)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OBJECT_NOT_VALID);
+
+	/* Written next to the file and renamed over it, so that nobody
+	 * ever reads a partly written file */
+	n = snprintf(tmp, sizeof(tmp), "%s.%lu.tmp", priv->file_cache_name, (unsigned long)getpid());
+	if (n < 0 || (size_t)n >= sizeof(tmp))
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_BUFFER_TOO_SMALL);
+
+	f = fopen(tmp, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if ((r = sc_make_cache_dir(card->ctx)) < 0)
+			SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
+		f = fopen(tmp, "wb");
+	}
+	if (f == NULL)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_INTERNAL);
+
+	if (fwrite(PIV_FILE_CACHE_MAGIC, 1, PIV_FILE_CACHE_MAGIC_LEN, f) != PIV_FILE_CACHE_MAGIC_LEN)
+		r = SC_ERROR_INTERNAL;
+	for (i = 0; r == SC_SUCCESS && i < PIV_OBJ_LAST_ENUM; i++) {
+		if (!piv_obj_persistent(i) || piv_objects[i].tag_len != 3
+				|| !(priv->obj_cache[i].flags & PIV_OBJ_CACHE_VALID))
+			continue;
+		len = priv->obj_cache[i].obj_len;
+		memcpy(hdr, piv_objects[i].tag_value, 3);
+		hdr[3] = (len >> 24) & 0xFF;
+		hdr[4] = (len >> 16) & 0xFF;
+		hdr[5] = (len >> 8) & 0xFF;
+		hdr[6] = len & 0xFF;
+		if (fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr)
+				|| (len && fwrite(priv->obj_cache[i].obj_data, 1, len, f) != len))
+			r = SC_ERROR_INTERNAL;
+	}
+	if (fclose(f) != 0)
+		r = SC_ERROR_INTERNAL;
+#ifdef _WIN32
+	/* rename() does not replace an existing file here */
+	if (r == SC_SUCCESS)
+		remove(priv->file_cache_name);
+#endif
+	if (r == SC_SUCCESS && rename(tmp, priv->file_cache_name) != 0)
+		r = SC_ERROR_INTERNAL;
+	if (r != SC_SUCCESS)
+		unlink(tmp);
+	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
+}
+
+/* Objects are being written to the card: stop using the file */
+static void piv_file_cache_drop(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+
+	if (priv->file_cache_name == NULL)
+		return;
+	unlink(priv->file_cache_name);
+	free(priv->file_cache_name);
+	priv->file_cache_name = NULL;
+}
+
+static int piv_load_options(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	scconf_block **blocks, *blk;
+	int i;
+
+	for (i = 0; card->ctx->conf_blocks[i]; i++) {
+		blocks = scconf_find_blocks(card->ctx->conf, card->ctx->conf_blocks[i],
+				"card_driver", "piv");
+		if (!blocks)
+			continue;
+		blk = blocks[0];
+		free(blocks);
+		if (blk == NULL)
+			continue;
+
+		priv->use_file_cache = scconf_get_bool(blk, "use_file_caching",
+				priv->use_file_cache);
+	}
+	return SC_SUCCESS;
+}
+
 static int piv_finish(sc_card_t *card)
 {
  	piv_private_data_t * priv = PIV_DATA(card);
@@ -2484,6 +2789,11 @@ static int piv_finish(sc_card_t *card)
 			free(priv->w_buf);
 		if (priv->offCardCertURL)
 			free(priv->offCardCertURL);
+		if (priv->file_cache_name) {
+			if (priv->file_cache_dirty)
+				piv_file_cache_save(card);
+			free(priv->file_cache_name);
+		}
 		for (i = 0; i < PIV_OBJ_LAST_ENUM - 1; i++) {
 			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"DEE freeing #%d, 0x%02x %p:%d %p:%d", i, 
 				priv->obj_cache[i].flags,
@@ -2572,6 +2882,11 @@ static int piv_init(sc_card_t *card)
 	 */
 	r = piv_process_history(card);
 
+	/* Before Discovery, so that it can come from the file as well */
+	piv_load_options(card);
+	if (priv->use_file_cache)
+		piv_file_cache_load(card);
+
 	r = piv_process_discovery(card);
 
 	if (r > 0)
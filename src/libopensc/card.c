@@ -77,6 +77,8 @@ static sc_card_t * sc_card_new(sc_context_t *ctx)
 		free(card);
 		return NULL;
 	}
+	/* statistics are optional, no need to fail without them */
+	card->stats = calloc(1, sizeof(sc_stats_t));
 
 	card->type = -1;
 	card->app_count = -1;
@@ -93,6 +95,9 @@ static void sc_card_free(sc_card_t *card)
 	free(card->ops);
 	if (card->algorithms != NULL)
 		free(card->algorithms);
+	if (card->stats != NULL)
+		free(card->stats);
+	sc_invalidate_cache(card);
 	if (card->mutex != NULL) {
 		int r = sc_mutex_destroy(card->ctx, card->mutex);
 		if (r != SC_SUCCESS)
@@ -102,6 +107,80 @@ static void sc_card_free(sc_card_t *card)
 	free(card);
 }
 
+/*
+ * Decide once per connection whether extended length APDUs are used.
+ * The card driver announces support with SC_CARD_CAP_APDU_EXT; the
+ * reader_driver block may disable it for the whole reader layer or for
+ * individual readers, and a matching card_atr block has the last word
+ * and may also set the card's max_send_size/max_recv_size.
+ */
+static void sc_card_negotiate_apdu_size(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	sc_reader_t *reader = card->reader;
+	scconf_block *conf_block;
+	const scconf_list *list;
+	int use_ext = (card->caps & SC_CARD_CAP_APDU_EXT) != 0;
+
+	if (use_ext && !reader->driver->enable_extended_apdu) {
+		sc_log(ctx, "extended APDUs disabled for reader driver '%s'", reader->driver->short_name);
+		use_ext = 0;
+	}
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", reader->driver->short_name, 1);
+	if (use_ext && conf_block != NULL && reader->name != NULL) {
+		for (list = scconf_find_list(conf_block, "disable_extended_apdu_readers");
+				list != NULL; list = list->next) {
+			if (list->data != NULL && strstr(reader->name, list->data) != NULL) {
+				sc_log(ctx, "extended APDUs disabled for reader '%s'", reader->name);
+				use_ext = 0;
+				break;
+			}
+		}
+	}
+
+	conf_block = _sc_match_atr_block(ctx, NULL, &card->atr);
+	if (conf_block != NULL) {
+		use_ext = scconf_get_bool(conf_block, "extended_apdu", use_ext);
+		card->max_send_size = scconf_get_int(conf_block, "max_send_size", card->max_send_size);
+		card->max_recv_size = scconf_get_int(conf_block, "max_recv_size", card->max_recv_size);
+	}
+
+	if (use_ext)
+		card->caps |= SC_CARD_CAP_APDU_EXT;
+	else
+		card->caps &= ~SC_CARD_CAP_APDU_EXT;
+}
+
+/* Returns 1 if the driver took the card, 0 if not, or an error */
+static int connect_match_driver(sc_card_t *card, struct sc_card_driver *drv)
+{
+	sc_context_t *ctx = card->ctx;
+	const struct sc_card_operations *ops = drv->ops;
+	int r;
+
+	sc_debug(ctx, SC_LOG_DEBUG_MATCH, "trying driver: %s", drv->short_name);
+	if (ops == NULL || ops->match_card == NULL)
+		return 0;
+	/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
+	*card->ops = *ops;
+	if (ops->match_card(card) != 1)
+		return 0;
+	sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matched: %s", drv->name);
+	memcpy(card->ops, ops, sizeof(struct sc_card_operations));
+	card->driver = drv;
+	r = ops->init(card);
+	if (r) {
+		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "driver '%s' init() failed: %s", drv->name,
+		      sc_strerror(r));
+		card->driver = NULL;
+		if (r == SC_ERROR_INVALID_CARD)
+			return 0;
+		return r;
+	}
+	return 1;
+}
+
 int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 {
 	sc_card_t *card;
@@ -128,32 +207,23 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	card->ctx = ctx;
 
 	memcpy(&card->atr, &reader->atr, sizeof(card->atr));
+	_sc_capture_card(card);
 
 	_sc_parse_atr(reader);
 
 	/* See if the ATR matches any ATR specified in the config file */
 	if ((driver = ctx->forced_driver) == NULL) {
 		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matching configured ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
-			driver = ctx->card_drivers[i];
-
-			if (driver->atr_map == NULL ||
-			    !strcmp(driver->short_name, "default")) {
-				driver = NULL;
-				continue;
-			}
-			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "trying driver: %s", driver->short_name);
-			idx = _sc_match_atr(card, driver->atr_map, NULL);
-			if (idx >= 0) {
-				struct sc_atr_table *src = &driver->atr_map[idx];
-
-				sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matched: %s", driver->name);
-				/* It's up to card driver to notice these correctly */
-				card->name = src->name;
-				card->type = src->type;
-				card->flags = src->flags;
-				break;
-			}
+		idx = _sc_atr_index_match_conf(ctx, &card->atr, &driver);
+		if (idx >= 0) {
+			struct sc_atr_table *src = &driver->atr_map[idx];
+
+			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matched: %s", driver->name);
+			/* It's up to card driver to notice these correctly */
+			card->name = src->name;
+			card->type = src->type;
+			card->flags = src->flags;
+		} else {
 			driver = NULL;
 		}
 	}
@@ -172,32 +242,35 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 			}
 		}
 	} else {
-		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matching built-in ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
-			struct sc_card_driver *drv = ctx->card_drivers[i];
-			const struct sc_card_operations *ops = drv->ops;
+		/* A driver that took this ATR before gets the first go */
+		driver = _sc_atr_index_lookup(ctx, &card->atr);
+		if (driver != NULL) {
+			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "trying driver known for ATR: %s", driver->short_name);
+			r = connect_match_driver(card, driver);
+			if (r < 0)
+				goto err;
+		}
 
-			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "trying driver: %s", drv->short_name);
-			if (ops == NULL || ops->match_card == NULL)
-				continue;
-			/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
-			*card->ops = *ops;
-			if (ops->match_card(card) != 1)
-				continue;
-			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matched: %s", drv->name);
-			memcpy(card->ops, ops, sizeof(struct sc_card_operations));
-			card->driver = drv;
-			r = ops->init(card);
-			if (r) {
-				sc_debug(ctx, SC_LOG_DEBUG_MATCH, "driver '%s' init() failed: %s", drv->name,
-				      sc_strerror(r));
-				if (r == SC_ERROR_INVALID_CARD) {
-					card->driver = NULL;
+		if (card->driver == NULL) {
+			unsigned long apdus = card->stats != NULL ? card->stats->apdus : 0;
+
+			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matching built-in ATRs");
+			for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+				struct sc_card_driver *drv = ctx->card_drivers[i];
+				int probed = card->stats == NULL || card->stats->apdus != apdus;
+
+				if (drv == driver)
 					continue;
-				}
-				goto err;
+				r = connect_match_driver(card, drv);
+				if (r < 0)
+					goto err;
+				if (r == 0)
+					continue;
+				/* Only learn what the ATR decided on its own */
+				if (!probed)
+					_sc_atr_index_learn(ctx, &card->atr, drv);
+				break;
 			}
-			break;
 		}
 	}
 	if (card->driver == NULL) {
@@ -209,6 +282,8 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 		card->name = card->driver->name;
 	*card_out = card;
 
+	sc_card_negotiate_apdu_size(card);
+
         /*  Override card limitations with reader limitations.
          *  Note that zero means no limitations at all.
 	 */
@@ -222,6 +297,9 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 
 	sc_log(ctx, "card info name:'%s', type:%i, flags:0x%X, max_send/recv_size:%i/%i",
 		card->name, card->type, card->flags, card->max_send_size, card->max_recv_size);
+	sc_log(ctx, "%s APDUs, binary transfer unit send/recv:%i/%i",
+		(card->caps & SC_CARD_CAP_APDU_EXT) ? "extended" : "short",
+		sc_get_max_send_size(card), sc_get_max_recv_size(card));
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 err:
 	if (connected)
@@ -272,9 +350,7 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 		return r;
 
 	r = card->reader->ops->reset(card->reader, do_cold_reset);
-	/* invalidate cache */
-	memset(&card->cache, 0, sizeof(card->cache));
-	card->cache.valid = 0;
+	sc_invalidate_cache(card);
 
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -288,11 +364,13 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 int sc_lock(sc_card_t *card)
 {
 	int r = 0, r2 = 0;
+	unsigned long long start;
 
 	LOG_FUNC_CALLED(card->ctx);
 	
 	if (card == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
+	start = _sc_stats_clock();
 	r = sc_mutex_lock(card->ctx, card->mutex);
 	if (r != SC_SUCCESS)
 		return r;
@@ -300,17 +378,24 @@ int sc_lock(sc_card_t *card)
 		if (card->reader->ops->lock != NULL) {
 			r = card->reader->ops->lock(card->reader);
 			if (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
-				/* invalidate cache */
-				memset(&card->cache, 0, sizeof(card->cache));
-				card->cache.valid = 0;
+				sc_invalidate_cache(card);
 				r = card->reader->ops->lock(card->reader);
 			}
+			/* another application may have selected other files */
+			if (r == 0 && !card->reader->transaction_kept
+					&& (card->caps & SC_CARD_CAP_SELECT_CACHE))
+				sc_invalidate_selection(card);
 		}
 		if (r == 0)
 			card->cache.valid = 1;
 	}
-	if (r == 0)
+	if (r == 0) {
+		if (card->lock_count == 0) {
+			_sc_stats_add_lock(card, _sc_stats_clock() - start);
+			_sc_capture_lock(card, 1);
+		}
 		card->lock_count++;
+	}
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
 		sc_log(card->ctx, "unable to release lock");
@@ -336,14 +421,13 @@ int sc_unlock(sc_card_t *card)
 	assert(card->lock_count >= 1);
 	if (--card->lock_count == 0) {
 #ifdef INVALIDATE_CARD_CACHE_IN_UNLOCK
-		/* invalidate cache */
-		memset(&card->cache, 0, sizeof(card->cache));
-		card->cache.valid = 0;
+		sc_invalidate_cache(card);
 		sc_log(card->ctx, "cache invalidated");
 #endif
 		/* release reader lock */
 		if (card->reader->ops->unlock != NULL)
 			r = card->reader->ops->unlock(card->reader);
+		_sc_capture_lock(card, 0);
 	}
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -412,10 +496,100 @@ int sc_delete_file(sc_card_t *card, const sc_path_t *path)
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+size_t sc_get_max_recv_size(const sc_card_t *card)
+{
+	assert(card != NULL);
+	if (card->max_recv_size > 0)
+		return card->max_recv_size;
+	return (card->caps & SC_CARD_CAP_APDU_EXT) ? 65536 : 256;
+}
+
+size_t sc_get_max_send_size(const sc_card_t *card)
+{
+	assert(card != NULL);
+	if (card->max_send_size > 0)
+		return card->max_send_size;
+	return (card->caps & SC_CARD_CAP_APDU_EXT) ? 65535 : 255;
+}
+
+/*
+ * Called when a READ/WRITE/UPDATE BINARY of more than short APDU size
+ * failed. If the error looks like the reader or the card refused the
+ * extended length APDU, fall back to short APDUs for the rest of the
+ * session and let the caller retry.
+ */
+static int sc_ext_apdu_rejected(sc_card_t *card, int r)
+{
+	if (!(card->caps & SC_CARD_CAP_APDU_EXT))
+		return 0;
+	switch (r) {
+	case SC_ERROR_WRONG_LENGTH:
+	case SC_ERROR_CLASS_NOT_SUPPORTED:
+	case SC_ERROR_INS_NOT_SUPPORTED:
+	case SC_ERROR_TRANSMIT_FAILED:
+		break;
+	default:
+		return 0;
+	}
+
+	sc_log(card->ctx, "extended APDU rejected (%s), falling back to short APDUs", sc_strerror(r));
+	card->caps &= ~SC_CARD_CAP_APDU_EXT;
+	if (card->max_recv_size > 256)
+		card->max_recv_size = 256;
+	if (card->max_send_size > 255)
+		card->max_send_size = 255;
+	return 1;
+}
+
+/* READ BINARY commands sent in one sc_transmit_apdu_batch() */
+#define READ_BINARY_BATCH	16
+
+/* For drivers that read with the ISO 7816 READ BINARY, read the chunks
+ * of a large EF with back-to-back commands. Returns the number of bytes
+ * read before the first chunk that did not come back complete, the
+ * caller reads the rest chunk by chunk. */
+static size_t read_binary_batch(sc_card_t *card, unsigned int idx,
+		u8 *buf, size_t count, size_t max_le)
+{
+	sc_apdu_t apdus[READ_BINARY_BATCH];
+	int results[READ_BINARY_BATCH];
+	size_t done = 0, pos, n, i;
+
+	if (card->ops->read_binary != sc_get_iso7816_driver()->ops->read_binary)
+		return 0;
+
+	while (done < count) {
+		for (n = 0, pos = done; n < READ_BINARY_BATCH && pos < count; n++) {
+			unsigned int off = idx + pos;
+			size_t len = count - pos > max_le ? max_le : count - pos;
+
+			if (off > 0x7fff)
+				break;
+			sc_format_apdu(card, &apdus[n], SC_APDU_CASE_2, 0xB0, (off >> 8) & 0x7F, off & 0xFF);
+			apdus[n].le = len;
+			apdus[n].resplen = len;
+			apdus[n].resp = buf + pos;
+			pos += len;
+		}
+		/* a single chunk is no better off in a batch */
+		if (n < 2)
+			break;
+
+		sc_transmit_apdu_batch(card, apdus, n, results);
+		for (i = 0; i < n; i++) {
+			if (results[i] != SC_SUCCESS || apdus[i].sw1 != 0x90 || apdus[i].sw2 != 0x00
+					|| apdus[i].resplen != apdus[i].le)
+				return done;
+			done += apdus[i].resplen;
+		}
+	}
+	return done;
+}
+
 int sc_read_binary(sc_card_t *card, unsigned int idx,
 		   unsigned char *buf, size_t count, unsigned long flags)
 {
-	size_t max_le = card->max_recv_size > 0 ? card->max_recv_size : 256;
+	size_t max_le = sc_get_max_recv_size(card);
 	int r;
 
 	assert(card != NULL && card->ops != NULL && buf != NULL);
@@ -432,6 +606,10 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 
 		r = sc_lock(card);
 		LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+		bytes_read = read_binary_batch(card, idx, p, count, max_le);
+		p += bytes_read;
+		idx += bytes_read;
+		count -= bytes_read;
 		while (count > 0) {
 			size_t n = count > max_le ? max_le : count;
 			r = sc_read_binary(card, idx, p, n, flags);
@@ -452,13 +630,15 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 		LOG_FUNC_RETURN(card->ctx, bytes_read);
 	}
 	r = card->ops->read_binary(card, idx, buf, count, flags);
+	if (r < 0 && count > 256 && sc_ext_apdu_rejected(card, r))
+		r = sc_read_binary(card, idx, buf, count, flags);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
 int sc_write_binary(sc_card_t *card, unsigned int idx,
 		    const u8 *buf, size_t count, unsigned long flags)
 {
-	size_t max_lc = card->max_send_size > 0 ? card->max_send_size : 255;
+	size_t max_lc = sc_get_max_send_size(card);
 	int r;
 
 	assert(card != NULL && card->ops != NULL && buf != NULL);
@@ -495,13 +675,15 @@ int sc_write_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	r = card->ops->write_binary(card, idx, buf, count, flags);
+	if (r < 0 && count > 255 && sc_ext_apdu_rejected(card, r))
+		r = sc_write_binary(card, idx, buf, count, flags);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
 int sc_update_binary(sc_card_t *card, unsigned int idx,
 		     const u8 *buf, size_t count, unsigned long flags)
 {
-	size_t max_lc = card->max_send_size > 0 ? card->max_send_size : 255;
+	size_t max_lc = sc_get_max_send_size(card);
 	int r;
 
 	assert(card != NULL && card->ops != NULL && buf != NULL);
@@ -538,6 +720,8 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	r = card->ops->update_binary(card, idx, buf, count, flags);
+	if (r < 0 && count > 255 && sc_ext_apdu_rejected(card, r))
+		r = sc_update_binary(card, idx, buf, count, flags);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -557,10 +741,93 @@ int sc_erase_binary(struct sc_card *card, unsigned int offs, size_t count,  unsi
 }
 
 
+void sc_invalidate_selection(sc_card_t *card)
+{
+	if (card->cache.current_ef != NULL)
+		sc_file_free(card->cache.current_ef);
+	if (card->cache.current_df != NULL)
+		sc_file_free(card->cache.current_df);
+	card->cache.current_ef = NULL;
+	card->cache.current_df = NULL;
+	memset(&card->cache.current_path, 0, sizeof(card->cache.current_path));
+}
+
+void sc_invalidate_cache(sc_card_t *card)
+{
+	sc_invalidate_selection(card);
+	memset(&card->cache, 0, sizeof(card->cache));
+	card->cache.valid = 0;
+}
+
+/*
+ * SC_CARD_CAP_SELECT_CACHE: card->cache.current_path is the absolute path
+ * (or DF name) of the file selected last, current_df or current_ef its FCI
+ * if that was asked for. Returns 1 if in_path is already selected and
+ * *file could be filled in. Otherwise returns 0 and sets rel_path->len if
+ * in_path is a child of the current DF that can be selected by file ID.
+ */
+static int select_from_cache(sc_card_t *card, const sc_path_t *in_path,
+		sc_file_t **file, sc_path_t *rel_path)
+{
+	const sc_path_t *cur = &card->cache.current_path;
+	const sc_file_t *cur_file;
+	size_t df_len;
+
+	rel_path->len = 0;
+	if (!card->cache.valid || cur->len == 0 || cur->type != in_path->type
+			|| in_path->aid.len != 0)
+		return 0;
+	if (in_path->type != SC_PATH_TYPE_PATH && in_path->type != SC_PATH_TYPE_DF_NAME)
+		return 0;
+
+	cur_file = card->cache.current_ef != NULL ? card->cache.current_ef : card->cache.current_df;
+	if (sc_compare_path(in_path, cur)) {
+		if (file == NULL)
+			return 1;
+		if (cur_file == NULL)
+			return 0;
+		sc_file_dup(file, cur_file);
+		return *file != NULL;
+	}
+
+	/* the current DF is known only if the FCI of the last file was read */
+	if (in_path->type != SC_PATH_TYPE_PATH || cur_file == NULL)
+		return 0;
+	if (cur_file->type == SC_FILE_TYPE_DF)
+		df_len = cur->len;
+	else if (cur_file->type == SC_FILE_TYPE_WORKING_EF || cur_file->type == SC_FILE_TYPE_INTERNAL_EF)
+		df_len = cur->len - 2;
+	else
+		return 0;
+	if (df_len < 2 || in_path->len != df_len + 2 || memcmp(in_path->value, cur->value, df_len) != 0)
+		return 0;
+	memcpy(rel_path->value, in_path->value + df_len, 2);
+	rel_path->len = 2;
+	rel_path->type = SC_PATH_TYPE_FILE_ID;
+	return 0;
+}
+
+/* Remember the file selected by sc_select_file() */
+static void select_to_cache(sc_card_t *card, const sc_path_t *in_path, sc_file_t *file)
+{
+	sc_invalidate_selection(card);
+	if (in_path->aid.len != 0
+			|| (in_path->type != SC_PATH_TYPE_PATH && in_path->type != SC_PATH_TYPE_DF_NAME))
+		return;
+	card->cache.current_path = *in_path;
+	if (file == NULL)
+		return;
+	if (file->type == SC_FILE_TYPE_DF)
+		sc_file_dup(&card->cache.current_df, file);
+	else
+		sc_file_dup(&card->cache.current_ef, file);
+}
+
 int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 {
 	int r;
 	char pbuf[SC_MAX_PATH_STRING_SIZE];
+	sc_path_t rel_path;
 
 	assert(card != NULL && in_path != NULL);
 
@@ -589,10 +856,33 @@ int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 	}
 	if (card->ops->select_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+
+	if (card->caps & SC_CARD_CAP_SELECT_CACHE) {
+		if (select_from_cache(card, in_path, file, &rel_path)) {
+			sc_log(card->ctx, "file already selected");
+			_sc_stats_inc(card, select_cached);
+			LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+		}
+		if (rel_path.len != 0) {
+			sc_log(card->ctx, "selecting %02X%02X in the current DF",
+				rel_path.value[0], rel_path.value[1]);
+			_sc_stats_inc(card, select_cached);
+			r = card->ops->select_file(card, &rel_path, file);
+			if (r == 0)
+				goto done;
+		}
+	}
 	r = card->ops->select_file(card, in_path, file);
+done:
 	/* Remember file path */
 	if (r == 0 && file && *file)
 		(*file)->path = *in_path;
+	if (card->caps & SC_CARD_CAP_SELECT_CACHE) {
+		if (r == 0)
+			select_to_cache(card, in_path, file ? *file : NULL);
+		else
+			sc_invalidate_selection(card);
+	}
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
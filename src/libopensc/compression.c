@@ -22,8 +22,18 @@
 
 #ifdef ENABLE_ZLIB	/* empty file without zlib */
 #include <zlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <process.h>
+#endif
 
 #include "internal.h"
 #include "errors.h"
@@ -109,16 +119,28 @@ int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int metho
 	}
 }
 
+/* zlib can't expand more than this, used to sanity check the gzip ISIZE */
+#define DEFLATE_MAX_RATIO	1032
+
 static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int gzip) {
 	/* Since uncompress does not offer a way to make it uncompress gzip... manually set it up */
 	z_stream gz;
 	int err;
 	int window_size = 15;
-	const int startSize = inLen < 1024 ? 2048 : inLen * 2;
-	const int blockSize = inLen < 1024 ? 512 : inLen / 2;
-	int bufferSize = startSize;
-	if(gzip)
+	size_t bufferSize = inLen < 1024 ? 2048 : inLen * 2;
+	u8* buf;
+
+	if(gzip) {
 		window_size += 0x20;
+		/* The gzip trailer has the uncompressed size (mod 2^32). If it
+		 * is plausible, a buffer of that size gets it done in one pass. */
+		if(inLen >= 18) {
+			size_t isize = in[inLen - 4] | (in[inLen - 3] << 8)
+				| (in[inLen - 2] << 16) | ((size_t)in[inLen - 1] << 24);
+			if(isize > 0 && isize / DEFLATE_MAX_RATIO <= inLen)
+				bufferSize = isize;
+		}
+	}
 	memset(&gz, 0, sizeof(gz));
 	
 	gz.next_in = (u8*)in;
@@ -130,40 +152,40 @@ static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size
 	*outLen = 0;
 
 	while(1) {
-		/* Setup buffer... */
-		int num;
-		u8* buf = realloc(*out, bufferSize);
+		buf = realloc(*out, bufferSize);
 		if(!buf) {
-			if(*out)
-				free(*out);
-			*out = NULL;
-			return Z_MEM_ERROR;
+			err = Z_MEM_ERROR;
+			break;
 		}
 		*out = buf;
 		gz.next_out = buf + *outLen;
 		gz.avail_out = bufferSize - *outLen;
 
-		err = inflate(&gz, Z_FULL_FLUSH);
-		if(err != Z_STREAM_END && err != Z_OK) {
-			if(*out)
-				free(*out);
-			*out = NULL;
+		err = inflate(&gz, Z_FINISH);
+		*outLen = bufferSize - gz.avail_out;
+		if(err == Z_STREAM_END)
 			break;
-		}
-		num = bufferSize - *outLen - gz.avail_out;
-		if(num > 0) {
-			*outLen += num;
-			bufferSize += num + blockSize;
-		}
-		if(err == Z_STREAM_END) {
-			buf = realloc(buf, *outLen); /* Shrink it down, if it fails, just use old data */
-			if(buf) {
-				*out = buf;
-			}
+		/* Z_BUF_ERROR with room left: the input is truncated */
+		if((err != Z_OK && err != Z_BUF_ERROR) || gz.avail_out != 0) {
+			if(err == Z_OK || err == Z_BUF_ERROR)
+				err = Z_DATA_ERROR;
 			break;
 		}
+		/* ISIZE was wrong, or there was none: grow */
+		bufferSize *= 2;
 	}
 	inflateEnd(&gz);
+
+	if(err != Z_STREAM_END) {
+		if(*out)
+			free(*out);
+		*out = NULL;
+		*outLen = 0;
+	} else if(*outLen < bufferSize && *outLen > 0) {
+		buf = realloc(*out, *outLen); /* Shrink it down, if it fails, just use old data */
+		if(buf)
+			*out = buf;
+	}
 	return zerr_to_opensc(err);
 }
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method) {
@@ -182,4 +204,118 @@ int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, in
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 }
+/*
+ * sc_decompress_alloc() with the result kept in the cache directory,
+ * under a hash of the compressed data, for the next process that reads
+ * the same object. The compressed data is stored along and compared, so
+ * a hash collision can't hand out somebody else's object.
+ * File format: 4 bytes compressed length and 4 bytes decompressed length
+ * (MSB first), compressed data, decompressed data. The file is written
+ * under a temporary name and renamed into place, and one of the wrong
+ * size is not used, so a partly written file is never taken for a
+ * shorter object.
+ */
+#define DECOMPRESS_CACHE_MAX_SIZE	(4 * 1024 * 1024)
+
+static int decompress_cache_filename(sc_context_t *ctx, const u8* in, size_t inLen,
+		char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+	if(r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s/inflated_%016llX", dir,
+		_sc_fnv64_update(SC_FNV64_OFFSET_BASIS, in, inLen));
+	if(r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int decompress_cache_read(const char *fname, u8** out, size_t* outLen,
+		const u8* in, size_t inLen)
+{
+	struct stat stbuf;
+	FILE *f;
+	u8 *buf;
+	size_t len;
+	int r = SC_ERROR_FILE_NOT_FOUND;
+
+	if(stat(fname, &stbuf) != 0 || stbuf.st_size > DECOMPRESS_CACHE_MAX_SIZE
+			|| (size_t)stbuf.st_size <= 8 + inLen)
+		return r;
+	len = stbuf.st_size;
+	if((buf = malloc(len)) == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	f = fopen(fname, "rb");
+	if(f != NULL) {
+		if(fread(buf, 1, len, f) == len && bebytes2ulong(buf) == inLen
+				&& bebytes2ulong(buf + 4) == len - 8 - inLen
+				&& memcmp(buf + 8, in, inLen) == 0) {
+			*outLen = len - 8 - inLen;
+			memmove(buf, buf + 8 + inLen, *outLen);
+			*out = buf;
+			buf = NULL;
+			r = SC_SUCCESS;
+		}
+		fclose(f);
+	}
+	if(buf)
+		free(buf);
+	return r;
+}
+
+static void decompress_cache_write(sc_context_t *ctx, const char *fname,
+		const u8* out, size_t outLen, const u8* in, size_t inLen)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+	u8 hdr[8];
+	int r, ok;
+
+	r = snprintf(tmp, sizeof(tmp), "%s.%lu.tmp", fname, (unsigned long)getpid());
+	if(r < 0 || (size_t)r >= sizeof(tmp))
+		return;
+	f = fopen(tmp, "wb");
+	if(f == NULL && errno == ENOENT) {
+		if(sc_make_cache_dir(ctx) < 0)
+			return;
+		f = fopen(tmp, "wb");
+	}
+	if(f == NULL)
+		return;
+	ulong2bebytes(hdr, inLen);
+	ulong2bebytes(hdr + 4, outLen);
+	ok = fwrite(hdr, 1, 8, f) == 8 && fwrite(in, 1, inLen, f) == inLen
+		&& fwrite(out, 1, outLen, f) == outLen;
+	if(fclose(f) != 0)
+		ok = 0;
+#ifdef _WIN32
+	/* rename() does not replace an existing file here */
+	if(ok)
+		remove(fname);
+#endif
+	if(!ok || rename(tmp, fname) != 0)
+		unlink(tmp);
+}
+
+int sc_decompress_alloc_cached(sc_context_t *ctx, u8** out, size_t* outLen, const u8* in, size_t inLen, int method) {
+	char fname[PATH_MAX];
+	int r;
+
+	if(decompress_cache_filename(ctx, in, inLen, fname, sizeof(fname)) != SC_SUCCESS)
+		return sc_decompress_alloc(out, outLen, in, inLen, method);
+
+	r = decompress_cache_read(fname, out, outLen, in, inLen);
+	if(r == SC_SUCCESS) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "decompressed data found in %s", fname);
+		return r;
+	}
+
+	r = sc_decompress_alloc(out, outLen, in, inLen, method);
+	if(r == SC_SUCCESS)
+		decompress_cache_write(ctx, fname, *out, *outLen, in, inLen);
+	return r;
+}
 #endif /* ENABLE_ZLIB */
@@ -30,6 +30,7 @@
 
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method);
 int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int method);
+int sc_decompress_alloc_cached(sc_context_t *ctx, u8** out, size_t* outLen, const u8* in, size_t inLen, int method);
 
 #endif
 
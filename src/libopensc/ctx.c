@@ -43,6 +43,8 @@ int _sc_add_reader(sc_context_t *ctx, sc_reader_t *reader)
 {
 	assert(reader != NULL);
 	reader->ctx = ctx;
+	if (reader->stats == NULL)
+		reader->stats = calloc(1, sizeof(sc_stats_t));
 	list_append(&ctx->readers, reader);
 	return SC_SUCCESS;
 }
@@ -54,6 +56,9 @@ int _sc_delete_reader(sc_context_t *ctx, sc_reader_t *reader)
 			reader->ops->release(reader);
 	if (reader->name)
 		free(reader->name);
+	if (reader->stats)
+		free(reader->stats);
+	_sc_reader_free_apdu_buf(reader);
 	list_delete(&ctx->readers, reader);
 	free(reader);
 	return SC_SUCCESS;
@@ -116,6 +121,9 @@ struct _sc_ctx_options {
 	struct _sc_driver_entry cdrv[SC_MAX_CARD_DRIVERS];
 	int ccount;
 	char *forced_card_driver;
+	char *reader_driver;
+	int debug_async;
+	const char *apdu_capture;
 };
 
 
@@ -196,6 +204,11 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
  */
 int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 {
+	int async = ctx->debug_ring != NULL;
+
+	/* The writer thread must be done with the old file */
+	sc_log_async_stop(ctx);
+
 	/* Close any existing handles */
 	if (ctx->debug_file && (ctx->debug_file != stderr && ctx->debug_file != stdout))
 		fclose(ctx->debug_file);
@@ -210,6 +223,8 @@ int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 		if (ctx->debug_file == NULL)
 			return SC_ERROR_INTERNAL;
 	}
+	if (async)
+		sc_log_async_start(ctx);
 	return SC_SUCCESS;
 }
 
@@ -229,6 +244,9 @@ static int load_parameters(sc_context_t *ctx, scconf_block *block,
 	val = scconf_get_str(block, "debug_file", NULL);
 	if (val)
 		sc_ctx_log_to_file(ctx, val);
+	opts->debug_async = scconf_get_bool(block, "debug_async", opts->debug_async);
+
+	opts->apdu_capture = scconf_get_str(block, "apdu_capture", opts->apdu_capture);
 
 	val = scconf_get_str(block, "force_card_driver", NULL);
 	if (val) {
@@ -237,6 +255,13 @@ static int load_parameters(sc_context_t *ctx, scconf_block *block,
 		opts->forced_card_driver = strdup(val);
 	}
 
+	val = scconf_get_str(block, "reader_driver", NULL);
+	if (val) {
+		if (opts->reader_driver)
+			free(opts->reader_driver);
+		opts->reader_driver = strdup(val);
+	}
+
 	list = scconf_find_list(block, "card_drivers");
 	if (list != NULL)
 		del_drvs(opts);
@@ -258,12 +283,15 @@ static void load_reader_driver_options(sc_context_t *ctx)
 	
 	driver->max_send_size = 0;
 	driver->max_recv_size = 0;
+	driver->enable_extended_apdu = 1;
 
 	conf_block = sc_get_conf_block(ctx, "reader_driver", driver->short_name, 1);
 	
 	if (conf_block != NULL) {
 		driver->max_send_size = scconf_get_int(conf_block, "max_send_size", driver->max_send_size);
 		driver->max_recv_size = scconf_get_int(conf_block, "max_recv_size", driver->max_recv_size);
+		driver->enable_extended_apdu = scconf_get_bool(conf_block, "enable_extended_apdu",
+				driver->enable_extended_apdu);
 	}
 }
 
@@ -656,6 +684,10 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	}
 
 	process_config_file(ctx, &opts);
+	if (ctx->debug && opts.debug_async)
+		sc_log_async_start(ctx);
+	if (opts.apdu_capture && !(parm->flags & SC_CTX_FLAG_NO_CAPTURE))
+		_sc_capture_start(ctx, opts.apdu_capture);
 	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "==================================="); /* first thing in the log */
 	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "opensc version: %s", sc_get_version());
 
@@ -681,12 +713,22 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 #elif defined(ENABLE_OPENCT)
 	ctx->reader_driver = sc_get_openct_driver();
 #endif
+	if (opts.reader_driver) {
+#ifndef _WIN32
+		if (strcmp(opts.reader_driver, "virtual") == 0)
+			ctx->reader_driver = sc_get_virtual_driver();
+		else
+#endif
+			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "unknown reader driver '%s'", opts.reader_driver);
+		free(opts.reader_driver);
+	}
 
 	load_reader_driver_options(ctx);
 	ctx->reader_driver->ops->init(ctx);
 	
 	load_card_drivers(ctx, &opts);
 	load_card_atrs(ctx);
+	_sc_atr_index_build(ctx);
 	if (opts.forced_card_driver) {
 		/* FIXME: check return value? */
 		sc_set_card_driver(ctx, opts.forced_card_driver);
@@ -743,6 +785,8 @@ int sc_release_context(sc_context_t *ctx)
 	if (ctx->reader_driver->ops->finish != NULL)
 		ctx->reader_driver->ops->finish(ctx);
 
+	_sc_atr_index_free(ctx);
+	_sc_capture_stop(ctx);
 	for (i = 0; ctx->card_drivers[i]; i++) {
 		struct sc_card_driver *drv = ctx->card_drivers[i];
 
@@ -762,6 +806,7 @@ int sc_release_context(sc_context_t *ctx)
 	}
 	if (ctx->conf != NULL)
 		scconf_free(ctx->conf);
+	sc_log_async_stop(ctx);
 	if (ctx->debug_file && (ctx->debug_file != stdout && ctx->debug_file != stderr))
 		fclose(ctx->debug_file);
 	if (ctx->app_name != NULL)
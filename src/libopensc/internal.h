@@ -109,6 +109,10 @@ unsigned long bebytes2ulong(const u8 *buf);
  */
 unsigned short bebytes2ushort(const u8 *buf);
 
+/* 64-bit FNV-1a; only used to derive cache file names, not for security */
+#define SC_FNV64_OFFSET_BASIS	0xcbf29ce484222325ULL
+unsigned long long _sc_fnv64_update(unsigned long long h, const u8 *data, size_t len);
+
 /* Returns an scconf_block entry with matching ATR/ATRmask to the ATR specified,
  * NULL otherwise. Additionally, if card driver is not specified, search through
  * all card drivers user configured ATRs. */
@@ -246,9 +250,63 @@ int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 void sc_apdu_log(sc_context_t *ctx, int level, const u8 *data, size_t len,
 	int is_outgoing);
 
+/**
+ * Hands debug output over to a background writer thread, so that
+ * logging does not wait for the debug file.
+ * @param  ctx  sc_context_t object
+ * @return SC_SUCCESS on success, SC_ERROR_NOT_SUPPORTED if the
+ *         platform has no support for it and an error code otherwise
+ */
+int sc_log_async_start(sc_context_t *ctx);
+/**
+ * Writes out the pending messages and returns to synchronous logging.
+ * @param  ctx  sc_context_t object
+ */
+void sc_log_async_stop(sc_context_t *ctx);
+
+/* APDU capture, see capture.c */
+int _sc_capture_start(sc_context_t *ctx, const char *filename);
+void _sc_capture_stop(sc_context_t *ctx);
+void _sc_capture_card(sc_card_t *card);
+void _sc_capture_lock(sc_card_t *card, int locked);
+void _sc_capture_apdu(sc_card_t *card, const sc_apdu_t *apdu, int result,
+		unsigned long long start, unsigned long usec);
+
+/* APDU buffers of a reader driver, see apdu.c */
+int _sc_reader_get_apdu_buf(sc_reader_t *reader, const sc_apdu_t *apdu, unsigned int proto,
+		u8 **sbuf, size_t *slen, u8 **rbuf, size_t rlen);
+void _sc_reader_clear_apdu_buf(sc_reader_t *reader, size_t slen, size_t rlen);
+void _sc_reader_free_apdu_buf(sc_reader_t *reader);
+
+/* ATR to card driver index, see atr-index.c */
+int _sc_atr_index_build(sc_context_t *ctx);
+void _sc_atr_index_free(sc_context_t *ctx);
+int _sc_atr_index_match_conf(sc_context_t *ctx, const struct sc_atr *atr,
+		struct sc_card_driver **driver);
+struct sc_card_driver *_sc_atr_index_lookup(sc_context_t *ctx, const struct sc_atr *atr);
+void _sc_atr_index_learn(sc_context_t *ctx, const struct sc_atr *atr, struct sc_card_driver *driver);
+
+/* APDU statistics, see stats.c */
+unsigned long long _sc_stats_clock(void);
+void _sc_stats_add_apdu(sc_card_t *card, u8 ins, size_t out_len, size_t in_len,
+	int r, unsigned long long usec);
+void _sc_stats_add_lock(sc_card_t *card, unsigned long long usec);
+/* Forget the cached file selection, see SC_CARD_CAP_SELECT_CACHE */
+void sc_invalidate_selection(sc_card_t *card);
+/* Forget everything in card->cache */
+void sc_invalidate_cache(sc_card_t *card);
+
+#define _sc_stats_inc(card, field) do { \
+	if ((card)->stats != NULL) \
+		(card)->stats->field++; \
+	if ((card)->reader->stats != NULL) \
+		(card)->reader->stats->field++; \
+} while (0)
+
 extern struct sc_reader_driver *sc_get_pcsc_driver(void);
 extern struct sc_reader_driver *sc_get_ctapi_driver(void);
 extern struct sc_reader_driver *sc_get_openct_driver(void);
+extern struct sc_reader_driver *sc_get_virtual_driver(void);
 extern struct sc_reader_driver *sc_get_cardmod_driver(void);
 
 #ifdef __cplusplus
@@ -113,7 +113,6 @@ static int iso7816_read_binary(sc_card_t *card,
 {
 	sc_context_t *ctx = card->ctx;
 	sc_apdu_t apdu;
-	u8 recvbuf[SC_MAX_APDU_BUFFER_SIZE];
 	int r;
 
 	if (idx > 0x7fff) {
@@ -121,17 +120,17 @@ static int iso7816_read_binary(sc_card_t *card,
 		return SC_ERROR_OFFSET_TOO_LARGE;
 	}
 
-	assert(count <= (card->max_recv_size > 0 ? card->max_recv_size : 256));
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0xB0, (idx >> 8) & 0x7F, idx & 0xFF);
+	assert(count <= sc_get_max_recv_size(card));
+	/* case 2 is sent as an extended APDU when count exceeds 256 */
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_2, 0xB0, (idx >> 8) & 0x7F, idx & 0xFF);
 	apdu.le = count;
 	apdu.resplen = count;
-	apdu.resp = recvbuf;
+	apdu.resp = buf;
 
 	r = sc_transmit_apdu(card, &apdu);
 	SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, r, "APDU transmit failed");
 	if (apdu.resplen == 0)
 		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, sc_check_sw(card, apdu.sw1, apdu.sw2));
-	memcpy(buf, recvbuf, apdu.resplen);
 
 	r =  sc_check_sw(card, apdu.sw1, apdu.sw2);
 	if (r == SC_ERROR_FILE_END_REACHED)
@@ -262,14 +261,14 @@ static int iso7816_write_binary(sc_card_t *card,
 	sc_apdu_t apdu;
 	int r;
 
-	assert(count <= (card->max_send_size > 0 ? card->max_send_size : 255));
+	assert(count <= sc_get_max_send_size(card));
 
 	if (idx > 0x7fff) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "invalid EF offset: 0x%X > 0x7FFF", idx);
 		return SC_ERROR_OFFSET_TOO_LARGE;
 	}
 
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0xD0,
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_3, 0xD0,
 		       (idx >> 8) & 0x7F, idx & 0xFF);
 	apdu.lc = count;
 	apdu.datalen = count;
@@ -289,14 +288,14 @@ static int iso7816_update_binary(sc_card_t *card,
 	sc_apdu_t apdu;
 	int r;
 
-	assert(count <= (card->max_send_size > 0 ? card->max_send_size : 255));
+	assert(count <= sc_get_max_send_size(card));
 
 	if (idx > 0x7fff) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "invalid EF offset: 0x%X > 0x7FFF", idx);
 		return SC_ERROR_OFFSET_TOO_LARGE;
 	}
 
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0xD6,
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_3, 0xD6,
 		       (idx >> 8) & 0x7F, idx & 0xFF);
 	apdu.lc = count;
 	apdu.datalen = count;
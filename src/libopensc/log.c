@@ -44,6 +44,190 @@
 
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args);
 
+/*
+ * Asynchronous logging: callers format their message into a slot of a
+ * ring buffer and return; a writer thread adds the timestamp and does
+ * the (possibly slow) file output. Slots are claimed lock-free, and if
+ * the writer falls behind messages are dropped rather than blocking
+ * the caller.
+ */
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+#define SC_LOG_ASYNC
+
+#define SC_LOG_RING_SIZE	256	/* must be a power of two */
+#define SC_LOG_RING_POLL_MS	20
+
+struct sc_log_entry {
+	volatile unsigned int seq;
+	struct timeval tv;
+	unsigned long thread;
+	char text[1836];
+};
+
+struct sc_log_ring {
+	struct sc_log_entry entry[SC_LOG_RING_SIZE];
+	volatile unsigned int head;	/* next slot to claim */
+	unsigned int tail;		/* next slot to write out */
+	volatile unsigned int dropped;
+	volatile int stop;
+	FILE *outf;
+	pthread_t thread;
+};
+#endif
+
+/* The part of a log line that follows the timestamp */
+static int sc_log_format(sc_context_t *ctx, char *buf, size_t left, const char *file, int line,
+		const char *func, const char *format, va_list args)
+{
+	int r;
+
+	if (file != NULL) {
+		r = snprintf(buf, left, "[%s] %s:%d:%s: ",
+			ctx->app_name, file, line, func ? func : "");
+		if (r < 0 || (unsigned int)r > left)
+			return -1;
+		buf += r;
+		left -= r;
+	}
+
+	r = vsnprintf(buf, left, format, args);
+	if (r < 0)
+		return -1;
+	return 0;
+}
+
+static void sc_log_write(FILE *outf, const char *stamp, const char *text)
+{
+	size_t n = strlen(text);
+
+	fprintf(outf, "%s%s", stamp, text);
+	if (n == 0 || text[n-1] != '\n')
+		fprintf(outf, "\n");
+}
+
+#ifdef SC_LOG_ASYNC
+static void sc_log_ring_write(struct sc_log_ring *ring, struct sc_log_entry *e)
+{
+	struct tm *tm, tm_buf;
+	char time_string[40], stamp[80];
+
+	tm = localtime_r(&e->tv.tv_sec, &tm_buf);
+	strftime(time_string, sizeof(time_string), "%H:%M:%S", tm);
+	snprintf(stamp, sizeof(stamp), "0x%lx %s.%03ld ", e->thread, time_string, (long)e->tv.tv_usec / 1000);
+	sc_log_write(ring->outf, stamp, e->text);
+}
+
+static void *sc_log_ring_writer(void *arg)
+{
+	struct sc_log_ring *ring = (struct sc_log_ring *)arg;
+	unsigned int dropped = 0, n;
+
+	for (;;) {
+		for (n = 0; ; n++) {
+			struct sc_log_entry *e = &ring->entry[ring->tail & (SC_LOG_RING_SIZE - 1)];
+
+			if (e->seq != ring->tail + 1)
+				break;
+			__sync_synchronize();
+			sc_log_ring_write(ring, e);
+			__sync_synchronize();
+			e->seq = ring->tail + SC_LOG_RING_SIZE;
+			ring->tail++;
+		}
+		if (ring->dropped != dropped) {
+			fprintf(ring->outf, "[opensc] %u log messages dropped\n", ring->dropped - dropped);
+			dropped = ring->dropped;
+			n++;
+		}
+		if (n)
+			fflush(ring->outf);
+		else if (ring->stop)
+			break;
+		else
+			msleep(SC_LOG_RING_POLL_MS);
+	}
+	return NULL;
+}
+
+static void sc_log_ring_put(sc_context_t *ctx, struct sc_log_ring *ring, const char *file,
+		int line, const char *func, const char *format, va_list args)
+{
+	struct sc_log_entry *e;
+	unsigned int pos = ring->head;
+	int dif;
+
+	for (;;) {
+		e = &ring->entry[pos & (SC_LOG_RING_SIZE - 1)];
+		dif = (int)(e->seq - pos);
+		if (dif == 0) {
+			if (__sync_bool_compare_and_swap(&ring->head, pos, pos + 1))
+				break;
+		} else if (dif < 0) {
+			/* full */
+			__sync_fetch_and_add(&ring->dropped, 1);
+			return;
+		}
+		pos = ring->head;
+	}
+
+	gettimeofday(&e->tv, NULL);
+	e->thread = (unsigned long)pthread_self();
+	if (sc_log_format(ctx, e->text, sizeof(e->text), file, line, func, format, args) < 0)
+		e->text[0] = '\0';
+	__sync_synchronize();
+	e->seq = pos + 1;
+}
+#endif
+
+int sc_log_async_start(sc_context_t *ctx)
+{
+#ifdef SC_LOG_ASYNC
+	struct sc_log_ring *ring;
+	unsigned int i;
+
+	if (ctx->debug_ring != NULL)
+		return SC_SUCCESS;
+	if (ctx->debug_file == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	ring = calloc(1, sizeof(struct sc_log_ring));
+	if (ring == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (i = 0; i < SC_LOG_RING_SIZE; i++)
+		ring->entry[i].seq = i;
+	ring->outf = ctx->debug_file;
+
+	if (pthread_create(&ring->thread, NULL, sc_log_ring_writer, ring) != 0) {
+		free(ring);
+		return SC_ERROR_INTERNAL;
+	}
+	ctx->debug_ring = ring;
+	return SC_SUCCESS;
+#else
+	return SC_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+void sc_log_async_stop(sc_context_t *ctx)
+{
+#ifdef SC_LOG_ASYNC
+	struct sc_log_ring *ring = ctx->debug_ring;
+
+	if (ring == NULL)
+		return;
+	/* back to synchronous output; callers that picked up the ring
+	 * before that may still be writing to it */
+	ctx->debug_ring = NULL;
+	__sync_synchronize();
+	while (ctx->debug_ring_users != 0)
+		msleep(1);
+	/* then let the writer drain the ring */
+	ring->stop = 1;
+	pthread_join(ring->thread, NULL);
+	free(ring);
+#endif
+}
+
 void sc_do_log(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, ...)
 {
 	va_list ap;
@@ -60,9 +244,8 @@ void sc_do_log_noframe(sc_context_t *ctx, int level, const char *format, va_list
 
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args)
 {
-	char	buf[1836], *p;
-	int	r;
-	size_t	left;
+	char	buf[1836];
+	char	stamp[80];
 #ifdef _WIN32
 	SYSTEMTIME st;
 #else
@@ -71,19 +254,38 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	char time_string[40];
 #endif
 	FILE		*outf = NULL;
-	int		n;
 
 	assert(ctx != NULL);
 
 	if (ctx->debug < level)
 		return;
 
-	p = buf;
-	left = sizeof(buf);
+	outf = ctx->debug_file;
+	if (outf == NULL)
+		return;
+
+#ifdef SC_LOG_ASYNC
+	if (ctx->debug_ring != NULL) {
+		struct sc_log_ring *ring;
+
+		/* counted before the ring is picked up, so that
+		 * sc_log_async_stop() can wait for us */
+		__sync_fetch_and_add(&ctx->debug_ring_users, 1);
+		ring = ctx->debug_ring;
+		if (ring != NULL)
+			sc_log_ring_put(ctx, ring, file, line, func, format, args);
+		__sync_fetch_and_sub(&ctx->debug_ring_users, 1);
+		if (ring != NULL)
+			return;
+	}
+#endif
+
+	if (sc_log_format(ctx, buf, sizeof(buf), file, line, func, format, args) < 0)
+		return;
 
 #ifdef _WIN32
 	GetLocalTime(&st);
-	r = snprintf(p, left,
+	snprintf(stamp, sizeof(stamp),
 			"%i-%02i-%02i %02i:%02i:%02i.%03i ",
 			st.wYear, st.wMonth, st.wDay,
 			st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
@@ -91,34 +293,10 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	gettimeofday (&tv, NULL);
 	tm = localtime (&tv.tv_sec);
 	strftime (time_string, sizeof(time_string), "%H:%M:%S", tm);
-	r = snprintf(p, left, "0x%lx %s.%03ld ", (unsigned long)pthread_self(), time_string, tv.tv_usec / 1000);
+	snprintf(stamp, sizeof(stamp), "0x%lx %s.%03ld ", (unsigned long)pthread_self(), time_string, tv.tv_usec / 1000);
 #endif
-	p += r;
-	left -= r;
-
-	if (file != NULL) {
-		r = snprintf(p, left, "[%s] %s:%d:%s: ", 
-			ctx->app_name, file, line, func ? func : "");
-		if (r < 0 || (unsigned int)r > sizeof(buf))
-			return;
-	} else {
-		r = 0;
-	}	
-	p += r;
-	left -= r;
 
-	r = vsnprintf(p, left, format, args);
-	if (r < 0)
-		return;
-
-	outf = ctx->debug_file;
-	if (outf == NULL)
-		return;
-
-	fprintf(outf, "%s", buf);
-	n = strlen(buf);
-	if (n == 0 || buf[n-1] != '\n')
-		fprintf(outf, "\n");
+	sc_log_write(outf, stamp, buf);
 	fflush(outf);
 
 	return;
@@ -258,6 +258,7 @@ struct sc_reader_driver {
 	size_t max_send_size; /* Max Lc supported by the reader layer */
 	size_t max_recv_size; /* Mac Le supported by the reader layer */
 	void *dll;
+	int enable_extended_apdu; /* Reader layer passes extended length APDUs */
 };
 
 /* reader flags */
@@ -271,6 +272,32 @@ struct sc_reader_driver {
 #define SC_READER_CAP_DISPLAY	0x00000001
 #define SC_READER_CAP_PIN_PAD	0x00000002
 
+/* APDU statistics, kept per reader and per card */
+#define SC_STATS_LATENCY_BUCKETS	12
+
+typedef struct sc_ins_stats {
+	unsigned int count;
+	unsigned int usec_max;
+	unsigned long long usec;
+	/* latency[i] counts the APDUs answered in less than 2^i ms
+	 * (i.e. < 1ms, < 2ms, < 4ms, ...), the last bucket the rest */
+	unsigned int latency[SC_STATS_LATENCY_BUCKETS];
+} sc_ins_stats_t;
+
+typedef struct sc_stats {
+	unsigned long apdus;		/* exchanges with the reader driver */
+	unsigned long errors;		/* ... that failed */
+	unsigned long long bytes_out;	/* encoded command APDUs */
+	unsigned long long bytes_in;	/* response data and status words */
+	unsigned long long usec;	/* time spent in the reader driver */
+	unsigned long get_response;	/* GET RESPONSE rounds after 61xx */
+	unsigned long resend;		/* APDUs sent again after 6Cxx */
+	unsigned long select_cached;	/* SELECT FILEs skipped or made relative */
+	unsigned long locks;		/* sc_lock() calls */
+	unsigned long long lock_usec;	/* time spent waiting for them */
+	sc_ins_stats_t ins[256];	/* by INS byte */
+} sc_stats_t;
+
 typedef struct sc_reader {
 	struct sc_context *ctx;
 	const struct sc_reader_driver *driver;
@@ -281,6 +308,16 @@ typedef struct sc_reader {
 	unsigned long flags, capabilities;
 	unsigned int supported_protocols, active_protocol;
 
+	sc_stats_t *stats;
+	/* Set by ops->lock() if the transaction of the previous lock was
+	 * kept, so that no other application can have used the card */
+	int transaction_kept;
+
+	/* Scratch space for APDUs sent and received, see apdu.c */
+	u8 *apdu_buf;
+	size_t apdu_buf_len;
+	int apdu_buf_locked;
+
 	struct sc_atr atr;
 	struct _atr_info {
 		u8 *hist_bytes;
@@ -410,6 +447,12 @@ struct sc_reader_operations {
  * instead of relying on the ACL info in the profile files. */
 #define SC_CARD_CAP_USE_FCI_AC		0x00000010
 
+/* sc_select_file() may skip the SELECT FILE of the file that is
+ * already selected and select children of the current DF by file ID.
+ * The driver must select files only through its select_file operation
+ * or ISO SELECT FILE APDUs. */
+#define SC_CARD_CAP_SELECT_CACHE	0x00000100
+
 /* D-TRUST CardOS cards special flags */
 #define SC_CARD_CAP_ONLY_RAW_HASH		0x00000040
 #define SC_CARD_CAP_ONLY_RAW_HASH_STRIPPED	0x00000080
@@ -447,6 +490,8 @@ typedef struct sc_card {
 
 	sc_serial_number_t serialnr;
 
+	sc_stats_t *stats;
+	unsigned int capture_id;	/* number of the card in the APDU capture */
 	void *mutex;
 
 	unsigned int magic;
@@ -605,6 +650,8 @@ typedef struct sc_context {
 	int debug;
 
 	FILE *debug_file;
+	struct sc_log_ring *debug_ring;	/* set while logging asynchronously */
+	volatile unsigned int debug_ring_users;	/* callers that may be using it */
 	char *preferred_language;
 
 	list_t readers;
@@ -614,6 +661,8 @@ typedef struct sc_context {
 
 	struct sc_card_driver *card_drivers[SC_MAX_CARD_DRIVERS];
 	struct sc_card_driver *forced_driver;
+	struct sc_atr_index *atr_index;
+	struct sc_capture_writer *capture;	/* set with apdu_capture */
 
 	sc_thread_context_t	*thread_ctx;
 	void *mutex;
@@ -630,6 +679,23 @@ typedef struct sc_context {
  */
 int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu);
 
+/** Sends a number of independent APDUs to the card, back-to-back
+ *  within a single card lock. The status words of each APDU are
+ *  returned in the APDU itself. The reader driver does not log the
+ *  APDUs, SC_APDU_FLAGS_NO_LOG is set on each of them.
+ *  @param  card     sc_card_t object to which the APDUs should be send
+ *  @param  apdus    array of count sc_apdu_t objects
+ *  @param  count    number of APDUs in the array
+ *  @param  results  optional array of count ints receiving the
+ *                   transmission status of each APDU; if a
+ *                   transmission fails the remaining APDUs are not
+ *                   sent and get the same error code
+ *  @return SC_SUCCESS if all APDUs were transmitted and the error code
+ *          of the first failed transmission otherwise
+ */
+int sc_transmit_apdu_batch(sc_card_t *card, sc_apdu_t *apdus, size_t count,
+		int *results);
+
 void sc_format_apdu(sc_card_t *card, sc_apdu_t *apdu, int cse, int ins,
 		    int p1, int p2);
 
@@ -674,11 +740,15 @@ typedef struct {
 	 *  dependend configuration data). If NULL the name "default"
 	 *  will be used. */
 	const char    *app_name;
-	/** flags, currently unused */
+	/** flags, see SC_CTX_FLAG_* */
 	unsigned long flags;
 	/** mutex functions to use (optional) */
 	sc_thread_context_t *thread_ctx;
 } sc_context_param_t;
+
+/* do not write the apdu_capture file set in opensc.conf */
+#define SC_CTX_FLAG_NO_CAPTURE		0x00000001UL
+
 /**
  * Creates a new sc_context_t object.
  * @param  ctx   pointer to a sc_context_t pointer for the newly
@@ -748,6 +818,95 @@ sc_reader_t *sc_ctx_get_reader_by_id(sc_context_t *ctx, unsigned int id);
  */
 unsigned int sc_ctx_get_reader_count(sc_context_t *ctx);
 
+/**
+ * Returns the APDU statistics of a reader, covering all cards that
+ * have been used in it since the context was created
+ * @param  reader  sc_reader_t object
+ * @param  stats   receives a copy of the statistics
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_reader_get_stats(sc_reader_t *reader, sc_stats_t *stats);
+
+/**
+ * Returns the APDU statistics of a card since it was connected
+ * @param  card   sc_card_t object
+ * @param  stats  receives a copy of the statistics
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_card_get_stats(sc_card_t *card, sc_stats_t *stats);
+
+/**
+ * Returns the sum of the APDU statistics of all readers
+ * @param  ctx    OpenSC context
+ * @param  stats  receives the statistics
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_ctx_get_stats(sc_context_t *ctx, sc_stats_t *stats);
+
+/**
+ * Clears the APDU statistics of all readers
+ * @param  ctx  OpenSC context
+ */
+void sc_ctx_reset_stats(sc_context_t *ctx);
+
+/**
+ * Prints APDU statistics in human readable form
+ * @param  out    output stream
+ * @param  title  heading line, may be NULL
+ * @param  stats  statistics to print
+ */
+void sc_stats_print(FILE *out, const char *title, const sc_stats_t *stats);
+
+/* APDU capture files, written when apdu_capture is set in opensc.conf */
+#define SC_CAPTURE_CARD		1	/* card connected */
+#define SC_CAPTURE_APDU		2	/* exchange with the reader driver */
+#define SC_CAPTURE_LOCK		3	/* outermost sc_lock() */
+#define SC_CAPTURE_UNLOCK	4	/* ... and its sc_unlock() */
+
+#define SC_CAPTURE_FLAG_REDACTED	0x01	/* command data blanked out */
+
+typedef struct sc_capture sc_capture_t;
+
+typedef struct sc_capture_record {
+	unsigned int type;
+	unsigned int flags;
+	unsigned int card;		/* number given out at SC_CAPTURE_CARD */
+	unsigned long session;		/* process ID of the writer */
+	unsigned long long time;	/* in microseconds */
+	unsigned long usec;		/* time the reader took for an APDU */
+	int result;			/* return code of the reader driver */
+	/* APDU: the command and the response with its status word,
+	 * CARD: the reader name and the ATR */
+	const u8 *data1;
+	size_t len1;
+	const u8 *data2;
+	size_t len2;
+} sc_capture_record_t;
+
+/**
+ * Opens an APDU capture file for reading
+ * @param  filename  name of the capture file
+ * @param  cap       returns the opened capture
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_capture_open(const char *filename, sc_capture_t **cap);
+
+/**
+ * Reads the next record of a capture. The data of the record is valid
+ * until the next call.
+ * @param  cap  capture opened with sc_capture_open()
+ * @param  rec  receives the record
+ * @return 1 if a record was read, 0 at the end of the capture and an
+ *         error code otherwise
+ */
+int sc_capture_read(sc_capture_t *cap, sc_capture_record_t *rec);
+
+/**
+ * Closes a capture opened with sc_capture_open()
+ * @param  cap  capture to close
+ */
+void sc_capture_close(sc_capture_t *cap);
+
 /**
  * Redirects OpenSC debug log to the specified file
  * @param  ctx existing OpenSC context
@@ -864,6 +1023,21 @@ int sc_select_file(sc_card_t *card, const sc_path_t *path,
  * @return number of files ids read or an error code
  */
 int sc_list_files(sc_card_t *card, u8 *buf, size_t buflen);
+/**
+ * Returns the largest Le usable for a single READ BINARY on this card,
+ * as negotiated between the card driver, the reader and opensc.conf
+ * when the card was connected.
+ * @param  card  sc_card_t object
+ * @return maximum number of bytes per READ BINARY command
+ */
+size_t sc_get_max_recv_size(const sc_card_t *card);
+/**
+ * Returns the largest Lc usable for a single WRITE/UPDATE BINARY
+ * on this card (see sc_get_max_recv_size()).
+ * @param  card  sc_card_t object
+ * @return maximum number of bytes per WRITE/UPDATE BINARY command
+ */
+size_t sc_get_max_send_size(const sc_card_t *card);
 /**
  * Read data from a binary EF
  * @param  card   sc_card_t object on which to issue the command
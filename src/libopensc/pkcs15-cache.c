@@ -34,6 +34,52 @@
 #include "internal.h"
 #include "pkcs15.h"
 
+static unsigned long long fnv64_update_str(unsigned long long h, const char *str)
+{
+	if (str == NULL)
+		str = "";
+	/* include the terminating zero so that adjacent fields can't merge */
+	return _sc_fnv64_update(h, (const u8 *) str, strlen(str) + 1);
+}
+
+int sc_pkcs15_cache_set_fingerprint(struct sc_pkcs15_card *p15card,
+				    const u8 *tokeninfo, size_t tokeninfo_len)
+{
+	struct sc_card *card;
+	unsigned long long h = SC_FNV64_OFFSET_BASIS;
+	char fp[2 * 8 + 1];
+
+	assert(p15card != NULL && p15card->card != NULL);
+	card = p15card->card;
+
+	if (p15card->fingerprint != NULL) {
+		free(p15card->fingerprint);
+		p15card->fingerprint = NULL;
+	}
+
+	/* Without any of the card or token serial numbers we can't tell two
+	 * cards of the same personalization batch apart: don't cache. */
+	if (card->serialnr.len == 0 && p15card->tokeninfo->serial_number == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	h = _sc_fnv64_update(h, card->atr.value, card->atr.len);
+	h = _sc_fnv64_update(h, card->serialnr.value, card->serialnr.len);
+	h = fnv64_update_str(h, p15card->tokeninfo->serial_number);
+	h = fnv64_update_str(h, p15card->tokeninfo->last_update);
+	/* The raw TokenInfo image catches changes on cards that do not
+	 * maintain lastUpdate. */
+	if (tokeninfo != NULL)
+		h = _sc_fnv64_update(h, tokeninfo, tokeninfo_len);
+
+	snprintf(fp, sizeof(fp), "%016llX", h);
+	p15card->fingerprint = strdup(fp);
+	if (p15card->fingerprint == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	sc_log(card->ctx, "file cache fingerprint %s", p15card->fingerprint);
+	return SC_SUCCESS;
+}
+
 static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 				   const sc_path_t *path,
 				   char *buf, size_t bufsize)
@@ -58,7 +104,11 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 	}
 	for (i = 0; i < pathlen; i++)
 		sprintf(pathname + 2*i, "%02X", pathptr[i]);
-	if (p15card->tokeninfo->serial_number != NULL) {
+	if (p15card->fingerprint != NULL) {
+		r = snprintf(buf, bufsize, "%s/%s_%s", dir, p15card->fingerprint, pathname);
+		if (r < 0)
+			return SC_ERROR_BUFFER_TOO_SMALL;
+	} else if (p15card->tokeninfo->serial_number != NULL) {
 		if (p15card->tokeninfo->last_update != NULL)
 			r = snprintf(buf, bufsize, "%s/%s_%s_%s", dir,
 			     p15card->tokeninfo->serial_number, p15card->tokeninfo->last_update,
@@ -139,7 +139,6 @@ int sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card,
 			       struct sc_pkcs15_cert **cert_out)
 {
 	int r;
-	struct sc_pkcs15_cert *cert;
 	u8 *data = NULL;
 	size_t len;
 	
@@ -147,6 +146,9 @@ int sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card,
 	SC_FUNC_CALLED(p15card->card->ctx, SC_LOG_DEBUG_VERBOSE);
 
 	if (info->path.len) {
+		*cert_out = sc_pkcs15_get_prefetched_cert(p15card, &info->path);
+		if (*cert_out != NULL)
+			return 0;
 		r = sc_pkcs15_read_file(p15card, &info->path, &data, &len);
 		if (r)
 			return r;
@@ -158,14 +160,23 @@ int sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card,
 		len = copy.len;
 	}
 
-	cert = malloc(sizeof(struct sc_pkcs15_cert));
-	if (cert == NULL) {
+	r = sc_pkcs15_parse_certificate(p15card->card->ctx, data, len, cert_out);
+	if (r)
 		free(data);
+	return r;
+}
+
+/* Parse a DER encoded certificate. On success, the certificate takes
+ * over data. */
+int sc_pkcs15_parse_certificate(struct sc_context *ctx, u8 *data, size_t len,
+			       struct sc_pkcs15_cert **cert_out)
+{
+	struct sc_pkcs15_cert *cert;
+
+	cert = calloc(1, sizeof(struct sc_pkcs15_cert));
+	if (cert == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
-	}
-	memset(cert, 0, sizeof(struct sc_pkcs15_cert));
-	if (parse_x509_cert(p15card->card->ctx, data, len, cert)) {
-		free(data);
+	if (parse_x509_cert(ctx, data, len, cert)) {
 		sc_pkcs15_free_certificate(cert);
 		return SC_ERROR_INVALID_ASN1_OBJECT;
 	}
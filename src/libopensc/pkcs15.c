@@ -26,6 +26,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "cardctl.h"
 #include "internal.h"
@@ -542,6 +545,9 @@ struct sc_pkcs15_card * sc_pkcs15_card_new(void)
 	return p15card;
 }
 
+static void sc_pkcs15_free_obj_index(struct sc_pkcs15_card *p15card);
+static void sc_pkcs15_free_prefetched(struct sc_pkcs15_card *p15card);
+
 void sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 {
 	size_t i;
@@ -553,6 +559,8 @@ void sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 	if (p15card->ops.clear)
 		p15card->ops.clear(p15card);
 
+	sc_pkcs15_free_obj_index(p15card);
+	sc_pkcs15_free_prefetched(p15card);
 	while (p15card->obj_list)   {
 		struct sc_pkcs15_object *obj = p15card->obj_list;
 
@@ -573,6 +581,8 @@ void sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 	if (p15card->file_unusedspace != NULL)
 		sc_file_free(p15card->file_unusedspace);
 	p15card->magic = 0;
+	if (p15card->fingerprint != NULL)
+		free(p15card->fingerprint);
 	if (p15card->tokeninfo->label != NULL)
 		free(p15card->tokeninfo->label);
 	if (p15card->tokeninfo->serial_number != NULL)
@@ -610,6 +620,7 @@ void sc_pkcs15_card_clear(sc_pkcs15_card_t *p15card)
 	p15card->flags = 0;
 	p15card->tokeninfo->version = 0;
 	p15card->tokeninfo->flags   = 0;
+	sc_pkcs15_free_obj_index(p15card);
 	while (p15card->obj_list)   {
 		struct sc_pkcs15_object *obj = p15card->obj_list;
 
@@ -636,6 +647,10 @@ void sc_pkcs15_card_clear(sc_pkcs15_card_t *p15card)
 		sc_file_free(p15card->file_unusedspace);
 		p15card->file_unusedspace = NULL;
 	}
+	if (p15card->fingerprint != NULL) {
+		free(p15card->fingerprint);
+		p15card->fingerprint = NULL;
+	}
 	if (p15card->tokeninfo->label != NULL) {
 		free(p15card->tokeninfo->label);
 		p15card->tokeninfo->label = NULL;
@@ -710,17 +725,89 @@ static struct sc_app_info *sc_dup_app_info(const struct sc_app_info *info)
 	return out;
 }
 
-static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid)
+static int sc_pkcs15_parse_df_data(struct sc_pkcs15_card *,
+		struct sc_pkcs15_df *, const u8 *, size_t);
+
+static int sc_pkcs15_bind_tokeninfo(sc_pkcs15_card_t *p15card)
 {
 	sc_path_t tmppath;
 	sc_card_t    *card = p15card->card;
 	sc_context_t *ctx  = card->ctx;
 	sc_pkcs15_tokeninfo_t tokeninfo;
+	unsigned char *buf = NULL;
+	size_t len;
+	int    err;
+
+	if (p15card->file_tokeninfo == NULL) {
+		sc_format_path("5032", &tmppath);
+		err = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &tmppath);
+		if (err != SC_SUCCESS)   {
+			sc_log(ctx, "Cannot make absolute path to EF(TokenInfo); error:%i", err);
+			return err;
+		}
+		sc_log(ctx, "absolute path to EF(TokenInfo) %s", sc_print_path(&tmppath));
+	} 
+	else {
+		tmppath = p15card->file_tokeninfo->path;
+		sc_file_free(p15card->file_tokeninfo);
+		p15card->file_tokeninfo = NULL;
+	}
+	err = sc_select_file(card, &tmppath, &p15card->file_tokeninfo);
+	if (err)
+		return err;
+
+	if ((len = p15card->file_tokeninfo->size) == 0) {
+		sc_log(ctx, "EF(TokenInfo) is empty");
+		return SC_ERROR_PKCS15_APP_NOT_FOUND;
+	}
+	buf = malloc(len);
+	if(buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	err = sc_read_binary(card, 0, buf, len, 0);
+	if (err < 0)
+		goto end;
+	if (err <= 2) {
+		err = SC_ERROR_PKCS15_APP_NOT_FOUND;
+		goto end;
+	}
+	len = err;
+
+	memset(&tokeninfo, 0, sizeof(tokeninfo));
+	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, len);
+	if (err != SC_SUCCESS)
+		goto end;
+
+	*(p15card->tokeninfo) = tokeninfo;
+
+	if (!p15card->tokeninfo->serial_number && card->serialnr.len)   {
+		char *serial = calloc(1, card->serialnr.len*2 + 1);
+		size_t ii;
+		
+		for(ii=0;ii<card->serialnr.len;ii++)
+			sprintf(serial + ii*2, "%02X", *(card->serialnr.value + ii));
+
+		p15card->tokeninfo->serial_number = serial;
+		sc_log(ctx, "p15card->tokeninfo->serial_number %s", p15card->tokeninfo->serial_number);
+	}
+
+	/* Computed even if caching is off: 'pkcs15-tool -L' fills the cache */
+	sc_pkcs15_cache_set_fingerprint(p15card, buf, len);
+end:
+	free(buf);
+	return err;
+}
+
+static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid)
+{
+	sc_path_t tmppath;
+	sc_card_t    *card = p15card->card;
+	sc_context_t *ctx  = card->ctx;
 	sc_pkcs15_df_t *df;
 	const sc_app_info_t *info = NULL;
 	unsigned char *buf = NULL;
 	size_t len;
-	int    err, ok = 0;
+	int    err, ok = 0, tokeninfo_read = 0;
 
 	LOG_FUNC_CALLED(ctx);
 	/* Enumerate apps now */
@@ -774,6 +861,15 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 	if (err < 0)
 		goto end;
 
+	/* With the file cache enabled EF(TokenInfo) is read first: it provides
+	 * the fingerprint that validates the cached EF(ODF) and DF images. */
+	if (p15card->opts.use_file_cache) {
+		err = sc_pkcs15_bind_tokeninfo(p15card);
+		if (err < 0)
+			goto end;
+		tokeninfo_read = 1;
+	}
+
 	if (p15card->file_odf == NULL) {
 		/* check if an ODF is present; we don't know yet whether we have a pkcs15 card */
 		sc_format_path("5031", &tmppath);
@@ -783,37 +879,54 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 			goto end;
 		}
 		sc_log(ctx, "absolute path to EF(ODF) %s", sc_print_path(&tmppath));
-		err = sc_select_file(card, &tmppath, &p15card->file_odf);
 	} 
 	else {
 		tmppath = p15card->file_odf->path;
 		sc_file_free(p15card->file_odf);
 		p15card->file_odf = NULL;
-		err = sc_select_file(card, &tmppath, &p15card->file_odf);
 	}
 
-	if (err != SC_SUCCESS) {
-		sc_log(ctx, "EF(ODF) not found in '%s'", sc_print_path(&tmppath));
-		goto end;
+	err = SC_ERROR_FILE_NOT_FOUND;
+	if (p15card->opts.use_file_cache && p15card->fingerprint)
+		err = sc_pkcs15_read_cached_file(p15card, &tmppath, &buf, &len);
+	if (err == SC_SUCCESS) {
+		sc_log(ctx, "EF(ODF) read from cache");
+		p15card->file_odf = sc_file_new();
+		if (p15card->file_odf == NULL) {
+			err = SC_ERROR_OUT_OF_MEMORY;
+			goto end;
+		}
+		p15card->file_odf->path = tmppath;
+		p15card->file_odf->size = len;
 	}
+	else {
+		err = sc_select_file(card, &tmppath, &p15card->file_odf);
+		if (err != SC_SUCCESS) {
+			sc_log(ctx, "EF(ODF) not found in '%s'", sc_print_path(&tmppath));
+			goto end;
+		}
 
-	len = p15card->file_odf->size;
-	if (!len) {
-		sc_log(ctx, "EF(ODF) is empty");
-		goto end;
-	}
-	buf = malloc(len);
-	if(buf == NULL)
-		return SC_ERROR_OUT_OF_MEMORY;
+		len = p15card->file_odf->size;
+		if (!len) {
+			sc_log(ctx, "EF(ODF) is empty");
+			goto end;
+		}
+		buf = malloc(len);
+		if(buf == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
 
-	err = sc_read_binary(card, 0, buf, len, 0);
-	if (err < 0)
-		goto end;
-	if (err < 2) {
-		err = SC_ERROR_PKCS15_APP_NOT_FOUND;
-		goto end;
+		err = sc_read_binary(card, 0, buf, len, 0);
+		if (err < 0)
+			goto end;
+		if (err < 2) {
+			err = SC_ERROR_PKCS15_APP_NOT_FOUND;
+			goto end;
+		}
+		len = err;
+		if (p15card->opts.use_file_cache && p15card->fingerprint)
+			sc_pkcs15_cache_file(p15card, &tmppath, buf, len);
 	}
-	len = err;
+
 	if (parse_odf(buf, len, p15card)) {
 		err = SC_ERROR_PKCS15_APP_NOT_FOUND;
 		sc_log(ctx, "Unable to parse ODF");
@@ -827,56 +940,26 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		sc_log(ctx, "  DF type %u, path %s, index %u, count %d", df->type, 
 				sc_print_path(&df->path), df->path.index, df->path.count);
 
-	if (p15card->file_tokeninfo == NULL) {
-		sc_format_path("5032", &tmppath);
-		err = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &tmppath);
-		if (err != SC_SUCCESS)   {
-			sc_log(ctx, "Cannot make absolute path to EF(TokenInfo); error:%i", err);
+	if (!tokeninfo_read) {
+		err = sc_pkcs15_bind_tokeninfo(p15card);
+		if (err < 0)
 			goto end;
-		}
-		sc_log(ctx, "absolute path to EF(TokenInfo) %s", sc_print_path(&tmppath));
-	} 
-	else {
-		tmppath = p15card->file_tokeninfo->path;
-		sc_file_free(p15card->file_tokeninfo);
-		p15card->file_tokeninfo = NULL;
 	}
-	err = sc_select_file(card, &tmppath, &p15card->file_tokeninfo);
-	if (err)
-		goto end;
 
-	if ((len = p15card->file_tokeninfo->size) == 0) {
-		sc_log(ctx, "EF(TokenInfo) is empty");
-		goto end;
-	}
-	buf = malloc(len);
-	if(buf == NULL)
-		return SC_ERROR_OUT_OF_MEMORY;
-
-	err = sc_read_binary(card, 0, buf, len, 0);
-	if (err < 0)
-		goto end;
-	if (err <= 2) {
-		err = SC_ERROR_PKCS15_APP_NOT_FOUND;
-		goto end;
-	}
-
-	memset(&tokeninfo, 0, sizeof(tokeninfo));
-	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, (size_t)err);
-	if (err != SC_SUCCESS)
-		goto end;
-
-	*(p15card->tokeninfo) = tokeninfo;
-
-	if (!p15card->tokeninfo->serial_number && card->serialnr.len)   {
-		char *serial = calloc(1, card->serialnr.len*2 + 1);
-		size_t ii;
-		
-		for(ii=0;ii<card->serialnr.len;ii++)
-			sprintf(serial + ii*2, "%02X", *(card->serialnr.value + ii));
-
-		p15card->tokeninfo->serial_number = serial;
-		sc_log(ctx, "p15card->tokeninfo->serial_number %s", p15card->tokeninfo->serial_number);
+	/* Warm start: decode all DFs of which the cache holds an image
+	 * right away, so that no object search has to touch the card. */
+	if (p15card->opts.use_file_cache && p15card->fingerprint) {
+		for (df = p15card->df_list; df; df = df->next) {
+			if (df->enumerated || df->path.count >= 0)
+				continue;
+			if (sc_pkcs15_read_cached_file(p15card, &df->path, &buf, &len))
+				continue;
+			err = sc_pkcs15_parse_df_data(p15card, df, buf, len);
+			free(buf);
+			buf = NULL;
+			if (err < 0)
+				sc_log(ctx, "Cached DF %s not usable: %s", sc_print_path(&df->path), sc_strerror(err));
+		}
 	}
 
 	ok = 1;
@@ -910,6 +993,7 @@ int sc_pkcs15_bind(sc_card_t *card, struct sc_aid *aid, struct sc_pkcs15_card **
 	p15card->opts.use_file_cache = 0;
 	p15card->opts.use_pin_cache = 1;
 	p15card->opts.pin_cache_counter = 10;
+	p15card->opts.prefetch = 0;
 
 	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
 
@@ -917,9 +1001,11 @@ int sc_pkcs15_bind(sc_card_t *card, struct sc_aid *aid, struct sc_pkcs15_card **
 		p15card->opts.use_file_cache = scconf_get_bool(conf_block, "use_file_caching", p15card->opts.use_file_cache);
 		p15card->opts.use_pin_cache = scconf_get_bool(conf_block, "use_pin_caching", p15card->opts.use_pin_cache);
 		p15card->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", p15card->opts.pin_cache_counter);
+		p15card->opts.prefetch = scconf_get_bool(conf_block, "prefetch", p15card->opts.prefetch);
 	}
-	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d",
-	         p15card->opts.use_file_cache, p15card->opts.use_pin_cache, p15card->opts.pin_cache_counter);
+	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d prefetch=%d",
+	         p15card->opts.use_file_cache, p15card->opts.use_pin_cache, p15card->opts.pin_cache_counter,
+	         p15card->opts.prefetch);
 
 	r = sc_lock(card);
 	if (r) {
@@ -974,6 +1060,59 @@ int sc_pkcs15_unbind(struct sc_pkcs15_card *p15card)
 	return 0;
 }
 
+/*
+ * Object index: one hash table per lookup key (object ID -- auth ID for
+ * PIN objects --, key/PIN reference and path) over the object list.
+ * Buckets keep the objects in list order, so an indexed search returns
+ * the same objects as a list scan. The index is only an accelerator:
+ * it is built on the first lookup and dropped (falling back to list
+ * scans) if memory runs out.
+ */
+enum {
+	SC_PKCS15_INDEX_ID = 0,
+	SC_PKCS15_INDEX_REFERENCE,
+	SC_PKCS15_INDEX_PATH,
+	SC_PKCS15_INDEX_COUNT
+};
+
+#define SC_PKCS15_INDEX_MIN_SIZE	64
+
+struct sc_pkcs15_obj_index_node {
+	struct sc_pkcs15_object *obj;
+	unsigned int hash;
+	struct sc_pkcs15_obj_index_node *next;
+};
+
+struct sc_pkcs15_obj_index {
+	struct sc_pkcs15_obj_index_node **table[SC_PKCS15_INDEX_COUNT];
+	size_t size;		/* buckets per table, a power of two */
+	size_t count;		/* indexed objects */
+};
+
+static int compare_obj_key(struct sc_pkcs15_object *obj, void *arg);
+static int sc_pkcs15_obj_index_find(struct sc_pkcs15_card *p15card,
+			struct sc_pkcs15_search_key *sk,
+			struct sc_pkcs15_obj_index_node **out);
+
+static int search_match(sc_pkcs15_object_t *obj,
+			unsigned int class_mask, unsigned int type,
+			int (*func)(sc_pkcs15_object_t *, void *),
+			void *func_arg)
+{
+	/* Check object type */
+	if (!(class_mask & SC_PKCS15_TYPE_TO_CLASS(obj->type)))
+		return 0;
+	if (type != 0
+	 && obj->type != type
+	 && (obj->type & SC_PKCS15_TYPE_CLASS_MASK) != type)
+		return 0;
+
+	/* Potential candidate, apply search function */
+	if (func != NULL && func(obj, func_arg) <= 0)
+		return 0;
+	return 1;
+}
+
 static int
 __sc_pkcs15_search_objects(sc_pkcs15_card_t *p15card,
 			unsigned int class_mask, unsigned int type,
@@ -982,6 +1121,7 @@ __sc_pkcs15_search_objects(sc_pkcs15_card_t *p15card,
 			sc_pkcs15_object_t **ret, size_t ret_size)
 {
 	sc_pkcs15_object_t *obj;
+	struct sc_pkcs15_obj_index_node *node;
 	sc_pkcs15_df_t	*df;
 	unsigned int	df_mask = 0;
 	size_t		match_count = 0;
@@ -1023,18 +1163,26 @@ __sc_pkcs15_search_objects(sc_pkcs15_card_t *p15card,
 		r = sc_pkcs15_parse_df(p15card, df);
 	}
 
+	/* A search by ID, reference or path only has to look at the
+	 * objects filed under that key in the object index */
+	if (func == compare_obj_key
+	 && sc_pkcs15_obj_index_find(p15card, (struct sc_pkcs15_search_key *) func_arg, &node)) {
+		for (; node != NULL; node = node->next) {
+			if (!search_match(node->obj, class_mask, type, func, func_arg))
+				continue;
+			match_count++;
+			if (!ret || ret_size <= 0)
+				continue;
+			ret[match_count-1] = node->obj;
+			if (ret_size <= match_count)
+				break;
+		}
+		return match_count;
+	}
+
 	/* And now loop over all objects */
 	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
-		/* Check object type */
-		if (!(class_mask & SC_PKCS15_TYPE_TO_CLASS(obj->type)))
-			continue;
-		if (type != 0
-		 && obj->type != type
-		 && (obj->type & SC_PKCS15_TYPE_CLASS_MASK) != type)
-			continue;
-
-		/* Potential candidate, apply search function */
-		if (func != NULL && func(obj, func_arg) <= 0)
+		if (!search_match(obj, class_mask, type, func, func_arg))
 			continue;
 		/* Okay, we have a match. */
 		match_count++;
@@ -1054,29 +1202,36 @@ int sc_pkcs15_get_objects(struct sc_pkcs15_card *p15card, unsigned int type,
 	return sc_pkcs15_get_objects_cond(p15card, type, NULL, NULL, ret, ret_size);
 }
 
-static int compare_obj_id(struct sc_pkcs15_object *obj, const sc_pkcs15_id_t *id)
+static const struct sc_pkcs15_id *obj_id(struct sc_pkcs15_object *obj)
 {
 	void *data = obj->data;
-	
+
 	switch (obj->type) {
 	case SC_PKCS15_TYPE_CERT_X509:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_cert_info *) data)->id, id);
+		return &((struct sc_pkcs15_cert_info *) data)->id;
 	case SC_PKCS15_TYPE_PRKEY_RSA:
 	case SC_PKCS15_TYPE_PRKEY_DSA:
 	case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
 	case SC_PKCS15_TYPE_PRKEY_EC:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_prkey_info *) data)->id, id);
+		return &((struct sc_pkcs15_prkey_info *) data)->id;
 	case SC_PKCS15_TYPE_PUBKEY_RSA:
 	case SC_PKCS15_TYPE_PUBKEY_DSA:
 	case SC_PKCS15_TYPE_PUBKEY_GOSTR3410:
 	case SC_PKCS15_TYPE_PUBKEY_EC:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_pubkey_info *) data)->id, id);
+		return &((struct sc_pkcs15_pubkey_info *) data)->id;
 	case SC_PKCS15_TYPE_AUTH_PIN:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_auth_info *) data)->auth_id, id);
+		return &((struct sc_pkcs15_auth_info *) data)->auth_id;
 	case SC_PKCS15_TYPE_DATA_OBJECT:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_data_info *) data)->id, id);
+		return &((struct sc_pkcs15_data_info *) data)->id;
 	}
-	return 0;
+	return NULL;
+}
+
+static int compare_obj_id(struct sc_pkcs15_object *obj, const sc_pkcs15_id_t *id)
+{
+	const struct sc_pkcs15_id *oid = obj_id(obj);
+
+	return oid != NULL && sc_pkcs15_compare_id(oid, id);
 }
 
 static int sc_obj_app_oid(struct sc_pkcs15_object *obj, const struct sc_object_id *app_oid)
@@ -1128,54 +1283,65 @@ static int compare_obj_flags(sc_pkcs15_object_t *obj, unsigned int mask, unsigne
 	return !((flags ^ value) & mask);
 }
 
-static int compare_obj_reference(sc_pkcs15_object_t *obj, int value)
+static int obj_reference(sc_pkcs15_object_t *obj, int *reference)
 {
 	struct sc_pkcs15_auth_info *auth_info;
 	void		*data = obj->data;
-	int		reference;
 
 	switch (obj->type) {
 	case SC_PKCS15_TYPE_AUTH_PIN:
 		auth_info = (struct sc_pkcs15_auth_info *) obj->data;
 		if (auth_info->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN)
 			return 0;
-		reference = auth_info->attrs.pin.reference;
-		break;
+		*reference = auth_info->attrs.pin.reference;
+		return 1;
 	case SC_PKCS15_TYPE_PRKEY_RSA:
 	case SC_PKCS15_TYPE_PRKEY_DSA:
 	case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
 	case SC_PKCS15_TYPE_PRKEY_EC:
-		reference = ((struct sc_pkcs15_prkey_info *) data)->key_reference;
-		break;
-	default:
-		return 0;
+		*reference = ((struct sc_pkcs15_prkey_info *) data)->key_reference;
+		return 1;
 	}
-	return reference == value;
+	return 0;
 }
 
-static int compare_obj_path(sc_pkcs15_object_t *obj, const sc_path_t *path)
+static int compare_obj_reference(sc_pkcs15_object_t *obj, int value)
+{
+	int		reference;
+
+	return obj_reference(obj, &reference) && reference == value;
+}
+
+static const sc_path_t *obj_path(sc_pkcs15_object_t *obj)
 {
 	void *data = obj->data;
-	
+
 	switch (obj->type) {
 	case SC_PKCS15_TYPE_CERT_X509:
-		return sc_compare_path(&((struct sc_pkcs15_cert_info *) data)->path, path);
+		return &((struct sc_pkcs15_cert_info *) data)->path;
 	case SC_PKCS15_TYPE_PRKEY_RSA:
 	case SC_PKCS15_TYPE_PRKEY_DSA:
 	case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
 	case SC_PKCS15_TYPE_PRKEY_EC:
-		return sc_compare_path(&((struct sc_pkcs15_prkey_info *) data)->path, path);
+		return &((struct sc_pkcs15_prkey_info *) data)->path;
 	case SC_PKCS15_TYPE_PUBKEY_RSA:
 	case SC_PKCS15_TYPE_PUBKEY_DSA:
 	case SC_PKCS15_TYPE_PUBKEY_GOSTR3410:
 	case SC_PKCS15_TYPE_PUBKEY_EC:
-		return sc_compare_path(&((struct sc_pkcs15_pubkey_info *) data)->path, path);
+		return &((struct sc_pkcs15_pubkey_info *) data)->path;
 	case SC_PKCS15_TYPE_AUTH_PIN:
-		return sc_compare_path(&((struct sc_pkcs15_auth_info *) data)->path, path);
+		return &((struct sc_pkcs15_auth_info *) data)->path;
 	case SC_PKCS15_TYPE_DATA_OBJECT:
-		return sc_compare_path(&((struct sc_pkcs15_data_info *) data)->path, path);
+		return &((struct sc_pkcs15_data_info *) data)->path;
 	}
-	return 0;
+	return NULL;
+}
+
+static int compare_obj_path(sc_pkcs15_object_t *obj, const sc_path_t *path)
+{
+	const sc_path_t *opath = obj_path(obj);
+
+	return opath != NULL && sc_compare_path(opath, path);
 }
 
 static int compare_obj_data_name(sc_pkcs15_object_t *obj, const char *app_label, const char *label)
@@ -1433,6 +1599,195 @@ int sc_pkcs15_find_so_pin(struct sc_pkcs15_card *p15card,
 	return find_by_key(p15card, SC_PKCS15_TYPE_AUTH_PIN, &sk, out);
 }
 
+static unsigned int obj_index_hash(const u8 *data, size_t len)
+{
+	unsigned int hash = 2166136261U;
+
+	while (len--) {
+		hash ^= *data++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static int obj_index_key(struct sc_pkcs15_object *obj, int kind, unsigned int *hash)
+{
+	const struct sc_pkcs15_id *id;
+	const sc_path_t *path;
+	int reference;
+
+	switch (kind) {
+	case SC_PKCS15_INDEX_ID:
+		if ((id = obj_id(obj)) == NULL)
+			return 0;
+		*hash = obj_index_hash(id->value, id->len);
+		return 1;
+	case SC_PKCS15_INDEX_REFERENCE:
+		if (!obj_reference(obj, &reference))
+			return 0;
+		*hash = obj_index_hash((const u8 *) &reference, sizeof(reference));
+		return 1;
+	case SC_PKCS15_INDEX_PATH:
+		if ((path = obj_path(obj)) == NULL)
+			return 0;
+		*hash = obj_index_hash(path->value, path->len);
+		return 1;
+	}
+	return 0;
+}
+
+static void obj_index_free(struct sc_pkcs15_obj_index *index)
+{
+	struct sc_pkcs15_obj_index_node *node, *next;
+	size_t i;
+	int kind;
+
+	for (kind = 0; kind < SC_PKCS15_INDEX_COUNT; kind++) {
+		if (index->table[kind] == NULL)
+			continue;
+		for (i = 0; i < index->size; i++) {
+			for (node = index->table[kind][i]; node != NULL; node = next) {
+				next = node->next;
+				free(node);
+			}
+		}
+		free(index->table[kind]);
+	}
+	free(index);
+}
+
+static void sc_pkcs15_free_obj_index(struct sc_pkcs15_card *p15card)
+{
+	if (p15card->obj_index != NULL)
+		obj_index_free(p15card->obj_index);
+	p15card->obj_index = NULL;
+}
+
+static int obj_index_insert(struct sc_pkcs15_obj_index *index, struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_obj_index_node *node, **pp;
+	unsigned int hash;
+	int kind;
+
+	for (kind = 0; kind < SC_PKCS15_INDEX_COUNT; kind++) {
+		if (!obj_index_key(obj, kind, &hash))
+			continue;
+		node = calloc(1, sizeof(*node));
+		if (node == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		node->obj = obj;
+		node->hash = hash;
+		for (pp = &index->table[kind][hash & (index->size - 1)]; *pp != NULL; pp = &(*pp)->next)
+			;
+		*pp = node;
+	}
+	index->count++;
+	return SC_SUCCESS;
+}
+
+static int obj_index_unlink(struct sc_pkcs15_obj_index_node **pp, struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_obj_index_node *node;
+
+	for (; *pp != NULL; pp = &(*pp)->next) {
+		if ((*pp)->obj != obj)
+			continue;
+		node = *pp;
+		*pp = node->next;
+		free(node);
+		return 1;
+	}
+	return 0;
+}
+
+static void obj_index_delete(struct sc_pkcs15_obj_index *index, struct sc_pkcs15_object *obj)
+{
+	unsigned int hash;
+	size_t i;
+	int kind;
+
+	for (kind = 0; kind < SC_PKCS15_INDEX_COUNT; kind++) {
+		/* an object changed without sc_pkcs15_reindex_object()
+		 * is not in the bucket of its current key */
+		if (obj_index_key(obj, kind, &hash)
+		 && obj_index_unlink(&index->table[kind][hash & (index->size - 1)], obj))
+			continue;
+		for (i = 0; i < index->size; i++)
+			if (obj_index_unlink(&index->table[kind][i], obj))
+				break;
+	}
+	if (index->count > 0)
+		index->count--;
+}
+
+static struct sc_pkcs15_obj_index *obj_index_build(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_obj_index *index;
+	struct sc_pkcs15_object *obj;
+	size_t count = 0;
+	int kind;
+
+	index = calloc(1, sizeof(*index));
+	if (index == NULL)
+		return NULL;
+
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		count++;
+	for (index->size = SC_PKCS15_INDEX_MIN_SIZE; index->size < count; index->size <<= 1)
+		;
+	for (kind = 0; kind < SC_PKCS15_INDEX_COUNT; kind++) {
+		index->table[kind] = calloc(index->size, sizeof(struct sc_pkcs15_obj_index_node *));
+		if (index->table[kind] == NULL)
+			goto err;
+	}
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		if (obj_index_insert(index, obj) != SC_SUCCESS)
+			goto err;
+
+	sc_log(p15card->card->ctx, "indexed %u objects in %u buckets", index->count, index->size);
+	return index;
+err:
+	obj_index_free(index);
+	return NULL;
+}
+
+/*
+ * Returns 1 and the bucket to look at in 'out' if the search key
+ * can be answered from the index, 0 if the object list has to be
+ * scanned.
+ */
+static int sc_pkcs15_obj_index_find(struct sc_pkcs15_card *p15card,
+			struct sc_pkcs15_search_key *sk,
+			struct sc_pkcs15_obj_index_node **out)
+{
+	unsigned int hash;
+	int kind;
+
+	if (sk == NULL)
+		return 0;
+	if (sk->id != NULL) {
+		kind = SC_PKCS15_INDEX_ID;
+		hash = obj_index_hash(sk->id->value, sk->id->len);
+	} else if (sk->match_reference) {
+		kind = SC_PKCS15_INDEX_REFERENCE;
+		hash = obj_index_hash((const u8 *) &sk->reference, sizeof(sk->reference));
+	} else if (sk->path != NULL) {
+		kind = SC_PKCS15_INDEX_PATH;
+		hash = obj_index_hash(sk->path->value, sk->path->len);
+	} else {
+		return 0;
+	}
+
+	if (p15card->obj_index == NULL) {
+		p15card->obj_index = obj_index_build(p15card);
+		if (p15card->obj_index == NULL)
+			return 0;
+	}
+
+	*out = p15card->obj_index->table[kind][hash & (p15card->obj_index->size - 1)];
+	return 1;
+}
+
 int sc_pkcs15_add_object(struct sc_pkcs15_card *p15card,
 			 struct sc_pkcs15_object *obj)
 {
@@ -1441,12 +1796,19 @@ int sc_pkcs15_add_object(struct sc_pkcs15_card *p15card,
 	obj->next = obj->prev = NULL;
 	if (p15card->obj_list == NULL) {
 		p15card->obj_list = obj;
-		return 0;
+	} else {
+		while (p->next != NULL)
+			p = p->next;
+		p->next = obj;
+		obj->prev = p;
+	}
+
+	if (p15card->obj_index != NULL) {
+		/* rebuild with more buckets once the chains get long */
+		if (p15card->obj_index->count >= 2 * p15card->obj_index->size
+		 || obj_index_insert(p15card->obj_index, obj) != SC_SUCCESS)
+			sc_pkcs15_free_obj_index(p15card);
 	}
-	while (p->next != NULL)
- 		p = p->next;
-	p->next = obj;
-	obj->prev = p;
 
 	return 0;
 }
@@ -1457,6 +1819,9 @@ void sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card,
 	if (!obj)
 		return;
 
+	if (p15card->obj_index != NULL)
+		obj_index_delete(p15card->obj_index, obj);
+
 	if (obj->prev == NULL)
 		p15card->obj_list = obj->next;
 	else
@@ -1465,6 +1830,14 @@ void sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card,
 		obj->next->prev = obj->prev;
 }
 
+void sc_pkcs15_reindex_object(struct sc_pkcs15_card *p15card,
+			     struct sc_pkcs15_object *obj)
+{
+	/* Rare enough to simply rebuild the index on the next lookup */
+	if (obj != NULL)
+		sc_pkcs15_free_obj_index(p15card);
+}
+
 void sc_pkcs15_free_object(struct sc_pkcs15_object *obj)
 {
 	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
@@ -1587,29 +1960,16 @@ int sc_pkcs15_encode_df(sc_context_t *ctx,
 	return 0;	
 }
 
-int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
-		       struct sc_pkcs15_df *df)
+static int sc_pkcs15_parse_df_data(struct sc_pkcs15_card *p15card,
+		struct sc_pkcs15_df *df, const u8 *buf, size_t bufsize)
 {
 	sc_context_t *ctx = p15card->card->ctx;
-	u8 *buf;
-	const u8 *p;
-	size_t bufsize;
-	int r;
+	const u8 *p = buf;
+	int r = 0;
 	struct sc_pkcs15_object *obj = NULL;
 	int (* func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
 		     const u8 **nbuf, size_t *nbufsize) = NULL;
 
-	sc_log(ctx, "called; path=%s, type=%d, enum=%d", 
-			sc_print_path(&df->path), df->type, df->enumerated);
-
-	if (p15card->ops.parse_df)   {
-		r = p15card->ops.parse_df(p15card, df);
-		LOG_FUNC_RETURN(ctx, r);
-	}
-
-	if (df->enumerated)
-		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
-
 	switch (df->type) {
 	case SC_PKCS15_PRKDF:
 		func = sc_pkcs15_decode_prkdf_entry;
@@ -1631,12 +1991,11 @@ int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 	}
 	if (func == NULL) {
 		sc_log(ctx, "unknown DF type: %d", df->type);
-		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+		return SC_ERROR_INVALID_ARGUMENTS;
 	}
-	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
-	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
+	if (bufsize == 0)
+		goto ret;
 
-	p = buf;
 	sc_log(ctx, "bufsize %i; first tag 0x%X", bufsize, *p);
 	while (bufsize && *p != 0x00) {
 		
@@ -1672,10 +2031,366 @@ int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 		r = 0;
 ret:
 	df->enumerated = 1;
+	return r;
+}
+
+int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
+		       struct sc_pkcs15_df *df)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	u8 *buf = NULL;
+	size_t bufsize;
+	int r;
+
+	sc_log(ctx, "called; path=%s, type=%d, enum=%d", 
+			sc_print_path(&df->path), df->type, df->enumerated);
+
+	if (p15card->ops.parse_df)   {
+		r = p15card->ops.parse_df(p15card, df);
+		LOG_FUNC_RETURN(ctx, r);
+	}
+
+	if (df->enumerated)
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
+	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
+	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
+
+	r = sc_pkcs15_parse_df_data(p15card, df, buf, bufsize);
+
+	/* Only whole files are kept in the cache. Store images validated
+	 * by the card fingerprint, so that the next bind finds them. */
+	if (r == SC_SUCCESS && p15card->opts.use_file_cache && p15card->fingerprint
+			&& df->path.count < 0)
+		sc_pkcs15_cache_file(p15card, &df->path, buf, bufsize);
+
 	free(buf);
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+/*
+ * Prefetch: read all DFs, and then all certificates, in one go under a
+ * single card lock. The reads are ordered by parent DF so that drivers
+ * caching the selection mostly get away with short relative SELECTs.
+ * Certificates are parsed on a worker thread, overlapping the card I/O
+ * of the next file, and are kept until sc_pkcs15_read_certificate()
+ * asks for them. DF entries go to the shared object list, so the DFs
+ * are parsed by the calling thread once all of them have been read.
+ */
+struct sc_pkcs15_prefetched_cert {
+	sc_path_t path;
+	struct sc_pkcs15_cert *cert;
+	struct sc_pkcs15_prefetched_cert *next;
+};
+
+#define SC_PKCS15_PREFETCH_MAX_CERTS	64
+
+struct prefetch_job {
+	sc_path_t path;
+	struct sc_pkcs15_df *df;	/* DF read, or NULL for a certificate */
+	size_t order;
+	u8 *data;
+	size_t len;
+	int r;
+	struct sc_pkcs15_cert *cert;
+};
+
+struct prefetch_queue {
+	struct sc_pkcs15_card *p15card;
+	struct prefetch_job *jobs;
+	size_t count;
+	size_t read;		/* jobs read from the card so far */
+	int done;		/* no more jobs will be read */
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+};
+
+/* Sort by parent DF, keeping the original order within a DF */
+static int prefetch_job_cmp(const void *a, const void *b)
+{
+	const struct prefetch_job *ja = a, *jb = b;
+	size_t la = ja->path.len, lb = jb->path.len;
+	int r;
+
+	if (ja->path.type == SC_PATH_TYPE_PATH && la >= 2)
+		la -= 2;
+	if (jb->path.type == SC_PATH_TYPE_PATH && lb >= 2)
+		lb -= 2;
+	if (ja->path.aid.len != jb->path.aid.len)
+		return ja->path.aid.len < jb->path.aid.len ? -1 : 1;
+	r = memcmp(ja->path.aid.value, jb->path.aid.value, ja->path.aid.len);
+	if (r == 0 && la != lb)
+		return la < lb ? -1 : 1;
+	if (r == 0)
+		r = memcmp(ja->path.value, jb->path.value, la);
+	if (r == 0 && ja->order != jb->order)
+		r = ja->order < jb->order ? -1 : 1;
+	return r;
+}
+
+/* Back to the original order, once the card is done with */
+static int prefetch_order_cmp(const void *a, const void *b)
+{
+	const struct prefetch_job *ja = a, *jb = b;
+
+	if (ja->order != jb->order)
+		return ja->order < jb->order ? -1 : 1;
+	return 0;
+}
+
+/* Parse a certificate into the job only; this may run on the worker */
+static void prefetch_parse(struct sc_pkcs15_card *p15card, struct prefetch_job *job)
+{
+	if (job->r < 0 || job->df != NULL)
+		return;
+	job->r = sc_pkcs15_parse_certificate(p15card->card->ctx,
+			job->data, job->len, &job->cert);
+	if (job->r == SC_SUCCESS)
+		job->data = NULL;
+}
+
+#ifdef HAVE_PTHREAD
+static void *prefetch_worker(void *arg)
+{
+	struct prefetch_queue *q = arg;
+	size_t i = 0;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (i == q->read && !q->done)
+			pthread_cond_wait(&q->cond, &q->lock);
+		if (i == q->read)
+			break;
+		pthread_mutex_unlock(&q->lock);
+		prefetch_parse(q->p15card, &q->jobs[i++]);
+		pthread_mutex_lock(&q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+#endif
+
+/* Read all jobs from the card, parsing certificates overlapped if possible */
+static void prefetch_run(struct prefetch_queue *q)
+{
+	struct sc_pkcs15_card *p15card = q->p15card;
+	size_t i;
+#ifdef HAVE_PTHREAD
+	pthread_t worker;
+	int threaded;
+
+	threaded = pthread_mutex_init(&q->lock, NULL) == 0;
+	if (threaded && pthread_cond_init(&q->cond, NULL) != 0) {
+		pthread_mutex_destroy(&q->lock);
+		threaded = 0;
+	}
+	if (threaded && pthread_create(&worker, NULL, prefetch_worker, q) != 0) {
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->lock);
+		threaded = 0;
+	}
+#endif
+
+	for (i = 0; i < q->count; i++) {
+		struct prefetch_job *job = &q->jobs[i];
+
+		job->r = sc_pkcs15_read_file(p15card, &job->path, &job->data, &job->len);
+		if (job->r < 0)
+			sc_log(p15card->card->ctx, "Prefetch of %s failed: %s",
+				sc_print_path(&job->path), sc_strerror(job->r));
+#ifdef HAVE_PTHREAD
+		if (threaded) {
+			pthread_mutex_lock(&q->lock);
+			q->read = i + 1;
+			pthread_cond_signal(&q->cond);
+			pthread_mutex_unlock(&q->lock);
+			continue;
+		}
+#endif
+		prefetch_parse(p15card, job);
+	}
+
+#ifdef HAVE_PTHREAD
+	if (threaded) {
+		pthread_mutex_lock(&q->lock);
+		q->done = 1;
+		pthread_cond_signal(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+		pthread_join(worker, NULL);
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->lock);
+	}
+#endif
+}
+
+static struct sc_pkcs15_prefetched_cert **
+find_prefetched_cert(struct sc_pkcs15_card *p15card, const sc_path_t *path)
+{
+	struct sc_pkcs15_prefetched_cert **pp;
+
+	for (pp = &p15card->prefetched; *pp != NULL; pp = &(*pp)->next)
+		if (sc_compare_path(&(*pp)->path, path)
+		 && (*pp)->path.index == path->index && (*pp)->path.count == path->count)
+			break;
+	return pp;
+}
+
+static int prefetch_dfs(struct sc_pkcs15_card *p15card)
+{
+	struct prefetch_queue q;
+	struct sc_pkcs15_df *df;
+	size_t i, count = 0;
+
+	/* Emulators enumerate their DFs themselves */
+	if (p15card->ops.parse_df)
+		return SC_SUCCESS;
+
+	for (df = p15card->df_list; df != NULL; df = df->next)
+		if (!df->enumerated)
+			count++;
+	if (count == 0)
+		return SC_SUCCESS;
+
+	memset(&q, 0, sizeof(q));
+	q.p15card = p15card;
+	q.jobs = calloc(count, sizeof(*q.jobs));
+	if (q.jobs == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (df = p15card->df_list; df != NULL; df = df->next) {
+		if (df->enumerated)
+			continue;
+		q.jobs[q.count].path = df->path;
+		q.jobs[q.count].df = df;
+		q.jobs[q.count].order = q.count;
+		q.count++;
+	}
+	qsort(q.jobs, q.count, sizeof(*q.jobs), prefetch_job_cmp);
+
+	prefetch_run(&q);
+	qsort(q.jobs, q.count, sizeof(*q.jobs), prefetch_order_cmp);
+
+	for (i = 0; i < q.count; i++) {
+		struct prefetch_job *job = &q.jobs[i];
+
+		/* As in sc_pkcs15_parse_df() */
+		if (job->r == SC_SUCCESS)
+			job->r = sc_pkcs15_parse_df_data(p15card, job->df,
+					job->data, job->len);
+		if (job->r == SC_SUCCESS && p15card->opts.use_file_cache
+				&& p15card->fingerprint && job->path.count < 0)
+			sc_pkcs15_cache_file(p15card, &job->path, job->data, job->len);
+		free(job->data);
+	}
+	free(q.jobs);
+	return SC_SUCCESS;
+}
+
+static int prefetch_certs(struct sc_pkcs15_card *p15card)
+{
+	struct prefetch_queue q;
+	struct sc_pkcs15_object *objs[SC_PKCS15_PREFETCH_MAX_CERTS];
+	struct sc_pkcs15_prefetched_cert *pc;
+	size_t i;
+	int r;
+
+	r = sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_CERT_X509, objs,
+			SC_PKCS15_PREFETCH_MAX_CERTS);
+	if (r <= 0)
+		return r;
+
+	memset(&q, 0, sizeof(q));
+	q.p15card = p15card;
+	q.jobs = calloc(r, sizeof(*q.jobs));
+	if (q.jobs == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (i = 0; i < (size_t) r; i++) {
+		struct sc_pkcs15_cert_info *info = objs[i]->data;
+
+		if (info->path.len == 0
+		 || *find_prefetched_cert(p15card, &info->path) != NULL)
+			continue;
+		q.jobs[q.count].path = info->path;
+		q.jobs[q.count].order = q.count;
+		q.count++;
+	}
+	qsort(q.jobs, q.count, sizeof(*q.jobs), prefetch_job_cmp);
+
+	prefetch_run(&q);
+
+	r = SC_SUCCESS;
+	for (i = 0; i < q.count; i++) {
+		struct prefetch_job *job = &q.jobs[i];
+
+		free(job->data);
+		if (job->cert == NULL)
+			continue;
+		pc = calloc(1, sizeof(*pc));
+		if (pc == NULL) {
+			sc_pkcs15_free_certificate(job->cert);
+			r = SC_ERROR_OUT_OF_MEMORY;
+			continue;
+		}
+		pc->path = job->path;
+		pc->cert = job->cert;
+		pc->next = p15card->prefetched;
+		p15card->prefetched = pc;
+	}
+	free(q.jobs);
+	return r;
+}
+
+int sc_pkcs15_prefetch(struct sc_pkcs15_card *p15card, unsigned int what)
+{
+	sc_context_t *ctx;
+	int r;
+
+	if (p15card == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	ctx = p15card->card->ctx;
+	LOG_FUNC_CALLED(ctx);
+
+	r = sc_lock(p15card->card);
+	LOG_TEST_RET(ctx, r, "sc_lock() failed");
+
+	r = SC_SUCCESS;
+	if (what & SC_PKCS15_PREFETCH_DF)
+		r = prefetch_dfs(p15card);
+	if (r >= 0 && (what & SC_PKCS15_PREFETCH_CERT))
+		r = prefetch_certs(p15card);
+
+	sc_unlock(p15card->card);
+	LOG_FUNC_RETURN(ctx, r < 0 ? r : SC_SUCCESS);
+}
+
+/* Hand out (once) a certificate read by sc_pkcs15_prefetch() */
+struct sc_pkcs15_cert *sc_pkcs15_get_prefetched_cert(struct sc_pkcs15_card *p15card,
+		const sc_path_t *path)
+{
+	struct sc_pkcs15_prefetched_cert **pp, *pc;
+	struct sc_pkcs15_cert *cert;
+
+	pp = find_prefetched_cert(p15card, path);
+	if ((pc = *pp) == NULL)
+		return NULL;
+	*pp = pc->next;
+	cert = pc->cert;
+	free(pc);
+	return cert;
+}
+
+static void sc_pkcs15_free_prefetched(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_prefetched_cert *pc;
+
+	while ((pc = p15card->prefetched) != NULL) {
+		p15card->prefetched = pc->next;
+		sc_pkcs15_free_certificate(pc->cert);
+		free(pc);
+	}
+}
+
 int sc_pkcs15_add_unusedspace(struct sc_pkcs15_card *p15card,
 		     const sc_path_t *path, const sc_pkcs15_id_t *auth_id)
 {
@@ -518,6 +518,8 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_df *df_list;
 	struct sc_pkcs15_object *obj_list;
+	/* hash indexes over obj_list, built on the first lookup */
+	struct sc_pkcs15_obj_index *obj_index;
 	sc_pkcs15_tokeninfo_t *tokeninfo;
 	sc_pkcs15_unusedspace_t *unusedspace_list;
 	int unusedspace_read;
@@ -526,8 +528,15 @@ typedef struct sc_pkcs15_card {
 		int use_file_cache;
 		int use_pin_cache;
 		int pin_cache_counter;
+		int prefetch;
 	} opts;
 
+	/* certificates read ahead by sc_pkcs15_prefetch() */
+	struct sc_pkcs15_prefetched_cert *prefetched;
+
+	/* Identifies this card and the version of its PKCS#15 structure,
+	 * used to key the file cache. NULL, if not known. */
+	char *fingerprint;
 
 	unsigned int magic;
 
@@ -639,6 +648,8 @@ void sc_pkcs15_free_data_object(struct sc_pkcs15_data *data_object);
 int sc_pkcs15_read_certificate(struct sc_pkcs15_card *card,
 			       const struct sc_pkcs15_cert_info *info,
 			       struct sc_pkcs15_cert **cert);
+int sc_pkcs15_parse_certificate(struct sc_context *ctx, u8 *data, size_t len,
+			       struct sc_pkcs15_cert **cert);
 void sc_pkcs15_free_certificate(struct sc_pkcs15_cert *cert);
 int sc_pkcs15_find_cert_by_id(struct sc_pkcs15_card *card,
 			      const struct sc_pkcs15_id *id,
@@ -729,6 +740,15 @@ int sc_pkcs15_encode_aodf_entry(struct sc_context *ctx,
 
 int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 		       struct sc_pkcs15_df *df);
+
+/* What sc_pkcs15_prefetch() reads ahead */
+#define SC_PKCS15_PREFETCH_DF		0x0001
+#define SC_PKCS15_PREFETCH_CERT		0x0002
+#define SC_PKCS15_PREFETCH_ALL		(SC_PKCS15_PREFETCH_DF | SC_PKCS15_PREFETCH_CERT)
+
+int sc_pkcs15_prefetch(struct sc_pkcs15_card *p15card, unsigned int what);
+struct sc_pkcs15_cert *sc_pkcs15_get_prefetched_cert(struct sc_pkcs15_card *p15card,
+		       const sc_path_t *path);
 int sc_pkcs15_read_df(struct sc_pkcs15_card *p15card,
 		      struct sc_pkcs15_df *df);
 int sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card,
@@ -758,6 +778,10 @@ int sc_pkcs15_add_object(struct sc_pkcs15_card *p15card,
 			 struct sc_pkcs15_object *obj);
 void sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card,
 			     struct sc_pkcs15_object *obj);
+/* To be called after changing the ID, auth ID, reference or path
+ * of an object that is already in the object list */
+void sc_pkcs15_reindex_object(struct sc_pkcs15_card *p15card,
+			     struct sc_pkcs15_object *obj);
 int sc_pkcs15_add_df(struct sc_pkcs15_card *, unsigned int, const sc_path_t *);
 void sc_pkcs15_remove_df(struct sc_pkcs15_card *p15card,
 			 struct sc_pkcs15_df *df);
@@ -791,6 +815,11 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
+/* Derive the file cache key from the card serial number, the ATR and
+ * the TokenInfo contents. Cache files written before the card has been
+ * changed on the outside are not matched anymore afterwards. */
+int sc_pkcs15_cache_set_fingerprint(struct sc_pkcs15_card *p15card,
+				    const u8 *tokeninfo, size_t tokeninfo_len);
 
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
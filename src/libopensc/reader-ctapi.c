@@ -176,21 +176,17 @@ static int ctapi_internal_transmit(sc_reader_t *reader,
 
 static int ctapi_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 {
-	size_t       ssize, rsize, rbuflen = 0;
+	size_t       ssize = 0, rsize, rbuflen = 0;
 	u8           *sbuf = NULL, *rbuf = NULL;
 	int          r;
 
 	rsize = rbuflen = apdu->resplen + 2;
-	rbuf     = malloc(rbuflen);
-	if (rbuf == NULL) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto out;
-	}
 	/* encode and log the APDU */
-	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, SC_PROTO_RAW);
+	r = _sc_reader_get_apdu_buf(reader, apdu, SC_PROTO_RAW, &sbuf, &ssize, &rbuf, rbuflen);
 	if (r != SC_SUCCESS)
 		goto out;
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+	if ((apdu->flags & SC_APDU_FLAGS_NO_LOG) == 0)
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
 	r = ctapi_internal_transmit(reader, sbuf, ssize,
 					rbuf, &rsize, apdu->control);
 	if (r < 0) {
@@ -198,19 +194,13 @@ static int ctapi_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "unable to transmit");
 		goto out;
 	}
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	if ((apdu->flags & SC_APDU_FLAGS_NO_LOG) == 0)
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
 	/* set response */
 	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
 out:
-	if (sbuf != NULL) {
-		sc_mem_clear(sbuf, ssize);
-		free(sbuf);
-	}
-	if (rbuf != NULL) {
-		sc_mem_clear(rbuf, rbuflen);
-		free(rbuf);
-	}
-	
+	_sc_reader_clear_apdu_buf(reader, ssize, rbuflen);
+
 	return r;
 }
 
@@ -309,7 +299,7 @@ static struct sc_reader_driver ctapi_drv = {
 	"CT-API module",
 	"ctapi",
 	&ctapi_ops,
-	0, 0, NULL
+	0, 0, NULL, 0
 };
 
 static struct ctapi_module * add_module(struct ctapi_global_private_data *gpriv,
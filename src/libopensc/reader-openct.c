@@ -44,7 +44,7 @@ static struct sc_reader_driver openct_reader_driver = {
 	"OpenCT reader",
 	"openct",
 	&openct_ops,
-	0, 0, NULL
+	0, 0, NULL, 0
 };
 
 /* private data structures */
@@ -276,21 +276,17 @@ openct_reader_internal_transmit(sc_reader_t *reader,
 
 static int openct_reader_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 {
-	size_t       ssize, rsize, rbuflen = 0;
+	size_t       ssize = 0, rsize, rbuflen = 0;
 	u8           *sbuf = NULL, *rbuf = NULL;
 	int          r;
 
 	rsize = rbuflen = apdu->resplen + 2;
-	rbuf     = malloc(rbuflen);
-	if (rbuf == NULL) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto out;
-	}
 	/* encode and log the APDU */
-	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, SC_PROTO_RAW);
+	r = _sc_reader_get_apdu_buf(reader, apdu, SC_PROTO_RAW, &sbuf, &ssize, &rbuf, rbuflen);
 	if (r != SC_SUCCESS)
 		goto out;
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+	if ((apdu->flags & SC_APDU_FLAGS_NO_LOG) == 0)
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
 	r = openct_reader_internal_transmit(reader, sbuf, ssize,
 				rbuf, &rsize, apdu->control);
 	if (r < 0) {
@@ -298,19 +294,13 @@ static int openct_reader_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "unable to transmit");
 		goto out;
 	}
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	if ((apdu->flags & SC_APDU_FLAGS_NO_LOG) == 0)
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
 	/* set response */
 	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
 out:
-	if (sbuf != NULL) {
-		sc_mem_clear(sbuf, ssize);
-		free(sbuf);
-	}
-	if (rbuf != NULL) {
-		sc_mem_clear(rbuf, rbuflen);
-		free(rbuf);
-	}
-	
+	_sc_reader_clear_apdu_buf(reader, ssize, rbuflen);
+
 	return r;
 }
 
@@ -26,6 +26,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <errno.h>
+#include <pthread.h>
+#endif
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -53,6 +60,8 @@ struct pcsc_global_private_data {
 	DWORD disconnect_action;
 	DWORD transaction_end_action;
 	DWORD reconnect_action;
+	unsigned int transaction_hold_time;
+	unsigned int presence_cache_time;
 	const char *provider_library;
 	void *dlhandle;
 	SCardEstablishContext_t SCardEstablishContext;
@@ -70,6 +79,20 @@ struct pcsc_global_private_data {
 	SCardTransmit_t SCardTransmit;
 	SCardListReaders_t SCardListReaders;
 	SCardGetAttrib_t SCardGetAttrib;
+#ifdef HAVE_PTHREAD
+	/* Reader status listener, see presence_cache_time */
+	pthread_mutex_t listen_mutex;
+	pthread_cond_t listen_cond;
+	pthread_t listen_thread;
+	SCARDCONTEXT pcsc_listen_ctx;
+	int listen_running;
+	int listen_exited;
+	int listen_stop;
+	int listen_rebuild;
+	unsigned long listen_gen;	/* bumped on every presence change */
+	char **listen_names;
+	size_t listen_count;
+#endif
 };
 
 struct pcsc_private_data {
@@ -89,6 +112,20 @@ struct pcsc_private_data {
 	DWORD get_tlv_properties;
 
 	int locked;
+#ifdef HAVE_PTHREAD
+	/* Transaction kept after pcsc_unlock(), see transaction_hold_time */
+	pthread_mutex_t hold_mutex;
+	pthread_cond_t hold_cond;
+	pthread_t hold_thread;
+	int hold_thread_running;
+	int hold_stop;
+	int held;
+	struct timespec hold_until;
+
+	/* listen_gen and time of the last refresh_attributes() */
+	unsigned long presence_gen;
+	unsigned long long presence_time;
+#endif
 };
 
 static int pcsc_detect_card_presence(sc_reader_t *reader);
@@ -220,7 +257,7 @@ static int pcsc_internal_transmit(sc_reader_t *reader,
 
 static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 {
-	size_t       ssize, rsize, rbuflen = 0;
+	size_t       ssize = 0, rsize, rbuflen = 0;
 	u8           *sbuf = NULL, *rbuf = NULL;
 	int          r;
 
@@ -230,18 +267,15 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 	 * The buffer for the returned data needs to be at least 2 bytes
 	 * larger than the expected data length to store SW1 and SW2. */
 	rsize = rbuflen = apdu->resplen <= 256 ? 258 : apdu->resplen + 2;
-	rbuf     = malloc(rbuflen);
-	if (rbuf == NULL) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto out;
-	}
 	/* encode and log the APDU */
-	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, reader->active_protocol);
+	r = _sc_reader_get_apdu_buf(reader, apdu, reader->active_protocol, &sbuf, &ssize, &rbuf, rbuflen);
 	if (r != SC_SUCCESS)
 		goto out;
-	if (reader->name)
-		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "reader '%s'", reader->name);
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+	if ((apdu->flags & SC_APDU_FLAGS_NO_LOG) == 0) {
+		if (reader->name)
+			sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "reader '%s'", reader->name);
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+	}
 
 	r = pcsc_internal_transmit(reader, sbuf, ssize,
 				rbuf, &rsize, apdu->control);
@@ -250,18 +284,12 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "unable to transmit");
 		goto out;
 	}
-	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	if ((apdu->flags & SC_APDU_FLAGS_NO_LOG) == 0)
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
 	/* set response */
 	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
 out:
-	if (sbuf != NULL) {
-		sc_mem_clear(sbuf, ssize);
-		free(sbuf);
-	}
-	if (rbuf != NULL) {
-		sc_mem_clear(rbuf, rbuflen);
-		free(rbuf);
-	}
+	_sc_reader_clear_apdu_buf(reader, ssize, rbuflen);
 
 	return r;
 }
@@ -358,14 +386,265 @@ static int refresh_attributes(sc_reader_t *reader)
 	return SC_SUCCESS;
 }
 
+#ifdef HAVE_PTHREAD
+/*
+ * With presence_cache_time set, a listener thread waits in
+ * SCardGetStatusChange() on all readers and bumps listen_gen whenever a
+ * card is inserted or removed or a reader goes away. Until then, and for
+ * at most presence_cache_time ms, pcsc_detect_card_presence() answers
+ * from the last refresh_attributes() without a round trip to pcscd.
+ */
+#define PCSC_PRESENCE_STATES	(SCARD_STATE_PRESENT | SCARD_STATE_EMPTY \
+		| SCARD_STATE_UNKNOWN | SCARD_STATE_UNAVAILABLE | 0xFFFF0000)
+
+static void pcsc_listen_free_states(SCARD_READERSTATE *states, size_t count)
+{
+	size_t i;
+
+	if (states == NULL)
+		return;
+	for (i = 0; i < count; i++)
+		free((char *) states[i].szReader);
+	free(states);
+}
+
+/* Sleep for a while, or until woken up; called with listen_mutex locked */
+static void pcsc_listen_pause(struct pcsc_global_private_data *gpriv, long ms)
+{
+	struct timeval tv;
+	struct timespec until;
+
+	gettimeofday(&tv, NULL);
+	until.tv_sec = tv.tv_sec + ms / 1000;
+	until.tv_nsec = tv.tv_usec * 1000 + (ms % 1000) * 1000000;
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&gpriv->listen_cond, &gpriv->listen_mutex, &until);
+}
+
+static void *pcsc_listen_thread(void *arg)
+{
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) arg;
+	SCARD_READERSTATE *states = NULL;
+	size_t i, count = 0;
+	int changed, rebuild = 1;
+	LONG rv;
+
+	pthread_mutex_lock(&gpriv->listen_mutex);
+	while (!gpriv->listen_stop) {
+		if (rebuild || gpriv->listen_rebuild) {
+			pcsc_listen_free_states(states, count);
+			count = gpriv->listen_count;
+			states = calloc(count + 1, sizeof(SCARD_READERSTATE));
+			for (i = 0; states != NULL && i < count; i++) {
+				states[i].szReader = strdup(gpriv->listen_names[i]);
+				states[i].dwCurrentState = SCARD_STATE_UNAWARE;
+				if (states[i].szReader == NULL) {
+					pcsc_listen_free_states(states, i);
+					states = NULL;
+				}
+			}
+			if (states == NULL)
+				count = 0;
+			gpriv->listen_rebuild = rebuild = 0;
+			/* Whatever happened meanwhile went unnoticed */
+			gpriv->listen_gen++;
+		}
+		if (count == 0) {
+			pthread_cond_wait(&gpriv->listen_cond, &gpriv->listen_mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&gpriv->listen_mutex);
+
+		rv = gpriv->SCardGetStatusChange(gpriv->pcsc_listen_ctx, INFINITE, states, count);
+
+		changed = 0;
+		if (rv == SCARD_S_SUCCESS) {
+			for (i = 0; i < count; i++) {
+				if (!(states[i].dwEventState & SCARD_STATE_CHANGED))
+					continue;
+				if ((states[i].dwEventState ^ states[i].dwCurrentState) & PCSC_PRESENCE_STATES)
+					changed = 1;
+				states[i].dwCurrentState = states[i].dwEventState;
+			}
+		}
+
+		pthread_mutex_lock(&gpriv->listen_mutex);
+		if (changed)
+			gpriv->listen_gen++;
+		if (rv != SCARD_S_SUCCESS && rv != (LONG)SCARD_E_CANCELLED
+				&& rv != (LONG)SCARD_E_TIMEOUT && !gpriv->listen_stop) {
+			/* Don't know what the readers are up to: distrust the
+			 * cache and try again a bit later */
+			gpriv->listen_gen++;
+			rebuild = 1;
+			pcsc_listen_pause(gpriv, 1000);
+		}
+	}
+	gpriv->listen_exited = 1;
+	pthread_cond_broadcast(&gpriv->listen_cond);
+	pthread_mutex_unlock(&gpriv->listen_mutex);
+
+	pcsc_listen_free_states(states, count);
+	return NULL;
+}
+
+/* Watch the current set of readers, called from pcsc_detect_readers() */
+static void pcsc_listen_update(sc_context_t *ctx)
+{
+	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
+	char **names;
+	size_t i, count = sc_ctx_get_reader_count(ctx);
+	LONG rv;
+
+	names = calloc(count + 1, sizeof(char *));
+	if (names == NULL)
+		return;
+	for (i = 0; i < count; i++) {
+		names[i] = strdup(sc_ctx_get_reader(ctx, i)->name);
+		if (names[i] == NULL) {
+			while (i--)
+				free(names[i]);
+			free(names);
+			return;
+		}
+	}
+
+	if (!gpriv->listen_running) {
+		rv = gpriv->SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &gpriv->pcsc_listen_ctx);
+		if (rv != SCARD_S_SUCCESS) {
+			PCSC_LOG(ctx, "SCardEstablishContext(listen) failed", rv);
+			goto err;
+		}
+		if (pthread_mutex_init(&gpriv->listen_mutex, NULL) != 0)
+			goto err_ctx;
+		if (pthread_cond_init(&gpriv->listen_cond, NULL) != 0) {
+			pthread_mutex_destroy(&gpriv->listen_mutex);
+			goto err_ctx;
+		}
+		gpriv->listen_names = names;
+		gpriv->listen_count = count;
+		gpriv->listen_stop = gpriv->listen_exited = 0;
+		if (pthread_create(&gpriv->listen_thread, NULL, pcsc_listen_thread, gpriv) != 0) {
+			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "cannot start reader status listener");
+			gpriv->listen_names = NULL;
+			gpriv->listen_count = 0;
+			pthread_cond_destroy(&gpriv->listen_cond);
+			pthread_mutex_destroy(&gpriv->listen_mutex);
+			goto err_ctx;
+		}
+		gpriv->listen_running = 1;
+		return;
+	}
+
+	pthread_mutex_lock(&gpriv->listen_mutex);
+	for (i = 0; i < gpriv->listen_count; i++)
+		free(gpriv->listen_names[i]);
+	free(gpriv->listen_names);
+	gpriv->listen_names = names;
+	gpriv->listen_count = count;
+	gpriv->listen_rebuild = 1;
+	pthread_cond_broadcast(&gpriv->listen_cond);
+	pthread_mutex_unlock(&gpriv->listen_mutex);
+	/* If this misses the listener, new readers are watched after the next
+	 * event; until then presence_cache_time still bounds the cache. */
+	gpriv->SCardCancel(gpriv->pcsc_listen_ctx);
+	return;
+
+err_ctx:
+	gpriv->SCardReleaseContext(gpriv->pcsc_listen_ctx);
+err:
+	for (i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+}
+
+static void pcsc_listen_stop(struct pcsc_global_private_data *gpriv)
+{
+	size_t i;
+
+	if (!gpriv->listen_running)
+		return;
+	pthread_mutex_lock(&gpriv->listen_mutex);
+	gpriv->listen_stop = 1;
+	pthread_cond_broadcast(&gpriv->listen_cond);
+	/* The thread may not be in SCardGetStatusChange() yet: keep cancelling */
+	while (!gpriv->listen_exited) {
+		pthread_mutex_unlock(&gpriv->listen_mutex);
+		gpriv->SCardCancel(gpriv->pcsc_listen_ctx);
+		pthread_mutex_lock(&gpriv->listen_mutex);
+		if (!gpriv->listen_exited)
+			pcsc_listen_pause(gpriv, 100);
+	}
+	pthread_mutex_unlock(&gpriv->listen_mutex);
+	pthread_join(gpriv->listen_thread, NULL);
+
+	gpriv->SCardReleaseContext(gpriv->pcsc_listen_ctx);
+	pthread_cond_destroy(&gpriv->listen_cond);
+	pthread_mutex_destroy(&gpriv->listen_mutex);
+	for (i = 0; i < gpriv->listen_count; i++)
+		free(gpriv->listen_names[i]);
+	free(gpriv->listen_names);
+	gpriv->listen_names = NULL;
+	gpriv->listen_count = 0;
+	gpriv->listen_running = 0;
+}
+
+static unsigned long pcsc_listen_gen(struct pcsc_global_private_data *gpriv)
+{
+	unsigned long gen;
+
+	pthread_mutex_lock(&gpriv->listen_mutex);
+	gen = gpriv->listen_gen;
+	pthread_mutex_unlock(&gpriv->listen_mutex);
+	return gen;
+}
+
+/* The last refresh_attributes() is still good */
+static int pcsc_presence_cached(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
+
+	if (!gpriv->listen_running || priv->presence_time == 0)
+		return 0;
+	if (_sc_stats_clock() - priv->presence_time >= gpriv->presence_cache_time * 1000ULL)
+		return 0;
+	return priv->presence_gen == pcsc_listen_gen(gpriv);
+}
+#endif
+
 static int pcsc_detect_card_presence(sc_reader_t *reader)
 {
 	int rv;
+#ifdef HAVE_PTHREAD
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	unsigned long gen = 0;
+#endif
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+#ifdef HAVE_PTHREAD
+	if (priv->gpriv->listen_running) {
+		if (pcsc_presence_cached(reader)) {
+			/* A change was reported by the call that refreshed */
+			reader->flags &= ~SC_READER_CARD_CHANGED;
+			SC_FUNC_RETURN(reader->ctx, SC_LOG_DEBUG_VERBOSE, reader->flags);
+		}
+		/* Taken before asking, so that a change meanwhile is not lost */
+		gen = pcsc_listen_gen(priv->gpriv);
+	}
+#endif
 	rv = refresh_attributes(reader);
 	if (rv != SC_SUCCESS)
 		SC_FUNC_RETURN(reader->ctx, SC_LOG_DEBUG_VERBOSE, rv);
+#ifdef HAVE_PTHREAD
+	if (priv->gpriv->listen_running) {
+		priv->presence_gen = gen;
+		priv->presence_time = _sc_stats_clock();
+	}
+#endif
 	SC_FUNC_RETURN(reader->ctx, SC_LOG_DEBUG_VERBOSE, reader->flags);
 }
 
@@ -491,12 +770,146 @@ static int pcsc_connect(sc_reader_t *reader)
 	return SC_SUCCESS;
 }
 
+#ifdef HAVE_PTHREAD
+/*
+ * With transaction_hold_time set, pcsc_unlock() does not end the PC/SC
+ * transaction but only marks it as held. If the reader is locked again
+ * within the hold time the transaction is reused without a round trip to
+ * the resource manager, otherwise the hold thread of the reader ends it.
+ */
+static int pcsc_hold_expired(const struct timespec *until)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	if (tv.tv_sec != until->tv_sec)
+		return tv.tv_sec > until->tv_sec;
+	return tv.tv_usec * 1000 >= until->tv_nsec;
+}
+
+/* End a held transaction, called with hold_mutex locked */
+static void pcsc_hold_end(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	LONG rv;
+
+	if (!priv->held)
+		return;
+	rv = priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
+	if (rv != SCARD_S_SUCCESS)
+		PCSC_TRACE(reader, "SCardEndTransaction failed", rv);
+	priv->held = 0;
+	priv->locked = 0;
+}
+
+static void *pcsc_hold_thread(void *arg)
+{
+	sc_reader_t *reader = (sc_reader_t *) arg;
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+
+	pthread_mutex_lock(&priv->hold_mutex);
+	while (!priv->hold_stop) {
+		if (!priv->held)
+			pthread_cond_wait(&priv->hold_cond, &priv->hold_mutex);
+		else if (pthread_cond_timedwait(&priv->hold_cond, &priv->hold_mutex, &priv->hold_until) == ETIMEDOUT
+				&& priv->held && pcsc_hold_expired(&priv->hold_until))
+			pcsc_hold_end(reader);
+	}
+	pthread_mutex_unlock(&priv->hold_mutex);
+	return NULL;
+}
+
+static int pcsc_hold_start(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+
+	if (priv->hold_thread_running)
+		return SC_SUCCESS;
+	if (pthread_mutex_init(&priv->hold_mutex, NULL) != 0)
+		return SC_ERROR_INTERNAL;
+	if (pthread_cond_init(&priv->hold_cond, NULL) != 0) {
+		pthread_mutex_destroy(&priv->hold_mutex);
+		return SC_ERROR_INTERNAL;
+	}
+	priv->hold_stop = 0;
+	priv->held = 0;
+	if (pthread_create(&priv->hold_thread, NULL, pcsc_hold_thread, reader) != 0) {
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "%s: cannot start transaction hold thread", reader->name);
+		pthread_cond_destroy(&priv->hold_cond);
+		pthread_mutex_destroy(&priv->hold_mutex);
+		return SC_ERROR_INTERNAL;
+	}
+	priv->hold_thread_running = 1;
+	return SC_SUCCESS;
+}
+
+/* End a held transaction and stop the hold thread */
+static void pcsc_hold_stop(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+
+	if (!priv->hold_thread_running)
+		return;
+	pthread_mutex_lock(&priv->hold_mutex);
+	priv->hold_stop = 1;
+	pthread_cond_signal(&priv->hold_cond);
+	pthread_mutex_unlock(&priv->hold_mutex);
+	pthread_join(priv->hold_thread, NULL);
+
+	pcsc_hold_end(reader);
+	pthread_cond_destroy(&priv->hold_cond);
+	pthread_mutex_destroy(&priv->hold_mutex);
+	priv->hold_thread_running = 0;
+}
+
+/* Take over a held transaction, returns 1 if there was one */
+static int pcsc_hold_reuse(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	int held;
+
+	if (!priv->hold_thread_running)
+		return 0;
+	pthread_mutex_lock(&priv->hold_mutex);
+	held = priv->held;
+	priv->held = 0;
+	pthread_mutex_unlock(&priv->hold_mutex);
+	return held;
+}
+
+/* Keep the transaction for transaction_hold_time ms, returns 1 on success */
+static int pcsc_hold(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	unsigned int ms = priv->gpriv->transaction_hold_time;
+	struct timeval tv;
+
+	if (pcsc_hold_start(reader) != SC_SUCCESS)
+		return 0;
+	pthread_mutex_lock(&priv->hold_mutex);
+	gettimeofday(&tv, NULL);
+	priv->hold_until.tv_sec = tv.tv_sec + ms / 1000;
+	priv->hold_until.tv_nsec = tv.tv_usec * 1000 + (ms % 1000) * 1000000;
+	if (priv->hold_until.tv_nsec >= 1000000000) {
+		priv->hold_until.tv_sec++;
+		priv->hold_until.tv_nsec -= 1000000000;
+	}
+	priv->held = 1;
+	pthread_cond_signal(&priv->hold_cond);
+	pthread_mutex_unlock(&priv->hold_mutex);
+	return 1;
+}
+#endif
+
 static int pcsc_disconnect(sc_reader_t * reader)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+#ifdef HAVE_PTHREAD
+	pcsc_hold_stop(reader);
+#endif
 	priv->gpriv->SCardDisconnect(priv->pcsc_card, priv->gpriv->disconnect_action);
 	reader->flags = 0;
 	return SC_SUCCESS;
@@ -510,6 +923,14 @@ static int pcsc_lock(sc_reader_t *reader)
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+#ifdef HAVE_PTHREAD
+	if (pcsc_hold_reuse(reader)) {
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "%s: reusing held transaction", reader->name);
+		reader->transaction_kept = 1;
+		return SC_SUCCESS;
+	}
+#endif
+	reader->transaction_kept = 0;
 	rv = priv->gpriv->SCardBeginTransaction(priv->pcsc_card);
 
 	switch (rv) {
@@ -547,6 +968,10 @@ static int pcsc_unlock(sc_reader_t *reader)
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+#ifdef HAVE_PTHREAD
+	if (priv->gpriv->transaction_hold_time && priv->locked && pcsc_hold(reader))
+		return SC_SUCCESS;
+#endif
 	rv = priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
 
 	priv->locked = 0;
@@ -561,6 +986,9 @@ static int pcsc_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
+#ifdef HAVE_PTHREAD
+	pcsc_hold_stop(reader);
+#endif
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -612,7 +1040,7 @@ static struct sc_reader_driver pcsc_drv = {
 	"PC/SC reader",
 	"pcsc",
 	&pcsc_ops,
-	0, 0, NULL
+	0, 0, NULL, 0
 };
 
 static int pcsc_init(sc_context_t *ctx)
@@ -634,6 +1062,8 @@ static int pcsc_init(sc_context_t *ctx)
 	gpriv->transaction_end_action = SCARD_LEAVE_CARD;
 	gpriv->reconnect_action = SCARD_LEAVE_CARD;
 	gpriv->enable_pinpad = 1;
+	gpriv->transaction_hold_time = 0;
+	gpriv->presence_cache_time = 0;
 	gpriv->provider_library = DEFAULT_PCSC_PROVIDER;
 	gpriv->pcsc_ctx = -1;
 	gpriv->pcsc_wait_ctx = -1;
@@ -652,9 +1082,18 @@ static int pcsc_init(sc_context_t *ctx)
 		    scconf_get_bool(conf_block, "enable_pinpad", gpriv->enable_pinpad);
 		gpriv->provider_library =
 		    scconf_get_str(conf_block, "provider_library", gpriv->provider_library);
-	}
-	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "PC/SC options: connect_exclusive=%d disconnect_action=%d transaction_end_action=%d reconnect_action=%d enable_pinpad=%d",
-		gpriv->connect_exclusive, gpriv->disconnect_action, gpriv->transaction_end_action, gpriv->reconnect_action, gpriv->enable_pinpad);
+		gpriv->transaction_hold_time =
+		    scconf_get_int(conf_block, "transaction_hold_time", gpriv->transaction_hold_time);
+		gpriv->presence_cache_time =
+		    scconf_get_int(conf_block, "presence_cache_time", gpriv->presence_cache_time);
+	}
+#ifndef HAVE_PTHREAD
+	gpriv->transaction_hold_time = 0;
+	gpriv->presence_cache_time = 0;
+#endif
+	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "PC/SC options: connect_exclusive=%d disconnect_action=%d transaction_end_action=%d reconnect_action=%d enable_pinpad=%d transaction_hold_time=%u presence_cache_time=%u",
+		gpriv->connect_exclusive, gpriv->disconnect_action, gpriv->transaction_end_action, gpriv->reconnect_action, gpriv->enable_pinpad, gpriv->transaction_hold_time,
+		gpriv->presence_cache_time);
 
 	gpriv->dlhandle = sc_dlopen(gpriv->provider_library);
 	if (gpriv->dlhandle == NULL) {
@@ -736,6 +1175,9 @@ static int pcsc_finish(sc_context_t *ctx)
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
 
 	if (gpriv) {
+#ifdef HAVE_PTHREAD
+		pcsc_listen_stop(gpriv);
+#endif
 		if (gpriv->pcsc_ctx != -1)
 			gpriv->SCardReleaseContext(gpriv->pcsc_ctx);
 		if (gpriv->dlhandle != NULL)
@@ -1014,6 +1456,10 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 	}
 
 	ret = SC_SUCCESS;
+#ifdef HAVE_PTHREAD
+	if (gpriv->presence_cache_time)
+		pcsc_listen_update(ctx);
+#endif
 
 out:
 
@@ -1685,7 +2131,7 @@ static struct sc_reader_driver cardmod_drv = {
 	"PC/SC cardmod reader",
 	"cardmod",
 	&cardmod_ops,
-	0, 0, NULL
+	0, 0, NULL, 0
 };
 
 static int cardmod_init(sc_context_t *ctx)
@@ -0,0 +1,1021 @@
+/*
+ * reader-virtual.c: in-process reader with emulated cards
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Each reader holds an ISO 7816-4 card emulated from a card image, a
+ * directory laid out like this:
+ *
+ *   atr             the ATR, in hex (optional)
+ *   3F00/           the MF; DFs are directories and EFs are files, all
+ *   3F00/2F00       named by their file ID in hex
+ *   3F00/5015/.aid  DF name of the DF, in hex, for SELECT by name
+ *   pins/01         value of the PIN with reference 01
+ *   keys/01.pem     private key with reference 01 (needs OpenSSL)
+ *
+ * The card understands SELECT, READ and UPDATE BINARY, GET RESPONSE,
+ * GET CHALLENGE, VERIFY, and with OpenSSL MSE SET and PSO COMPUTE
+ * DIGITAL SIGNATURE / DECIPHER with RSA keys. A key can only be used
+ * once the PIN with the same reference, or any PIN if there is none
+ * such, has been verified. The image is read again on every connect,
+ * so whatever was written to the card is forgotten.
+ *
+ * src/tests/regression/virtual-card is a sample image.
+ *
+ * Every APDU is delayed by the configured latency plus the time its
+ * bytes would take on a T=0 or T=1 link of the configured speed.
+ */
+
+#include "config.h"
+
+#ifndef _WIN32	/* empty file on Windows */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef ENABLE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#endif
+
+#include "internal.h"
+
+#define VCARD_DEFAULT_ATR	"3B:80:80:01:01"
+#define VCARD_MAX_TRIES		3
+
+struct vcard_file {
+	u8 fid[2];
+	int is_df;
+	u8 *data;
+	size_t len;
+	u8 name[16];
+	size_t name_len;
+	struct vcard_file *parent;
+	struct vcard_file *children;
+	struct vcard_file *next;
+};
+
+struct vcard_pin {
+	u8 value[32];
+	size_t len;
+	int tries;
+	int verified;
+};
+
+struct vcard_cmd {
+	u8 cla, ins, p1, p2;
+	const u8 *data;
+	size_t lc;
+	size_t le;
+	int has_le;
+};
+
+struct virtual_global_private_data {
+	unsigned int latency;		/* us per APDU */
+	unsigned int baud_rate;		/* 0 for no transfer time */
+	unsigned int protocol;
+	volatile int cancelled;
+};
+
+struct virtual_private_data {
+	struct virtual_global_private_data *gpriv;
+	char *image;
+	int seen;
+
+	/* card state, valid while connected */
+	struct vcard_file *mf;
+	struct vcard_file *cur_df;
+	struct vcard_file *cur_ef;
+	struct vcard_pin *pins[256];
+	unsigned int key_ref;
+	unsigned long rng;
+	u8 *pending;			/* T=0 data left for GET RESPONSE */
+	size_t pending_len, pending_off;
+#ifdef ENABLE_OPENSSL
+	EVP_PKEY *keys[256];		/* loaded on first use */
+#endif
+	u8 resp[SC_MAX_EXT_APDU_BUFFER_SIZE + 2];
+};
+
+static struct sc_reader_operations virtual_ops;
+
+static struct sc_reader_driver virtual_drv = {
+	"Virtual card reader",
+	"virtual",
+	&virtual_ops,
+	0, 0, NULL, 0
+};
+
+#define GET_PRIV_DATA(r) ((struct virtual_private_data *) (r)->drv_data)
+
+/* Read a whole file; *len is the size */
+static u8 *vcard_read_file(const char *path, size_t *len)
+{
+	FILE *f;
+	struct stat st;
+	u8 *buf;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return NULL;
+	if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)) {
+		fclose(f);
+		return NULL;
+	}
+	buf = malloc(st.st_size ? st.st_size : 1);
+	if (buf != NULL && fread(buf, 1, st.st_size, f) != (size_t)st.st_size) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	*len = st.st_size;
+	return buf;
+}
+
+/* Read a small text file holding hex, e.g. the ATR or a DF name */
+static int vcard_read_hex(const char *path, u8 *out, size_t *outlen)
+{
+	char text[3 * SC_MAX_ATR_SIZE + 16];
+	u8 *data;
+	size_t len;
+	int r;
+
+	data = vcard_read_file(path, &len);
+	if (data == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (len >= sizeof(text))
+		len = sizeof(text) - 1;
+	memcpy(text, data, len);
+	free(data);
+	while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r' || text[len - 1] == ' '))
+		len--;
+	text[len] = '\0';
+	r = sc_hex_to_bin(text, out, outlen);
+	return r;
+}
+
+static int vcard_parse_fid(const char *name, u8 fid[2])
+{
+	size_t len = 2;
+
+	if (strlen(name) != 4 || sc_hex_to_bin(name, fid, &len) != SC_SUCCESS || len != 2)
+		return -1;
+	return 0;
+}
+
+static void vcard_free_tree(struct vcard_file *file)
+{
+	struct vcard_file *child, *next;
+
+	if (file == NULL)
+		return;
+	for (child = file->children; child != NULL; child = next) {
+		next = child->next;
+		vcard_free_tree(child);
+	}
+	free(file->data);
+	free(file);
+}
+
+static struct vcard_file *vcard_load_tree(sc_context_t *ctx, const char *path,
+		const u8 fid[2], struct vcard_file *parent)
+{
+	struct vcard_file *file, *child;
+	struct dirent *ent;
+	struct stat st;
+	char sub[PATH_MAX];
+	u8 cfid[2];
+	DIR *dir;
+
+	if (stat(path, &st) != 0)
+		return NULL;
+	file = calloc(1, sizeof(struct vcard_file));
+	if (file == NULL)
+		return NULL;
+	memcpy(file->fid, fid, 2);
+	file->parent = parent;
+
+	if (!S_ISDIR(st.st_mode)) {
+		file->data = vcard_read_file(path, &file->len);
+		if (file->data == NULL) {
+			free(file);
+			return NULL;
+		}
+		return file;
+	}
+
+	file->is_df = 1;
+	snprintf(sub, sizeof(sub), "%s/.aid", path);
+	file->name_len = sizeof(file->name);
+	if (vcard_read_hex(sub, file->name, &file->name_len) != SC_SUCCESS)
+		file->name_len = 0;
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		free(file);
+		return NULL;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		if (vcard_parse_fid(ent->d_name, cfid) != 0)
+			continue;
+		snprintf(sub, sizeof(sub), "%s/%s", path, ent->d_name);
+		child = vcard_load_tree(ctx, sub, cfid, file);
+		if (child == NULL) {
+			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "cannot load %s", sub);
+			continue;
+		}
+		child->next = file->children;
+		file->children = child;
+	}
+	closedir(dir);
+	return file;
+}
+
+static void vcard_free(struct virtual_private_data *priv)
+{
+	int i;
+
+	vcard_free_tree(priv->mf);
+	priv->mf = priv->cur_df = priv->cur_ef = NULL;
+	for (i = 0; i < 256; i++) {
+		if (priv->pins[i] != NULL)
+			sc_mem_clear(priv->pins[i], sizeof(struct vcard_pin));
+		free(priv->pins[i]);
+		priv->pins[i] = NULL;
+#ifdef ENABLE_OPENSSL
+		if (priv->keys[i] != NULL)
+			EVP_PKEY_free(priv->keys[i]);
+		priv->keys[i] = NULL;
+#endif
+	}
+	free(priv->pending);
+	priv->pending = NULL;
+	priv->pending_len = priv->pending_off = 0;
+}
+
+static int vcard_load(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+	static const u8 mf_fid[2] = { 0x3F, 0x00 };
+	char path[PATH_MAX];
+	u8 *data;
+	size_t len;
+	int i;
+
+	vcard_free(priv);
+	snprintf(path, sizeof(path), "%s/3F00", priv->image);
+	priv->mf = vcard_load_tree(reader->ctx, path, mf_fid, NULL);
+	if (priv->mf == NULL || !priv->mf->is_df) {
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "%s: no MF in card image", priv->image);
+		return SC_ERROR_CARD_NOT_PRESENT;
+	}
+	priv->cur_df = priv->mf;
+
+	for (i = 0; i < 256; i++) {
+		snprintf(path, sizeof(path), "%s/pins/%02X", priv->image, i);
+		data = vcard_read_file(path, &len);
+		if (data == NULL) {
+			snprintf(path, sizeof(path), "%s/pins/%02x", priv->image, i);
+			data = vcard_read_file(path, &len);
+		}
+		if (data == NULL)
+			continue;
+		while (len > 0 && (data[len - 1] == '\n' || data[len - 1] == '\r'))
+			len--;
+		priv->pins[i] = calloc(1, sizeof(struct vcard_pin));
+		if (priv->pins[i] != NULL) {
+			if (len > sizeof(priv->pins[i]->value))
+				len = sizeof(priv->pins[i]->value);
+			memcpy(priv->pins[i]->value, data, len);
+			priv->pins[i]->len = len;
+			priv->pins[i]->tries = VCARD_MAX_TRIES;
+		}
+		sc_mem_clear(data, len);
+		free(data);
+	}
+	/* the same challenges on every run */
+	priv->rng = 0x2545F4914F6CDD1DUL;
+	priv->key_ref = 0;
+	return SC_SUCCESS;
+}
+
+static int vcard_parse_cmd(const u8 *buf, size_t len, struct vcard_cmd *c)
+{
+	const u8 *body = buf + 4;
+	size_t n = len - 4;
+
+	if (len < 4)
+		return -1;
+	memset(c, 0, sizeof(*c));
+	c->cla = buf[0];
+	c->ins = buf[1];
+	c->p1 = buf[2];
+	c->p2 = buf[3];
+	if (n == 0)
+		return 0;
+	if (n == 1) {
+		c->le = body[0] ? body[0] : 256;
+		c->has_le = 1;
+		return 0;
+	}
+	if (body[0] != 0) {
+		c->lc = body[0];
+		c->data = body + 1;
+		if (n == 1 + c->lc)
+			return 0;
+		if (n != 2 + c->lc)
+			return -1;
+		c->le = body[1 + c->lc] ? body[1 + c->lc] : 256;
+		c->has_le = 1;
+		return 0;
+	}
+	/* extended length */
+	if (n == 3) {
+		c->le = (body[1] << 8) | body[2];
+		if (c->le == 0)
+			c->le = 65536;
+		c->has_le = 1;
+		return 0;
+	}
+	c->lc = (body[1] << 8) | body[2];
+	c->data = body + 3;
+	if (c->lc == 0)
+		return -1;
+	if (n == 3 + c->lc)
+		return 0;
+	if (n != 5 + c->lc)
+		return -1;
+	c->le = (body[3 + c->lc] << 8) | body[4 + c->lc];
+	if (c->le == 0)
+		c->le = 65536;
+	c->has_le = 1;
+	return 0;
+}
+
+static size_t vcard_sw(u8 *resp, unsigned int sw1, unsigned int sw2)
+{
+	resp[0] = (u8)sw1;
+	resp[1] = (u8)sw2;
+	return 2;
+}
+
+/* Answer with data, the way a T=0 or T=1 card would */
+static size_t vcard_reply(struct virtual_private_data *priv, const struct vcard_cmd *c,
+		const u8 *data, size_t len, u8 *resp)
+{
+	if (priv->gpriv->protocol == SC_PROTO_T0 && len > 0) {
+		if (!c->has_le) {
+			/* case 4: the data has to be fetched */
+			free(priv->pending);
+			priv->pending = malloc(len);
+			if (priv->pending == NULL)
+				return vcard_sw(resp, 0x6F, 0x00);
+			memcpy(priv->pending, data, len);
+			priv->pending_len = len;
+			priv->pending_off = 0;
+			return vcard_sw(resp, 0x61, len > 255 ? 0x00 : len);
+		}
+		if (c->le != len && len < c->le && len < 256)
+			return vcard_sw(resp, 0x6C, len);
+	}
+	if (c->has_le && len > c->le)
+		len = c->le;
+	/* without Le (T=1) the card sends what fits into its buffer */
+	if (len > SC_MAX_EXT_APDU_BUFFER_SIZE)
+		len = SC_MAX_EXT_APDU_BUFFER_SIZE;
+	memcpy(resp, data, len);
+	return len + vcard_sw(resp + len, 0x90, 0x00);
+}
+
+static size_t vcard_fci(const struct vcard_file *file, u8 tag, u8 *out)
+{
+	u8 *p = out + 2;
+
+	*p++ = 0x83;
+	*p++ = 2;
+	*p++ = file->fid[0];
+	*p++ = file->fid[1];
+	*p++ = 0x82;
+	*p++ = 1;
+	*p++ = file->is_df ? 0x38 : 0x01;
+	if (!file->is_df) {
+		*p++ = 0x80;
+		*p++ = 2;
+		*p++ = (u8)(file->len >> 8);
+		*p++ = (u8)file->len;
+	}
+	if (file->name_len) {
+		*p++ = 0x84;
+		*p++ = (u8)file->name_len;
+		memcpy(p, file->name, file->name_len);
+		p += file->name_len;
+	}
+	out[0] = tag;
+	out[1] = (u8)(p - out - 2);
+	return p - out;
+}
+
+static struct vcard_file *vcard_child(const struct vcard_file *df, const u8 *fid, int want)
+{
+	struct vcard_file *f;
+
+	if (df == NULL)
+		return NULL;
+	for (f = df->children; f != NULL; f = f->next)
+		if (!memcmp(f->fid, fid, 2) && (want < 0 || f->is_df == want))
+			return f;
+	return NULL;
+}
+
+static struct vcard_file *vcard_find_name(struct vcard_file *df, const u8 *name, size_t len)
+{
+	struct vcard_file *f, *found;
+
+	if (df->name_len == len && !memcmp(df->name, name, len))
+		return df;
+	for (f = df->children; f != NULL; f = f->next) {
+		if (f->is_df && (found = vcard_find_name(f, name, len)) != NULL)
+			return found;
+	}
+	return NULL;
+}
+
+static size_t vcard_select(struct virtual_private_data *priv, const struct vcard_cmd *c, u8 *resp)
+{
+	struct vcard_file *f = NULL;
+	u8 fci[64];
+	size_t i;
+
+	switch (c->p1) {
+	case 0x00:
+		if (c->lc == 0 || (c->lc == 2 && c->data[0] == 0x3F && c->data[1] == 0x00)) {
+			f = priv->mf;
+			break;
+		}
+		if (c->lc != 2)
+			return vcard_sw(resp, 0x67, 0x00);
+		f = vcard_child(priv->cur_df, c->data, -1);
+		if (f == NULL && priv->cur_df->parent != NULL) {
+			if (!memcmp(priv->cur_df->parent->fid, c->data, 2))
+				f = priv->cur_df->parent;
+			else
+				f = vcard_child(priv->cur_df->parent, c->data, -1);
+		}
+		break;
+	case 0x01:
+	case 0x02:
+		if (c->lc != 2)
+			return vcard_sw(resp, 0x67, 0x00);
+		f = vcard_child(priv->cur_df, c->data, c->p1 == 0x01);
+		break;
+	case 0x03:
+		f = priv->cur_df->parent;
+		break;
+	case 0x04:
+		if (c->lc == 0 || c->lc > sizeof(f->name))
+			return vcard_sw(resp, 0x6A, 0x82);
+		f = vcard_find_name(priv->mf, c->data, c->lc);
+		break;
+	case 0x08:
+	case 0x09:
+		if (c->lc == 0 || c->lc % 2)
+			return vcard_sw(resp, 0x67, 0x00);
+		f = c->p1 == 0x08 ? priv->mf : priv->cur_df;
+		for (i = 0; f != NULL && i < c->lc; i += 2) {
+			if (i == 0 && c->p1 == 0x08 && c->data[0] == 0x3F && c->data[1] == 0x00)
+				continue;
+			f = vcard_child(f, c->data + i, -1);
+		}
+		break;
+	default:
+		return vcard_sw(resp, 0x6A, 0x86);
+	}
+	if (f == NULL)
+		return vcard_sw(resp, 0x6A, 0x82);
+
+	if (f->is_df) {
+		priv->cur_df = f;
+		priv->cur_ef = NULL;
+	} else {
+		priv->cur_df = f->parent;
+		priv->cur_ef = f;
+	}
+	if ((c->p2 & 0x0C) == 0x0C)
+		return vcard_sw(resp, 0x90, 0x00);
+	return vcard_reply(priv, c, fci, vcard_fci(f, (c->p2 & 0x0C) == 0x04 ? 0x62 : 0x6F, fci), resp);
+}
+
+static size_t vcard_binary(struct virtual_private_data *priv, const struct vcard_cmd *c, u8 *resp)
+{
+	struct vcard_file *ef = priv->cur_ef;
+	size_t off;
+
+	if (c->p1 & 0x80)
+		return vcard_sw(resp, 0x6A, 0x81);	/* no short EF identifiers */
+	if (ef == NULL)
+		return vcard_sw(resp, 0x69, 0x86);
+	off = (c->p1 << 8) | c->p2;
+
+	if (c->ins == 0xB0) {
+		if (off >= ef->len)
+			return vcard_sw(resp, 0x6B, 0x00);
+		return vcard_reply(priv, c, ef->data + off, ef->len - off, resp);
+	}
+	/* UPDATE BINARY, kept until the next connect */
+	if (off + c->lc > ef->len)
+		return vcard_sw(resp, 0x6B, 0x00);
+	memcpy(ef->data + off, c->data, c->lc);
+	return vcard_sw(resp, 0x90, 0x00);
+}
+
+static size_t vcard_get_response(struct virtual_private_data *priv, const struct vcard_cmd *c, u8 *resp)
+{
+	size_t len, left;
+
+	if (priv->pending == NULL)
+		return vcard_sw(resp, 0x6F, 0x00);
+	left = priv->pending_len - priv->pending_off;
+	len = c->le < left ? c->le : left;
+	memcpy(resp, priv->pending + priv->pending_off, len);
+	priv->pending_off += len;
+	left -= len;
+	if (left == 0) {
+		free(priv->pending);
+		priv->pending = NULL;
+		return len + vcard_sw(resp + len, 0x90, 0x00);
+	}
+	return len + vcard_sw(resp + len, 0x61, left > 255 ? 0x00 : left);
+}
+
+static size_t vcard_get_challenge(struct virtual_private_data *priv, const struct vcard_cmd *c, u8 *resp)
+{
+	u8 buf[256];
+	size_t i, len = c->le > sizeof(buf) ? sizeof(buf) : c->le;
+
+	for (i = 0; i < len; i++) {
+		/* xorshift */
+		priv->rng ^= priv->rng << 13;
+		priv->rng ^= priv->rng >> 7;
+		priv->rng ^= priv->rng << 17;
+		buf[i] = (u8)(priv->rng >> 24);
+	}
+	return vcard_reply(priv, c, buf, len, resp);
+}
+
+static size_t vcard_unpad(const u8 *pin, size_t len)
+{
+	while (len > 0 && (pin[len - 1] == 0xFF || pin[len - 1] == 0x00))
+		len--;
+	return len;
+}
+
+static size_t vcard_verify(struct virtual_private_data *priv, const struct vcard_cmd *c, u8 *resp)
+{
+	struct vcard_pin *pin = priv->pins[c->p2];
+	size_t len;
+
+	if (pin == NULL)
+		return vcard_sw(resp, 0x6A, 0x88);
+	if (pin->tries == 0)
+		return vcard_sw(resp, 0x69, 0x83);
+	if (c->lc == 0) {
+		if (pin->verified)
+			return vcard_sw(resp, 0x90, 0x00);
+		return vcard_sw(resp, 0x63, 0xC0 | pin->tries);
+	}
+	len = vcard_unpad(c->data, c->lc);
+	if (len == vcard_unpad(pin->value, pin->len) && !memcmp(c->data, pin->value, len)) {
+		pin->tries = VCARD_MAX_TRIES;
+		pin->verified = 1;
+		return vcard_sw(resp, 0x90, 0x00);
+	}
+	pin->verified = 0;
+	if (--pin->tries == 0)
+		return vcard_sw(resp, 0x69, 0x83);
+	return vcard_sw(resp, 0x63, 0xC0 | pin->tries);
+}
+
+static size_t vcard_mse(struct virtual_private_data *priv, const struct vcard_cmd *c, u8 *resp)
+{
+	size_t i;
+
+	for (i = 0; i + 2 <= c->lc; i += 2 + c->data[i + 1]) {
+		if (i + 2 + c->data[i + 1] > c->lc)
+			return vcard_sw(resp, 0x6A, 0x80);
+		if ((c->data[i] == 0x83 || c->data[i] == 0x84) && c->data[i + 1] > 0)
+			priv->key_ref = c->data[i + 1 + c->data[i + 1]];
+	}
+	return vcard_sw(resp, 0x90, 0x00);
+}
+
+#ifdef ENABLE_OPENSSL
+/* Whether the PIN guarding a key has been verified */
+static int vcard_key_allowed(struct virtual_private_data *priv, unsigned int key_ref)
+{
+	int i, any = 0;
+
+	if (priv->pins[key_ref] != NULL)
+		return priv->pins[key_ref]->verified;
+	for (i = 0; i < 256; i++) {
+		if (priv->pins[i] == NULL)
+			continue;
+		if (priv->pins[i]->verified)
+			return 1;
+		any = 1;
+	}
+	return !any;
+}
+
+static EVP_PKEY *vcard_key(struct virtual_private_data *priv, unsigned int key_ref)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	if (priv->keys[key_ref] != NULL)
+		return priv->keys[key_ref];
+	snprintf(path, sizeof(path), "%s/keys/%02X.pem", priv->image, key_ref);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		snprintf(path, sizeof(path), "%s/keys/%02x.pem", priv->image, key_ref);
+		f = fopen(path, "r");
+	}
+	if (f == NULL)
+		return NULL;
+	priv->keys[key_ref] = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+	fclose(f);
+	return priv->keys[key_ref];
+}
+
+static size_t vcard_pso(struct virtual_private_data *priv, const struct vcard_cmd *c, u8 *resp)
+{
+	EVP_PKEY *pkey;
+	RSA *rsa;
+	const u8 *in = c->data;
+	size_t inlen = c->lc;
+	u8 out[512];
+	int r = -1, pad;
+	size_t ret;
+
+	if (!((c->p1 == 0x9E && c->p2 == 0x9A) || (c->p1 == 0x80 && c->p2 == 0x86)))
+		return vcard_sw(resp, 0x6A, 0x86);
+	if ((pkey = vcard_key(priv, priv->key_ref)) == NULL)
+		return vcard_sw(resp, 0x6A, 0x88);
+	if (!vcard_key_allowed(priv, priv->key_ref))
+		return vcard_sw(resp, 0x69, 0x82);
+	if ((rsa = EVP_PKEY_get1_RSA(pkey)) == NULL)
+		return vcard_sw(resp, 0x6A, 0x81);
+
+	if (c->p1 == 0x9E) {
+		/* padded by the host when the data fills the modulus */
+		pad = inlen == (size_t)RSA_size(rsa) ? RSA_NO_PADDING : RSA_PKCS1_PADDING;
+		if ((size_t)RSA_size(rsa) <= sizeof(out))
+			r = RSA_private_encrypt(inlen, in, out, rsa, pad);
+	} else {
+		/* skip the padding indicator */
+		if (inlen > 0 && inlen == (size_t)RSA_size(rsa) + 1) {
+			in++;
+			inlen--;
+		}
+		if ((size_t)RSA_size(rsa) <= sizeof(out))
+			r = RSA_private_decrypt(inlen, in, out, rsa, RSA_NO_PADDING);
+	}
+	if (r < 0)
+		ret = vcard_sw(resp, 0x6A, 0x80);
+	else
+		ret = vcard_reply(priv, c, out, r, resp);
+	sc_mem_clear(out, sizeof(out));
+	RSA_free(rsa);
+	return ret;
+}
+#endif
+
+static size_t vcard_process(struct virtual_private_data *priv, const u8 *cmd, size_t len, u8 *resp)
+{
+	struct vcard_cmd c;
+
+	if (vcard_parse_cmd(cmd, len, &c) != 0)
+		return vcard_sw(resp, 0x67, 0x00);
+	if (c.cla & 0x80)
+		return vcard_sw(resp, 0x6E, 0x00);
+	/* anything but GET RESPONSE drops what was left to fetch */
+	if (c.ins != 0xC0 && priv->pending != NULL) {
+		free(priv->pending);
+		priv->pending = NULL;
+	}
+
+	switch (c.ins) {
+	case 0xA4:
+		return vcard_select(priv, &c, resp);
+	case 0xB0:
+	case 0xD6:
+		return vcard_binary(priv, &c, resp);
+	case 0xC0:
+		return vcard_get_response(priv, &c, resp);
+	case 0x84:
+		return vcard_get_challenge(priv, &c, resp);
+	case 0x20:
+		return vcard_verify(priv, &c, resp);
+	case 0x22:
+		return vcard_mse(priv, &c, resp);
+#ifdef ENABLE_OPENSSL
+	case 0x2A:
+		return vcard_pso(priv, &c, resp);
+#endif
+	}
+	return vcard_sw(resp, 0x6D, 0x00);
+}
+
+/* Time the exchange would have taken on a real reader */
+static void virtual_delay(struct virtual_global_private_data *gpriv, size_t sent, size_t received)
+{
+	unsigned long long usec = gpriv->latency;
+	struct timespec ts;
+
+	if (gpriv->baud_rate) {
+		/* 12 etu per character on T=0, 11 etu plus the block
+		 * prologue and epilogue on T=1 */
+		unsigned int etu = 12;
+
+		if (gpriv->protocol == SC_PROTO_T1) {
+			etu = 11;
+			sent += 4;
+			received += 4;
+		}
+		usec += (unsigned long long)(sent + received) * etu * 1000000 / gpriv->baud_rate;
+	}
+	if (usec == 0)
+		return;
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+static int virtual_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+	size_t ssize = 0, rsize, full, rbuflen;
+	u8 *sbuf = NULL, *rbuf = NULL;
+	int r;
+
+	if (priv->mf == NULL)
+		return SC_ERROR_CARD_NOT_PRESENT;
+
+	rbuflen = apdu->resplen + 2;
+	r = _sc_reader_get_apdu_buf(reader, apdu, reader->active_protocol, &sbuf, &ssize, &rbuf, rbuflen);
+	if (r != SC_SUCCESS)
+		goto out;
+	if ((apdu->flags & SC_APDU_FLAGS_NO_LOG) == 0)
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+
+	rsize = vcard_process(priv, sbuf, ssize, priv->resp);
+	virtual_delay(priv->gpriv, ssize, rsize);
+	/* all of it is cleared below, even what is not handed back */
+	full = rsize;
+
+	/* like a reader, hand back no more than was asked for */
+	if (rsize > rbuflen) {
+		memcpy(rbuf, priv->resp, rbuflen - 2);
+		memcpy(rbuf + rbuflen - 2, priv->resp + rsize - 2, 2);
+		rsize = rbuflen;
+	} else {
+		memcpy(rbuf, priv->resp, rsize);
+	}
+	sc_mem_clear(priv->resp, full);
+	if ((apdu->flags & SC_APDU_FLAGS_NO_LOG) == 0)
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
+out:
+	_sc_reader_clear_apdu_buf(reader, ssize, rbuflen);
+	return r;
+}
+
+static int virtual_detect_card_presence(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+
+	reader->flags |= SC_READER_CARD_PRESENT;
+	if (!priv->seen) {
+		reader->flags |= SC_READER_CARD_CHANGED;
+		priv->seen = 1;
+	} else {
+		reader->flags &= ~SC_READER_CARD_CHANGED;
+	}
+	return reader->flags;
+}
+
+static int virtual_connect(sc_reader_t *reader)
+{
+	int r;
+
+	r = vcard_load(reader);
+	if (r != SC_SUCCESS)
+		return r;
+	reader->active_protocol = GET_PRIV_DATA(reader)->gpriv->protocol;
+	return SC_SUCCESS;
+}
+
+static int virtual_disconnect(sc_reader_t *reader)
+{
+	vcard_free(GET_PRIV_DATA(reader));
+	return SC_SUCCESS;
+}
+
+static int virtual_reset(sc_reader_t *reader, int do_cold_reset)
+{
+	(void)do_cold_reset;
+
+	/* back to the MF with all security states gone */
+	return vcard_load(reader);
+}
+
+static int virtual_lock(sc_reader_t *reader)
+{
+	(void)reader;
+	return SC_SUCCESS;
+}
+
+static int virtual_unlock(sc_reader_t *reader)
+{
+	(void)reader;
+	return SC_SUCCESS;
+}
+
+static int virtual_release(sc_reader_t *reader)
+{
+	struct virtual_private_data *priv = GET_PRIV_DATA(reader);
+
+	vcard_free(priv);
+	free(priv->image);
+	free(priv);
+	reader->drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+static int virtual_cancel(sc_context_t *ctx)
+{
+	struct virtual_global_private_data *gpriv = (struct virtual_global_private_data *) ctx->reader_drv_data;
+
+	if (gpriv != NULL)
+		gpriv->cancelled = 1;
+	return SC_SUCCESS;
+}
+
+/* Emulated cards are never removed: just wait for the timeout */
+static int virtual_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_reader_t **event_reader,
+		unsigned int *event, int timeout, void **reader_states)
+{
+	struct virtual_global_private_data *gpriv = (struct virtual_global_private_data *) ctx->reader_drv_data;
+	struct timespec ts;
+	int waited = 0;
+
+	(void)event_mask;
+	(void)event_reader;
+	(void)event;
+	(void)reader_states;
+
+	while (!gpriv->cancelled && (timeout < 0 || waited < timeout)) {
+		int step = timeout < 0 || timeout - waited > 100 ? 100 : timeout - waited;
+
+		ts.tv_sec = 0;
+		ts.tv_nsec = step * 1000000L;
+		nanosleep(&ts, NULL);
+		waited += step;
+	}
+	gpriv->cancelled = 0;
+	return SC_ERROR_EVENT_TIMEOUT;
+}
+
+static int virtual_add_reader(sc_context_t *ctx, const char *image, unsigned int n)
+{
+	struct virtual_global_private_data *gpriv = (struct virtual_global_private_data *) ctx->reader_drv_data;
+	struct virtual_private_data *priv;
+	sc_reader_t *reader;
+	const char *base;
+	char path[PATH_MAX], name[128];
+	size_t len;
+	int r;
+
+	reader = calloc(1, sizeof(sc_reader_t));
+	priv = calloc(1, sizeof(struct virtual_private_data));
+	if (reader == NULL || priv == NULL || (priv->image = strdup(image)) == NULL) {
+		free(reader);
+		free(priv);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	priv->gpriv = gpriv;
+
+	base = strrchr(image, '/');
+	base = base != NULL && base[1] != '\0' ? base + 1 : image;
+	snprintf(name, sizeof(name), "Virtual reader %u (%s)", n, base);
+	reader->name = strdup(name);
+	if (reader->name == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	reader->driver = &virtual_drv;
+	reader->ops = &virtual_ops;
+	reader->drv_data = priv;
+	reader->supported_protocols = gpriv->protocol;
+
+	snprintf(path, sizeof(path), "%s/atr", image);
+	len = sizeof(reader->atr.value);
+	if (vcard_read_hex(path, reader->atr.value, &len) != SC_SUCCESS || len == 0) {
+		len = sizeof(reader->atr.value);
+		sc_hex_to_bin(VCARD_DEFAULT_ATR, reader->atr.value, &len);
+	}
+	reader->atr.len = len;
+
+	r = _sc_add_reader(ctx, reader);
+	if (r == SC_SUCCESS)
+		return r;
+err:
+	free(reader->name);
+	free(reader);
+	free(priv->image);
+	free(priv);
+	return r;
+}
+
+static int virtual_init(sc_context_t *ctx)
+{
+	struct virtual_global_private_data *gpriv;
+	scconf_block *conf_block;
+	const scconf_list *list = NULL;
+	const char *proto;
+	unsigned int n = 0;
+
+	gpriv = calloc(1, sizeof(struct virtual_global_private_data));
+	if (gpriv == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	gpriv->protocol = SC_PROTO_T1;
+	ctx->reader_drv_data = gpriv;
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	if (conf_block != NULL) {
+		gpriv->latency = scconf_get_int(conf_block, "latency", gpriv->latency);
+		gpriv->baud_rate = scconf_get_int(conf_block, "baud_rate", gpriv->baud_rate);
+		proto = scconf_get_str(conf_block, "protocol", "t1");
+		if (!strcasecmp(proto, "t0"))
+			gpriv->protocol = SC_PROTO_T0;
+		list = scconf_find_list(conf_block, "images");
+	}
+	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "virtual reader options: latency=%u baud_rate=%u protocol=%s",
+		gpriv->latency, gpriv->baud_rate, gpriv->protocol == SC_PROTO_T0 ? "t0" : "t1");
+
+	for (; list != NULL; list = list->next)
+		if (virtual_add_reader(ctx, list->data, n) == SC_SUCCESS)
+			n++;
+	if (n == 0)
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "no card images configured");
+	return SC_SUCCESS;
+}
+
+static int virtual_finish(sc_context_t *ctx)
+{
+	free(ctx->reader_drv_data);
+	ctx->reader_drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+struct sc_reader_driver * sc_get_virtual_driver(void)
+{
+	virtual_ops.init = virtual_init;
+	virtual_ops.finish = virtual_finish;
+	virtual_ops.detect_readers = NULL;
+	virtual_ops.cancel = virtual_cancel;
+	virtual_ops.release = virtual_release;
+	virtual_ops.detect_card_presence = virtual_detect_card_presence;
+	virtual_ops.connect = virtual_connect;
+	virtual_ops.disconnect = virtual_disconnect;
+	virtual_ops.transmit = virtual_transmit;
+	virtual_ops.lock = virtual_lock;
+	virtual_ops.unlock = virtual_unlock;
+	virtual_ops.wait_for_event = virtual_wait_for_event;
+	virtual_ops.reset = virtual_reset;
+	virtual_ops.use_reader = NULL;
+
+	return &virtual_drv;
+}
+#endif
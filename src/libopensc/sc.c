@@ -145,6 +145,17 @@ unsigned short bebytes2ushort(const u8 *buf)
 	return (unsigned short) (buf[0] << 8 | buf[1]);
 }
 
+unsigned long long _sc_fnv64_update(unsigned long long h, const u8 *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= data[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
 int sc_format_oid(struct sc_object_id *oid, const char *in)
 {
 	int        ii;
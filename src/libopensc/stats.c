@@ -0,0 +1,198 @@
+/*
+ * stats.c: APDU statistics
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifndef HAVE_GETTIMEOFDAY
+#include <sys/timeb.h>
+#endif
+
+#include "internal.h"
+
+/* Microseconds since some fixed point in the past */
+unsigned long long _sc_stats_clock(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+	struct timeval tv;
+
+	if (gettimeofday(&tv, NULL) != 0)
+		return 0;
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	struct _timeb time_buf;
+
+	_ftime(&time_buf);
+	return (unsigned long long)time_buf.time * 1000000 + time_buf.millitm * 1000;
+#endif
+}
+
+static void stats_add_apdu(sc_stats_t *stats, u8 ins, size_t out_len, size_t in_len,
+		int r, unsigned long long usec)
+{
+	sc_ins_stats_t *is = &stats->ins[ins];
+	unsigned long long ms = usec / 1000;
+	int i;
+
+	stats->apdus++;
+	stats->usec += usec;
+	stats->bytes_out += out_len;
+	if (r != SC_SUCCESS) {
+		stats->errors++;
+		return;
+	}
+	stats->bytes_in += in_len;
+
+	is->count++;
+	is->usec += usec;
+	if (usec > is->usec_max)
+		is->usec_max = (unsigned int)usec;
+	for (i = 0; i < SC_STATS_LATENCY_BUCKETS - 1 && ms >= (1ULL << i); i++)
+		;
+	is->latency[i]++;
+}
+
+void _sc_stats_add_apdu(sc_card_t *card, u8 ins, size_t out_len, size_t in_len,
+		int r, unsigned long long usec)
+{
+	if (card->stats != NULL)
+		stats_add_apdu(card->stats, ins, out_len, in_len, r, usec);
+	if (card->reader->stats != NULL)
+		stats_add_apdu(card->reader->stats, ins, out_len, in_len, r, usec);
+}
+
+void _sc_stats_add_lock(sc_card_t *card, unsigned long long usec)
+{
+	_sc_stats_inc(card, locks);
+	if (card->stats != NULL)
+		card->stats->lock_usec += usec;
+	if (card->reader->stats != NULL)
+		card->reader->stats->lock_usec += usec;
+}
+
+int sc_reader_get_stats(sc_reader_t *reader, sc_stats_t *stats)
+{
+	if (reader == NULL || stats == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (reader->stats == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+	memcpy(stats, reader->stats, sizeof(*stats));
+	return SC_SUCCESS;
+}
+
+int sc_card_get_stats(sc_card_t *card, sc_stats_t *stats)
+{
+	if (card == NULL || stats == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (card->stats == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+	memcpy(stats, card->stats, sizeof(*stats));
+	return SC_SUCCESS;
+}
+
+int sc_ctx_get_stats(sc_context_t *ctx, sc_stats_t *stats)
+{
+	unsigned int i, j, k;
+
+	if (ctx == NULL || stats == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+		const sc_stats_t *rs = sc_ctx_get_reader(ctx, i)->stats;
+
+		if (rs == NULL)
+			continue;
+		stats->apdus += rs->apdus;
+		stats->errors += rs->errors;
+		stats->bytes_out += rs->bytes_out;
+		stats->bytes_in += rs->bytes_in;
+		stats->usec += rs->usec;
+		stats->get_response += rs->get_response;
+		stats->resend += rs->resend;
+		stats->select_cached += rs->select_cached;
+		stats->locks += rs->locks;
+		stats->lock_usec += rs->lock_usec;
+		for (j = 0; j < 256; j++) {
+			stats->ins[j].count += rs->ins[j].count;
+			stats->ins[j].usec += rs->ins[j].usec;
+			if (rs->ins[j].usec_max > stats->ins[j].usec_max)
+				stats->ins[j].usec_max = rs->ins[j].usec_max;
+			for (k = 0; k < SC_STATS_LATENCY_BUCKETS; k++)
+				stats->ins[j].latency[k] += rs->ins[j].latency[k];
+		}
+	}
+	return SC_SUCCESS;
+}
+
+void sc_ctx_reset_stats(sc_context_t *ctx)
+{
+	unsigned int i;
+
+	if (ctx == NULL)
+		return;
+	for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+
+		if (reader->stats != NULL)
+			memset(reader->stats, 0, sizeof(*reader->stats));
+	}
+}
+
+void sc_stats_print(FILE *out, const char *title, const sc_stats_t *stats)
+{
+	unsigned int i, k;
+
+	if (title != NULL)
+		fprintf(out, "%s\n", title);
+	fprintf(out, "  APDUs:           %lu (%lu failed)\n", stats->apdus, stats->errors);
+	fprintf(out, "  Bytes out/in:    %llu / %llu\n", stats->bytes_out, stats->bytes_in);
+	fprintf(out, "  Time in reader:  %llu.%03llu ms",
+		stats->usec / 1000, stats->usec % 1000);
+	if (stats->apdus)
+		fprintf(out, " (%llu us per APDU)", stats->usec / stats->apdus);
+	fprintf(out, "\n");
+	fprintf(out, "  GET RESPONSE:    %lu\n", stats->get_response);
+	fprintf(out, "  6Cxx resends:    %lu\n", stats->resend);
+	fprintf(out, "  Cached SELECTs:  %lu\n", stats->select_cached);
+	fprintf(out, "  Locks:           %lu (%llu.%03llu ms waiting)\n", stats->locks,
+		stats->lock_usec / 1000, stats->lock_usec % 1000);
+
+	if (stats->apdus == stats->errors)
+		return;
+	fprintf(out, "  INS    count   avg ms   max ms |");
+	for (k = 0; k < SC_STATS_LATENCY_BUCKETS - 1; k++)
+		fprintf(out, " %6s%u", "<", 1U << k);
+	fprintf(out, " %7s\n", "more");
+	for (i = 0; i < 256; i++) {
+		const sc_ins_stats_t *is = &stats->ins[i];
+
+		if (is->count == 0)
+			continue;
+		fprintf(out, "  %02X %9u %8.2f %8.2f |", i, is->count,
+			(double)is->usec / is->count / 1000, (double)is->usec_max / 1000);
+		for (k = 0; k < SC_STATS_LATENCY_BUCKETS; k++)
+			fprintf(out, " %7u", is->latency[k]);
+		fprintf(out, "\n");
+	}
+}
@@ -253,6 +253,9 @@ typedef struct sc_file {
  * returns 0x6Cxx (wrong length)
  */
 #define SC_APDU_FLAGS_NO_RETRY_WL	0x00000004UL
+/* the reader driver does not dump the APDU to the debug log, used for
+ * the APDUs of sc_transmit_apdu_batch() */
+#define SC_APDU_FLAGS_NO_LOG		0x00000008UL
 
 typedef struct sc_apdu {
 	int cse;		/* APDU case */
@@ -173,6 +173,15 @@ static CK_RV pkcs15_bind(struct sc_pkcs11_card *p11card)
 		return sc_to_cryptoki_error(rc, NULL);
 	}
 
+	/* Read ahead what the slot creation will ask for anyway; with lazy
+	 * loading the certificates are left until they are needed. */
+	if (fw_data->p15_card->opts.prefetch) {
+		rc = sc_pkcs15_prefetch(fw_data->p15_card, sc_pkcs11_conf.lazy_loading
+				? SC_PKCS15_PREFETCH_DF : SC_PKCS15_PREFETCH_ALL);
+		if (rc < 0)
+			sc_debug(context, SC_LOG_DEBUG_NORMAL, "sc_pkcs15_prefetch failed: %d", rc);
+	}
+
 	rv = register_mechanisms(p11card);
 	if (rv != CKR_OK) {
 		sc_debug(context, SC_LOG_DEBUG_NORMAL, "register_mechanisms failed: 0x%x", rv);
@@ -286,7 +295,10 @@ __pkcs15_release_object(struct pkcs15_any_object *obj)
 {
 	if (--(obj->refcount) != 0)
 		return obj->refcount;
-	
+
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_free_pubkey(&obj->base);
+#endif
 	sc_mem_clear(obj, obj->size);
 	free(obj);
 
@@ -325,15 +337,12 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetTokenInfo(%lx)", slotID);
 
-	rv = slot_get_token(slotID, &slot);
+	/* Talking to the card only needs the card's lock */
+	rv = sc_pkcs11_lock_token(slotID, &slot);
 	if (rv != CKR_OK)
-		goto out;
+		return rv;
 
 	/* User PIN flags are cleared before re-calculation */
 	slot->token_info.flags &= ~(CKF_USER_PIN_COUNT_LOW|CKF_USER_PIN_FINAL_TRY|CKF_USER_PIN_LOCKED);
@@ -371,7 +380,7 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	}
 	memcpy(pInfo, &slot->token_info, sizeof(CK_TOKEN_INFO));
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_token(slot);
 	return rv;
 }
 
@@ -424,7 +433,8 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data,
 
 	p15_info = (struct sc_pkcs15_cert_info *) cert->data;
 
-	if (cert->flags & SC_PKCS15_CO_FLAG_PRIVATE)   	/* is the cert private? */
+	if ((cert->flags & SC_PKCS15_CO_FLAG_PRIVATE) 	/* is the cert private? */
+			|| sc_pkcs11_conf.lazy_loading)
 		p15_cert = NULL; 		/* will read cert when needed */
 	else
 	if ((rv = sc_pkcs15_read_certificate(fw_data->p15_card, p15_info, &p15_cert) < 0))
@@ -492,6 +502,9 @@ __pkcs15_create_pubkey_object(struct pkcs15_fw_data *fw_data,
 			p15_key = (struct sc_pkcs15_pubkey *) pubkey->emulated;
 			sc_debug(context, SC_LOG_DEBUG_NORMAL, "Using emulated pubkey %p", p15_key);
 		}
+		else if (sc_pkcs11_conf.lazy_loading) {
+			p15_key = NULL;		/* will read key when needed */
+		}
 		else {
 			if ((rv = sc_pkcs15_read_pubkey(fw_data->p15_card, pubkey, &p15_key)) < 0)
 				 p15_key = NULL;
@@ -712,16 +725,19 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data,
 				cert->cert_info, &cert->cert_data) < 0))
 		return rv;
 
-	/* update the related public key object */
+	/* update the related public key object, unless its key was
+	 * already read from the PuKDF */
 	obj2 = cert->cert_pubkey;
 
-	obj2->pub_data = cert->cert_data->key;
-	/* We take the pub key from the cert that we will discard below */
-	/* invalidate public data of the cert object so that sc_pkcs15_cert_free
-	 * does not free the public key data as well (something like
-	 * sc_pkcs15_pubkey_dup would have been nice here) -- Nils
-	 */
-	cert->cert_data->key = NULL;
+	if (obj2->pub_data == NULL) {
+		obj2->pub_data = cert->cert_data->key;
+		/* We take the pub key from the cert that we will discard below */
+		/* invalidate public data of the cert object so that sc_pkcs15_cert_free
+		 * does not free the public key data as well (something like
+		 * sc_pkcs15_pubkey_dup would have been nice here) -- Nils
+		 */
+		cert->cert_data->key = NULL;
+	}
 
 	/* now that we have the cert and pub key, lets see if we can bind anything else */
 	
@@ -730,6 +746,36 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data,
 	return 0;
 }
 
+/* Read a public key that was not read when the object was created,
+ * from the PuKDF entry or else from the certificate it belongs to */
+static int
+check_pubkey_data_read(struct pkcs15_fw_data *fw_data,
+				 struct pkcs15_pubkey_object *pubkey)
+{
+	int rv;
+
+	if (!pubkey)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+
+	if (pubkey->pub_data)
+		return 0;
+	if (pubkey->pub_p15obj == NULL)
+		return check_cert_data_read(fw_data, pubkey->pub_genfrom);
+
+	rv = sc_pkcs15_read_pubkey(fw_data->p15_card, pubkey->pub_p15obj, &pubkey->pub_data);
+	if (rv < 0) {
+		pubkey->pub_data = NULL;
+		if (pubkey->pub_genfrom)
+			return check_cert_data_read(fw_data, pubkey->pub_genfrom);
+		return rv;
+	}
+	if (pubkey->pub_info->modulus_length == 0
+			&& pubkey->pub_data->algorithm == SC_ALGORITHM_RSA)
+		pubkey->pub_info->modulus_length = 8 * pubkey->pub_data->u.rsa.modulus.len;
+
+	return 0;
+}
+
 static void
 pkcs15_add_object(struct sc_pkcs11_slot *slot,
 		  struct pkcs15_any_object *obj,
@@ -743,15 +789,18 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot,
 		return;
 
         
-	if (list_contains(&slot->objects, obj))
+	if (sc_pkcs11_object_map_find(&slot->object_map, (CK_OBJECT_HANDLE)obj))
 		return;
 
 	if (pHandle != NULL)
 		*pHandle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
 
-	list_append(&slot->objects, obj);
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Setting object handle of 0x%lx to 0x%lx", obj->base.handle, (CK_OBJECT_HANDLE)obj);
 	obj->base.handle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
+	if (sc_pkcs11_object_map_add(&slot->object_map, &obj->base) != CKR_OK)
+		return;
+	list_append(&slot->objects, obj);
+	sc_pkcs11_invalidate_find_index(slot);
 	obj->base.flags |= SC_PKCS11_OBJECT_SEEN;
 	obj->refcount++;
 
@@ -2168,6 +2217,8 @@ static CK_RV pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 		/* Oppose to pkcs15_add_object */
 		--any_obj->refcount; /* correct refcont */
 		list_delete(&session->slot->objects, any_obj);
+		sc_pkcs11_object_map_remove(&session->slot->object_map, any_obj->base.handle);
+		sc_pkcs11_invalidate_find_index(session->slot);
 		/* Delete object in pkcs15 */
 		rv = __pkcs15_delete_object(fw_data, any_obj);
 	}
@@ -2478,7 +2529,7 @@ static CK_RV pkcs15_prkey_get_attribute(struct sc_pkcs11_session *session,
 		((attr->type == CKA_MODULUS_BITS) && (prkey->prv_p15obj->type == SC_PKCS15_TYPE_PRKEY_EC)) || 
 		(attr->type == CKA_ECDSA_PARAMS)) {
 		/* First see if we have a associated public key */
-		if (prkey->prv_pubkey && prkey->prv_pubkey->pub_data)
+		if (prkey->prv_pubkey && check_pubkey_data_read(fw_data, prkey->prv_pubkey) == 0)
 			key = prkey->prv_pubkey->pub_data;
 		else {
 			/* Try to find a certificate with the public key */
@@ -2624,7 +2675,8 @@ static CK_RV pkcs15_prkey_sign(struct sc_pkcs11_session *ses, void *obj,
 {
 	struct pkcs15_prkey_object *prkey = (struct pkcs15_prkey_object *) obj;
 	struct pkcs15_fw_data *fw_data = (struct pkcs15_fw_data *) ses->slot->card->fw_data;
-	int rv, flags = 0;
+	u8 digest[64];
+	int rv, flags = 0, truncate = 0;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Initiating signing operation, mechanism 0x%x.\n",
 				pMechanism->mechanism);
@@ -2674,27 +2726,41 @@ static CK_RV pkcs15_prkey_sign(struct sc_pkcs11_session *ses, void *obj,
 		flags = SC_ALGORITHM_ECDSA_HASH_NONE;
 		break;
 	case CKM_ECDSA_SHA1:
-		flags = SC_ALGORITHM_ECDSA_HASH_SHA1;
-		break;
-#if 0
 	case CKM_ECDSA_SHA224:
-		flags = SC_ALGORITHM_ECDSA_HASH_SHA224;
-		break;
 	case CKM_ECDSA_SHA256:
-		flags = SC_ALGORITHM_ECDSA_HASH_SHA256;
-		break;
 	case CKM_ECDSA_SHA384:
-		flags = SC_ALGORITHM_ECDSA_HASH_SHA384;
-		break;
 	case CKM_ECDSA_SHA512:
-		flags = SC_ALGORITHM_ECDSA_HASH_SHA512;
+		/* Hashed in software, we only get the digest;
+		 * see register_ec_mechanisms() */
+		flags = SC_ALGORITHM_ECDSA_HASH_NONE;
+		truncate = 1;
 		break;
-#endif
 	default:
 		sc_debug(context, SC_LOG_DEBUG_NORMAL, "DEE - need EC for %d",pMechanism->mechanism);
 		return CKR_MECHANISM_INVALID;
 	}
 
+	/* ECDSA only signs the leftmost bits of the digest, as many as the
+	 * order of the curve has (ANSI X9.62). Not every card does this
+	 * itself, so hand it an integer that already fits. The order is
+	 * as long as the field for the curves we support. */
+	if (truncate && prkey->prv_info->field_length
+			&& ulDataLen * 8 > prkey->prv_info->field_length
+			&& ulDataLen <= sizeof(digest)) {
+		size_t bits = prkey->prv_info->field_length;
+		size_t i, n = (bits + 7) / 8;
+		unsigned int shift = n * 8 - bits;
+
+		memcpy(digest, pData, n);
+		if (shift) {
+			for (i = n - 1; i > 0; i--)
+				digest[i] = (digest[i] >> shift) | (digest[i - 1] << (8 - shift));
+			digest[0] >>= shift;
+		}
+		pData = digest;
+		ulDataLen = n;
+	}
+
 	rv = sc_lock(ses->slot->card->card);
 	if (rv < 0)
 		return sc_to_cryptoki_error(rv, "C_Sign");
@@ -2850,7 +2916,12 @@ static CK_RV pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session,
 		case CKA_EC_POINT:
 			if (pubkey->pub_data == NULL) 
 				/* FIXME: check the return value? */
-				check_cert_data_read(fw_data, cert);
+				check_pubkey_data_read(fw_data, pubkey);
+			break;
+		case CKA_KEY_TYPE:
+			/* the PuKDF entry tells the type without reading the key */
+			if (pubkey->pub_data == NULL && pubkey->pub_p15obj == NULL)
+				check_pubkey_data_read(fw_data, pubkey);
 			break;
 	}
 
@@ -2905,6 +2976,12 @@ static CK_RV pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session,
 			*(CK_KEY_TYPE*)attr->pValue = CKK_GOSTR3410;
 		else if (pubkey->pub_data && pubkey->pub_data->algorithm == SC_ALGORITHM_EC)
 			*(CK_KEY_TYPE*)attr->pValue = CKK_EC;
+		else if (!pubkey->pub_data && pubkey->pub_p15obj
+				&& pubkey->pub_p15obj->type == SC_PKCS15_TYPE_PUBKEY_GOSTR3410)
+			*(CK_KEY_TYPE*)attr->pValue = CKK_GOSTR3410;
+		else if (!pubkey->pub_data && pubkey->pub_p15obj
+				&& pubkey->pub_p15obj->type == SC_PKCS15_TYPE_PUBKEY_EC)
+			*(CK_KEY_TYPE*)attr->pValue = CKK_EC;
 		else
 			*(CK_KEY_TYPE*)attr->pValue = CKK_RSA;
 		break;
@@ -3381,6 +3458,9 @@ static int register_ec_mechanisms(struct sc_pkcs11_card *p11card, int flags,
 		ec_flags |= CKF_EC_COMPRESS;
 
 	mech_info.flags = CKF_HW | CKF_SIGN; /* check for more */
+#ifdef ENABLE_OPENSSL
+	mech_info.flags |= CKF_VERIFY;
+#endif
 	mech_info.flags |= ec_flags;
 	mech_info.ulMinKeySize = min_key_size;
 	mech_info.ulMaxKeySize = max_key_size;
@@ -3392,12 +3472,20 @@ static int register_ec_mechanisms(struct sc_pkcs11_card *p11card, int flags,
 	if (rc != CKR_OK)
 		return rc;
 
-#if ENABLE_OPENSSL
-	mt = sc_pkcs11_new_fw_mechanism(CKM_ECDSA_SHA1,
-		&mech_info, CKK_EC, NULL);
-	if (!mt)
-		return CKR_HOST_MEMORY;
-	rc = sc_pkcs11_register_mechanism(p11card, mt);
+#ifdef ENABLE_OPENSSL
+	/* The data is hashed in software as it comes in, and only
+	 * the digest is signed with the card's raw ECDSA, cut down
+	 * to the key size by pkcs15_prkey_sign() */
+	rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card, CKM_ECDSA_SHA1, CKM_SHA_1, mt);
+	if (rc != CKR_OK)
+		return rc;
+	rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card, CKM_ECDSA_SHA256, CKM_SHA256, mt);
+	if (rc != CKR_OK)
+		return rc;
+	rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card, CKM_ECDSA_SHA384, CKM_SHA384, mt);
+	if (rc != CKR_OK)
+		return rc;
+	rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card, CKM_ECDSA_SHA512, CKM_SHA512, mt);
 	if (rc != CKR_OK)
 		return rc;
 #endif
@@ -3450,7 +3538,7 @@ static CK_RV register_mechanisms(struct sc_pkcs11_card *p11card)
 	mech_info.flags = CKF_HW | CKF_SIGN | CKF_DECRYPT;
 #ifdef ENABLE_OPENSSL
 	/* That practise definitely conflicts with CKF_HW -- andre 2010-11-28 */
-	mech_info.flags |= CKF_VERIFY;
+	mech_info.flags |= CKF_VERIFY | CKF_VERIFY_RECOVER | CKF_ENCRYPT;
 #endif
 	mech_info.ulMinKeySize = ~0;
 	mech_info.ulMaxKeySize = 0;
@@ -3552,6 +3640,16 @@ static CK_RV register_mechanisms(struct sc_pkcs11_card *p11card)
 			if (rc != CKR_OK)
 				return rc;
 		}
+		if (flags & SC_ALGORITHM_RSA_HASH_SHA384) {
+			rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card, CKM_SHA384_RSA_PKCS, CKM_SHA384, mt);
+			if (rc != CKR_OK)
+				return rc;
+		}
+		if (flags & SC_ALGORITHM_RSA_HASH_SHA512) {
+			rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card, CKM_SHA512_RSA_PKCS, CKM_SHA512, mt);
+			if (rc != CKR_OK)
+				return rc;
+		}
 		if (flags & SC_ALGORITHM_RSA_HASH_MD5) {
 			rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card, CKM_MD5_RSA_PKCS, CKM_MD5, mt);
 			if (rc != CKR_OK)
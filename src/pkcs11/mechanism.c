@@ -20,7 +20,10 @@ struct hash_signature_info {
 	sc_pkcs11_mechanism_type_t *sign_type;
 };
 
-/* Also used for verification and decryption data */
+/* Also used for verification and decryption data.
+ * Mechanisms with a software hash stream the data through md and
+ * only keep the digest in buffer; the others sign the raw data, which
+ * cannot be longer than the key anyway. */
 struct signature_data {
 	struct sc_pkcs11_object *key;
 	struct hash_signature_info *info;
@@ -636,44 +639,137 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 			CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
 {
 	struct signature_data *data;
-	struct sc_pkcs11_object *key;
-	unsigned char *pubkey_value;
-	CK_KEY_TYPE key_type;
-	CK_BYTE params[9 /* GOST_PARAMS_OID_SIZE */] = { 0 };
-	CK_ATTRIBUTE attr = {CKA_VALUE, NULL, 0};
-	CK_ATTRIBUTE attr_key_type = {CKA_KEY_TYPE, &key_type, sizeof(key_type)};
-	CK_ATTRIBUTE attr_key_params = {CKA_GOSTR3410_PARAMS, &params, sizeof(params)};
-	int rv;
 
 	data = (struct signature_data *) operation->priv_data;
 
 	if (pSignature == NULL)
 		return CKR_ARGUMENTS_BAD;
 
-	key = data->key;
-	rv = key->ops->get_attribute(operation->session, key, &attr);
+	return sc_pkcs11_verify_data(operation->session, data->key,
+		operation->mechanism.mechanism, data->md,
+		data->buffer, data->buffer_len, pSignature, ulSignatureLen);
+}
+
+/*
+ * Initialize a verify recover context. Like verification, this
+ * is done in software with the public key.
+ */
+CK_RV
+sc_pkcs11_verif_recover_init(struct sc_pkcs11_session *session,
+			CK_MECHANISM_PTR pMechanism,
+			struct sc_pkcs11_object *key,
+			CK_MECHANISM_TYPE key_type)
+{
+	struct sc_pkcs11_card *p11card;
+	sc_pkcs11_operation_t *operation;
+	sc_pkcs11_mechanism_type_t *mt;
+	CK_RV rv;
+
+	if (!session || !session->slot
+	 || !(p11card = session->slot->card))
+		return CKR_ARGUMENTS_BAD;
+
+	/* See if we support this mechanism type */
+	mt = sc_pkcs11_find_mechanism(p11card, pMechanism->mechanism, CKF_VERIFY_RECOVER);
+	if (mt == NULL)
+		return CKR_MECHANISM_INVALID;
+
+	/* See if compatible with key type */
+	if (mt->key_type != key_type)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	rv = session_start_operation(session, SC_PKCS11_OPERATION_VERIFY_RECOVER, mt, &operation);
 	if (rv != CKR_OK)
 		return rv;
-	pubkey_value = malloc(attr.ulValueLen);
-	attr.pValue = pubkey_value;
-	rv = key->ops->get_attribute(operation->session, key, &attr);
+
+	memcpy(&operation->mechanism, pMechanism, sizeof(CK_MECHANISM));
+	rv = mt->verif_recover_init(operation, key);
+
 	if (rv != CKR_OK)
-		goto done;
+		session_stop_operation(session, SC_PKCS11_OPERATION_VERIFY_RECOVER);
 
-	rv = key->ops->get_attribute(operation->session, key, &attr_key_type);
-	if (rv == CKR_OK && key_type == CKK_GOSTR3410) {
-		rv = key->ops->get_attribute(operation->session, key, &attr_key_params);
-		if (rv != CKR_OK)
-			goto done;
-	}
+	return rv;
+}
 
-	rv = sc_pkcs11_verify_data(pubkey_value, attr.ulValueLen,
-		params, sizeof(params),
-		operation->mechanism.mechanism, data->md,
-		data->buffer, data->buffer_len, pSignature, ulSignatureLen);
+CK_RV
+sc_pkcs11_verif_recover(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen,
+		CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	sc_pkcs11_operation_t *op;
+	int rv;
 
-done:
-	free(pubkey_value);
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_VERIFY_RECOVER, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = op->type->verif_recover(op, pSignature, ulSignatureLen,
+				pData, pulDataLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && pData != NULL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_VERIFY_RECOVER);
+
+	return rv;
+}
+
+/*
+ * Initialize an encryption context. Encryption only needs the
+ * public key and is done in software.
+ */
+CK_RV
+sc_pkcs11_encr_init(struct sc_pkcs11_session *session,
+			CK_MECHANISM_PTR pMechanism,
+			struct sc_pkcs11_object *key,
+			CK_MECHANISM_TYPE key_type)
+{
+	struct sc_pkcs11_card *p11card;
+	sc_pkcs11_operation_t *operation;
+	sc_pkcs11_mechanism_type_t *mt;
+	CK_RV rv;
+
+	if (!session || !session->slot
+	 || !(p11card = session->slot->card))
+		return CKR_ARGUMENTS_BAD;
+
+	/* See if we support this mechanism type */
+	mt = sc_pkcs11_find_mechanism(p11card, pMechanism->mechanism, CKF_ENCRYPT);
+	if (mt == NULL)
+		return CKR_MECHANISM_INVALID;
+
+	/* See if compatible with key type */
+	if (mt->key_type != key_type)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	rv = session_start_operation(session, SC_PKCS11_OPERATION_ENCRYPT, mt, &operation);
+	if (rv != CKR_OK)
+		return rv;
+
+	memcpy(&operation->mechanism, pMechanism, sizeof(CK_MECHANISM));
+	rv = mt->encrypt_init(operation, key);
+
+	if (rv != CKR_OK)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_encr(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	sc_pkcs11_operation_t *op;
+	int rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_ENCRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = op->type->encrypt(op, pData, ulDataLen,
+				pEncryptedData, pulEncryptedDataLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && pEncryptedData != NULL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
 
 	return rv;
 }
@@ -776,6 +872,38 @@ sc_pkcs11_decrypt(sc_pkcs11_operation_t *operation,
 				pData, pulDataLen);
 }
 
+#ifdef ENABLE_OPENSSL
+static CK_RV
+sc_pkcs11_verify_recover(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen,
+		CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	struct signature_data *data;
+
+	data = (struct signature_data*) operation->priv_data;
+
+	return sc_pkcs11_verify_recover_data(operation->session, data->key,
+				operation->mechanism.mechanism,
+				pSignature, ulSignatureLen,
+				pData, pulDataLen);
+}
+
+static CK_RV
+sc_pkcs11_encrypt(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	struct signature_data *data;
+
+	data = (struct signature_data*) operation->priv_data;
+
+	return sc_pkcs11_encrypt_data(operation->session, data->key,
+				operation->mechanism.mechanism,
+				pData, ulDataLen,
+				pEncryptedData, pulEncryptedDataLen);
+}
+#endif
+
 /*
  * Create new mechanism type for a mechanism supported by
  * the card
@@ -820,6 +948,18 @@ sc_pkcs11_new_fw_mechanism(CK_MECHANISM_TYPE mech,
 		mt->decrypt_init = sc_pkcs11_decrypt_init;
 		mt->decrypt = sc_pkcs11_decrypt;
 	}
+#ifdef ENABLE_OPENSSL
+	/* Public key operations, done in software; the setup is
+	 * the same as for decryption */
+	if (pInfo->flags & CKF_VERIFY_RECOVER) {
+		mt->verif_recover_init = sc_pkcs11_decrypt_init;
+		mt->verif_recover = sc_pkcs11_verify_recover;
+	}
+	if (pInfo->flags & CKF_ENCRYPT) {
+		mt->encrypt_init = sc_pkcs11_decrypt_init;
+		mt->encrypt = sc_pkcs11_encrypt;
+	}
+#endif
 
 	return mt;
 }
@@ -854,7 +994,7 @@ sc_pkcs11_register_sign_and_hash_mechanism(struct sc_pkcs11_card *p11card,
 		return CKR_MECHANISM_INVALID;
 
 	/* These hash-based mechs can only be used for sign/verify */
-	mech_info.flags &= (CKF_SIGN | CKF_SIGN_RECOVER | CKF_VERIFY | CKF_VERIFY_RECOVER);
+	mech_info.flags &= (CKF_SIGN | CKF_SIGN_RECOVER | CKF_VERIFY);
 
 	info = calloc(1, sizeof(*info));
 	info->mech = mech;
@@ -293,6 +293,10 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	conf->pin_unblock_style = SC_PKCS11_PIN_UNBLOCK_NOT_ALLOWED;
 	conf->create_puk_slot = 0;
 	conf->zero_ckaid_for_ca_certs = 0;
+	conf->lazy_loading = 0;
+	conf->stats_file = NULL;
+	conf->detect_threads = 1;
+	conf->detect_timeout = 0;
 
 	conf_block = sc_get_conf_block(ctx, "pkcs11", NULL, 1);
 	if (!conf_block)
@@ -315,10 +319,211 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	
 	conf->create_puk_slot = scconf_get_bool(conf_block, "create_puk_slot", conf->create_puk_slot);
 	conf->zero_ckaid_for_ca_certs = scconf_get_bool(conf_block, "zero_ckaid_for_ca_certs", conf->zero_ckaid_for_ca_certs);
+	conf->lazy_loading = scconf_get_bool(conf_block, "lazy_loading", conf->lazy_loading);
+	conf->stats_file = scconf_get_str(conf_block, "stats_file", conf->stats_file);
+	conf->detect_threads = scconf_get_int(conf_block, "detect_threads", conf->detect_threads);
+	conf->detect_timeout = scconf_get_int(conf_block, "detect_timeout", conf->detect_timeout);
 
 	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "PKCS#11 options: plug_and_play=%d max_virtual_slots=%d slots_per_card=%d "
-		 "hide_empty_tokens=%d lock_login=%d pin_unblock_style=%d zero_ckaid_for_ca_certs=%d",
+		 "hide_empty_tokens=%d lock_login=%d pin_unblock_style=%d zero_ckaid_for_ca_certs=%d lazy_loading=%d "
+		 "detect_threads=%u detect_timeout=%u",
 		 conf->plug_and_play, conf->max_virtual_slots, conf->slots_per_card,
 		 conf->hide_empty_tokens, conf->lock_login, conf->pin_unblock_style,
-		 conf->zero_ckaid_for_ca_certs);
+		 conf->zero_ckaid_for_ca_certs, conf->lazy_loading,
+		 conf->detect_threads, conf->detect_timeout);
+}
+
+/*
+ * Handle tables: entries are allocated from a growing array and reused
+ * through a free list. A handle carries the entry's position plus one in
+ * its low bits and the entry's generation above them. The generation is
+ * bumped whenever an entry is released, so a stale handle does not
+ * resolve to whatever took the entry over.
+ */
+#define HANDLE_INDEX_BITS	20
+#define HANDLE_INDEX_MASK	((1UL << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GEN_MASK		(~(CK_ULONG)0 >> HANDLE_INDEX_BITS)
+
+struct sc_pkcs11_handle_entry {
+	void *ptr;
+	CK_ULONG gen;
+	unsigned int next_free;	/* position plus one, 0 ends the list */
+};
+
+CK_ULONG sc_pkcs11_handle_add(struct sc_pkcs11_handle_table *table, void *ptr)
+{
+	struct sc_pkcs11_handle_entry *e;
+	unsigned int pos;
+
+	if (ptr == NULL)
+		return 0;
+	if (table->free_head != 0) {
+		pos = table->free_head - 1;
+		table->free_head = table->entries[pos].next_free;
+	} else {
+		if (table->used == table->size) {
+			unsigned int size = table->size ? table->size * 2 : 64;
+
+			if (size > HANDLE_INDEX_MASK)
+				size = HANDLE_INDEX_MASK;
+			if (size <= table->size)
+				return 0;
+			e = realloc(table->entries, size * sizeof(*e));
+			if (e == NULL)
+				return 0;
+			table->entries = e;
+			table->size = size;
+		}
+		pos = table->used++;
+		table->entries[pos].gen = 0;
+	}
+	e = &table->entries[pos];
+	e->ptr = ptr;
+	e->next_free = 0;
+	table->count++;
+	return (e->gen << HANDLE_INDEX_BITS) | (pos + 1);
+}
+
+void *sc_pkcs11_handle_get(const struct sc_pkcs11_handle_table *table, CK_ULONG handle)
+{
+	const struct sc_pkcs11_handle_entry *e;
+	CK_ULONG pos = (handle & HANDLE_INDEX_MASK);
+
+	if (pos == 0 || pos > table->used)
+		return NULL;
+	e = &table->entries[pos - 1];
+	if (e->ptr == NULL || e->gen != (handle >> HANDLE_INDEX_BITS))
+		return NULL;
+	return e->ptr;
+}
+
+void sc_pkcs11_handle_remove(struct sc_pkcs11_handle_table *table, CK_ULONG handle)
+{
+	struct sc_pkcs11_handle_entry *e;
+	CK_ULONG pos = (handle & HANDLE_INDEX_MASK);
+
+	if (sc_pkcs11_handle_get(table, handle) == NULL)
+		return;
+	e = &table->entries[pos - 1];
+	e->ptr = NULL;
+	e->gen = (e->gen + 1) & HANDLE_GEN_MASK;
+	e->next_free = table->free_head;
+	table->free_head = (unsigned int)pos;
+	table->count--;
+}
+
+/* Iterate over the table: start with *pos = 0, ends with NULL. Entries
+ * may be removed while iterating. */
+void *sc_pkcs11_handle_next(const struct sc_pkcs11_handle_table *table, unsigned int *pos)
+{
+	while (*pos < table->used) {
+		void *ptr = table->entries[(*pos)++].ptr;
+
+		if (ptr != NULL)
+			return ptr;
+	}
+	return NULL;
+}
+
+void sc_pkcs11_handle_table_free(struct sc_pkcs11_handle_table *table)
+{
+	free(table->entries);
+	memset(table, 0, sizeof(*table));
+}
+
+/*
+ * Object maps: the objects of a slot by handle, in an open addressing
+ * hash table with linear probing. Object handles stay what they were,
+ * since an object can be visible in several slots of a card under the
+ * same handle.
+ */
+static size_t object_map_hash(CK_OBJECT_HANDLE handle, size_t size)
+{
+	/* handles are pointers: drop the alignment bits */
+	return (size_t)((handle >> 4) * 2654435761UL) & (size - 1);
+}
+
+static int object_map_grow(struct sc_pkcs11_object_map *map)
+{
+	struct sc_pkcs11_object **old = map->buckets;
+	size_t i, old_size = map->size;
+	size_t size = old_size ? old_size * 2 : 32;
+
+	map->buckets = calloc(size, sizeof(struct sc_pkcs11_object *));
+	if (map->buckets == NULL) {
+		map->buckets = old;
+		return -1;
+	}
+	map->size = size;
+	for (i = 0; i < old_size; i++) {
+		size_t h;
+
+		if (old[i] == NULL)
+			continue;
+		for (h = object_map_hash(old[i]->handle, size); map->buckets[h] != NULL; h = (h + 1) & (size - 1))
+			;
+		map->buckets[h] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+struct sc_pkcs11_object *sc_pkcs11_object_map_find(const struct sc_pkcs11_object_map *map,
+		CK_OBJECT_HANDLE handle)
+{
+	size_t h;
+
+	if (map->size == 0 || handle == 0)
+		return NULL;
+	for (h = object_map_hash(handle, map->size); map->buckets[h] != NULL; h = (h + 1) & (map->size - 1))
+		if (map->buckets[h]->handle == handle)
+			return map->buckets[h];
+	return NULL;
+}
+
+CK_RV sc_pkcs11_object_map_add(struct sc_pkcs11_object_map *map, struct sc_pkcs11_object *object)
+{
+	size_t h;
+
+	/* keep the load below 3/4 */
+	if ((map->count + 1) * 4 > map->size * 3 && object_map_grow(map) != 0)
+		return CKR_HOST_MEMORY;
+	for (h = object_map_hash(object->handle, map->size); map->buckets[h] != NULL; h = (h + 1) & (map->size - 1))
+		if (map->buckets[h]->handle == object->handle)
+			return CKR_OK;
+	map->buckets[h] = object;
+	map->count++;
+	return CKR_OK;
+}
+
+void sc_pkcs11_object_map_remove(struct sc_pkcs11_object_map *map, CK_OBJECT_HANDLE handle)
+{
+	size_t h, i, j, mask = map->size - 1;
+
+	if (map->size == 0)
+		return;
+	for (h = object_map_hash(handle, map->size); map->buckets[h] != NULL; h = (h + 1) & mask)
+		if (map->buckets[h]->handle == handle)
+			break;
+	if (map->buckets[h] == NULL)
+		return;
+	map->buckets[h] = NULL;
+	map->count--;
+	/* Move up what was probed past the hole */
+	for (i = (h + 1) & mask; map->buckets[i] != NULL; i = (i + 1) & mask) {
+		struct sc_pkcs11_object *o = map->buckets[i];
+
+		j = object_map_hash(o->handle, map->size);
+		if ((i > h && (j <= h || j > i)) || (i < h && j <= h && j > i)) {
+			map->buckets[h] = o;
+			map->buckets[i] = NULL;
+			h = i;
+		}
+	}
+}
+
+void sc_pkcs11_object_map_free(struct sc_pkcs11_object_map *map)
+{
+	free(map->buckets);
+	memset(map, 0, sizeof(*map));
 }
@@ -8,6 +8,7 @@
 #include "config.h"
 
 #ifdef ENABLE_OPENSSL		/* empty file without openssl */
+#include <stdlib.h>
 #include <string.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
@@ -18,6 +19,7 @@
 #include <openssl/opensslconf.h> /* for OPENSSL_NO_* */
 #ifndef OPENSSL_NO_EC
 #include <openssl/ec.h>
+#include <openssl/ecdsa.h>
 #endif /* OPENSSL_NO_EC */
 #ifndef OPENSSL_NO_ENGINE
 #include <openssl/engine.h>
@@ -53,6 +55,10 @@ static sc_pkcs11_mechanism_type_t openssl_sha1_mech = {
 	NULL,
 	NULL,
 	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
 	NULL
 };
 
@@ -75,6 +81,10 @@ static sc_pkcs11_mechanism_type_t openssl_sha256_mech = {
 	NULL,
 	NULL,
 	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
 	NULL
 };
 
@@ -96,6 +106,10 @@ static sc_pkcs11_mechanism_type_t openssl_sha384_mech = {
 	NULL,
 	NULL,
 	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
 	NULL
 };
 
@@ -117,6 +131,10 @@ static sc_pkcs11_mechanism_type_t openssl_sha512_mech = {
 	NULL,
 	NULL,
 	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
 	NULL
 };
 #endif
@@ -140,6 +158,10 @@ static sc_pkcs11_mechanism_type_t openssl_gostr3411_mech = {
 	NULL,
 	NULL,
 	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
 	NULL
 };
 #endif
@@ -162,6 +184,10 @@ static sc_pkcs11_mechanism_type_t openssl_md5_mech = {
 	NULL,
 	NULL,
 	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
 	NULL
 };
 
@@ -183,6 +209,10 @@ static sc_pkcs11_mechanism_type_t openssl_ripemd160_mech = {
 	NULL,
 	NULL,
 	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
 	NULL
 };
 
@@ -302,6 +332,9 @@ static void sc_pkcs11_openssl_md_release(sc_pkcs11_operation_t *op)
 	op->priv_data = NULL;
 }
 
+/* Largest RSA modulus we handle in software, in bytes */
+#define MAX_RSA_SIZE	(8192 / 8)
+
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
 
 static void reverse(unsigned char *buf, size_t len)
@@ -316,114 +349,347 @@ static void reverse(unsigned char *buf, size_t len)
 	}
 }
 
-static CK_RV gostr3410_verify_data(const unsigned char *pubkey, int pubkey_len,
-		const unsigned char *params, int params_len,
-		unsigned char *data, int data_len,
-		unsigned char *signat, int signat_len)
+static EVP_PKEY *gostr3410_load_pubkey(const unsigned char *pubkey, int pubkey_len,
+		const unsigned char *params, int params_len)
 {
 	EVP_PKEY *pkey;
-	EVP_PKEY_CTX *pkey_ctx;
+	EVP_PKEY_CTX *pkey_ctx = NULL;
 	EC_POINT *P;
 	BIGNUM *X, *Y;
-	ASN1_OCTET_STRING *octet;
+	ASN1_OCTET_STRING *octet = NULL;
 	const EC_GROUP *group = NULL;
 	char paramset[2] = "A";
-	int r = -1, ret_vrf = 0;
+	int r;
 
 	pkey = EVP_PKEY_new();
 	if (!pkey)
-		return CKR_HOST_MEMORY;
+		return NULL;
 	r = EVP_PKEY_set_type(pkey, NID_id_GostR3410_2001);
 	if (r == 1) {
 		pkey_ctx = EVP_PKEY_CTX_new(pkey, NULL);
-		if (!pkey_ctx) {
-			EVP_PKEY_free(pkey);
-			return CKR_HOST_MEMORY;
-		}
 		/* FIXME: fully check params[] */
-		if (params_len > 0 && params[params_len - 1] >= 1 &&
+		if (pkey_ctx && params_len > 0 && params[params_len - 1] >= 1 &&
 				params[params_len - 1] <= 3) {
 			paramset[0] += params[params_len - 1] - 1;
 			r = EVP_PKEY_CTX_ctrl_str(pkey_ctx, "paramset", paramset);
 		}
 		else
 			r = -1;
-		if (r == 1)
-			r = EVP_PKEY_paramgen_init(pkey_ctx);
-		if (r == 1)
-			r = EVP_PKEY_paramgen(pkey_ctx, &pkey);
-		if (r == 1 && EVP_PKEY_get0(pkey) != NULL)
-			group = EC_KEY_get0_group(EVP_PKEY_get0(pkey));
-		r = -1;
-		if (group)
-			octet = d2i_ASN1_OCTET_STRING(NULL, &pubkey, (long)pubkey_len);
-		if (group && octet) {
-			reverse(octet->data, octet->length);
-			Y = BN_bin2bn(octet->data, octet->length / 2, NULL);
-			X = BN_bin2bn((const unsigned char*)octet->data +
-					octet->length / 2, octet->length / 2, NULL);
-			ASN1_OCTET_STRING_free(octet);
-			P = EC_POINT_new(group);
-			if (P && X && Y)
-				r = EC_POINT_set_affine_coordinates_GFp(group,
-						P, X, Y, NULL);
-			BN_free(X);
-			BN_free(Y);
-			if (r == 1 && EVP_PKEY_get0(pkey) && P)
-				r = EC_KEY_set_public_key(EVP_PKEY_get0(pkey), P);
-			EC_POINT_free(P);
-		}
-		if (r == 1) {
-			r = EVP_PKEY_verify_init(pkey_ctx);
-			reverse(data, data_len);
-			if (r == 1)
-				ret_vrf = EVP_PKEY_verify(pkey_ctx, signat, signat_len,
-						data, data_len);
-		}
+	}
+	if (r == 1)
+		r = EVP_PKEY_paramgen_init(pkey_ctx);
+	if (r == 1)
+		r = EVP_PKEY_paramgen(pkey_ctx, &pkey);
+	if (r == 1 && EVP_PKEY_get0(pkey) != NULL)
+		group = EC_KEY_get0_group(EVP_PKEY_get0(pkey));
+	r = -1;
+	if (group)
+		octet = d2i_ASN1_OCTET_STRING(NULL, &pubkey, (long)pubkey_len);
+	if (group && octet) {
+		reverse(octet->data, octet->length);
+		Y = BN_bin2bn(octet->data, octet->length / 2, NULL);
+		X = BN_bin2bn((const unsigned char*)octet->data +
+				octet->length / 2, octet->length / 2, NULL);
+		ASN1_OCTET_STRING_free(octet);
+		P = EC_POINT_new(group);
+		if (P && X && Y)
+			r = EC_POINT_set_affine_coordinates_GFp(group,
+					P, X, Y, NULL);
+		BN_free(X);
+		BN_free(Y);
+		if (r == 1 && EVP_PKEY_get0(pkey) && P)
+			r = EC_KEY_set_public_key(EVP_PKEY_get0(pkey), P);
+		EC_POINT_free(P);
 	}
 	EVP_PKEY_CTX_free(pkey_ctx);
-	EVP_PKEY_free(pkey);
+	if (r != 1) {
+		EVP_PKEY_free(pkey);
+		return NULL;
+	}
+	return pkey;
+}
+
+static CK_RV gostr3410_verify_data(EVP_PKEY *pkey,
+		unsigned char *data, int data_len,
+		unsigned char *signat, int signat_len)
+{
+	EVP_PKEY_CTX *pkey_ctx;
+	int r, ret_vrf = 0;
+
+	pkey_ctx = EVP_PKEY_CTX_new(pkey, NULL);
+	if (!pkey_ctx)
+		return CKR_HOST_MEMORY;
+	r = EVP_PKEY_verify_init(pkey_ctx);
+	reverse(data, data_len);
+	if (r == 1)
+		ret_vrf = EVP_PKEY_verify(pkey_ctx, signat, signat_len,
+				data, data_len);
+	EVP_PKEY_CTX_free(pkey_ctx);
 	if (r != 1)
 		return CKR_GENERAL_ERROR;
 	return ret_vrf == 1 ? CKR_OK : CKR_SIGNATURE_INVALID;
 }
+
+/* params is the DER encoded ECParameters, point the DER encoded
+ * OCTET STRING holding the public point, as in CKA_EC_PARAMS and
+ * CKA_EC_POINT */
+static EVP_PKEY *ec_load_pubkey(const unsigned char *params, int params_len,
+		const unsigned char *point, int point_len)
+{
+	EVP_PKEY *pkey = NULL;
+	EC_GROUP *group;
+	EC_KEY *ec;
+	ASN1_OCTET_STRING *octet;
+	const unsigned char *p;
+
+	group = d2i_ECPKParameters(NULL, &params, (long)params_len);
+	octet = d2i_ASN1_OCTET_STRING(NULL, &point, (long)point_len);
+	ec = EC_KEY_new();
+	if (group && octet && ec && EC_KEY_set_group(ec, group) == 1) {
+		p = octet->data;
+		if (o2i_ECPublicKey(&ec, &p, octet->length) != NULL)
+			pkey = EVP_PKEY_new();
+		if (pkey && EVP_PKEY_assign_EC_KEY(pkey, ec) == 1)
+			ec = NULL;
+		else if (pkey) {
+			EVP_PKEY_free(pkey);
+			pkey = NULL;
+		}
+	}
+	EC_KEY_free(ec);
+	EC_GROUP_free(group);
+	ASN1_OCTET_STRING_free(octet);
+	return pkey;
+}
+
+/* PKCS#11 ECDSA signatures are r || s, each half of the signature.
+ * For the hashing mechanisms, the digest is taken from md. */
+static CK_RV ecdsa_verify_data(EVP_PKEY *pkey, sc_pkcs11_operation_t *md,
+		unsigned char *data, int data_len,
+		unsigned char *signat, int signat_len)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+	ECDSA_SIG *sig;
+	int r = -1;
+
+	if (signat_len <= 0 || signat_len % 2)
+		return CKR_SIGNATURE_LEN_RANGE;
+
+	if (md != NULL) {
+		EVP_DigestFinal(DIGEST_CTX(md), digest, &digest_len);
+		data = digest;
+		data_len = digest_len;
+	}
+
+	sig = ECDSA_SIG_new();
+	if (sig == NULL)
+		return CKR_HOST_MEMORY;
+	if (BN_bin2bn(signat, signat_len / 2, sig->r) != NULL
+			&& BN_bin2bn(signat + signat_len / 2, signat_len / 2, sig->s) != NULL)
+		r = ECDSA_do_verify(data, data_len, sig, EVP_PKEY_get0(pkey));
+	ECDSA_SIG_free(sig);
+	if (r < 0) {
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "ECDSA_do_verify() returned %d\n", r);
+		return CKR_GENERAL_ERROR;
+	}
+	return r == 1 ? CKR_OK : CKR_SIGNATURE_INVALID;
+}
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC) */
 
+/* Fetch an attribute of the key into a newly allocated buffer */
+static CK_RV get_attribute_value(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_object *key, CK_ATTRIBUTE_TYPE type,
+		unsigned char **value, CK_ULONG *value_len)
+{
+	CK_ATTRIBUTE attr = { type, NULL, 0 };
+	CK_RV rv;
+
+	rv = key->ops->get_attribute(session, key, &attr);
+	if (rv != CKR_OK)
+		return rv;
+	if (attr.ulValueLen == 0)
+		return CKR_GENERAL_ERROR;
+	attr.pValue = malloc(attr.ulValueLen);
+	if (attr.pValue == NULL)
+		return CKR_HOST_MEMORY;
+	rv = key->ops->get_attribute(session, key, &attr);
+	if (rv != CKR_OK) {
+		free(attr.pValue);
+		return rv;
+	}
+	*value = attr.pValue;
+	*value_len = attr.ulValueLen;
+	return CKR_OK;
+}
+
+/*
+ * Return the public key of an object as an EVP_PKEY. It is parsed from
+ * the object's attributes once and then kept on the object until the
+ * object is released, so software operations with the same key neither
+ * fetch its attributes again nor re-parse them.
+ */
+static CK_RV get_pubkey(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_object *key, EVP_PKEY **pkey)
+{
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE attr_key_type = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
+	unsigned char *value = NULL, *params = NULL;
+	CK_ULONG value_len = 0, params_len = 0;
+	const unsigned char *p;
+	CK_RV rv;
+
+	if (key->pubkey != NULL) {
+		*pkey = (EVP_PKEY *) key->pubkey;
+		return CKR_OK;
+	}
+
+	rv = key->ops->get_attribute(session, key, &attr_key_type);
+	if (rv != CKR_OK)
+		return rv;
+
+	switch (key_type) {
+	case CKK_RSA:
+		rv = get_attribute_value(session, key, CKA_VALUE, &value, &value_len);
+		if (rv != CKR_OK)
+			break;
+		p = value;
+		key->pubkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &p, (long)value_len);
+		break;
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
+	case CKK_GOSTR3410:
+		rv = get_attribute_value(session, key, CKA_VALUE, &value, &value_len);
+		if (rv == CKR_OK)
+			rv = get_attribute_value(session, key, CKA_GOSTR3410_PARAMS,
+					&params, &params_len);
+		if (rv == CKR_OK)
+			key->pubkey = gostr3410_load_pubkey(value, value_len,
+					params, params_len);
+		break;
+	case CKK_EC:
+		rv = get_attribute_value(session, key, CKA_EC_POINT, &value, &value_len);
+		if (rv == CKR_OK)
+			rv = get_attribute_value(session, key, CKA_EC_PARAMS,
+					&params, &params_len);
+		if (rv == CKR_OK)
+			key->pubkey = ec_load_pubkey(params, params_len,
+					value, value_len);
+		break;
+#endif
+	default:
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		break;
+	}
+	free(value);
+	free(params);
+	if (rv != CKR_OK)
+		return rv;
+	if (key->pubkey == NULL) {
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "Unable to parse public key of type 0x%lx\n",
+			(unsigned long) key_type);
+		return CKR_GENERAL_ERROR;
+	}
+
+	*pkey = (EVP_PKEY *) key->pubkey;
+	return CKR_OK;
+}
+
+void sc_pkcs11_free_pubkey(struct sc_pkcs11_object *key)
+{
+	if (key->pubkey != NULL)
+		EVP_PKEY_free((EVP_PKEY *) key->pubkey);
+	key->pubkey = NULL;
+}
+
+/*
+ * RSA public key operation for CKM_RSA_PKCS and CKM_RSA_X_509.
+ * A NULL out only returns the size of the output buffer needed.
+ */
+static CK_RV rsa_public_op(EVP_PKEY *pkey, CK_MECHANISM_TYPE mech, int encrypt,
+		unsigned char *in, int in_len,
+		unsigned char *out, CK_ULONG_PTR out_len)
+{
+	RSA *rsa;
+	int pad, res;
+
+	switch (mech) {
+	case CKM_RSA_PKCS:
+		pad = RSA_PKCS1_PADDING;
+		break;
+	case CKM_RSA_X_509:
+		pad = RSA_NO_PADDING;
+		break;
+	default:
+		return CKR_ARGUMENTS_BAD;
+	}
+
+	rsa = EVP_PKEY_get1_RSA(pkey);
+	if (rsa == NULL)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	if (out == NULL || *out_len < (CK_ULONG) RSA_size(rsa)) {
+		*out_len = RSA_size(rsa);
+		RSA_free(rsa);
+		return out == NULL ? CKR_OK : CKR_BUFFER_TOO_SMALL;
+	}
+
+	if (encrypt)
+		res = RSA_public_encrypt(in_len, in, out, rsa, pad);
+	else
+		res = RSA_public_decrypt(in_len, in, out, rsa, pad);
+	RSA_free(rsa);
+	if (res <= 0) {
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "RSA_public_%s() returned %d\n",
+			encrypt ? "encrypt" : "decrypt", res);
+		return encrypt ? CKR_DATA_LEN_RANGE : CKR_SIGNATURE_INVALID;
+	}
+
+	*out_len = res;
+	return CKR_OK;
+}
+
 /* If no hash function was used, finish with RSA_public_decrypt().
  * If a hash function was used, we can make a big shortcut by
  *   finishing with EVP_VerifyFinal().
  */
-CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
-			const unsigned char *pubkey_params, int pubkey_params_len,
+CK_RV sc_pkcs11_verify_data(struct sc_pkcs11_session *session,
+			struct sc_pkcs11_object *key,
 			CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 			unsigned char *data, int data_len,
 			unsigned char *signat, int signat_len)
 {
-	int res;
-	CK_RV rv = CKR_GENERAL_ERROR;
+	unsigned char rsa_out[MAX_RSA_SIZE];
+	CK_ULONG rsa_outlen = sizeof(rsa_out);
 	EVP_PKEY *pkey;
+	int res;
+	CK_RV rv;
 
-	if (mech == CKM_GOSTR3410)
-	{
+	rv = get_pubkey(session, key, &pkey);
+	if (rv != CKR_OK)
+		return rv;
+
+	switch (mech) {
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
-		return gostr3410_verify_data(pubkey, pubkey_len,
-				pubkey_params, pubkey_params_len,
-				data, data_len, signat, signat_len);
-#else
-		(void)pubkey_params, (void)pubkey_params_len; /* no warning */
-		return CKR_FUNCTION_NOT_SUPPORTED;
+	case CKM_GOSTR3410:
+		return gostr3410_verify_data(pkey, data, data_len,
+				signat, signat_len);
+	case CKM_ECDSA:
+	case CKM_ECDSA_SHA1:
+	case CKM_ECDSA_SHA224:
+	case CKM_ECDSA_SHA256:
+	case CKM_ECDSA_SHA384:
+	case CKM_ECDSA_SHA512:
+		return ecdsa_verify_data(pkey, md, data, data_len,
+				signat, signat_len);
 #endif
+	default:
+		break;
 	}
 
-	pkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &pubkey, pubkey_len);
-	if (pkey == NULL)
-		return CKR_GENERAL_ERROR;
-
 	if (md != NULL) {
 		EVP_MD_CTX *md_ctx = DIGEST_CTX(md);
 
 		res = EVP_VerifyFinal(md_ctx, signat, signat_len, pkey);
-		EVP_PKEY_free(pkey);
 		if (res == 1)
 			return CKR_OK;
 		else if (res == 0)
@@ -433,50 +699,60 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 			return CKR_GENERAL_ERROR;
 		}
 	}
-	else {
-		RSA *rsa;
-		unsigned char *rsa_out = NULL, pad;
-		int rsa_outlen = 0;
-
-		switch(mech) {
-		case CKM_RSA_PKCS:
-		 	pad = RSA_PKCS1_PADDING;
-		 	break;
-		 case CKM_RSA_X_509:
-		 	pad = RSA_NO_PADDING;
-		 	break;
-		 default:
-			EVP_PKEY_free(pkey);
-		 	return CKR_ARGUMENTS_BAD;
-		 }
 
-		rsa = EVP_PKEY_get1_RSA(pkey);
-		EVP_PKEY_free(pkey);
-		if (rsa == NULL)
-			return CKR_DEVICE_MEMORY;
+	rv = rsa_public_op(pkey, mech, 0, signat, signat_len, rsa_out, &rsa_outlen);
+	if (rv == CKR_BUFFER_TOO_SMALL)
+		return CKR_KEY_SIZE_RANGE;
+	if (rv != CKR_OK)
+		return rv;
 
-		rsa_out = malloc(RSA_size(rsa));
-		if (rsa_out == NULL) {
-			RSA_free(rsa);
-			return CKR_DEVICE_MEMORY;
-		}
-		
-		rsa_outlen = RSA_public_decrypt(signat_len, signat, rsa_out, rsa, pad);
-		RSA_free(rsa);
-		if(rsa_outlen <= 0) {
-			free(rsa_out);
-			sc_debug(context, SC_LOG_DEBUG_NORMAL, "RSA_public_decrypt() returned %d\n", rsa_outlen);
-			return CKR_GENERAL_ERROR;
-		}
-
-		if (rsa_outlen == data_len && memcmp(rsa_out, data, data_len) == 0)
-			rv = CKR_OK;
-		else
-			rv = CKR_SIGNATURE_INVALID;
+	if (rsa_outlen == (CK_ULONG) data_len && memcmp(rsa_out, data, data_len) == 0)
+		return CKR_OK;
+	return CKR_SIGNATURE_INVALID;
+}
 
-		free(rsa_out);
+CK_RV sc_pkcs11_verify_recover_data(struct sc_pkcs11_session *session,
+			struct sc_pkcs11_object *key, CK_MECHANISM_TYPE mech,
+			unsigned char *signat, int signat_len,
+			unsigned char *out, CK_ULONG_PTR out_len)
+{
+	unsigned char rsa_out[MAX_RSA_SIZE];
+	CK_ULONG rsa_outlen = sizeof(rsa_out);
+	EVP_PKEY *pkey;
+	CK_RV rv;
+
+	rv = get_pubkey(session, key, &pkey);
+	if (rv != CKR_OK)
+		return rv;
+
+	/* The recovered length is only known after the operation */
+	rv = rsa_public_op(pkey, mech, 0, signat, signat_len, rsa_out, &rsa_outlen);
+	if (rv == CKR_BUFFER_TOO_SMALL)
+		return CKR_KEY_SIZE_RANGE;
+	if (rv != CKR_OK)
+		return rv;
+
+	if (out == NULL || *out_len < rsa_outlen) {
+		*out_len = rsa_outlen;
+		return out == NULL ? CKR_OK : CKR_BUFFER_TOO_SMALL;
 	}
+	memcpy(out, rsa_out, rsa_outlen);
+	*out_len = rsa_outlen;
+	return CKR_OK;
+}
+
+CK_RV sc_pkcs11_encrypt_data(struct sc_pkcs11_session *session,
+			struct sc_pkcs11_object *key, CK_MECHANISM_TYPE mech,
+			unsigned char *data, int data_len,
+			unsigned char *out, CK_ULONG_PTR out_len)
+{
+	EVP_PKEY *pkey;
+	CK_RV rv;
+
+	rv = get_pubkey(session, key, &pkey);
+	if (rv != CKR_OK)
+		return rv;
 
-	return rv;
+	return rsa_public_op(pkey, mech, 1, data, data_len, out, out_len);
 }
 #endif
@@ -419,6 +419,10 @@ static enum_specs ck_mec_s[] = {
   { CKM_EC_KEY_PAIR_GEN          , "CKM_EC_KEY_PAIR_GEN          " },
   { CKM_ECDSA                    , "CKM_ECDSA                    " },
   { CKM_ECDSA_SHA1               , "CKM_ECDSA_SHA1               " },
+  { CKM_ECDSA_SHA224             , "CKM_ECDSA_SHA224             " },
+  { CKM_ECDSA_SHA256             , "CKM_ECDSA_SHA256             " },
+  { CKM_ECDSA_SHA384             , "CKM_ECDSA_SHA384             " },
+  { CKM_ECDSA_SHA512             , "CKM_ECDSA_SHA512             " },
   { CKM_ECDH1_DERIVE             , "CKM_ECDH1_DERIVE             " },
   { CKM_ECDH1_COFACTOR_DERIVE    , "CKM_ECDH1_COFACTOR_DERIVE    " },
   { CKM_ECMQV_DERIVE             , "CKM_ECMQV_DERIVE             " },
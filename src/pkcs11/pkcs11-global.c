@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #ifdef HAVE_SYS_TIME_H
@@ -30,7 +31,7 @@
 
 sc_context_t *context = NULL;
 struct sc_pkcs11_config sc_pkcs11_conf;
-list_t sessions;
+struct sc_pkcs11_handle_table sessions;
 list_t virtual_slots;
 #if !defined(_WIN32)
 pid_t initialized_pid = (pid_t)-1;
@@ -38,8 +39,13 @@ pid_t initialized_pid = (pid_t)-1;
 static int in_finalize = 0;
 extern CK_FUNCTION_LIST pkcs11_function_list;
 
-#if defined(HAVE_PTHREAD) && defined(PKCS11_THREAD_LOCKING)
+#ifdef HAVE_PTHREAD
 #include <pthread.h>
+#define PKCS11_EVENT_MONITOR
+static void event_monitor_stop(void);
+#endif
+
+#if defined(HAVE_PTHREAD) && defined(PKCS11_THREAD_LOCKING)
 CK_RV mutex_create(void **mutex)
 {
 	pthread_mutex_t *m = malloc(sizeof(*mutex));
@@ -169,14 +175,6 @@ static sc_thread_context_t sc_thread_ctx = {
 };
 
 /* simclist helpers to locate interesting objects by ID */
-static int session_list_seeker(const void *el, const void *key) {
-	const struct sc_pkcs11_session *session = (struct sc_pkcs11_session *)el;
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (session->handle == *(CK_SESSION_HANDLE*)key)
-		return 1;
-	return 0;
-}
 static int slot_list_seeker(const void *el, const void *key) {
 	const struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *)el;
 	if ((el == NULL) || (key == NULL))
@@ -231,9 +229,8 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	/* Load configuration */
 	load_pkcs11_parameters(&sc_pkcs11_conf, context);
 
-	/* List of sessions */
-	list_init(&sessions);
-	list_attributes_seeker(&sessions, session_list_seeker);
+	/* Table of sessions */
+	memset(&sessions, 0, sizeof(sessions));
 	
 	/* List of slots */
 	list_init(&virtual_slots);
@@ -244,8 +241,12 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 		create_slot(NULL);
 	}
 	/* Create slots for readers found on initialization */
-	for (i=0; i<sc_ctx_get_reader_count(context); i++) {
-		initialize_reader(sc_ctx_get_reader(context, i));
+	if (sc_pkcs11_conf.detect_threads > 1) {
+		card_detect_all();
+	} else {
+		for (i=0; i<sc_ctx_get_reader_count(context); i++) {
+			initialize_reader(sc_ctx_get_reader(context, i));
+		}
 	}
 
 	/* Set initial event state on slots */
@@ -270,9 +271,36 @@ out:
 	return rv;
 }
 
+/* Append the APDU statistics of all readers to the configured stats_file */
+static void dump_stats(void)
+{
+	sc_stats_t stats;
+	char title[256];
+	FILE *out;
+	unsigned int i;
+
+	if (sc_pkcs11_conf.stats_file == NULL)
+		return;
+	out = fopen(sc_pkcs11_conf.stats_file, "a");
+	if (out == NULL) {
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "Cannot open stats file %s", sc_pkcs11_conf.stats_file);
+		return;
+	}
+	for (i = 0; i < sc_ctx_get_reader_count(context); i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(context, i);
+
+		if (sc_reader_get_stats(reader, &stats) != SC_SUCCESS || stats.apdus == 0)
+			continue;
+		snprintf(title, sizeof(title), "Reader '%s':", reader->name);
+		sc_stats_print(out, title, &stats);
+	}
+	fclose(out);
+}
+
 CK_RV C_Finalize(CK_VOID_PTR pReserved)
 {
 	int i;
+	unsigned int pos;
 	void *p;
 	sc_pkcs11_slot_t *slot;
 	CK_RV rv;
@@ -283,28 +311,37 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
+	/* cancel pending calls */
+	in_finalize = 1;
+#ifdef PKCS11_EVENT_MONITOR
+	event_monitor_stop();
+#endif
+
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Finalize()");
 	
-	/* cancel pending calls */
-	in_finalize = 1;
 	sc_cancel(context);
+	card_detect_cleanup();
+	dump_stats();
 	/* remove all cards from readers */
 	for (i=0; i < (int)sc_ctx_get_reader_count(context); i++)
 		card_removed(sc_ctx_get_reader(context, i));
 
-	while ((p = list_fetch(&sessions)))
+	for (pos = 0; (p = sc_pkcs11_handle_next(&sessions, &pos)) != NULL; )
 		free(p);
-	list_destroy(&sessions);
+	sc_pkcs11_handle_table_free(&sessions);
 
 	while ((slot = list_fetch(&virtual_slots))) {
 		list_destroy(&slot->objects);
+		sc_pkcs11_object_map_free(&slot->object_map);
+		sc_pkcs11_invalidate_find_index(slot);
 		free(slot);
 	}
 	list_destroy(&virtual_slots);
+	slot_index_free();
 
 	sc_release_context(context);
 	context = NULL;
@@ -503,6 +540,32 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 	return rv;
 }
 
+/* OpenSC extension, see pkcs11-opensc.h */
+CK_RV C_OpenSC_GetApduCount(CK_SLOT_ID slotID, CK_ULONG_PTR pulCount)
+{
+	struct sc_pkcs11_slot *slot;
+	sc_stats_t stats;
+	CK_RV rv;
+
+	if (pulCount == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = slot_get_slot(slotID, &slot);
+	if (rv == CKR_OK) {
+		if (slot->reader == NULL || sc_reader_get_stats(slot->reader, &stats) != SC_SUCCESS)
+			rv = CKR_FUNCTION_FAILED;
+		else
+			*pulCount = stats.apdus;
+	}
+
+	sc_pkcs11_unlock();
+	return rv;
+}
+
 CK_RV C_GetMechanismList(CK_SLOT_ID slotID,
 			 CK_MECHANISM_TYPE_PTR pMechanismList,
                          CK_ULONG_PTR pulCount)
@@ -552,26 +615,18 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 		  CK_ULONG ulPinLen,
 		  CK_CHAR_PTR pLabel)
 {
-	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 	CK_RV rv;
-	unsigned int i;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_token(slotID, &slot);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = slot_get_token(slotID, &slot);
-	if (rv != CKR_OK)
+	/* Make sure there's no open session for this token; sessions
+	 * are only opened with the card locked */
+	if (slot->nsessions > 0) {
+		rv = CKR_SESSION_EXISTS;
 		goto out;
-	
-	/* Make sure there's no open session for this token */
-	for (i=0; i<list_size(&sessions); i++) {
-		session = (struct sc_pkcs11_session*)list_get_at(&sessions, i);
-		if (session->slot == slot) {
-			rv = CKR_SESSION_EXISTS;
-			goto out;
-		}
 	}
 
 	if (slot->card->framework->init_token == NULL) {
@@ -586,10 +641,243 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 		 * corresponding function vector and flags */
 	}
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_token(slot);
+	return rv;
+}
+
+#ifdef PKCS11_EVENT_MONITOR
+/*
+ * Event monitor. A blocking C_WaitForSlotEvent() starts a thread that
+ * sits in sc_wait_for_event() and, whenever a reader reports something,
+ * brings the slots up to date under the global lock and wakes up the
+ * waiters. Waiters then only have to look at the slot events, and
+ * non-blocking calls no longer need to poll every reader.
+ * The thread needs the PKCS#11 locking to be on, as it works on the
+ * slots concurrently with the application, and a reader driver that
+ * can wait for events; without it the old polling is used.
+ */
+static pthread_mutex_t monitor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t monitor_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t monitor_thread;
+static int monitor_running = 0;
+static int monitor_stop = 0;
+static int monitor_started = 0;		/* thread to be joined */
+static int monitor_unsupported = 0;	/* the reader driver can not wait */
+static unsigned int monitor_mask = 0;
+static unsigned long monitor_gen = 0;		/* bumped after each event */
+static unsigned long monitor_attach_gen = 0;	/* monitor_gen of the last new reader */
+#if !defined(_WIN32)
+static pid_t monitor_pid = (pid_t)-1;
+#endif
+
+/* Sleep for a while, or until the monitor is stopped */
+static void event_monitor_pause(void)
+{
+	struct timeval now;
+	struct timespec until;
+
+	gettimeofday(&now, NULL);
+	until.tv_sec = now.tv_sec + 1;
+	until.tv_nsec = now.tv_usec * 1000;
+	pthread_mutex_lock(&monitor_lock);
+	if (!monitor_stop)
+		pthread_cond_timedwait(&monitor_cond, &monitor_lock, &until);
+	pthread_mutex_unlock(&monitor_lock);
+}
+
+static void *event_monitor(void *arg)
+{
+	void *reader_states = NULL;
+	sc_reader_t *found;
+	unsigned int events;
+	int r, stop;
+
+	(void)arg;
+
+	for (;;) {
+		events = 0;
+		r = sc_wait_for_event(context, monitor_mask, &found, &events, -1, &reader_states);
+
+		pthread_mutex_lock(&monitor_lock);
+		stop = monitor_stop;
+		pthread_mutex_unlock(&monitor_lock);
+		if (stop)
+			break;
+
+		if (r == SC_ERROR_NOT_SUPPORTED) {
+			sc_debug(context, SC_LOG_DEBUG_NORMAL, "event monitor: reader driver can not wait for events");
+			pthread_mutex_lock(&monitor_lock);
+			monitor_unsupported = 1;
+			pthread_mutex_unlock(&monitor_lock);
+			break;
+		}
+		if (r != SC_SUCCESS) {
+			/* No readers to watch, or PC/SC trouble: don't spin */
+			sc_debug(context, SC_LOG_DEBUG_NORMAL, "event monitor: sc_wait_for_event() returned %d", r);
+			if (reader_states)
+				sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
+			event_monitor_pause();
+			continue;
+		}
+
+		/* Watch the new set of readers from now on */
+		if (events & (SC_EVENT_READER_ATTACHED | SC_EVENT_READER_DETACHED))
+			sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
+
+		if (sc_pkcs11_lock() != CKR_OK)
+			break;
+		if (events & SC_EVENT_READER_ATTACHED)
+			sc_ctx_detect_readers(context);
+		card_detect_all();
+		sc_pkcs11_unlock();
+
+		pthread_mutex_lock(&monitor_lock);
+		monitor_gen++;
+		if (events & SC_EVENT_READER_ATTACHED)
+			monitor_attach_gen = monitor_gen;
+		pthread_cond_broadcast(&monitor_cond);
+		pthread_mutex_unlock(&monitor_lock);
+	}
+
+	if (reader_states)
+		sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
+	pthread_mutex_lock(&monitor_lock);
+	monitor_running = 0;
+	pthread_cond_broadcast(&monitor_cond);
+	pthread_mutex_unlock(&monitor_lock);
+	return NULL;
+}
+
+/* Called with the global lock held */
+static CK_RV event_monitor_start(unsigned int mask)
+{
+	CK_RV rv = CKR_OK;
+
+	if (!global_lock || context->reader_driver->ops->wait_for_event == NULL)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	pthread_mutex_lock(&monitor_lock);
+	if (monitor_unsupported)
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+	else if (!monitor_running) {
+		/* Reap a thread that gave up */
+		if (monitor_started) {
+			pthread_join(monitor_thread, NULL);
+			monitor_started = 0;
+		}
+		monitor_stop = 0;
+		monitor_mask = mask;
+		monitor_running = 1;
+		if (pthread_create(&monitor_thread, NULL, event_monitor, NULL) != 0) {
+			monitor_running = 0;
+			rv = CKR_FUNCTION_FAILED;
+		} else {
+			monitor_started = 1;
+#if !defined(_WIN32)
+			monitor_pid = getpid();
+#endif
+		}
+	}
+	pthread_mutex_unlock(&monitor_lock);
 	return rv;
 }
 
+/* Called without the global lock, which the monitor thread may need */
+static void event_monitor_stop(void)
+{
+	struct timeval now;
+	struct timespec until;
+	int running;
+
+	pthread_mutex_lock(&monitor_lock);
+	running = monitor_started;
+#if !defined(_WIN32)
+	/* The thread did not survive a fork() */
+	if (running && monitor_pid != getpid())
+		running = monitor_running = 0;
+#endif
+	monitor_started = 0;
+	monitor_unsupported = 0;
+	monitor_stop = 1;
+	pthread_cond_broadcast(&monitor_cond);
+	/* The thread may not be in SCardGetStatusChange() yet: keep cancelling */
+	while (monitor_running) {
+		pthread_mutex_unlock(&monitor_lock);
+		sc_cancel(context);
+		gettimeofday(&now, NULL);
+		until.tv_sec = now.tv_sec;
+		until.tv_nsec = now.tv_usec * 1000 + 100000000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		pthread_mutex_lock(&monitor_lock);
+		if (monitor_running)
+			pthread_cond_timedwait(&monitor_cond, &monitor_lock, &until);
+	}
+	pthread_mutex_unlock(&monitor_lock);
+	if (running)
+		pthread_join(monitor_thread, NULL);
+}
+
+static int event_monitor_active(void)
+{
+	int running;
+
+	pthread_mutex_lock(&monitor_lock);
+	running = monitor_running;
+	pthread_mutex_unlock(&monitor_lock);
+	return running;
+}
+
+/* Called with the global lock held, returns with it held unless
+ * something other than CKR_OK or CKR_FUNCTION_NOT_SUPPORTED, which
+ * means that the monitor is gone, is returned */
+static CK_RV event_monitor_wait(CK_SLOT_ID_PTR slot_id, unsigned int mask)
+{
+	unsigned long gen;
+	int attached, running;
+	CK_RV rv;
+
+	pthread_mutex_lock(&monitor_lock);
+	gen = monitor_gen;
+	pthread_mutex_unlock(&monitor_lock);
+
+	for (;;) {
+		rv = slot_find_changed(slot_id, mask);
+		if (rv == CKR_OK)
+			return rv;
+
+		sc_pkcs11_unlock();
+		pthread_mutex_lock(&monitor_lock);
+		while (gen == monitor_gen && monitor_running)
+			pthread_cond_wait(&monitor_cond, &monitor_lock);
+		attached = monitor_attach_gen > gen;
+		running = monitor_running;
+		gen = monitor_gen;
+		pthread_mutex_unlock(&monitor_lock);
+
+		/* Was C_Finalize called ? */
+		if (in_finalize == 1)
+			return CKR_CRYPTOKI_NOT_INITIALIZED;
+		if ((rv = sc_pkcs11_lock()) != CKR_OK)
+			return rv;
+		if (!running) {
+			/* Let the caller wait without the monitor */
+			return CKR_FUNCTION_NOT_SUPPORTED;
+		}
+
+		if (sc_pkcs11_conf.plug_and_play && attached) {
+			/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
+			   Change the first hotplug slot id on every call to make this happen. */
+			sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
+			*slot_id = hotplug_slot->id - 1;
+			return CKR_OK;
+		}
+	}
+}
+#endif
+
 CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 			 CK_SLOT_ID_PTR pSlot,  /* location that receives the slot ID */
 			 CK_VOID_PTR pReserved) /* reserved.  Should be NULL_PTR */
@@ -597,7 +885,7 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 	sc_reader_t *found;
 	unsigned int mask, events;
 	void *reader_states = NULL;
-	CK_SLOT_ID slot_id;
+	CK_SLOT_ID slot_id = 0;
 	CK_RV rv;
 	int r;
 	
@@ -605,10 +893,6 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 		return  CKR_ARGUMENTS_BAD;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_WaitForSlotEvent(block=%d)", !(flags & CKF_DONT_BLOCK));
-	/* Not all pcsc-lite versions implement consistently used functions as they are */
-	/* FIXME: add proper checking into build to check correct pcsc-lite version for SCardStatusChange/SCardCancel */
-	if (!(flags & CKF_DONT_BLOCK))
-		return CKR_FUNCTION_NOT_SUPPORTED;
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
@@ -620,26 +904,28 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 		mask |= SC_EVENT_READER_EVENTS;
 	}
 
+#ifdef PKCS11_EVENT_MONITOR
+	if (!(flags & CKF_DONT_BLOCK) && event_monitor_start(mask) == CKR_OK) {
+		rv = event_monitor_wait(&slot_id, mask);
+		if (rv == CKR_OK)
+			goto out;
+		if (rv != CKR_FUNCTION_NOT_SUPPORTED)
+			return rv;
+		/* The monitor gave up, so do without */
+	}
+	/* The monitor keeps the slots up to date */
+	if (!event_monitor_active())
+#endif
+	card_detect_all();
 	rv = slot_find_changed(&slot_id, mask);
 	if ((rv == CKR_OK) || (flags & CKF_DONT_BLOCK))
 		goto out;
 
+	/* Without the monitor thread, wait in this one */
 again:
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_WaitForSlotEvent() reader_states:%p", reader_states);
 	sc_pkcs11_unlock();
 	r = sc_wait_for_event(context, mask, &found, &events, -1, &reader_states);
-	if (sc_pkcs11_conf.plug_and_play && events & SC_EVENT_READER_ATTACHED) {
-		/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
-		   Change the first hotplug slot id on every call to make this happen. */
-		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
-		*pSlot= hotplug_slot->id -1;
-	
-		rv = sc_pkcs11_lock();
-		if (rv != CKR_OK)
-			return rv;
-
-		goto out;
-	}
 	/* Was C_Finalize called ? */
 	if (in_finalize == 1)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
@@ -653,8 +939,17 @@ again:
 		goto out;
 	}
 
+	if (sc_pkcs11_conf.plug_and_play && events & SC_EVENT_READER_ATTACHED) {
+		/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
+		   Change the first hotplug slot id on every call to make this happen. */
+		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
+		slot_id = hotplug_slot->id - 1;
+		goto out;
+	}
+
 	/* If no changed slot was found (maybe an unsupported card
 	 * was inserted/removed) then go waiting again */
+	card_detect_all();
 	rv = slot_find_changed(&slot_id, mask);
 	if (rv != CKR_OK)
 		goto again;
@@ -669,7 +964,7 @@ out:
 		sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
 	}
 
-	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_WaitForSlotEvent() = %s, event in 0x%lx", lookup_enum (RV_T, rv), *pSlot);
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_WaitForSlotEvent() = %s, event in 0x%lx", lookup_enum (RV_T, rv), slot_id);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -761,6 +1056,44 @@ void sc_pkcs11_unlock(void)
 	__sc_pkcs11_unlock(global_lock);
 }
 
+/*
+ * Per-card locks. The global lock protects the slot and session lists
+ * and reader/card detection; each card's lock serializes the work done
+ * on it (objects, login state, card I/O) through any of its slots, so
+ * that a long card operation does not stall the other cards.
+ * The global lock may be taken while holding a card lock, but nobody
+ * waits for a card lock while holding the global lock: callers hold on
+ * to the card under the global lock, see sc_pkcs11_lock_token(), and
+ * only then drop it and wait for the card.
+ */
+CK_RV sc_pkcs11_init_card_lock(struct sc_pkcs11_card *p11card)
+{
+	p11card->lock = NULL;
+	if (!global_lock || !global_locking)
+		return CKR_OK;
+	return global_locking->CreateMutex(&p11card->lock);
+}
+
+void sc_pkcs11_lock_card(struct sc_pkcs11_card *p11card)
+{
+	if (!p11card->lock || !global_locking)
+		return;
+	while (global_locking->LockMutex(p11card->lock) != CKR_OK)
+		;
+}
+
+void sc_pkcs11_unlock_card(struct sc_pkcs11_card *p11card)
+{
+	__sc_pkcs11_unlock(p11card->lock);
+}
+
+void sc_pkcs11_free_card_lock(struct sc_pkcs11_card *p11card)
+{
+	if (p11card->lock && global_locking)
+		global_locking->DestroyMutex(p11card->lock);
+	p11card->lock = NULL;
+}
+
 /*
  * Free the lock - note the lock must be held when
  * you come here
@@ -45,6 +45,10 @@ static sc_pkcs11_mechanism_type_t find_mechanism = {
 	NULL,		/* verif_init */
 	NULL,		/* verif_update */
 	NULL,		/* verif_final */
+	NULL,		/* verif_recover_init */
+	NULL,		/* verif_recover */
+	NULL,		/* encrypt_init */
+	NULL,		/* encrypt */
 #endif
 	NULL,		/* decrypt_init */
 	NULL,		/* decrypt */
@@ -64,20 +68,13 @@ static void sc_find_release(sc_pkcs11_operation_t *operation)
 	}
 }
 
-static CK_RV get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
-				     struct sc_pkcs11_session **session,
+/* Called with the session locked */
+static CK_RV get_object_from_session(struct sc_pkcs11_session *session, CK_OBJECT_HANDLE hObject,
 				     struct sc_pkcs11_object **object)
 {
-	CK_RV rv;
-	struct sc_pkcs11_session *sess;
-	rv = get_session(hSession, &sess);
-	if (rv != CKR_OK)
-		return rv;
-
-	*object = list_seek(&sess->slot->objects, &hObject);
+	*object = sc_pkcs11_object_map_find(&session->slot->object_map, hObject);
 	if (!*object)
 		return CKR_OBJECT_HANDLE_INVALID;
-	*session = sess;
 	return CKR_OK;
 }
 
@@ -93,7 +90,7 @@ CK_RV C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 	SC_FUNC_CALLED(context, SC_LOG_DEBUG_VERBOSE);
@@ -101,12 +98,6 @@ CK_RV C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_CreateObject()", pTemplate, ulCount);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -119,7 +110,7 @@ CK_RV C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = card->framework->create_object(card, session->slot,
 				pTemplate, ulCount, phObject);
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	SC_FUNC_RETURN(context, SC_LOG_DEBUG_VERBOSE, rv);
 }
 
@@ -139,13 +130,13 @@ CK_RV C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DestroyObject(hSession=0x%lx, hObject=0x%lx)", hSession, hObject);
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -159,7 +150,7 @@ CK_RV C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	else
 		rv = object->ops->destroy_object(session, object);
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -193,11 +184,11 @@ CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -233,7 +224,7 @@ CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = %s",
 			hSession, hObject, lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -250,13 +241,13 @@ CK_RV C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_SetAttributeValue", pTemplate, ulCount);
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -273,37 +264,250 @@ CK_RV C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			if (rv != CKR_OK)
 				break;
 		}
+		/* cached CKA_ID/CKA_LABEL may be stale now */
+		object->attr_cache.flags = 0;
+		sc_pkcs11_invalidate_find_index(session->slot);
 	}
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
+/*
+ * C_FindObjectsInit() support: each object caches the attributes most
+ * templates are made of, and each slot keeps tables of its objects by
+ * CKA_CLASS and CKA_ID. The tables are built on the first search and
+ * dropped whenever objects are added to or removed from the slot.
+ */
+#define SC_PKCS11_FIND_INDEX_SIZE	64
+
+struct sc_pkcs11_find_bucket {
+	unsigned int *pos;	/* ascending positions in find_index->objects */
+	unsigned int count, allocated;
+};
+
+struct sc_pkcs11_find_index {
+	struct sc_pkcs11_object **objects;	/* slot->objects, in list order */
+	unsigned int count;
+	struct sc_pkcs11_find_bucket by_class[SC_PKCS11_FIND_INDEX_SIZE];
+	struct sc_pkcs11_find_bucket by_id[SC_PKCS11_FIND_INDEX_SIZE];
+	/* objects without a cached CKA_CLASS resp. CKA_ID */
+	struct sc_pkcs11_find_bucket no_class, no_id;
+};
+
+static unsigned int find_index_hash(const CK_BYTE *data, CK_ULONG len)
+{
+	unsigned int hash = 2166136261U;
+
+	while (len--) {
+		hash ^= *data++;
+		hash *= 16777619U;
+	}
+	return hash % SC_PKCS11_FIND_INDEX_SIZE;
+}
+
+static int find_bucket_add(struct sc_pkcs11_find_bucket *bucket, unsigned int pos)
+{
+	unsigned int *tmp;
+
+	if (bucket->count == bucket->allocated) {
+		tmp = realloc(bucket->pos, (bucket->allocated + 8) * sizeof(unsigned int));
+		if (tmp == NULL)
+			return -1;
+		bucket->pos = tmp;
+		bucket->allocated += 8;
+	}
+	bucket->pos[bucket->count++] = pos;
+	return 0;
+}
+
+static int cache_attribute(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object,
+		CK_ATTRIBUTE_TYPE type, void *value, CK_ULONG *len)
+{
+	CK_ATTRIBUTE attr;
+
+	attr.type = type;
+	attr.pValue = value;
+	attr.ulValueLen = *len;
+	if (object->ops->get_attribute(session, object, &attr) != CKR_OK)
+		return 0;
+	*len = attr.ulValueLen;
+	return 1;
+}
+
+static void cache_object_attributes(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object)
+{
+	struct sc_pkcs11_attr_cache *cache = &object->attr_cache;
+	CK_ULONG len;
+
+	if (cache->flags & SC_PKCS11_ATTR_CACHE_VALID)
+		return;
+	memset(cache, 0, sizeof(*cache));
+
+	len = sizeof(cache->class);
+	if (cache_attribute(session, object, CKA_CLASS, &cache->class, &len)
+			&& len == sizeof(cache->class))
+		cache->flags |= SC_PKCS11_ATTR_CACHE_CLASS;
+	len = sizeof(cache->private);
+	if (cache_attribute(session, object, CKA_PRIVATE, &cache->private, &len)
+			&& len == sizeof(cache->private))
+		cache->flags |= SC_PKCS11_ATTR_CACHE_PRIVATE;
+	/* The key type of a public key may only be known once the key
+	 * value has been read, so leave it to get_attribute() */
+	len = sizeof(cache->key_type);
+	if ((cache->flags & SC_PKCS11_ATTR_CACHE_CLASS) && cache->class != CKO_PUBLIC_KEY
+			&& cache_attribute(session, object, CKA_KEY_TYPE, &cache->key_type, &len)
+			&& len == sizeof(cache->key_type))
+		cache->flags |= SC_PKCS11_ATTR_CACHE_KEY_TYPE;
+	cache->id_len = sizeof(cache->id);
+	if (cache_attribute(session, object, CKA_ID, cache->id, &cache->id_len))
+		cache->flags |= SC_PKCS11_ATTR_CACHE_ID;
+	cache->label_len = sizeof(cache->label);
+	if (cache_attribute(session, object, CKA_LABEL, cache->label, &cache->label_len))
+		cache->flags |= SC_PKCS11_ATTR_CACHE_LABEL;
+
+	cache->flags |= SC_PKCS11_ATTR_CACHE_VALID;
+}
+
+/* Returns 1 on match, 0 on mismatch and -1 if the attribute isn't cached */
+static int cmp_cached_attribute(const struct sc_pkcs11_attr_cache *cache, CK_ATTRIBUTE_PTR attr)
+{
+	const void *value;
+	CK_ULONG len;
+
+	switch (attr->type) {
+	case CKA_CLASS:
+		if (!(cache->flags & SC_PKCS11_ATTR_CACHE_CLASS))
+			return -1;
+		value = &cache->class;
+		len = sizeof(cache->class);
+		break;
+	case CKA_PRIVATE:
+		if (!(cache->flags & SC_PKCS11_ATTR_CACHE_PRIVATE))
+			return -1;
+		value = &cache->private;
+		len = sizeof(cache->private);
+		break;
+	case CKA_KEY_TYPE:
+		if (!(cache->flags & SC_PKCS11_ATTR_CACHE_KEY_TYPE))
+			return -1;
+		value = &cache->key_type;
+		len = sizeof(cache->key_type);
+		break;
+	case CKA_ID:
+		if (!(cache->flags & SC_PKCS11_ATTR_CACHE_ID))
+			return -1;
+		value = cache->id;
+		len = cache->id_len;
+		break;
+	case CKA_LABEL:
+		if (!(cache->flags & SC_PKCS11_ATTR_CACHE_LABEL))
+			return -1;
+		value = cache->label;
+		len = cache->label_len;
+		break;
+	default:
+		return -1;
+	}
+
+	if (attr->ulValueLen != len)
+		return 0;
+	return len == 0 || (attr->pValue != NULL && !memcmp(attr->pValue, value, len));
+}
+
+static void find_index_free(struct sc_pkcs11_find_index *index)
+{
+	unsigned int i;
+
+	for (i = 0; i < SC_PKCS11_FIND_INDEX_SIZE; i++) {
+		free(index->by_class[i].pos);
+		free(index->by_id[i].pos);
+	}
+	free(index->no_class.pos);
+	free(index->no_id.pos);
+	free(index->objects);
+	free(index);
+}
+
+static struct sc_pkcs11_find_index *find_index_build(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_find_index *index;
+	struct sc_pkcs11_attr_cache *cache;
+	struct sc_pkcs11_find_bucket *bucket;
+	struct sc_pkcs11_object *object;
+	unsigned int i, size;
+
+	index = calloc(1, sizeof(*index));
+	if (index == NULL)
+		return NULL;
+	size = list_size(&slot->objects);
+	index->objects = calloc(size ? size : 1, sizeof(struct sc_pkcs11_object *));
+	if (index->objects == NULL)
+		goto err;
+
+	list_iterator_start(&slot->objects);
+	while (index->count < size && list_iterator_hasnext(&slot->objects))
+		index->objects[index->count++] = (struct sc_pkcs11_object *)list_iterator_next(&slot->objects);
+	list_iterator_stop(&slot->objects);
+
+	for (i = 0; i < index->count; i++) {
+		object = index->objects[i];
+		cache = &object->attr_cache;
+		cache_object_attributes(session, object);
+
+		if (cache->flags & SC_PKCS11_ATTR_CACHE_CLASS)
+			bucket = &index->by_class[cache->class % SC_PKCS11_FIND_INDEX_SIZE];
+		else
+			bucket = &index->no_class;
+		if (find_bucket_add(bucket, i))
+			goto err;
+
+		if (cache->flags & SC_PKCS11_ATTR_CACHE_ID)
+			bucket = &index->by_id[find_index_hash(cache->id, cache->id_len)];
+		else
+			bucket = &index->no_id;
+		if (find_bucket_add(bucket, i))
+			goto err;
+	}
+
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Indexed %u objects of slot %lu", index->count, slot->id);
+	return index;
+err:
+	find_index_free(index);
+	return NULL;
+}
+
+void sc_pkcs11_invalidate_find_index(struct sc_pkcs11_slot *slot)
+{
+	if (slot->find_index != NULL)
+		find_index_free(slot->find_index);
+	slot->find_index = NULL;
+}
+
 CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			CK_ATTRIBUTE_PTR pTemplate,	/* attribute values to match */
 			CK_ULONG ulCount)
 {				/* attributes in search template */
 	CK_RV rv;
-	CK_BBOOL is_private = TRUE;
+	CK_BBOOL is_private;
 	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
 	int match, hide_private;
-	unsigned int i, j;
+	unsigned int i, j, k, pos;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_find_operation *operation;
+	struct sc_pkcs11_find_index *index;
+	struct sc_pkcs11_find_bucket *bucket, *rest;
 	struct sc_pkcs11_slot *slot;
 
 	if (pTemplate == NULL_PTR && ulCount > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_FindObjectsInit(slot = %d)\n", session->slot->id);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_FindObjectsInit()", pTemplate, ulCount);
 
@@ -318,44 +522,72 @@ CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	operation->handles = NULL;
 	slot = session->slot;
 
+	if (slot->find_index == NULL)
+		slot->find_index = find_index_build(session, slot);
+	index = slot->find_index;
+	if (index == NULL) {
+		rv = CKR_HOST_MEMORY;
+		goto out;
+	}
+
 	/* Check whether we should hide private objects */
 	hide_private = 0;
 	if (slot->login_user != CKU_USER && (slot->token_info.flags & CKF_LOGIN_REQUIRED))
 		hide_private = 1;
-        
-	/* For each object in token do */
-	for (i=0; i<list_size(&slot->objects); i++) {
-		object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
-		sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object with handle 0x%lx", object->handle);
+
+	/* Only look at the objects filed under the template's CKA_ID
+	 * or, failing that, its CKA_CLASS */
+	bucket = rest = NULL;
+	for (j = 0; j < ulCount; j++) {
+		if (pTemplate[j].type == CKA_ID
+		 && (pTemplate[j].pValue != NULL || pTemplate[j].ulValueLen == 0)) {
+			bucket = &index->by_id[find_index_hash(pTemplate[j].pValue, pTemplate[j].ulValueLen)];
+			rest = &index->no_id;
+			break;
+		}
+		if (pTemplate[j].type == CKA_CLASS && pTemplate[j].pValue != NULL
+		 && pTemplate[j].ulValueLen == sizeof(CK_OBJECT_CLASS)) {
+			bucket = &index->by_class[*(CK_OBJECT_CLASS *)pTemplate[j].pValue % SC_PKCS11_FIND_INDEX_SIZE];
+			rest = &index->no_class;
+		}
+	}
+
+	/* For each candidate object in token order do */
+	for (i = k = 0; ; ) {
+		if (bucket == NULL) {
+			if (i >= index->count)
+				break;
+			pos = i++;
+		} else if (i < bucket->count && (k >= rest->count || bucket->pos[i] < rest->pos[k])) {
+			pos = bucket->pos[i++];
+		} else if (k < rest->count) {
+			pos = rest->pos[k++];
+		} else {
+			break;
+		}
+		object = index->objects[pos];
 
 		/* User not logged in and private object? */ 
 		if (hide_private) {
-			if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
+			if (object->attr_cache.flags & SC_PKCS11_ATTR_CACHE_PRIVATE)
+				is_private = object->attr_cache.private;
+			else if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
 			        continue;
-			if (is_private) {
-				sc_debug(context, SC_LOG_DEBUG_NORMAL,
-					 "Object %d/%d: Private object and not logged in.\n",
-					 slot->id, object->handle);
+			if (is_private)
 				continue;
-			}
 		}
 
 		/* Try to match every attribute */
 		match = 1;
 		for (j = 0; j < ulCount; j++) {
-			rv = object->ops->cmp_attribute(session, object, &pTemplate[j]);
-			if (rv == 0) {
-				sc_debug(context, SC_LOG_DEBUG_NORMAL,
-					 "Object %d/%d: Attribute 0x%x does NOT match.\n",
-					 slot->id, object->handle, pTemplate[j].type);
+			int r = cmp_cached_attribute(&object->attr_cache, &pTemplate[j]);
+
+			if (r < 0)
+				r = object->ops->cmp_attribute(session, object, &pTemplate[j]);
+			if (r == 0) {
 				match = 0;
 				break;
 			}
-
-			if (context->debug >= 4) {
-				sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object %d/%d: Attribute 0x%x matches.\n",
-					 slot->id, object->handle, pTemplate[j].type);
-			}
 		}
 
 		if (match) {
@@ -379,7 +611,7 @@ CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "%d matching objects\n", operation->num_handles);
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -396,14 +628,10 @@ CK_RV C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (phObject == NULL_PTR || ulMaxObjectCount == 0 || pulObjectCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = session_get_operation(session, SC_PKCS11_OPERATION_FIND,
 				   (sc_pkcs11_operation_t **) & operation);
 	if (rv != CKR_OK)
@@ -421,7 +649,7 @@ CK_RV C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	operation->current_handle += to_return;
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -430,19 +658,15 @@ CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE hSession)
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = session_get_operation(session, SC_PKCS11_OPERATION_FIND, NULL);
 	if (rv == CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 
-out:	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -460,17 +684,15 @@ CK_RV C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DigestInit(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_init(session, pMechanism);
+	rv = sc_pkcs11_md_init(session, pMechanism);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DigestInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -483,21 +705,17 @@ CK_RV C_Digest(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Digest(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = sc_pkcs11_md_update(session, pData, ulDataLen);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
-out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -508,16 +726,14 @@ CK_RV C_DigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DigestUpdate() == %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -534,16 +750,14 @@ CK_RV C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
+	rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DigestFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -562,11 +776,11 @@ CK_RV C_SignInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -592,7 +806,7 @@ CK_RV C_SignInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_sign_init(session, pMechanism, object, key_type);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_SignInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -606,14 +820,10 @@ CK_RV C_Sign(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	CK_ULONG length;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
 	 * signature buffer size, or if the result would be
@@ -633,7 +843,7 @@ CK_RV C_Sign(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = sc_pkcs11_sign_final(session, pSignature, pulSignatureLen);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Sign() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -644,16 +854,14 @@ CK_RV C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_SignUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -665,14 +873,10 @@ CK_RV C_SignFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ULONG length;
 	CK_RV rv;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
 	 * signature buffer size, or if the result would be
@@ -689,7 +893,7 @@ CK_RV C_SignFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_SignFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -711,11 +915,11 @@ CK_RV C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -745,7 +949,7 @@ CK_RV C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_sign_init(session, pMechanism, object, key_type);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_SignRecoverInit() = %sn", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -762,7 +966,48 @@ CK_RV C_EncryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		    CK_MECHANISM_PTR pMechanism,	/* the encryption mechanism */
 		    CK_OBJECT_HANDLE hKey)
 {				/* handle of encryption key */
+#ifndef ENABLE_OPENSSL
 	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	CK_RV rv;
+	CK_BBOOL can_encrypt;
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE encrypt_attribute = { CKA_ENCRYPT, &can_encrypt, sizeof(can_encrypt) };
+	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *object;
+
+	if (pMechanism == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_object_from_session(session, hKey, &object);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+
+	rv = object->ops->get_attribute(session, object, &encrypt_attribute);
+	if (rv != CKR_OK || !can_encrypt) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+	rv = object->ops->get_attribute(session, object, &key_type_attr);
+	if (rv != CKR_OK) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	rv = sc_pkcs11_encr_init(session, pMechanism, object, key_type);
+
+out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_EncryptInit() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
+#endif
 }
 
 CK_RV C_Encrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -771,7 +1016,23 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_BYTE_PTR pEncryptedData,	/* receives encrypted data */
 		CK_ULONG_PTR pulEncryptedDataLen)
 {				/* receives encrypted byte count */
+#ifndef ENABLE_OPENSSL
 	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_pkcs11_encr(session, pData, ulDataLen,
+			pEncryptedData, pulEncryptedDataLen);
+
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Encrypt() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
+#endif
 }
 
 CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -805,11 +1066,11 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -835,7 +1096,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_decr_init(session, pMechanism, object, key_type);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DecryptInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -848,17 +1109,15 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
-				pData, pulDataLen);
+	rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
+			pData, pulDataLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Decrypt() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -941,17 +1200,13 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			|| (pPrivateKeyTemplate == NULL_PTR && ulPrivateKeyAttributeCount > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PrivKey attrs", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PubKey attrs", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -969,7 +1224,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 							phPrivateKey);
 	}
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1021,20 +1276,17 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK) {
-		slot = session->slot;
-		if (slot->card->framework->get_random == NULL)
-			rv = CKR_RANDOM_NO_RNG;
-		else
-			rv = slot->card->framework->get_random(slot->card, RandomData, ulRandomLen);
-	}
+	slot = session->slot;
+	if (slot->card->framework->get_random == NULL)
+		rv = CKR_RANDOM_NO_RNG;
+	else
+		rv = slot->card->framework->get_random(slot->card, RandomData, ulRandomLen);
 
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1068,12 +1320,12 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1095,7 +1347,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_verif_init(session, pMechanism, object, key_type);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_VerifyInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1112,20 +1364,16 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = sc_pkcs11_verif_update(session, pData, ulDataLen);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
-out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1140,16 +1388,14 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_VerifyUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1164,16 +1410,14 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
+	rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_VerifyFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1182,7 +1426,47 @@ CK_RV C_VerifyRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			  CK_MECHANISM_PTR pMechanism,	/* the verification mechanism */
 			  CK_OBJECT_HANDLE hKey)
 {				/* handle of the verification key */
+#ifndef ENABLE_OPENSSL
 	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	CK_BBOOL can_verify_recover;
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE verify_recover_attribute = { CKA_VERIFY_RECOVER, &can_verify_recover, sizeof(can_verify_recover) };
+	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *object;
+
+	if (pMechanism == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_object_from_session(session, hKey, &object);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+	rv = object->ops->get_attribute(session, object, &verify_recover_attribute);
+	if (rv != CKR_OK || !can_verify_recover) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+	rv = object->ops->get_attribute(session, object, &key_type_attr);
+	if (rv != CKR_OK) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	rv = sc_pkcs11_verif_recover_init(session, pMechanism, object, key_type);
+
+out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_VerifyRecoverInit() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
+#endif
 }
 
 CK_RV C_VerifyRecover(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -1191,7 +1475,23 @@ CK_RV C_VerifyRecover(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		      CK_BYTE_PTR pData,	/* receives decrypted data (digest) */
 		      CK_ULONG_PTR pulDataLen)
 {				/* receives byte count of data */
+#ifndef ENABLE_OPENSSL
 	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_pkcs11_verif_recover(session, pSignature, ulSignatureLen,
+			pData, pulDataLen);
+
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_VerifyRecover() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
+#endif
 }
 
 /*
@@ -9,4 +9,12 @@
  */
 #define OPENSC_CKA_NON_REPUDIATION      (CKA_VENDOR_DEFINED | 1UL)
 
+/*
+ * Number of APDUs exchanged with the reader of a slot since C_Initialize,
+ * for benchmarks. Not in the function list: look it up in the module
+ * by the name OPENSC_GET_APDU_COUNT.
+ */
+#define OPENSC_GET_APDU_COUNT		"C_OpenSC_GetApduCount"
+typedef CK_RV (*OPENSC_GET_APDU_COUNT_FN)(CK_SLOT_ID slotID, CK_ULONG_PTR pulCount);
+
 #endif
@@ -28,12 +28,70 @@
 
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
 {
-	*session = list_seek(&sessions, &hSession);
+	*session = sc_pkcs11_handle_get(&sessions, hSession);
 	if (!*session)
 		return CKR_SESSION_HANDLE_INVALID;
 	return CKR_OK;
 }
 
+/* Drop the references taken by sc_pkcs11_lock_session() */
+static void session_put(struct sc_pkcs11_session *session, struct sc_pkcs11_card *card)
+{
+	if (sc_pkcs11_lock() != CKR_OK)
+		return;
+	if (--session->refs == 0 && session->closed)
+		free(session);
+	card_put(card);
+	sc_pkcs11_unlock();
+}
+
+/*
+ * Look up a session and lock the card it belongs to. The global lock
+ * is only held for the lookup: the session and the card are referenced
+ * so they stay around while we wait for the card, and rechecked once
+ * we have it.
+ */
+CK_RV sc_pkcs11_lock_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
+{
+	struct sc_pkcs11_session *sess;
+	struct sc_pkcs11_card *card = NULL;
+	CK_RV rv;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+	rv = get_session(hSession, &sess);
+	if (rv == CKR_OK && (card = sess->slot->card) == NULL)
+		rv = CKR_TOKEN_NOT_PRESENT;
+	if (rv == CKR_OK) {
+		sess->refs++;
+		card->refs++;
+	}
+	sc_pkcs11_unlock();
+	if (rv != CKR_OK)
+		return rv;
+
+	sc_pkcs11_lock_card(card);
+	if (sess->closed || card->removed) {
+		rv = sess->closed ? CKR_SESSION_HANDLE_INVALID : CKR_DEVICE_REMOVED;
+		sc_pkcs11_unlock_card(card);
+		session_put(sess, card);
+		return rv;
+	}
+
+	*session = sess;
+	return CKR_OK;
+}
+
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *session)
+{
+	/* The slot keeps its card while the card is referenced */
+	struct sc_pkcs11_card *card = session->slot->card;
+
+	sc_pkcs11_unlock_card(card);
+	session_put(session, card);
+}
+
 CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 		    CK_FLAGS flags,	/* defined in CK_SESSION_INFO */
 		    CK_VOID_PTR pApplication,	/* pointer passed to callback */
@@ -50,102 +108,121 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	if (flags & ~(CKF_SERIAL_SESSION | CKF_RW_SESSION))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_OpenSession(0x%lx)", slotID);
 
-	rv = slot_get_token(slotID, &slot);
+	rv = sc_pkcs11_lock_token(slotID, &slot);
 	if (rv != CKR_OK)
 		goto out;
 
 	/* Check that no conflictions sessions exist */
 	if (!(flags & CKF_RW_SESSION) && (slot->login_user == CKU_SO)) {
 		rv = CKR_SESSION_READ_WRITE_SO_EXISTS;
-		goto out;
+		goto out_token;
 	}
 
 	session = (struct sc_pkcs11_session *)calloc(1, sizeof(struct sc_pkcs11_session));
 	if (session == NULL) {
 		rv = CKR_HOST_MEMORY;
-		goto out;
+		goto out_token;
 	}
 
 	session->slot = slot;
 	session->notify_callback = Notify;
 	session->notify_data = pApplication;
 	session->flags = flags;
-	slot->nsessions++;
-	session->handle = (CK_SESSION_HANDLE) session;	/* cast a pointer to long */
-	list_append(&sessions, session);
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK) {
+		free(session);
+		goto out_token;
+	}
+	session->handle = sc_pkcs11_handle_add(&sessions, session);
+	if (session->handle != 0)
+		slot->nsessions++;
+	sc_pkcs11_unlock();
+	if (session->handle == 0) {
+		free(session);
+		rv = CKR_HOST_MEMORY;
+		goto out_token;
+	}
 	*phSession = session->handle;
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_OpenSession handle: 0x%lx", session->handle);
 
+out_token:
+	sc_pkcs11_unlock_token(slot);
 out:
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_OpenSession() = %s", lookup_enum(RV_T, rv));
-	sc_pkcs11_unlock();
 	return rv;
 }
 
-/* Internal version of C_CloseSession that gets called with
- * the global lock held */
-static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
+/* Take a session off the session list. Called with the global lock
+ * held; returns 1 if it was the last session of its slot */
+static int session_remove(struct sc_pkcs11_session *session)
 {
-	struct sc_pkcs11_slot *slot;
-	struct sc_pkcs11_session *session;
-
-	sc_debug(context, SC_LOG_DEBUG_NORMAL, "real C_CloseSession(0x%lx)", hSession);
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "real C_CloseSession(0x%lx)", session->handle);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session)
-		return CKR_SESSION_HANDLE_INVALID;
+	sc_pkcs11_handle_remove(&sessions, session->handle);
+	/* Callers waiting for the card find it closed and free it */
+	session->closed = 1;
+	return --session->slot->nsessions == 0;
+}
 
-	/* If we're the last session using this slot, make sure
-	 * we log out */
-	slot = session->slot;
-	slot->nsessions--;
-	if (slot->nsessions == 0 && slot->login_user >= 0) {
+/* Log out once the last session of a slot is gone. Called with
+ * the card locked, or with nobody working on the card */
+static void slot_logout(struct sc_pkcs11_slot *slot)
+{
+	if (slot->login_user >= 0) {
 		slot->login_user = -1;
 		slot->card->framework->logout(slot->card, slot->fw_data);
 	}
-
-	if (list_delete(&sessions, session) != 0)
-		sc_debug(context, SC_LOG_DEBUG_NORMAL, "Could not delete session from list!");
-	free(session);
-	return CKR_OK;
 }
 
-/* Internal version of C_CloseAllSessions that gets called with
- * the global lock held */
+/* Internal version of C_CloseAllSessions that gets called with the
+ * global lock held, and with nobody working on the card */
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 {
-	CK_RV rv = CKR_OK;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_slot *slot = NULL;
 	unsigned int i;
-	sc_debug(context, SC_LOG_DEBUG_NORMAL, "real C_CloseAllSessions(0x%lx) %d", slotID, list_size(&sessions));
-	for (i = 0; i < list_size(&sessions); i++) {
-		session = list_get_at(&sessions, i);
-		if (session->slot->id == slotID)
-			if ((rv = sc_pkcs11_close_session(session->handle)) != CKR_OK)
-				return rv;
+	int last = 0;
+
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "real C_CloseAllSessions(0x%lx) %d", slotID, sessions.count);
+	for (i = 0; (session = sc_pkcs11_handle_next(&sessions, &i)) != NULL; ) {
+		if (session->slot->id != slotID)
+			continue;
+		slot = session->slot;
+		last = session_remove(session);
+		if (session->refs == 0)
+			free(session);
 	}
+	if (last)
+		slot_logout(slot);
 	return CKR_OK;
 }
 
 CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
 	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	int last;
 
-	rv = sc_pkcs11_lock();
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_CloseSession(0x%lx)\n", hSession);
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_CloseSession(0x%lx)\n", hSession);
-
-	rv = sc_pkcs11_close_session(hSession);
+	rv = sc_pkcs11_lock();
+	if (rv == CKR_OK) {
+		last = session_remove(session);
+		sc_pkcs11_unlock();
+		/* If we're the last session using this slot, make sure
+		 * we log out */
+		if (last)
+			slot_logout(session->slot);
+	}
 
-	sc_pkcs11_unlock();
+	/* Frees the session, unless someone else is waiting for it */
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -153,20 +230,31 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 {				/* the token's slot */
 	CK_RV rv;
 	struct sc_pkcs11_slot *slot;
-
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
+	struct sc_pkcs11_session *session;
+	unsigned int i;
+	int last = 0;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_CloseAllSessions(0x%lx)\n", slotID);
 
-	rv = slot_get_token(slotID, &slot);
+	rv = sc_pkcs11_lock_token(slotID, &slot);
 	if (rv != CKR_OK)
-		goto out;
+		return rv;
 
-	rv = sc_pkcs11_close_all_sessions(slotID);
+	rv = sc_pkcs11_lock();
+	if (rv == CKR_OK) {
+		for (i = 0; (session = sc_pkcs11_handle_next(&sessions, &i)) != NULL; ) {
+			if (session->slot != slot)
+				continue;
+			last = session_remove(session);
+			if (session->refs == 0)
+				free(session);
+		}
+		sc_pkcs11_unlock();
+		if (last)
+			slot_logout(slot);
+	}
 
-      out:sc_pkcs11_unlock();
+	sc_pkcs11_unlock_token(slot);
 	return rv;
 }
 
@@ -180,18 +268,12 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;	
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetSessionInfo(0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetSessionInfo(slot 0x%lx).", session->slot->id);
 	pInfo->slotID = session->slot->id;
 	pInfo->flags = session->flags;
@@ -208,9 +290,8 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		    ? CKS_RW_PUBLIC_SESSION : CKS_RO_PUBLIC_SESSION;
 	}
 
-      out:
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetSessionInfo(0x%lx) = %s", hSession, lookup_enum(RV_T, rv));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -242,7 +323,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
@@ -250,11 +331,6 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = CKR_USER_TYPE_INVALID;
 		goto out;
 	}
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Login(0x%lx, %d)", hSession, userType);
 
@@ -286,7 +362,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			slot->login_user = userType;
 	}
 
-      out:sc_pkcs11_unlock();
+      out:sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -296,16 +372,10 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Logout(0x%lx)", hSession);
 
 	slot = session->slot;
@@ -316,7 +386,7 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	} else
 		rv = CKR_USER_NOT_LOGGED_IN;
 
-      out:sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -329,16 +399,10 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -353,7 +417,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 		rv = slot->card->framework->init_pin(slot->card, slot, pPin, ulPinLen);
 	}
 
-      out:sc_pkcs11_unlock();
+      out:sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -368,16 +432,10 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	    || (pNewPin == NULL_PTR && ulNewLen > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	slot = session->slot;
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Changing PIN (session 0x%lx; login user %d)\n", hSession,
 		 slot->login_user);
@@ -391,6 +449,6 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 					       slot->login_user, pOldPin, ulOldLen, pNewPin,
 					       ulNewLen);
 
-      out:sc_pkcs11_unlock();
+      out:sc_pkcs11_unlock_session(session);
 	return rv;
 }
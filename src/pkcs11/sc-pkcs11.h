@@ -80,6 +80,10 @@ struct sc_pkcs11_config {
 	unsigned int pin_unblock_style;
 	unsigned int create_puk_slot;
 	unsigned int zero_ckaid_for_ca_certs;
+	unsigned int lazy_loading;
+	const char *stats_file;
+	unsigned int detect_threads;
+	unsigned int detect_timeout;
 };
 
 /*
@@ -116,10 +120,33 @@ struct sc_pkcs11_object_ops {
 	/* Others to be added when implemented */
 };
 
+/* Attributes most search templates consist of, read once through
+ * ops->get_attribute() for C_FindObjectsInit() */
+#define SC_PKCS11_ATTR_CACHE_VALID	0x0001
+#define SC_PKCS11_ATTR_CACHE_CLASS	0x0002
+#define SC_PKCS11_ATTR_CACHE_PRIVATE	0x0004
+#define SC_PKCS11_ATTR_CACHE_KEY_TYPE	0x0008
+#define SC_PKCS11_ATTR_CACHE_ID		0x0010
+#define SC_PKCS11_ATTR_CACHE_LABEL	0x0020
+
+struct sc_pkcs11_attr_cache {
+	unsigned int flags;
+	CK_OBJECT_CLASS class;
+	CK_BBOOL private;
+	CK_KEY_TYPE key_type;
+	CK_ULONG id_len;
+	CK_BYTE id[256];
+	CK_ULONG label_len;
+	CK_BYTE label[256];
+};
+
 struct sc_pkcs11_object {
 	CK_OBJECT_HANDLE handle;
 	int flags;
 	struct sc_pkcs11_object_ops *ops;
+	struct sc_pkcs11_attr_cache attr_cache;
+	/* Parsed public key for software operations, see openssl.c */
+	void *pubkey;
 };
 
 #define SC_PKCS11_OBJECT_SEEN	0x0001
@@ -193,6 +220,28 @@ struct sc_pkcs11_card {
 	/* List of supported mechanisms */
 	struct sc_pkcs11_mechanism_type **mechanisms;
 	unsigned int nmechanisms;
+
+	/* Serializes the work on the card, shared by all of its slots */
+	void *lock;
+	/* Callers that hold on to the card, see sc_pkcs11_lock_token() */
+	unsigned int refs;
+	/* Set when the card went away while still held on to */
+	int removed;
+};
+
+/* Handles mapped to pointers in constant time, see misc.c */
+struct sc_pkcs11_handle_table {
+	struct sc_pkcs11_handle_entry *entries;
+	unsigned int size;	/* entries allocated */
+	unsigned int used;	/* entries ever handed out */
+	unsigned int count;	/* entries in use */
+	unsigned int free_head;
+};
+
+/* Objects of a slot by handle, see misc.c */
+struct sc_pkcs11_object_map {
+	struct sc_pkcs11_object **buckets;
+	size_t size, count;
 };
 
 struct sc_pkcs11_slot {
@@ -205,6 +254,8 @@ struct sc_pkcs11_slot {
 	unsigned int events; /* Card events SC_EVENT_CARD_{INSERTED,REMOVED} */
 	void *fw_data; /* Framework specific data */
 	list_t objects; /* Objects in this slot */
+	struct sc_pkcs11_object_map object_map; /* The same objects, by handle */
+	struct sc_pkcs11_find_index *find_index; /* Lookup tables over objects, built on demand */
 	unsigned int nsessions; /* Number of sessions using this slot */
 	sc_timestamp_t slot_state_expires;
 };
@@ -220,6 +271,8 @@ enum {
 	SC_PKCS11_OPERATION_VERIFY,
 	SC_PKCS11_OPERATION_DIGEST,
 	SC_PKCS11_OPERATION_DECRYPT,
+	SC_PKCS11_OPERATION_ENCRYPT,
+	SC_PKCS11_OPERATION_VERIFY_RECOVER,
 	SC_PKCS11_OPERATION_MAX
 };
 
@@ -255,6 +308,16 @@ struct sc_pkcs11_mechanism_type {
 					CK_BYTE_PTR, CK_ULONG);
 	CK_RV		  (*verif_final)(sc_pkcs11_operation_t *,
 					CK_BYTE_PTR, CK_ULONG);
+	CK_RV		  (*verif_recover_init)(sc_pkcs11_operation_t *,
+					struct sc_pkcs11_object *);
+	CK_RV		  (*verif_recover)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*encrypt_init)(sc_pkcs11_operation_t *,
+					struct sc_pkcs11_object *);
+	CK_RV		  (*encrypt)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
 #endif
 	CK_RV		  (*decrypt_init)(sc_pkcs11_operation_t *,
 					struct sc_pkcs11_object *);
@@ -298,13 +361,17 @@ struct sc_pkcs11_session {
 	CK_VOID_PTR notify_data;
 	/* Active operations - one per type */
 	struct sc_pkcs11_operation *operation[SC_PKCS11_OPERATION_MAX];
+	/* Callers between sc_pkcs11_lock_session() and _unlock_session() */
+	unsigned int refs;
+	/* Set once closed; freed when the last caller is done with it */
+	int closed;
 };
 typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 
 /* Module variables */
 extern struct sc_context *context;
 extern struct sc_pkcs11_config sc_pkcs11_conf;
-extern list_t sessions;
+extern struct sc_pkcs11_handle_table sessions;
 extern list_t virtual_slots;
 extern list_t cards;
 
@@ -322,11 +389,14 @@ void sc_pkcs11_print_attrs(int level, const char *file, unsigned int line, const
 
 /* Slot and card handling functions */
 CK_RV card_removed(sc_reader_t *reader);
+void card_put(struct sc_pkcs11_card *p11card);
 CK_RV card_detect_all(void);
+void card_detect_cleanup(void);
 CK_RV create_slot(sc_reader_t *reader);
 CK_RV initialize_reader(sc_reader_t *reader);
 CK_RV card_detect(sc_reader_t *reader);
 CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot **);
+void slot_index_free(void);
 CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_token_removed(CK_SLOT_ID id);
 CK_RV slot_allocate(struct sc_pkcs11_slot **, struct sc_pkcs11_card *);
@@ -350,6 +420,7 @@ CK_RV sc_pkcs11_create_secret_key(struct sc_pkcs11_session *,
 /* Generic object handling */
 int sc_pkcs11_any_cmp_attribute(struct sc_pkcs11_session *,
 			void *, CK_ATTRIBUTE_PTR);
+void sc_pkcs11_invalidate_find_index(struct sc_pkcs11_slot *);
 
 /* Get attributes from template (misc.c) */
 CK_RV attr_find(CK_ATTRIBUTE_PTR, CK_ULONG, CK_ULONG, void *, size_t *);
@@ -379,6 +450,14 @@ CK_RV sc_pkcs11_verif_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_verif_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_verif_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
+CK_RV sc_pkcs11_verif_recover_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
+				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
+CK_RV sc_pkcs11_verif_recover(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG,
+				CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_encr_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
+				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
+CK_RV sc_pkcs11_encr(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG,
+				CK_BYTE_PTR, CK_ULONG_PTR);
 #endif
 CK_RV sc_pkcs11_decr_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR, struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_decr(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
@@ -399,21 +478,48 @@ CK_RV sc_pkcs11_register_sign_and_hash_mechanism(struct sc_pkcs11_card *,
 				sc_pkcs11_mechanism_type_t *);
 
 #ifdef ENABLE_OPENSSL
-CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
-	const unsigned char *pubkey_params, int pubkey_params_len,
+CK_RV sc_pkcs11_verify_data(struct sc_pkcs11_session *session,
+	struct sc_pkcs11_object *key,
 	CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 	unsigned char *inp, int inp_len,
 	unsigned char *signat, int signat_len);
+CK_RV sc_pkcs11_verify_recover_data(struct sc_pkcs11_session *session,
+	struct sc_pkcs11_object *key, CK_MECHANISM_TYPE mech,
+	unsigned char *signat, int signat_len,
+	unsigned char *out, CK_ULONG_PTR out_len);
+CK_RV sc_pkcs11_encrypt_data(struct sc_pkcs11_session *session,
+	struct sc_pkcs11_object *key, CK_MECHANISM_TYPE mech,
+	unsigned char *inp, int inp_len,
+	unsigned char *out, CK_ULONG_PTR out_len);
+void sc_pkcs11_free_pubkey(struct sc_pkcs11_object *key);
 #endif
 
 /* Load configuration defaults */
 void load_pkcs11_parameters(struct sc_pkcs11_config *, struct sc_context *);
 
+CK_ULONG sc_pkcs11_handle_add(struct sc_pkcs11_handle_table *, void *);
+void *sc_pkcs11_handle_get(const struct sc_pkcs11_handle_table *, CK_ULONG);
+void sc_pkcs11_handle_remove(struct sc_pkcs11_handle_table *, CK_ULONG);
+void *sc_pkcs11_handle_next(const struct sc_pkcs11_handle_table *, unsigned int *);
+void sc_pkcs11_handle_table_free(struct sc_pkcs11_handle_table *);
+struct sc_pkcs11_object *sc_pkcs11_object_map_find(const struct sc_pkcs11_object_map *, CK_OBJECT_HANDLE);
+CK_RV sc_pkcs11_object_map_add(struct sc_pkcs11_object_map *, struct sc_pkcs11_object *);
+void sc_pkcs11_object_map_remove(struct sc_pkcs11_object_map *, CK_OBJECT_HANDLE);
+void sc_pkcs11_object_map_free(struct sc_pkcs11_object_map *);
+
 /* Locking primitives at the pkcs11 level */
 CK_RV sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR);
 CK_RV sc_pkcs11_lock(void);
 void sc_pkcs11_unlock(void);
 void sc_pkcs11_free_lock(void);
+CK_RV sc_pkcs11_init_card_lock(struct sc_pkcs11_card *);
+void sc_pkcs11_lock_card(struct sc_pkcs11_card *);
+void sc_pkcs11_unlock_card(struct sc_pkcs11_card *);
+void sc_pkcs11_free_card_lock(struct sc_pkcs11_card *);
+CK_RV sc_pkcs11_lock_token(CK_SLOT_ID, struct sc_pkcs11_slot **);
+void sc_pkcs11_unlock_token(struct sc_pkcs11_slot *);
+CK_RV sc_pkcs11_lock_session(CK_SESSION_HANDLE, struct sc_pkcs11_session **);
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *);
 
 #ifdef __cplusplus
 }
@@ -23,6 +23,11 @@
 
 #include <string.h>
 #include <stdlib.h>
+#ifdef HAVE_PTHREAD
+#include <errno.h>
+#include <sys/time.h>
+#include <pthread.h>
+#endif
 
 #include "sc-pkcs11.h"
 
@@ -36,6 +41,17 @@ static struct sc_pkcs11_framework_ops *frameworks[] = {
 	NULL
 };
 
+/* virtual_slots by slot ID, which is the position in the list */
+static struct sc_pkcs11_slot **slot_index = NULL;
+static size_t slot_index_size = 0;
+
+void slot_index_free(void)
+{
+	free(slot_index);
+	slot_index = NULL;
+	slot_index_size = 0;
+}
+
 static struct sc_pkcs11_slot * reader_get_slot(sc_reader_t *reader)
 {
 	unsigned int i;
@@ -79,6 +95,15 @@ CK_RV create_slot(sc_reader_t *reader)
 
 	if (list_size(&virtual_slots) >= sc_pkcs11_conf.max_virtual_slots)
 		return CKR_FUNCTION_FAILED;
+	if (slot_index_size <= list_size(&virtual_slots)) {
+		size_t size = slot_index_size ? slot_index_size * 2 : 16;
+		struct sc_pkcs11_slot **index = realloc(slot_index, size * sizeof(*index));
+
+		if (index == NULL)
+			return CKR_HOST_MEMORY;
+		slot_index = index;
+		slot_index_size = size;
+	}
 
 	slot = (struct sc_pkcs11_slot *)calloc(1, sizeof(struct sc_pkcs11_slot));
 	if (!slot)
@@ -86,7 +111,8 @@ CK_RV create_slot(sc_reader_t *reader)
 
 	list_append(&virtual_slots, slot);
 	slot->login_user = -1;
-	slot->id = (CK_SLOT_ID) list_locate(&virtual_slots, slot);
+	slot->id = (CK_SLOT_ID) list_size(&virtual_slots) - 1;
+	slot_index[slot->id] = slot;
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Creating slot with id 0x%lx", slot->id);
 	
 	list_init(&slot->objects);
@@ -101,8 +127,8 @@ CK_RV create_slot(sc_reader_t *reader)
 }
 
 
-/* create slots associated with a reader, called whenever a reader is seen. */
-CK_RV initialize_reader(sc_reader_t *reader)
+/* create the slots of a reader, unless it is ignored */
+static CK_RV create_reader_slots(sc_reader_t *reader)
 {
 	unsigned int i;
 	CK_RV rv;
@@ -127,8 +153,45 @@ CK_RV initialize_reader(sc_reader_t *reader)
 		if (rv != CKR_OK)
 			return rv;
 	}
+	return CKR_OK;
+}
+
+/*
+ * Ask the reader for its card under the lock of the card in it, so as
+ * not to race with card I/O of another session. Called with the global
+ * lock held, which is dropped while waiting for the card, see
+ * sc_pkcs11_lock_token(); the card may be torn down in the meantime.
+ */
+static int detect_card_presence(sc_reader_t *reader)
+{
+	struct sc_pkcs11_slot *slot = reader_get_slot(reader);
+	struct sc_pkcs11_card *card = slot != NULL ? slot->card : NULL;
+	int rc;
+
+	if (card == NULL || card->lock == NULL)
+		return sc_detect_card_presence(reader);
+
+	card->refs++;
+	sc_pkcs11_unlock();
+	sc_pkcs11_lock_card(card);
+	rc = sc_detect_card_presence(reader);
+	sc_pkcs11_unlock_card(card);
+	if (sc_pkcs11_lock() != CKR_OK)
+		return SC_ERROR_NOT_ALLOWED;
+	card_put(card);
+	return rc;
+}
+
+/* create slots associated with a reader, called whenever a reader is seen. */
+CK_RV initialize_reader(sc_reader_t *reader)
+{
+	CK_RV rv;
+
+	rv = create_reader_slots(reader);
+	if (rv != CKR_OK || !reader_get_slot(reader))
+		return rv;
 
-	if (sc_detect_card_presence(reader)) {
+	if (detect_card_presence(reader)) {
 		card_detect(reader);
 	}
 
@@ -136,6 +199,37 @@ CK_RV initialize_reader(sc_reader_t *reader)
 }
 
 
+/* Tear down the tokens of a card and free it. Called with the global
+ * lock held, once nobody holds on to the card any longer */
+static void card_release(struct sc_pkcs11_card *card)
+{
+	unsigned int i;
+
+	for (i=0; i < list_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		if (slot->reader == card->reader)
+			slot_token_removed(slot->id);
+	}
+
+	card->framework->unbind(card);
+	sc_disconnect_card(card->card);
+	/* FIXME: free mechanisms
+	 * spaces allocated by the
+	 * sc_pkcs11_register_sign_and_hash_mechanism
+	 * and sc_pkcs11_new_fw_mechanism.
+	 * but see sc_pkcs11_register_generic_mechanisms
+	for (i=0; i < card->nmechanisms; ++i) {
+		// if 'mech_data' is a pointer earlier returned by the ?alloc
+		free(card->mechanisms[i]->mech_data);
+		// if 'mechanisms[i]' is a pointer earlier returned by the ?alloc
+		free(card->mechanisms[i]);
+	}
+	*/
+	free(card->mechanisms);
+	sc_pkcs11_free_card_lock(card);
+	free(card);
+}
+
 CK_RV card_removed(sc_reader_t * reader)
 {
 	unsigned int i;
@@ -146,36 +240,370 @@ CK_RV card_removed(sc_reader_t * reader)
 
 	for (i=0; i < list_size(&virtual_slots); i++) {
 		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		if (slot->reader == reader) {
+		if (slot->reader == reader && slot->card) {
 			/* Save the "card" object */
-			if (slot->card)
-				card = slot->card;
-			slot_token_removed(slot->id);
+			card = slot->card;
+			break;
 		}
 	}
 
-	if (card) {
-		card->framework->unbind(card);
-		sc_disconnect_card(card->card);
-		/* FIXME: free mechanisms
-		 * spaces allocated by the
-		 * sc_pkcs11_register_sign_and_hash_mechanism
-		 * and sc_pkcs11_new_fw_mechanism.
-		 * but see sc_pkcs11_register_generic_mechanisms
-		for (i=0; i < card->nmechanisms; ++i) {
-			// if 'mech_data' is a pointer earlier returned by the ?alloc
-			free(card->mechanisms[i]->mech_data);
-			// if 'mechanisms[i]' is a pointer earlier returned by the ?alloc
-			free(card->mechanisms[i]);
+	if (card == NULL) {
+		for (i=0; i < list_size(&virtual_slots); i++) {
+			sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+			if (slot->reader == reader)
+				slot_token_removed(slot->id);
 		}
-		*/
-		free(card->mechanisms);
-		free(card);
+	} else if (card->refs > 0) {
+		/* Still being worked on: the last one to let go of
+		 * the card tears it down, see card_put() */
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: card still in use", reader->name);
+		card->removed = 1;
+	} else {
+		card_release(card);
 	}
 	
 	return CKR_OK;
 }
 
+/* Let go of a card held on to by sc_pkcs11_lock_token() or
+ * sc_pkcs11_lock_session(). Called with the global lock held */
+void card_put(struct sc_pkcs11_card *card)
+{
+	if (--card->refs == 0 && card->removed)
+		card_release(card);
+}
+
+/*
+ * Look up the token of a slot and lock its card. The global lock is
+ * only held for the lookup: the card is held on to, so that it is not
+ * torn down while we wait for it.
+ */
+CK_RV sc_pkcs11_lock_token(CK_SLOT_ID id, struct sc_pkcs11_slot **slot)
+{
+	struct sc_pkcs11_card *card;
+	CK_RV rv;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+	rv = slot_get_token(id, slot);
+	if (rv == CKR_OK && (*slot)->card == NULL)
+		rv = CKR_TOKEN_NOT_PRESENT;
+	if (rv != CKR_OK) {
+		sc_pkcs11_unlock();
+		return rv;
+	}
+	card = (*slot)->card;
+	card->refs++;
+	sc_pkcs11_unlock();
+
+	sc_pkcs11_lock_card(card);
+	if (card->removed) {
+		sc_pkcs11_unlock_token(*slot);
+		return CKR_DEVICE_REMOVED;
+	}
+	return CKR_OK;
+}
+
+void sc_pkcs11_unlock_token(struct sc_pkcs11_slot *slot)
+{
+	/* slot->card does not change while the card is held on to */
+	struct sc_pkcs11_card *card = slot->card;
+
+	sc_pkcs11_unlock_card(card);
+	if (sc_pkcs11_lock() != CKR_OK)
+		return;
+	card_put(card);
+	sc_pkcs11_unlock();
+}
+
+/* Connect the card and find a framework that binds to it; touches
+ * nothing but p11card, so that several cards can be bound at once */
+static CK_RV card_bind(struct sc_pkcs11_card *p11card, struct sc_pkcs11_framework_ops **framework)
+{
+	sc_reader_t *reader = p11card->reader;
+	unsigned int i;
+	int rc;
+	CK_RV rv = CKR_OK;
+
+	if (p11card->card == NULL) {
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: Connecting ... ", reader->name);
+		rc = sc_connect_card(reader, &p11card->card);
+		if (rc != SC_SUCCESS)
+			return sc_to_cryptoki_error(rc, NULL);
+	}
+
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: Detecting Framework\n", reader->name);
+	for (i = 0; frameworks[i]; i++) {
+		if (frameworks[i]->bind == NULL)
+			continue;
+		rv = frameworks[i]->bind(p11card);
+		if (rv == CKR_OK)
+			break;
+	}
+
+	if (frameworks[i] == NULL)
+		return CKR_TOKEN_NOT_RECOGNIZED;
+
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: Detected framework %d. Creating tokens.\n", reader->name, i);
+	*framework = frameworks[i];
+	return CKR_OK;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * With detect_threads > 1, card_detect_all() connects and binds the cards
+ * of all readers on a pool of worker threads, and creates the tokens of
+ * all of them once the workers are done. Workers only ever touch their
+ * own sc_pkcs11_card; the slot list is left to the caller, who holds the
+ * global lock. A card still binding when detect_timeout expires stays
+ * with its worker and is published by a later card_detect().
+ */
+enum {
+	DETECT_QUEUED,
+	DETECT_RUNNING,
+	DETECT_DONE
+};
+
+struct detect_job {
+	sc_reader_t *reader;
+	struct sc_pkcs11_card *p11card;
+	struct sc_pkcs11_framework_ops *framework;
+	CK_RV rv;
+	int state;
+	struct detect_job *next;
+};
+
+static pthread_mutex_t detect_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t detect_cond = PTHREAD_COND_INITIALIZER;
+static struct detect_job *detect_jobs = NULL;
+static unsigned int detect_workers = 0;
+
+static void *detect_worker(void *arg)
+{
+	struct detect_job *job;
+
+	(void)arg;
+
+	pthread_mutex_lock(&detect_lock);
+	for (;;) {
+		for (job = detect_jobs; job != NULL; job = job->next)
+			if (job->state == DETECT_QUEUED)
+				break;
+		if (job == NULL)
+			break;
+		job->state = DETECT_RUNNING;
+		pthread_mutex_unlock(&detect_lock);
+
+		job->rv = card_bind(job->p11card, &job->framework);
+
+		pthread_mutex_lock(&detect_lock);
+		job->state = DETECT_DONE;
+		pthread_cond_broadcast(&detect_cond);
+	}
+	detect_workers--;
+	pthread_cond_broadcast(&detect_cond);
+	pthread_mutex_unlock(&detect_lock);
+	return NULL;
+}
+
+/* Publish the tokens of a bound card, or drop a card that did not bind */
+static CK_RV detect_job_finish(struct detect_job *job)
+{
+	struct sc_pkcs11_card *p11card = job->p11card;
+	CK_RV rv = job->rv;
+
+	if (rv == CKR_OK && (rv = sc_pkcs11_init_card_lock(p11card)) != CKR_OK)
+		job->framework->unbind(p11card);
+	if (rv == CKR_OK) {
+		rv = job->framework->create_tokens(p11card);
+		if (rv == CKR_OK)
+			p11card->framework = job->framework;
+		/* otherwise left to the slots like card_detect() does */
+	} else {
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: detection failed: 0x%lx",
+			job->reader->name, (unsigned long) rv);
+		if (p11card->card != NULL)
+			sc_disconnect_card(p11card->card);
+		free(p11card);
+	}
+	free(job);
+	return rv;
+}
+
+/* Take all finished jobs off the list, optionally those of one reader only */
+static struct detect_job *detect_take_done(sc_reader_t *reader)
+{
+	struct detect_job *done = NULL, **jp, *job;
+
+	pthread_mutex_lock(&detect_lock);
+	jp = &detect_jobs;
+	while ((job = *jp) != NULL) {
+		if (job->state == DETECT_DONE && (reader == NULL || job->reader == reader)) {
+			*jp = job->next;
+			job->next = done;
+			done = job;
+		} else {
+			jp = &job->next;
+		}
+	}
+	pthread_mutex_unlock(&detect_lock);
+	return done;
+}
+
+/* Returns 1 while the card in the reader is being bound; a card that has
+ * been bound meanwhile gets its tokens */
+static int detect_pending(sc_reader_t *reader)
+{
+	struct detect_job *job;
+	int pending = 0;
+
+	pthread_mutex_lock(&detect_lock);
+	for (job = detect_jobs; job != NULL; job = job->next)
+		if (job->reader == reader && job->state != DETECT_DONE)
+			pending = 1;
+	pthread_mutex_unlock(&detect_lock);
+
+	if ((job = detect_take_done(reader)) != NULL)
+		detect_job_finish(job);
+	return pending;
+}
+
+static CK_RV card_detect_parallel(void)
+{
+	struct detect_job *job, *next;
+	struct sc_pkcs11_slot *slot;
+	struct timeval now;
+	struct timespec until;
+	unsigned int i, queued = 0;
+	int rc;
+
+	for (i = 0; i < sc_ctx_get_reader_count(context); i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(context, i);
+
+		if (!reader_get_slot(reader)) {
+			if (create_reader_slots(reader) != CKR_OK)
+				continue;
+			if (!reader_get_slot(reader))
+				continue;	/* ignored reader */
+		}
+		if (detect_pending(reader))
+			continue;
+
+		rc = detect_card_presence(reader);
+		if (rc < 0) {
+			sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: failed, %s\n", reader->name, sc_strerror(rc));
+			continue;
+		}
+		if (rc == 0 || (rc & SC_READER_CARD_CHANGED))
+			card_removed(reader);
+		if (rc == 0)
+			continue;
+
+		slot = reader_get_slot(reader);
+		if (slot->card != NULL) {
+			/* Known card, one whose tokens could not be created,
+			 * or one that is still in use after it went away */
+			if (slot->card->framework == NULL && !slot->card->removed)
+				card_detect(reader);
+			continue;
+		}
+
+		job = calloc(1, sizeof(struct detect_job));
+		if (job != NULL)
+			job->p11card = calloc(1, sizeof(struct sc_pkcs11_card));
+		if (job == NULL || job->p11card == NULL) {
+			free(job);
+			break;
+		}
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: First seen the card ", reader->name);
+		job->reader = job->p11card->reader = reader;
+		job->state = DETECT_QUEUED;
+
+		pthread_mutex_lock(&detect_lock);
+		job->next = detect_jobs;
+		detect_jobs = job;
+		pthread_mutex_unlock(&detect_lock);
+		queued++;
+	}
+
+	pthread_mutex_lock(&detect_lock);
+	for (i = 0; i < queued && detect_workers < sc_pkcs11_conf.detect_threads; i++) {
+		pthread_attr_t attr;
+		pthread_t thread;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		rc = pthread_create(&thread, &attr, detect_worker, NULL);
+		pthread_attr_destroy(&attr);
+		if (rc != 0)
+			break;
+		detect_workers++;
+	}
+	if (queued && detect_workers == 0) {
+		/* No threads to be had: do it here */
+		detect_workers++;
+		pthread_mutex_unlock(&detect_lock);
+		detect_worker(NULL);
+		pthread_mutex_lock(&detect_lock);
+	}
+
+	if (sc_pkcs11_conf.detect_timeout) {
+		gettimeofday(&now, NULL);
+		until.tv_sec = now.tv_sec + sc_pkcs11_conf.detect_timeout / 1000;
+		until.tv_nsec = now.tv_usec * 1000 + (sc_pkcs11_conf.detect_timeout % 1000) * 1000000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+	}
+	for (;;) {
+		for (job = detect_jobs; job != NULL; job = job->next)
+			if (job->state != DETECT_DONE)
+				break;
+		if (job == NULL || detect_workers == 0)
+			break;
+		if (!sc_pkcs11_conf.detect_timeout)
+			pthread_cond_wait(&detect_cond, &detect_lock);
+		else if (pthread_cond_timedwait(&detect_cond, &detect_lock, &until) == ETIMEDOUT) {
+			sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: still detecting, not waiting any longer",
+				job->reader->name);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&detect_lock);
+
+	/* Publish all tokens in one go */
+	for (job = detect_take_done(NULL); job != NULL; job = next) {
+		next = job->next;
+		detect_job_finish(job);
+	}
+	return CKR_OK;
+}
+
+/* Called from C_Finalize(): wait for the workers and drop what they found */
+void card_detect_cleanup(void)
+{
+	struct detect_job *job;
+
+	pthread_mutex_lock(&detect_lock);
+	while (detect_workers > 0)
+		pthread_cond_wait(&detect_cond, &detect_lock);
+	while ((job = detect_jobs) != NULL) {
+		detect_jobs = job->next;
+		if (job->state == DETECT_DONE && job->rv == CKR_OK)
+			job->framework->unbind(job->p11card);
+		job->rv = CKR_CANCEL;
+		job->next = NULL;
+		detect_job_finish(job);
+	}
+	pthread_mutex_unlock(&detect_lock);
+}
+#else
+void card_detect_cleanup(void)
+{
+}
+#endif
 
 CK_RV card_detect(sc_reader_t *reader)
 {
@@ -186,8 +614,14 @@ CK_RV card_detect(sc_reader_t *reader)
 	rv = CKR_OK;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: Detecting smart card\n", reader->name);
+#ifdef HAVE_PTHREAD
+	if (detect_pending(reader)) {
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: still being detected\n", reader->name);
+		return CKR_TOKEN_NOT_PRESENT;
+	}
+#endif
       /* Check if someone inserted a card */
-      again:rc = sc_detect_card_presence(reader);
+      again:rc = detect_card_presence(reader);
 	if (rc < 0) {
 		sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: failed, %s\n", reader->name, sc_strerror(rc));
 		return sc_to_cryptoki_error(rc, NULL);
@@ -219,6 +653,12 @@ CK_RV card_detect(sc_reader_t *reader)
 		}
 	}
 
+	/* A card that went away while in use is torn down first */
+	if (p11card != NULL && p11card->removed) {
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: previous card still in use\n", reader->name);
+		return CKR_TOKEN_NOT_PRESENT;
+	}
+
 	/* Detect the card if it's not known already */
 	if (p11card == NULL) {
 		sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: First seen the card ", reader->name);
@@ -228,35 +668,26 @@ CK_RV card_detect(sc_reader_t *reader)
 		p11card->reader = reader;
 	}
 
-	if (p11card->card == NULL) {
-		sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: Connecting ... ", reader->name);
-		rc = sc_connect_card(reader, &p11card->card);
-		if (rc != SC_SUCCESS)
-			return sc_to_cryptoki_error(rc, NULL);
-	}
-
 	/* Detect the framework */
 	if (p11card->framework == NULL) {
-		sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: Detecting Framework\n", reader->name);
+		struct sc_pkcs11_framework_ops *framework;
 
-		for (i = 0; frameworks[i]; i++) {
-			if (frameworks[i]->bind == NULL)
-				continue;
-			rv = frameworks[i]->bind(p11card);
-			if (rv == CKR_OK)
-				break;
-		}
+		rv = card_bind(p11card, &framework);
+		if (rv != CKR_OK)
+			return rv;
 
-		if (frameworks[i] == NULL)
-			return CKR_TOKEN_NOT_RECOGNIZED;
+		if (p11card->lock == NULL) {
+			rv = sc_pkcs11_init_card_lock(p11card);
+			if (rv != CKR_OK)
+				return rv;
+		}
 
 		/* Initialize framework */
-		sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: Detected framework %d. Creating tokens.\n", reader->name, i);
-		rv = frameworks[i]->create_tokens(p11card);
+		rv = framework->create_tokens(p11card);
 		if (rv != CKR_OK)
 			return rv;
 
-		p11card->framework = frameworks[i];
+		p11card->framework = framework;
 	}
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: Detection ended\n", reader->name);
 	return CKR_OK;
@@ -265,6 +696,11 @@ CK_RV card_detect(sc_reader_t *reader)
 CK_RV card_detect_all(void) {
 	 unsigned int i;
 
+#ifdef HAVE_PTHREAD
+	 if (sc_pkcs11_conf.detect_threads > 1)
+		 return card_detect_parallel();
+#endif
+
 	 /* Detect cards in all initialized readers */
 	 for (i=0; i< sc_ctx_get_reader_count(context); i++) {
 		 sc_reader_t *reader = sc_ctx_get_reader(context, i);
@@ -302,7 +738,12 @@ CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-	*slot = list_seek(&virtual_slots, &id);	/* FIXME: check for null? */
+	if (id < list_size(&virtual_slots) && slot_index[id] != NULL && slot_index[id]->id == id) {
+		*slot = slot_index[id];
+		return CKR_OK;
+	}
+	/* The ID of the hotplug slot moves away from its list position */
+	*slot = list_seek(&virtual_slots, &id);
 	if (!*slot)
 		return CKR_SLOT_ID_INVALID;
 	return CKR_OK;
@@ -331,6 +772,7 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 	return CKR_OK;
 }
 
+/* Called with the global lock held, and with nobody working on the card */
 CK_RV slot_token_removed(CK_SLOT_ID id)
 {
 	int rv, token_was_present;
@@ -347,10 +789,12 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	/* Terminate active sessions */
 	sc_pkcs11_close_all_sessions(id);
 
+	sc_pkcs11_object_map_free(&slot->object_map);
 	while ((object = list_fetch(&slot->objects))) {
 		if (object->ops->release)
 			object->ops->release(object);
 	}
+	sc_pkcs11_invalidate_find_index(slot);
 
 	/* Release framework stuff */
 	if (slot->card != NULL) {
@@ -370,13 +814,13 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	return CKR_OK;
 }
 
-/* Called from C_WaitForSlotEvent */
+/* Called from C_WaitForSlotEvent, after the slots have been brought up
+ * to date with card_detect_all() */
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 {
 	unsigned int i;
 	SC_FUNC_CALLED(context, SC_LOG_DEBUG_NORMAL);
 
-	card_detect_all();
 	for (i=0; i<list_size(&virtual_slots); i++) {
 		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
 		sc_debug(context, SC_LOG_DEBUG_NORMAL, "slot 0x%lx token: %d events: 0x%02X",slot->id, (slot->slot_info.flags & CKF_TOKEN_PRESENT), slot->events);
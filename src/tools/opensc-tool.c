@@ -46,11 +46,17 @@ static int	opt_wait = 0;
 static char **	opt_apdus;
 static char	*opt_reader;
 static int	opt_apdu_count = 0;
+static int	opt_stats = 0;
+static const char *opt_replay = NULL;
+static const char *opt_analyze = NULL;
 static int	verbose = 0;
 
 enum {
 	OPT_SERIAL = 0x100,
-	OPT_LIST_ALG
+	OPT_LIST_ALG,
+	OPT_STATS,
+	OPT_REPLAY,
+	OPT_ANALYZE
 };
 
 static const struct option options[] = {
@@ -68,6 +74,9 @@ static const struct option options[] = {
 	{ "card-driver",	1, NULL,		'c' },
 	{ "list-algorithms",    0, NULL,	OPT_LIST_ALG }, 
 	{ "wait",		0, NULL,		'w' },
+	{ "stats",		0, NULL,	OPT_STATS },
+	{ "replay",		1, NULL,	OPT_REPLAY },
+	{ "analyze",		1, NULL,	OPT_ANALYZE },
 	{ "verbose",		0, NULL,		'v' },
 	{ NULL, 0, NULL, 0 }
 };
@@ -87,12 +96,33 @@ static const char *option_help[] = {
 	"Forces the use of driver <arg> [auto-detect]",
 	"Lists algorithms supported by card",
 	"Wait for a card to be inserted",
+	"Prints APDU statistics when done",
+	"Sends the APDUs of capture file <arg> to the card",
+	"Reports redundant APDUs in capture file <arg>",
 	"Verbose operation. Use several times to enable debug output.",
 };
 
 static sc_context_t *ctx = NULL;
 static sc_card_t *card = NULL;
 
+static void print_stats(void)
+{
+	sc_stats_t stats;
+	char title[256];
+	unsigned int i;
+
+	if (card && sc_card_get_stats(card, &stats) == SC_SUCCESS)
+		sc_stats_print(stdout, "Card:", &stats);
+	for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+
+		if (sc_reader_get_stats(reader, &stats) != SC_SUCCESS || stats.apdus == 0)
+			continue;
+		snprintf(title, sizeof(title), "Reader %u: %s", i, reader->name);
+		sc_stats_print(stdout, title, &stats);
+	}
+}
+
 static int opensc_info(void)
 {
 	printf (
@@ -527,6 +557,285 @@ static int send_apdu(void)
 	return 0;
 }
 
+/* APDUs of the first card of a capture, sent again to the card */
+static int replay_capture(void)
+{
+	sc_capture_t *cap;
+	sc_capture_record_t rec;
+	sc_stats_t before, after;
+	sc_apdu_t apdu;
+	u8 *rbuf;
+	unsigned int replay_card = 0, depth = 0;
+	unsigned long replay_session = 0;
+	unsigned long sent = 0, skipped = 0, differ = 0;
+	unsigned long long recorded_usec = 0;
+	int r, err = 0;
+
+	r = sc_capture_open(opt_replay, &cap);
+	if (r) {
+		fprintf(stderr, "Cannot open capture %s: %s\n", opt_replay, sc_strerror(r));
+		return 1;
+	}
+	rbuf = malloc(SC_MAX_EXT_APDU_BUFFER_SIZE);
+	if (rbuf == NULL) {
+		sc_capture_close(cap);
+		return 1;
+	}
+	sc_card_get_stats(card, &before);
+
+	while ((r = sc_capture_read(cap, &rec)) > 0) {
+		if (rec.type == SC_CAPTURE_CARD && replay_card == 0) {
+			replay_card = rec.card;
+			replay_session = rec.session;
+		}
+		if (rec.card != replay_card || rec.session != replay_session)
+			continue;
+
+		if (rec.type == SC_CAPTURE_LOCK) {
+			if (sc_lock(card) == SC_SUCCESS)
+				depth++;
+			continue;
+		}
+		if (rec.type == SC_CAPTURE_UNLOCK) {
+			if (depth > 0) {
+				sc_unlock(card);
+				depth--;
+			}
+			continue;
+		}
+		if (rec.type != SC_CAPTURE_APDU)
+			continue;
+		/* never send made up PINs, they would block the card */
+		if ((rec.flags & SC_CAPTURE_FLAG_REDACTED) || rec.len2 < 2) {
+			skipped++;
+			continue;
+		}
+
+		r = sc_bytes2apdu(ctx, rec.data1, rec.len1, &apdu);
+		if (r) {
+			fprintf(stderr, "Invalid APDU in capture: %s\n", sc_strerror(r));
+			err = 1;
+			break;
+		}
+		/* one exchange for each one recorded, the recorded
+		 * GET RESPONSEs and resent APDUs follow */
+		apdu.flags |= SC_APDU_FLAGS_NO_GET_RESP | SC_APDU_FLAGS_NO_RETRY_WL;
+		apdu.resp = rbuf;
+		apdu.resplen = SC_MAX_EXT_APDU_BUFFER_SIZE;
+		r = sc_transmit_apdu(card, &apdu);
+		if (r) {
+			fprintf(stderr, "APDU transmit failed: %s\n", sc_strerror(r));
+			err = 1;
+			break;
+		}
+		sent++;
+		recorded_usec += rec.usec;
+		if (apdu.sw1 != rec.data2[rec.len2 - 2] || apdu.sw2 != rec.data2[rec.len2 - 1]
+				|| apdu.resplen != rec.len2 - 2
+				|| memcmp(apdu.resp, rec.data2, apdu.resplen) != 0) {
+			differ++;
+			if (verbose)
+				printf("APDU %lu: SW %02X%02X, recorded %02X%02X\n", sent,
+					apdu.sw1, apdu.sw2, rec.data2[rec.len2 - 2], rec.data2[rec.len2 - 1]);
+		}
+	}
+	if (r < 0) {
+		fprintf(stderr, "Invalid capture %s: %s\n", opt_replay, sc_strerror(r));
+		err = 1;
+	}
+	while (depth-- > 0)
+		sc_unlock(card);
+	sc_card_get_stats(card, &after);
+
+	printf("Replayed %lu APDUs, %lu skipped (PINs), %lu answered differently\n",
+		sent, skipped, differ);
+	printf("Reader time: %llu.%03llu ms, recorded %llu.%03llu ms\n",
+		(after.usec - before.usec) / 1000, (after.usec - before.usec) % 1000,
+		recorded_usec / 1000, recorded_usec % 1000);
+	free(rbuf);
+	sc_capture_close(cap);
+	return err;
+}
+
+/* A card in a capture, and the operation going on with it */
+struct analyze_card {
+	unsigned long session;		/* process that used the card */
+	unsigned int id;
+	unsigned long long start;	/* of the operation */
+	unsigned long apdus, selects, reads, get_responses;
+	unsigned long long usec, select_usec, read_usec, get_response_usec;
+	/* kept from one operation to the next, as a card driver could */
+	unsigned long long selected;	/* hash of the last SELECT */
+	unsigned long long *read_seen;	/* ... and of the READ BINARYs since */
+	size_t read_count, read_size;
+	unsigned int op;
+};
+
+static unsigned long long analyze_hash(unsigned long long h, const u8 *data, size_t len)
+{
+	while (len--) {
+		h ^= *data++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void analyze_report(struct analyze_card *c, unsigned long long end, unsigned long long origin)
+{
+	if (c->apdus == 0)
+		return;
+	printf("%7lu %4u %5u %10.1f %9.1f %6lu %9.1f %5lu %7.1f %5lu %7.1f %5lu %7.1f\n",
+		c->session, c->id, ++c->op,
+		(c->start - origin) / 1000.0, (end - c->start) / 1000.0,
+		c->apdus, c->usec / 1000.0,
+		c->get_responses, c->get_response_usec / 1000.0,
+		c->selects, c->select_usec / 1000.0,
+		c->reads, c->read_usec / 1000.0);
+}
+
+static void analyze_begin(struct analyze_card *c, unsigned long long time)
+{
+	c->start = time;
+	c->apdus = c->selects = c->reads = c->get_responses = 0;
+	c->usec = c->select_usec = c->read_usec = c->get_response_usec = 0;
+}
+
+static void analyze_apdu(struct analyze_card *c, const sc_capture_record_t *rec)
+{
+	unsigned long long h;
+	size_t i;
+	int ok;
+
+	if (rec->len1 < 4)
+		return;
+	ok = rec->len2 >= 2 && (rec->data2[rec->len2 - 2] == 0x90 || rec->data2[rec->len2 - 2] == 0x61);
+	c->apdus++;
+	c->usec += rec->usec;
+
+	switch (rec->data1[1]) {
+	case 0xC0:	/* GET RESPONSE */
+		c->get_responses++;
+		c->get_response_usec += rec->usec;
+		break;
+	case 0xA4:	/* SELECT FILE */
+		h = analyze_hash(0xcbf29ce484222325ULL, rec->data1 + 2, rec->len1 - 2);
+		if (h == c->selected) {
+			c->selects++;
+			c->select_usec += rec->usec;
+		} else {
+			c->read_count = 0;
+		}
+		c->selected = ok ? h : 0;
+		break;
+	case 0xB0:	/* READ BINARY */
+		h = analyze_hash(c->selected, rec->data1 + 2, rec->len1 - 2);
+		for (i = 0; i < c->read_count; i++)
+			if (c->read_seen[i] == h)
+				break;
+		if (i < c->read_count) {
+			c->reads++;
+			c->read_usec += rec->usec;
+		} else if (ok && c->selected != 0) {
+			if (c->read_count == c->read_size) {
+				size_t n = c->read_size ? 2 * c->read_size : 16;
+				unsigned long long *p = realloc(c->read_seen, n * sizeof(*p));
+
+				if (p == NULL)
+					break;
+				c->read_seen = p;
+				c->read_size = n;
+			}
+			c->read_seen[c->read_count++] = h;
+		}
+		break;
+	case 0xD6:	/* UPDATE BINARY */
+	case 0xD0:	/* WRITE BINARY */
+	case 0x0E:	/* ERASE BINARY */
+		c->read_count = 0;
+		break;
+	}
+}
+
+/* Redundant SELECTs, repeated READ BINARYs and GET RESPONSE overhead
+ * for each operation, i.e. outermost sc_lock(), in a capture */
+static int analyze_capture(void)
+{
+	sc_capture_t *cap;
+	sc_capture_record_t rec;
+	struct analyze_card *cards = NULL, *c;
+	size_t ncards = 0, i;
+	unsigned long long origin = 0, last = 0;
+	int r, err = 0;
+
+	r = sc_capture_open(opt_analyze, &cap);
+	if (r) {
+		fprintf(stderr, "Cannot open capture %s: %s\n", opt_analyze, sc_strerror(r));
+		return 1;
+	}
+
+	printf("%7s %4s %5s %10s %9s %6s %9s %13s %13s %13s\n", "Process", "Card", "Op", "start ms",
+		"ms", "APDUs", "reader ms", "GET RESPONSE", "re-SELECT", "re-READ");
+	printf("%56s %5s %7s %5s %7s %5s %7s\n", "", "n", "ms", "n", "ms", "n", "ms");
+	while ((r = sc_capture_read(cap, &rec)) > 0) {
+		if (origin == 0)
+			origin = rec.time;
+		last = rec.time;
+		for (i = 0, c = NULL; i < ncards; i++)
+			if (cards[i].id == rec.card && cards[i].session == rec.session)
+				c = &cards[i];
+		if (c == NULL) {
+			struct analyze_card *p = realloc(cards, (ncards + 1) * sizeof(*cards));
+
+			if (p == NULL) {
+				err = 1;
+				break;
+			}
+			cards = p;
+			c = &cards[ncards++];
+			memset(c, 0, sizeof(*c));
+			c->session = rec.session;
+			c->id = rec.card;
+			analyze_begin(c, rec.time);
+		}
+
+		switch (rec.type) {
+		case SC_CAPTURE_CARD:
+			c->selected = 0;
+			c->read_count = 0;
+			if (verbose) {
+				printf("Process %lu card %u: %.*s, ATR ", rec.session, rec.card,
+					(int)rec.len1, rec.data1);
+				for (i = 0; i < rec.len2; i++)
+					printf("%02X", rec.data2[i]);
+				printf("\n");
+			}
+			break;
+		case SC_CAPTURE_LOCK:
+			analyze_report(c, rec.time, origin);
+			analyze_begin(c, rec.time);
+			break;
+		case SC_CAPTURE_UNLOCK:
+			analyze_report(c, rec.time, origin);
+			analyze_begin(c, rec.time);
+			break;
+		case SC_CAPTURE_APDU:
+			analyze_apdu(c, &rec);
+			break;
+		}
+	}
+	if (r < 0) {
+		fprintf(stderr, "Invalid capture %s: %s\n", opt_analyze, sc_strerror(r));
+		err = 1;
+	}
+	for (i = 0; i < ncards; i++) {
+		analyze_report(&cards[i], last, origin);
+		free(cards[i].read_seen);
+	}
+	free(cards);
+	sc_capture_close(cap);
+	return err;
+}
+
 static void print_serial(sc_card_t *in_card)
 {
 	int r;
@@ -731,6 +1040,17 @@ int main(int argc, char * const argv[])
 			do_list_algorithms = 1; 
 			action_count++; 
 			break;
+		case OPT_STATS:
+			opt_stats = 1;
+			break;
+		case OPT_REPLAY:
+			opt_replay = optarg;
+			action_count++;
+			break;
+		case OPT_ANALYZE:
+			opt_analyze = optarg;
+			action_count++;
+			break;
 		}
 	}
 	if (action_count == 0)
@@ -744,6 +1064,9 @@ int main(int argc, char * const argv[])
 	memset(&ctx_param, 0, sizeof(ctx_param));
 	ctx_param.ver      = 0;
 	ctx_param.app_name = app_name;
+	/* do not capture into the file that is being read */
+	if (opt_replay || opt_analyze)
+		ctx_param.flags |= SC_CTX_FLAG_NO_CAPTURE;
 
 	r = sc_context_create(&ctx, &ctx_param);
 	if (r) {
@@ -776,6 +1099,11 @@ int main(int argc, char * const argv[])
 			goto end;
 		action_count--;
 	}
+	if (opt_analyze) {
+		if ((err = analyze_capture()))
+			goto end;
+		action_count--;
+	}
 	if (action_count <= 0)
 		goto end;
 
@@ -820,6 +1148,11 @@ int main(int argc, char * const argv[])
 			goto end;
 		action_count--;
 	}
+	if (opt_replay) {
+		if ((err = replay_capture()))
+			goto end;
+		action_count--;
+	}
 	
 	if (do_list_files) {
 		if ((err = list_files()))
@@ -833,6 +1166,8 @@ int main(int argc, char * const argv[])
 		action_count--; 
 	} 
 end:
+	if (opt_stats && ctx)
+		print_stats();
 	if (card) {
 		sc_unlock(card);
 		sc_disconnect_card(card);
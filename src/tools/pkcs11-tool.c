@@ -23,6 +23,16 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifndef HAVE_GETTIMEOFDAY
+#include <sys/timeb.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #ifdef ENABLE_OPENSSL
 #include <openssl/opensslv.h>
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L
@@ -49,6 +59,7 @@
 
 extern void *C_LoadModule(const char *name, CK_FUNCTION_LIST_PTR_PTR);
 extern CK_RV C_UnloadModule(void *module);
+extern void *C_GetModuleSymbol(void *module, const char *name);
 
 #define NEED_SESSION_RO	0x01
 #define NEED_SESSION_RW	0x02
@@ -61,6 +72,7 @@ static struct ec_curve_info {
 } ec_curve_infos[] = {
 	{"prime256v1", "1.2.840.10045.3.1.7", "06082A8648CE3D030107", 256},
 	{"secp384r1", "1.3.132.0.34", "06052B81040022", 384},
+	{"secp521r1", "1.3.132.0.35", "06052B81040023", 521},
 	{NULL, NULL, NULL, 0},
 };
 
@@ -83,7 +95,10 @@ enum {
 	OPT_PUK,
 	OPT_NEW_PIN,
 	OPT_LOGIN_TYPE,
-	OPT_TEST_EC
+	OPT_TEST_EC,
+	OPT_BENCHMARK,
+	OPT_BENCH_OPS,
+	OPT_BENCH_THREADS
 };
 
 static const struct option options[] = {
@@ -133,6 +148,9 @@ static const struct option options[] = {
 	{ "verbose",		0, NULL,		'v' },
 	{ "private",		0, NULL,		OPT_PRIVATE },
 	{ "test-ec",		0, NULL,		OPT_TEST_EC },
+	{ "benchmark",		0, NULL,		OPT_BENCHMARK },
+	{ "benchmark-ops",	1, NULL,		OPT_BENCH_OPS },
+	{ "benchmark-threads",	1, NULL,		OPT_BENCH_THREADS },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -182,7 +200,10 @@ static const char *option_help[] = {
 	"Test Mozilla-like keypair gen and cert req, <arg>=certfile",
 	"Verbose operation. (Set OPENSC_DEBUG to enable OpenSC specific debugging)",
 	"Set the CKA_PRIVATE attribute (object is only viewable after a login)",
-	"Test EC (best used with the --login or --pin option)"
+	"Test EC (best used with the --login or --pin option)",
+	"Measure the speed of the token and write the results as JSON (use --login to include private keys)",
+	"Number of operations per thread and benchmark (default: 100)",
+	"Number of threads, each with a session of its own (default: 1)"
 };
 
 static const char *	app_name = "pkcs11-tool"; /* for utils.c */
@@ -216,6 +237,8 @@ static char *		opt_key_type = NULL;
 static int		opt_is_private = 0;
 static int		opt_test_hotplug = 0;
 static int		opt_login_type = -1;
+static unsigned long	opt_bench_ops = 100;
+static unsigned int	opt_bench_threads = 1;
 
 static void *module = NULL;
 static CK_FUNCTION_LIST_PTR p11 = NULL;
@@ -306,6 +329,7 @@ static CK_MECHANISM_TYPE p11_name_to_mechanism(const char *);
 static void		p11_perror(const char *, CK_RV);
 static const char *	CKR2Str(CK_ULONG res);
 static int		p11_test(CK_SESSION_HANDLE session);
+static int		p11_benchmark(CK_SESSION_HANDLE session);
 static int test_card_detection(int);
 static int		hex_to_bin(const char *in, CK_BYTE *out, size_t *outlen);
 static void		test_kpgen_certwrite(CK_SLOT_ID slot, CK_SESSION_HANDLE session);
@@ -341,6 +365,7 @@ int main(int argc, char * argv[])
 	int do_test = 0;
 	int do_test_kpgen_certwrite = 0;
 	int do_test_ec = 0;
+	int do_benchmark = 0;
 	int need_session = 0;
 	int opt_login = 0;
 	int do_init_token = 0;
@@ -348,6 +373,7 @@ int main(int argc, char * argv[])
 	int do_change_pin = 0;
 	int do_unlock_pin = 0;
 	int action_count = 0;
+	CK_C_INITIALIZE_ARGS init_args;
 	CK_RV rv;
 
 #ifdef ENABLE_OPENSSL
@@ -576,6 +602,27 @@ int main(int argc, char * argv[])
 			do_test_ec = 1;
 			action_count++;
 			break;
+		case OPT_BENCHMARK:
+			need_session |= NEED_SESSION_RO;
+			do_benchmark = 1;
+			action_count++;
+			break;
+		case OPT_BENCH_OPS:
+			opt_bench_ops = strtoul(optarg, NULL, 0);
+			if (opt_bench_ops == 0)
+				util_fatal("Invalid number of operations \"%s\"", optarg);
+			break;
+		case OPT_BENCH_THREADS:
+			opt_bench_threads = (unsigned int) strtoul(optarg, NULL, 0);
+			if (opt_bench_threads == 0)
+				util_fatal("Invalid number of threads \"%s\"", optarg);
+#ifndef HAVE_PTHREAD
+			if (opt_bench_threads > 1) {
+				fprintf(stderr, "No thread support, using one thread\n");
+				opt_bench_threads = 1;
+			}
+#endif
+			break;
 		default:
 			util_print_usage_and_die(app_name, options, option_help);
 		}
@@ -591,7 +638,10 @@ int main(int argc, char * argv[])
 	if (module == NULL)
 		util_fatal("Failed to load pkcs11 module");
 
-	rv = p11->C_Initialize(NULL);
+	/* the benchmark threads share the module */
+	memset(&init_args, 0, sizeof(init_args));
+	init_args.flags = CKF_OS_LOCKING_OK;
+	rv = p11->C_Initialize(do_benchmark && opt_bench_threads > 1 ? &init_args : NULL);
 	if (rv != CKR_OK)
 		p11_fatal("C_Initialize", rv);
 
@@ -786,6 +836,9 @@ int main(int argc, char * argv[])
 	if (do_test_ec) 
 		test_ec(opt_slot, session);
 
+	if (do_benchmark)
+		err = p11_benchmark(session);
+
 end:
 	if (session != CK_INVALID_HANDLE) {
 		rv = p11->C_CloseSession(session);
@@ -3841,6 +3894,536 @@ static int p11_test(CK_SESSION_HANDLE session)
 	return errors;
 }
 
+/*
+ * Benchmark: run each operation opt_bench_ops times in each of
+ * opt_bench_threads threads, every thread with a session of its own,
+ * and write ops/sec, latency percentiles and APDUs per operation
+ * as JSON.
+ */
+struct bench_test {
+	const char	*name;
+	CK_MECHANISM_TYPE mech;		/* (CK_MECHANISM_TYPE)-1 if none */
+	CK_OBJECT_HANDLE key;
+	CK_ULONG	key_bits;
+	char		*key_label;
+	CK_BYTE		*data;
+	CK_ULONG	data_len;
+	CK_BYTE		sig[512];	/* for C_Verify */
+	CK_ULONG	sig_len;
+	CK_RV		(*op)(struct bench_test *, CK_SESSION_HANDLE);
+};
+
+struct bench_thread {
+	struct bench_test *test;
+	CK_SESSION_HANDLE session;
+	double		*latency;	/* in ms, one per successful operation */
+	unsigned long	done, errors;
+	CK_RV		last_error;
+};
+
+/* Sign mechanisms, with the key type and the size of their input:
+ * a hash, a whole message or, with 0, as long as the modulus */
+static const struct bench_sign_mech {
+	CK_MECHANISM_TYPE mech;
+	CK_KEY_TYPE	key_type;
+	CK_ULONG	data_len;
+} bench_sign_mechs[] = {
+	{ CKM_RSA_PKCS,			CKK_RSA,	20 },
+	{ CKM_RSA_X_509,		CKK_RSA,	0 },
+	{ CKM_MD5_RSA_PKCS,		CKK_RSA,	1024 },
+	{ CKM_SHA1_RSA_PKCS,		CKK_RSA,	1024 },
+	{ CKM_SHA256_RSA_PKCS,		CKK_RSA,	1024 },
+	{ CKM_SHA384_RSA_PKCS,		CKK_RSA,	1024 },
+	{ CKM_SHA512_RSA_PKCS,		CKK_RSA,	1024 },
+	{ CKM_RIPEMD160_RSA_PKCS,	CKK_RSA,	1024 },
+	{ CKM_ECDSA,			CKK_EC,		20 },
+	{ CKM_ECDSA_SHA1,		CKK_EC,		1024 },
+	{ CKM_ECDSA_SHA256,		CKK_EC,		1024 },
+	{ CKM_ECDSA_SHA384,		CKK_EC,		1024 },
+	{ CKM_ECDSA_SHA512,		CKK_EC,		1024 },
+	{ CKM_GOSTR3410,		CKK_GOSTR3410,	32 },
+	{ CKM_GOSTR3410_WITH_GOSTR3411,	CKK_GOSTR3410,	1024 },
+	{ 0, 0, 0 }
+};
+
+/* Size of an EC key, from the curves known in ec_curve_infos */
+static CK_ULONG bench_ec_key_bits(CK_SESSION_HANDLE sess, CK_OBJECT_HANDLE key)
+{
+	CK_BYTE *params, oid[16];
+	CK_ULONG params_len, bits = 0;
+	size_t oid_len;
+	int i;
+
+	if (key == CK_INVALID_HANDLE || (params = getEC_PARAMS(sess, key, &params_len)) == NULL)
+		return 0;
+	for (i = 0; bits == 0 && ec_curve_infos[i].name != NULL; i++) {
+		oid_len = sizeof(oid);
+		if (hex_to_bin(ec_curve_infos[i].oid_encoded, oid, &oid_len)
+				&& oid_len == params_len && !memcmp(oid, params, oid_len))
+			bits = ec_curve_infos[i].size;
+	}
+	free(params);
+	return bits;
+}
+
+static double bench_clock(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+#else
+	struct _timeb tb;
+
+	_ftime(&tb);
+	return tb.time * 1000.0 + tb.millitm;
+#endif
+}
+
+static CK_RV bench_digest(struct bench_test *t, CK_SESSION_HANDLE sess)
+{
+	CK_MECHANISM mech = { t->mech, NULL, 0 };
+	CK_BYTE hash[64];
+	CK_ULONG hash_len = sizeof(hash);
+	CK_RV rv;
+
+	rv = p11->C_DigestInit(sess, &mech);
+	if (rv == CKR_OK)
+		rv = p11->C_Digest(sess, t->data, t->data_len, hash, &hash_len);
+	return rv;
+}
+
+static CK_RV bench_find(struct bench_test *t, CK_SESSION_HANDLE sess)
+{
+	CK_OBJECT_HANDLE objs[16];
+	CK_ULONG count;
+	CK_RV rv;
+
+	(void)t;
+	rv = p11->C_FindObjectsInit(sess, NULL, 0);
+	if (rv != CKR_OK)
+		return rv;
+	do {
+		rv = p11->C_FindObjects(sess, objs, 16, &count);
+	} while (rv == CKR_OK && count == 16);
+	p11->C_FindObjectsFinal(sess);
+	return rv;
+}
+
+static CK_RV bench_get_attribute(struct bench_test *t, CK_SESSION_HANDLE sess)
+{
+	CK_OBJECT_CLASS cls;
+	CK_BYTE label[256], id[256];
+	CK_ATTRIBUTE attrs[3] = {
+		{ CKA_CLASS, &cls, sizeof(cls) },
+		{ CKA_LABEL, label, sizeof(label) },
+		{ CKA_ID, id, sizeof(id) }
+	};
+
+	return p11->C_GetAttributeValue(sess, t->key, attrs, 3);
+}
+
+static CK_RV bench_sign(struct bench_test *t, CK_SESSION_HANDLE sess)
+{
+	CK_MECHANISM mech = { t->mech, NULL, 0 };
+	CK_BYTE sig[512];
+	CK_ULONG sig_len = sizeof(sig);
+	CK_RV rv;
+
+	rv = p11->C_SignInit(sess, &mech, t->key);
+	if (rv == CKR_OK)
+		rv = p11->C_Sign(sess, t->data, t->data_len, sig, &sig_len);
+	return rv;
+}
+
+static CK_RV bench_verify(struct bench_test *t, CK_SESSION_HANDLE sess)
+{
+	CK_MECHANISM mech = { t->mech, NULL, 0 };
+	CK_RV rv;
+
+	rv = p11->C_VerifyInit(sess, &mech, t->key);
+	if (rv == CKR_OK)
+		rv = p11->C_Verify(sess, t->data, t->data_len, t->sig, t->sig_len);
+	return rv;
+}
+
+static CK_RV bench_decrypt(struct bench_test *t, CK_SESSION_HANDLE sess)
+{
+	CK_MECHANISM mech = { t->mech, NULL, 0 };
+	CK_BYTE out[512];
+	CK_ULONG out_len = sizeof(out);
+	CK_RV rv;
+
+	rv = p11->C_DecryptInit(sess, &mech, t->key);
+	if (rv == CKR_OK)
+		rv = p11->C_Decrypt(sess, t->data, t->data_len, out, &out_len);
+	return rv;
+}
+
+static void *bench_thread_main(void *arg)
+{
+	struct bench_thread *th = (struct bench_thread *) arg;
+	unsigned long i;
+	double start;
+	CK_RV rv;
+
+	for (i = 0; i < opt_bench_ops; i++) {
+		start = bench_clock();
+		rv = th->test->op(th->test, th->session);
+		if (rv == CKR_OK) {
+			th->latency[th->done++] = bench_clock() - start;
+		} else {
+			th->errors++;
+			th->last_error = rv;
+		}
+	}
+	return NULL;
+}
+
+static int bench_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of sorted values */
+static double bench_percentile(const double *v, unsigned long n, unsigned int p)
+{
+	unsigned long rank = (n * p + 99) / 100;
+
+	return n == 0 ? 0 : v[rank > 0 ? rank - 1 : 0];
+}
+
+static void bench_json_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; s != NULL && *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char) *s);
+		else
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+static int bench_get_apdu_count(CK_SLOT_ID slot, CK_ULONG *count)
+{
+	OPENSC_GET_APDU_COUNT_FN get_count;
+
+	get_count = (OPENSC_GET_APDU_COUNT_FN) C_GetModuleSymbol(module, OPENSC_GET_APDU_COUNT);
+	return get_count != NULL && get_count(slot, count) == CKR_OK;
+}
+
+static void bench_run(FILE *out, struct bench_test *t, CK_SESSION_HANDLE *sessions, int *first)
+{
+	struct bench_thread *th;
+	double *all, start, elapsed;
+	unsigned long n = 0, errors = 0;
+	CK_ULONG apdus_before = 0, apdus_after = 0;
+	CK_RV last_error = CKR_OK;
+	int have_apdus;
+	unsigned int j;
+
+	th = calloc(opt_bench_threads, sizeof(*th));
+	all = calloc(opt_bench_threads * opt_bench_ops + 1, sizeof(*all));
+	if (th == NULL || all == NULL)
+		util_fatal("out of memory");
+	for (j = 0; j < opt_bench_threads; j++) {
+		th[j].test = t;
+		th[j].session = sessions[j];
+		th[j].latency = all + j * opt_bench_ops;
+	}
+	if (verbose)
+		fprintf(stderr, "Benchmarking %s %s\n", t->name,
+			t->mech != (CK_MECHANISM_TYPE)-1 ? p11_mechanism_to_name(t->mech) : "");
+
+	have_apdus = bench_get_apdu_count(opt_slot, &apdus_before);
+	start = bench_clock();
+#ifdef HAVE_PTHREAD
+	if (opt_bench_threads > 1) {
+		pthread_t *tids = calloc(opt_bench_threads, sizeof(pthread_t));
+
+		if (tids == NULL)
+			util_fatal("out of memory");
+		for (j = 0; j < opt_bench_threads; j++)
+			if (pthread_create(&tids[j], NULL, bench_thread_main, &th[j]) != 0)
+				util_fatal("cannot create thread");
+		for (j = 0; j < opt_bench_threads; j++)
+			pthread_join(tids[j], NULL);
+		free(tids);
+	} else
+#endif
+		bench_thread_main(&th[0]);
+	elapsed = bench_clock() - start;
+	have_apdus = have_apdus && bench_get_apdu_count(opt_slot, &apdus_after);
+
+	/* pack the latencies of all threads together */
+	for (j = 0; j < opt_bench_threads; j++) {
+		memmove(all + n, th[j].latency, th[j].done * sizeof(*all));
+		n += th[j].done;
+		errors += th[j].errors;
+		if (th[j].errors)
+			last_error = th[j].last_error;
+	}
+	qsort(all, n, sizeof(*all), bench_cmp_double);
+
+	fprintf(out, "%s\n    {\n      \"test\": ", *first ? "" : ",");
+	*first = 0;
+	bench_json_string(out, t->name);
+	if (t->mech != (CK_MECHANISM_TYPE)-1) {
+		fprintf(out, ",\n      \"mechanism\": ");
+		bench_json_string(out, p11_mechanism_to_name(t->mech));
+	}
+	if (t->key_label != NULL) {
+		fprintf(out, ",\n      \"key\": ");
+		bench_json_string(out, t->key_label);
+	}
+	if (t->key_bits)
+		fprintf(out, ",\n      \"key_bits\": %lu", t->key_bits);
+	fprintf(out, ",\n      \"ops\": %lu,\n      \"errors\": %lu", n, errors);
+	if (errors) {
+		fprintf(out, ",\n      \"last_error\": ");
+		bench_json_string(out, CKR2Str(last_error));
+	}
+	fprintf(out, ",\n      \"seconds\": %.3f,\n      \"ops_per_sec\": %.2f",
+		elapsed / 1000, elapsed > 0 ? n * 1000.0 / elapsed : 0.0);
+	fprintf(out, ",\n      \"latency_ms\": { \"min\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f }",
+		n ? all[0] : 0.0, bench_percentile(all, n, 50), bench_percentile(all, n, 95),
+		bench_percentile(all, n, 99), n ? all[n - 1] : 0.0);
+	if (have_apdus && n + errors > 0)
+		fprintf(out, ",\n      \"apdus_per_op\": %.2f",
+			(double)(apdus_after - apdus_before) / (n + errors));
+	else
+		fprintf(out, ",\n      \"apdus_per_op\": null");
+	fprintf(out, "\n    }");
+
+	free(all);
+	free(th);
+}
+
+/* Sets up the sign, verify and decrypt tests of a private key */
+static void bench_key(FILE *out, CK_SESSION_HANDLE sess, CK_SESSION_HANDLE *sessions,
+		CK_OBJECT_HANDLE key, int *first)
+{
+	CK_MECHANISM_TYPE *sign_mechs = NULL, *verify_mechs = NULL, *decrypt_mechs = NULL;
+	CK_ULONG num_sign, num_verify, num_decrypt, i, k, mod_len;
+	CK_OBJECT_HANDLE pubkey = CK_INVALID_HANDLE;
+	CK_KEY_TYPE key_type;
+	int can_sign, can_decrypt;
+	struct bench_test t;
+	CK_BYTE *id;
+	CK_ULONG id_len;
+	CK_BYTE data[1024];
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = (CK_BYTE) i;
+	memset(&t, 0, sizeof(t));
+	t.key = key;
+	t.key_label = getLABEL(sess, key, NULL);
+	key_type = getKEY_TYPE(sess, key);
+	if ((id = getID(sess, key, &id_len)) != NULL) {
+		if (!find_object(sess, CKO_PUBLIC_KEY, &pubkey, id, id_len, 0))
+			pubkey = CK_INVALID_HANDLE;
+		free(id);
+	}
+	if (key_type == CKK_RSA)
+		t.key_bits = getMODULUS_BITS(sess, key);
+	else if (key_type == CKK_EC) {
+		/* tokens may keep the curve with the public key only */
+		t.key_bits = bench_ec_key_bits(sess, key);
+		if (t.key_bits == 0)
+			t.key_bits = bench_ec_key_bits(sess, pubkey);
+	}
+	mod_len = key_type == CKK_RSA ? (t.key_bits + 7) / 8 : 0;
+
+	can_sign = getSIGN(sess, key);
+	can_decrypt = getDECRYPT(sess, key) && key_type == CKK_RSA;
+	num_sign = get_mechanisms(opt_slot, &sign_mechs, CKF_SIGN);
+	num_verify = get_mechanisms(opt_slot, &verify_mechs, CKF_VERIFY);
+	num_decrypt = get_mechanisms(opt_slot, &decrypt_mechs, CKF_DECRYPT);
+
+	for (k = 0; can_sign && bench_sign_mechs[k].mech != 0; k++) {
+		const struct bench_sign_mech *m = &bench_sign_mechs[k];
+
+		if (m->key_type != key_type || (opt_mechanism_used && m->mech != opt_mechanism))
+			continue;
+		for (i = 0; i < num_sign && sign_mechs[i] != m->mech; i++)
+			;
+		if (i == num_sign)
+			continue;
+		t.mech = m->mech;
+		t.data = data;
+		t.data_len = m->data_len;
+		if (t.data_len == 0) {
+			/* starts with 0, so below the modulus */
+			if (mod_len == 0 || mod_len > sizeof(data))
+				continue;
+			t.data_len = mod_len;
+		}
+		t.name = "sign";
+		t.op = bench_sign;
+		t.key = key;
+		bench_run(out, &t, sessions, first);
+
+		/* sign once to have a signature to verify */
+		for (i = 0; i < num_verify && verify_mechs[i] != m->mech; i++)
+			;
+		if (i == num_verify || pubkey == CK_INVALID_HANDLE)
+			continue;
+		{
+			CK_MECHANISM mech = { m->mech, NULL, 0 };
+
+			t.sig_len = sizeof(t.sig);
+			if (p11->C_SignInit(sess, &mech, key) != CKR_OK
+					|| p11->C_Sign(sess, t.data, t.data_len, t.sig, &t.sig_len) != CKR_OK)
+				continue;
+		}
+		t.name = "verify";
+		t.op = bench_verify;
+		t.key = pubkey;
+		if (bench_verify(&t, sess) == CKR_OK)
+			bench_run(out, &t, sessions, first);
+		t.key = key;
+	}
+
+	for (i = 0; can_decrypt && i < num_decrypt; i++) {
+		CK_BYTE cipher[512];
+
+		if (opt_mechanism_used && decrypt_mechs[i] != opt_mechanism)
+			continue;
+		t.data = cipher;
+		if (decrypt_mechs[i] == CKM_RSA_X_509) {
+			/* any value below the modulus does */
+			if (mod_len == 0 || mod_len > sizeof(cipher))
+				continue;
+			for (k = 0; k < mod_len; k++)
+				cipher[k] = (CK_BYTE) k;
+			t.data_len = mod_len;
+		} else if (decrypt_mechs[i] == CKM_RSA_PKCS) {
+#ifdef ENABLE_OPENSSL
+			EVP_PKEY *pkey = NULL;
+			int len = -1;
+
+			if (pubkey != CK_INVALID_HANDLE)
+				pkey = get_public_key(sess, key);
+			if (pkey != NULL && EVP_PKEY_size(pkey) <= (int)sizeof(cipher))
+#if OPENSSL_VERSION_NUMBER >= 0x00909000L
+				len = EVP_PKEY_encrypt_old(cipher, data, 16, pkey);
+#else
+				len = EVP_PKEY_encrypt(cipher, data, 16, pkey);
+#endif
+			if (pkey != NULL)
+				EVP_PKEY_free(pkey);
+			if (len <= 0)
+				continue;
+			t.data_len = len;
+#else
+			/* needs OpenSSL to encrypt something to decrypt */
+			continue;
+#endif
+		} else {
+			continue;
+		}
+		t.name = "decrypt";
+		t.mech = decrypt_mechs[i];
+		t.op = bench_decrypt;
+		t.key = key;
+		bench_run(out, &t, sessions, first);
+	}
+
+	free(t.key_label);
+	free(sign_mechs);
+	free(verify_mechs);
+	free(decrypt_mechs);
+}
+
+static int p11_benchmark(CK_SESSION_HANDLE session)
+{
+	CK_SESSION_HANDLE *sessions;
+	CK_MECHANISM_TYPE *mechs = NULL;
+	CK_OBJECT_HANDLE key;
+	CK_TOKEN_INFO info;
+	CK_ULONG num_mechs, i;
+	struct bench_test t;
+	CK_BYTE data[1024];
+	FILE *out = stdout;
+	int first = 1;
+	CK_RV rv;
+
+	if (opt_output != NULL && (out = fopen(opt_output, "w")) == NULL)
+		util_fatal("failed to open %s: %m", opt_output);
+
+	sessions = calloc(opt_bench_threads, sizeof(CK_SESSION_HANDLE));
+	if (sessions == NULL)
+		util_fatal("out of memory");
+	for (i = 0; i < opt_bench_threads; i++) {
+		rv = p11->C_OpenSession(opt_slot, CKF_SERIAL_SESSION, NULL, NULL, &sessions[i]);
+		if (rv != CKR_OK)
+			p11_fatal("C_OpenSession", rv);
+	}
+	get_token_info(opt_slot, &info);
+
+	fprintf(out, "{\n  \"module\": ");
+	bench_json_string(out, opt_module);
+	fprintf(out, ",\n  \"slot\": %lu,\n  \"token\": ", opt_slot);
+	bench_json_string(out, p11_utf8_to_local(info.label, sizeof(info.label)));
+	fprintf(out, ",\n  \"model\": ");
+	bench_json_string(out, p11_utf8_to_local(info.model, sizeof(info.model)));
+	fprintf(out, ",\n  \"threads\": %u,\n  \"ops_per_thread\": %lu,\n  \"results\": [",
+		opt_bench_threads, opt_bench_ops);
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = (CK_BYTE) i;
+
+	/* digests */
+	memset(&t, 0, sizeof(t));
+	t.name = "digest";
+	t.op = bench_digest;
+	t.data = data;
+	t.data_len = sizeof(data);
+	num_mechs = get_mechanisms(opt_slot, &mechs, CKF_DIGEST);
+	for (i = 0; i < num_mechs; i++) {
+		if (opt_mechanism_used && mechs[i] != opt_mechanism)
+			continue;
+		t.mech = mechs[i];
+		bench_run(out, &t, sessions, &first);
+	}
+	free(mechs);
+
+	/* object search and attributes */
+	memset(&t, 0, sizeof(t));
+	t.mech = (CK_MECHANISM_TYPE)-1;
+	t.name = "find_objects";
+	t.op = bench_find;
+	bench_run(out, &t, sessions, &first);
+	if (find_object(session, CKO_PRIVATE_KEY, &key, NULL, 0, 0)
+			|| find_object(session, CKO_CERTIFICATE, &key, NULL, 0, 0)) {
+		t.name = "get_attribute_value";
+		t.op = bench_get_attribute;
+		t.key = key;
+		t.key_label = getLABEL(session, key, NULL);
+		bench_run(out, &t, sessions, &first);
+		free(t.key_label);
+	}
+
+	/* private key operations, on all keys or the one given */
+	for (i = 0; find_object(session, CKO_PRIVATE_KEY, &key,
+				opt_object_id_len ? opt_object_id : NULL, opt_object_id_len, i); i++)
+		bench_key(out, session, sessions, key, &first);
+
+	fprintf(out, "\n  ]\n}\n");
+	for (i = 0; i < opt_bench_threads; i++)
+		p11->C_CloseSession(sessions[i]);
+	free(sessions);
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
+
 /* Does about the same as Mozilla does when you go to an on-line CA
  * for obtaining a certificate: key pair generation, signing the
  * cert request + some other tests, writing certs and changing
@@ -4413,6 +4996,10 @@ static struct mech_info	p11_mechanisms[] = {
       { CKM_ECDSA_KEY_PAIR_GEN,	"ECDSA-KEY-PAIR-GEN", NULL },
       { CKM_ECDSA,		"ECDSA", NULL },
       { CKM_ECDSA_SHA1,		"ECDSA-SHA1", NULL },
+      { CKM_ECDSA_SHA224,	"ECDSA-SHA224", NULL },
+      { CKM_ECDSA_SHA256,	"ECDSA-SHA256", NULL },
+      { CKM_ECDSA_SHA384,	"ECDSA-SHA384", NULL },
+      { CKM_ECDSA_SHA512,	"ECDSA-SHA512", NULL },
       { CKM_ECDH1_DERIVE,	"ECDH1-DERIVE", NULL },
       { CKM_ECDH1_COFACTOR_DERIVE,"ECDH1-COFACTOR-DERIVE", NULL },
       { CKM_ECMQV_DERIVE,	"ECMQV-DERIVE", NULL },